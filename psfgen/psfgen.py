@@ -17,7 +17,8 @@ class PsfGen(object):
     and coordinates.
     """
 
-    def __init__(self, output=sys.stdout, case_sensitive=False):
+    def __init__(self, output=sys.stdout, case_sensitive=False,
+                 topology=None):
         """
         Creates a PsfGen object.
 
@@ -27,6 +28,11 @@ class PsfGen(object):
                 will be opened.
             case_sensitive (bool): Whether or not residue names and definitions
                 are considered to be case sensitive
+            topology (PsfGen): Another PsfGen object whose topology
+                definitions are used, without parsing them again. They are
+                shared read-only by both objects and copied the first time
+                either one changes them. The case sensitivity of topology
+                is used instead of case_sensitive.
         """
         if isinstance(output, str):
             self.output = open(output, 'wb')
@@ -36,6 +42,13 @@ class PsfGen(object):
             raise ValueError("output argument must be a str or open file")
 
         self._fileno = self.output.fileno()
+        if topology is not None:
+            self._data = _psfgen.init_mol(outfd=self._fileno,
+                                          shared=topology._data)
+            self._read_topos = topology._read_topos
+            self._allcaps = topology._allcaps
+            return
+
         self._data = _psfgen.init_mol(outfd=self._fileno)
 
         self._read_topos = False # Cannot change case sensitivity if true
@@ -46,11 +59,12 @@ class PsfGen(object):
 
     def __del__(self):
 
+        # Flushes messages to the output, so it is closed afterwards
+        _psfgen.del_mol(self._data);
+
         if not self.output.closed and self.output is not sys.stdout:
             self.output.close()
 
-        _psfgen.del_mol(self._data);
-
     #===========================================================================
 
     # This property decorator lets the case sensitivity be a boolean attribute
@@ -100,6 +114,31 @@ class PsfGen(object):
 
     #===========================================================================
 
+    def read_topologies(self, filenames, threads=0):
+        """
+        Parses several charmm format topology files into current library.
+        The files are parsed concurrently, then added in the order given,
+        with the same result as calling read_topology on each in turn.
+
+        Args:
+            filenames (list of str): Files to parse
+            threads (int): Most files to parse at once, 0 for one per
+                processor
+
+        Raises:
+            FileNotFoundError: If a file cannot be opened for reading. No
+                file is read in that case
+            ValueError: If an error occurs during parsing
+
+        While the files are parsed, other threads calling into this object
+        get a RuntimeError.
+        """
+        _psfgen.parse_topologies(psfstate=self._data,
+                                 filenames=list(filenames), threads=threads)
+        self._read_topos = True
+
+    #===========================================================================
+
     def alias_residue(self, top_resname, pdb_resname):
         """
         Set a correspondence between a residue name in a PDB file and in the
@@ -354,6 +393,23 @@ class PsfGen(object):
 
     #===========================================================================
 
+    def get_memory_stats(self):
+        """
+        Get memory usage of the internal molecule and topology storage
+
+        Returns:
+            (dict str -> dict): For each arena ("arena", "angle_arena",
+                "dihedral_arena", "index_arena", "topology_arena") and for
+                the velocity blocks ("velocities"), bytes requested,
+                reserved and wasted and the number of blocks.
+                For each hash table ("segments", "residues", "atom_types",
+                "residue_definitions", "topology_files"), entries,
+                slots, probe lengths and bytes used.
+        """
+        return _psfgen.query_system(psfstate=self._data, task="memory")
+
+    #===========================================================================
+
     def get_residue_types(self):
         """
         Get all defined residues
@@ -397,6 +453,41 @@ class PsfGen(object):
 
     #===========================================================================
 
+    def add_segments(self, segments, threads=0):
+        """
+        Adds several new segments to the internal molecule state. The
+        segments are set up in the order given, then generated
+        concurrently, with the same structure as calling add_segment on
+        each in turn.
+
+        Args:
+            segments (list of dict): Keyword arguments of add_segment for
+                each segment, segid included
+            threads (int): Most segments to generate at once, 0 for one per
+                processor
+
+        Raises:
+            ValueError: If a segment cannot be set up or generated. Segments
+                that fail to generate are removed, the others are kept
+
+        While the segments are generated, other threads calling into this
+        object get a RuntimeError.
+        """
+        segids = self.get_segids() or []
+        try:
+            for segment in segments:
+                segment = dict(segment)
+                if segment["segid"] in segids:
+                    raise ValueError("Duplicate segID '%s'" % segment["segid"])
+                segids.append(segment["segid"])
+                segment.setdefault("first", "none")
+                segment.setdefault("last", "none")
+                _psfgen.add_segment(psfstate=self._data, defer=True, **segment)
+        finally:
+            _psfgen.end_segments(psfstate=self._data, threads=threads)
+
+    #===========================================================================
+
     def read_coords(self, filename, segid):
         """
         Reads in coordinates from a PDB file, matching segment, residue, and
@@ -626,6 +717,92 @@ class PsfGen(object):
 
     #===========================================================================
 
+    def set_arena_mode(self, arena="all", mmap=True, hugepages=False,
+                       grow=True):
+        """
+        Selects how memory for atoms, angles, or dihedrals is allocated.
+        Intended for very large systems; affects memory obtained from now on,
+        so call it before building the structure.
+
+        Args:
+            arena (str): One of "atoms" (atoms, bonds and other terms),
+                "angles", "dihedrals", or "all"
+            mmap (bool): Obtain blocks with anonymous mmap instead of malloc
+            hugepages (bool): Ask for transparent huge pages. Requires mmap
+            grow (bool): Double the block size with each new block
+
+        Raises:
+            ValueError: If the mode is not supported here. No arena is
+                changed in that case, including with "all"
+        """
+        _psfgen.set_arena_mode(psfstate=self._data, arena=arena, mmap=mmap,
+                               hugepages=hugepages, grow=grow)
+
+    #===========================================================================
+
+    def set_atom_index(self, enabled=True):
+        """
+        Keeps an index from (segid, resid, atom name) to atoms so that
+        set_position, set_charge and the other per-atom setters find their
+        atom in constant time. Worthwhile when setting many atoms one at a
+        time; the index is rebuilt on the next lookup after atoms are added,
+        deleted or renamed.
+
+        Args:
+            enabled (bool): Build the index, or free it if False
+        """
+        _psfgen.set_atom_index(psfstate=self._data, enabled=enabled)
+
+    #===========================================================================
+
+    def set_topology_cache(self, directory):
+        """
+        Caches parsed topology files in binary form, so that later
+        read_topology calls on an unchanged file skip the text parser.
+        Cache files are named by a hash of the topology file contents and
+        the case sensitivity setting; stale or unreadable ones are
+        replaced after parsing the text again. The directory may be shared
+        by concurrent jobs.
+
+        Args:
+            directory (str): Existing directory for cache files, or None to
+                stop using the cache
+        """
+        _psfgen.set_topology_cache(psfstate=self._data, directory=directory)
+
+    #===========================================================================
+
+    def set_lazy_topology(self, enabled=True):
+        """
+        Defers parsing the atoms, bonds and other entries of each residue
+        and patch in topology files read afterwards until the residue or
+        patch is first used. Large force fields of which only a few residues
+        are needed then load quickly. Errors in a deferred entry are
+        reported when it is first used, and the topology cache and parallel
+        parsing are not used while this is enabled.
+
+        Args:
+            enabled (bool): Defer residue entries, or parse them immediately
+                if False
+        """
+        _psfgen.set_lazy_topology(psfstate=self._data, enabled=enabled)
+
+    #===========================================================================
+
+    def compact(self):
+        """
+        Releases bonds, angles and dihedrals left behind by deleted atoms,
+        regenerated angles/dihedrals, or patches, so that their memory is
+        reused by later additions, and drops deleted residues and segments
+        so later passes skip them. Useful after many deletions.
+
+        Returns:
+            (int): Number of bonds, angles, and dihedrals reclaimed
+        """
+        return _psfgen.compact(self._data)
+
+    #===========================================================================
+
     def regenerate_resids(self):
         """
         Regenerates residue IDs by removing insertion codes and minimially
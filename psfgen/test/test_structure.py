@@ -0,0 +1,766 @@
+#/usr/bin/env python
+"""
+Tests building and editing the structure: segments generated together,
+compaction, deletion, resids, and residues that share their definitions.
+"""
+import pytest
+import os
+
+dir = os.path.dirname(__file__)
+
+SEGMENTS = [dict(segid="P0", pdbfile="psf_protein_P0.pdb"),
+            dict(segid="W1", pdbfile="psf_wat_1.pdb"),
+            dict(segid="P1", pdbfile="psf_protein_P1.pdb",
+                 first="NTER", last="CTER"),
+            dict(segid="BAD", pdbfile="psf_ions.pdb",
+                 residues=[("9001", "ALA"), ("9002", "XXX")]),
+            dict(segid="I", pdbfile="psf_ions.pdb"),
+            dict(segid="W0", pdbfile="psf_wat_0.pdb", auto_dihedrals=False)]
+
+COORDS = [("P0", "psf_protein_P0.pdb"), ("P1", "psf_protein_P1.pdb"),
+          ("W0", "psf_wat_0.pdb"), ("W1", "psf_wat_1.pdb"),
+          ("I", "psf_ions.pdb")]
+
+#==============================================================================
+
+def new_gen(output):
+    from psfgen import PsfGen
+    os.chdir(dir)
+    gen = PsfGen(output=output)
+    gen.read_topology("top_all36_caps.rtf")
+    gen.read_topology("top_all36_prot.rtf")
+    gen.read_topology("top_water_ions.rtf")
+    return gen
+
+def read_files(*filenames):
+    contents = []
+    for filename in filenames:
+        with open(filename) as f:
+            contents.append(f.read())
+    return contents
+
+#==============================================================================
+
+def test_batch_matches_serial(tmpdir):
+    """
+    Tests generating segments together on threads gives the same system as
+    adding them one at a time, with a segment that fails
+    """
+    outputs = {}
+    for mode in ("serial", "batch"):
+        gen = new_gen(str(tmpdir.join(mode + ".log")))
+        if mode == "serial":
+            for segment in SEGMENTS:
+                if segment["segid"] == "BAD":
+                    with pytest.raises(ValueError):
+                        gen.add_segment(**segment)
+                else:
+                    gen.add_segment(**segment)
+        else:
+            with pytest.raises(ValueError):
+                gen.add_segments(SEGMENTS, threads=4)
+        assert "BAD" not in gen.get_segids()
+
+        for segid, filename in COORDS:
+            gen.read_coords(segid=segid, filename=filename)
+        gen.patch(patchname="DISU", targets=[("P0", "10"), ("P0", "15")])
+        gen.guess_coords()
+        psf = str(tmpdir.join(mode + ".psf"))
+        pdb = str(tmpdir.join(mode + ".pdb"))
+        gen.write_psf(filename=psf)
+        gen.write_pdb(filename=pdb)
+        outputs[mode] = read_files(psf, pdb)
+        del gen
+
+    assert outputs["serial"] == outputs["batch"]
+
+#==============================================================================
+
+def test_failed_end(tmpdir):
+    """
+    Tests a segment that fails to build leaves the structure as it was and
+    gives back the memory its atoms took, and can then be built under the
+    same name
+    """
+    gen = new_gen(str(tmpdir.join("output.log")))
+    gen.add_segment(segid="P0", pdbfile="psf_protein_P0.pdb")
+    gen.add_segment(segid="W0", pdbfile="psf_wat_0.pdb")
+    before = str(tmpdir.join("before.psf"))
+    gen.write_psf(filename=before)
+
+    def requested():
+        return gen.get_memory_stats()["arena"]["requested"]
+
+    # Only the segment record, allocated when the segment is set up, stays
+    failed = []
+    for attempt in range(2):
+        start = requested()
+        with pytest.raises(ValueError):
+            gen.add_segment(segid="BAD", pdbfile="psf_ions.pdb",
+                            residues=[("9001", "ALA"), ("9002", "XXX")])
+        failed.append(requested() - start)
+        assert gen.get_segids() == ["P0", "W0"]
+        after = str(tmpdir.join("after%d.psf" % attempt))
+        gen.write_psf(filename=after)
+        assert psf_counts(after) == psf_counts(before)
+        assert read_files(after) == read_files(before)
+
+    start = requested()
+    gen.add_segment(segid="BAD", pdbfile="psf_ions.pdb",
+                    residues=[("9001", "ALA"), ("9002", "GLY")])
+    assert gen.get_resids("BAD")[-2:] == ["9001", "9002"]
+    assert failed[0] == failed[1]
+    assert 10 * failed[0] < requested() - start
+    del gen
+
+#==============================================================================
+
+def test_read_psf(tmpdir):
+    """
+    Tests a structure read back from its psf and pdb files is written out
+    the same, segment and residue tables included
+    """
+    from psfgen import PsfGen
+    gen = new_gen(str(tmpdir.join("output.log")))
+    for segment in SEGMENTS:
+        if segment["segid"] != "BAD":
+            gen.add_segment(**segment)
+    for segid, filename in COORDS:
+        gen.read_coords(segid=segid, filename=filename)
+    psf = str(tmpdir.join("built.psf"))
+    pdb = str(tmpdir.join("built.pdb"))
+    gen.write_psf(filename=psf)
+    gen.write_pdb(filename=pdb)
+    segids = gen.get_segids()
+    resids = [gen.get_resids(segid) for segid in segids]
+    del gen
+
+    gen = PsfGen(output=str(tmpdir.join("read.log")))
+    gen.read_psf(filename=psf, pdbfile=pdb)
+    assert gen.get_segids() == segids
+    assert [gen.get_resids(segid) for segid in segids] == resids
+    assert gen.get_memory_stats()["segments"]["entries"] == len(segids)
+    assert gen.get_memory_stats()["residues"]["entries"] \
+        == sum(len(r) for r in resids)
+    psf2 = str(tmpdir.join("read.psf"))
+    pdb2 = str(tmpdir.join("read.pdb"))
+    gen.write_psf(filename=psf2)
+    gen.write_pdb(filename=pdb2)
+    del gen
+
+    # Chain ids and occupancies are not kept in the psf
+    def atoms(text):
+        return [line[:21] + line[22:54] + line[60:]
+                for line in text.splitlines()]
+    assert read_files(psf2) == read_files(psf)
+    assert atoms(read_files(pdb2)[0]) == atoms(read_files(pdb)[0])
+
+#==============================================================================
+
+def test_queued_segments(tmpdir):
+    """
+    Tests queued segments must be generated before anything else is done
+    """
+    import _psfgen
+    gen = new_gen(str(tmpdir.join("output.log")))
+    _psfgen.add_segment(psfstate=gen._data, segid="W0",
+                        pdbfile="psf_wat_0.pdb", first="none", last="none",
+                        defer=True)
+
+    with pytest.raises(ValueError):
+        gen.read_coords(segid="W0", filename="psf_wat_0.pdb")
+    with pytest.raises(ValueError):
+        gen.get_atom_names(segid="W0", resid="1")
+    with pytest.raises(ValueError):
+        gen.write_psf(filename=str(tmpdir.join("queued.psf")))
+    with pytest.raises(ValueError):
+        gen.read_topology("top_all36_caps.rtf")
+
+    _psfgen.end_segments(psfstate=gen._data)
+    gen.read_coords(segid="W0", filename="psf_wat_0.pdb")
+    assert gen.get_atom_names(segid="W0", resid="1") == ["OH2", "H1", "H2"]
+    del gen
+
+#==============================================================================
+
+def test_busy(tmpdir):
+    """
+    Tests other threads are turned away while segments are generated
+    """
+    import _psfgen
+    import threading
+    gen = new_gen(str(tmpdir.join("output.log")))
+    for i in range(4):
+        _psfgen.add_segment(psfstate=gen._data, segid="W%d" % i,
+                            pdbfile="psf_wat_%d.pdb" % (i % 2), first="none",
+                            last="none", defer=True)
+
+    thread = threading.Thread(target=_psfgen.end_segments,
+                              kwargs=dict(psfstate=gen._data, threads=1))
+    busy = 0
+    thread.start()
+    while thread.is_alive():
+        try:
+            gen.get_segids()
+        except RuntimeError:
+            busy += 1
+    thread.join()
+
+    assert busy
+    assert gen.get_segids() == ["W0", "W1", "W2", "W3"]
+    del gen
+
+#==============================================================================
+
+def pdb_residues(filename):
+    """ Returns the resid and flat coordinates of each residue of a pdb """
+    residues = []
+    with open(filename) as f:
+        for line in f:
+            if not line.startswith("ATOM"):
+                continue
+            resid = line[22:27].strip()
+            if not residues or residues[-1][0] != resid:
+                residues.append((resid, []))
+            residues[-1][1].extend(float(line[c:c+8])
+                                   for c in (30, 38, 46))
+    return residues
+
+def flat(coordinates):
+    return [x for xyz in coordinates for x in xyz]
+
+def test_many_residues(tmpdir):
+    """
+    Tests residues of a segment spanning several storage chunks keep their
+    order, atoms and coordinates, also after deletions at chunk boundaries
+    """
+    gen = new_gen(str(tmpdir.join("output.log")))
+    gen.add_segment(segid="W1", pdbfile="psf_wat_1.pdb")
+    gen.read_coords(segid="W1", filename="psf_wat_1.pdb")
+    residues = pdb_residues("psf_wat_1.pdb")
+    assert len(residues) > 6 * 64
+    assert gen.get_resids("W1") == [resid for resid, _ in residues]
+
+    boundaries = [0, 1, 63, 64, 65, 127, 128, 383, 384, len(residues) - 1]
+    for i in boundaries:
+        resid, coords = residues[i]
+        assert gen.get_resname(segid="W1", resid=resid) == "TIP3"
+        assert flat(gen.get_coordinates(segid="W1", resid=resid)) \
+            == pytest.approx(coords, abs=1e-3)
+        assert gen.get_atom_indices(segid="W1", resid=resid) \
+            == [3 * i + 1, 3 * i + 2, 3 * i + 3]
+
+    for i in (128, 64, 63):
+        gen.delete_atoms(segid="W1", resid=residues[i][0])
+        del residues[i]
+    assert gen.get_resids("W1") == [resid for resid, _ in residues]
+    for i in boundaries[:-1] + [len(residues) - 1]:
+        resid, coords = residues[i]
+        assert flat(gen.get_coordinates(segid="W1", resid=resid)) \
+            == pytest.approx(coords, abs=1e-3)
+
+    gen.compact()
+    assert gen.get_resids("W1") == [resid for resid, _ in residues]
+    resid, coords = residues[64]
+    assert flat(gen.get_coordinates(segid="W1", resid=resid)) \
+        == pytest.approx(coords, abs=1e-3)
+    del gen
+
+#==============================================================================
+
+def psf_counts(filename):
+    """ Returns the atom and bond counts of a psf file """
+    counts = {}
+    with open(filename) as f:
+        for line in f:
+            if "!NATOM" in line or "!NBOND" in line:
+                counts[line.split()[1]] = int(line.split()[0])
+    return counts["!NATOM"], counts["!NBOND:"]
+
+@pytest.mark.parametrize("index", [False, True])
+def test_instanced_waters(tmpdir, index):
+    """
+    Tests reading and editing waters that share the atoms of one residue
+    """
+    gen = new_gen(str(tmpdir.join("output.log")))
+    gen.set_atom_index(index)
+    gen.add_segment(segid="W0", pdbfile="psf_wat_0.pdb",
+                    auto_angles=False, auto_dihedrals=False)
+    gen.read_coords(segid="W0", filename="psf_wat_0.pdb")
+    before = str(tmpdir.join("before.psf"))
+    gen.write_psf(filename=before)
+    natoms, nbonds = psf_counts(before)
+
+    # Reads give each water its own coordinates and ids
+    assert gen.get_atom_names(segid="W0", resid="2") == ["OH2", "H1", "H2"]
+    assert gen.get_coordinates(segid="W0", resid="2")[0] \
+        == pytest.approx((-27.639, -27.520, -28.226))
+    assert gen.get_atom_indices(segid="W0", resid="2") == [4, 5, 6]
+
+    gen.set_position(segid="W0", resid="3", atomname="H1",
+                     position=(1., 2., 3.))
+    assert gen.get_coordinates(segid="W0", resid="3")[1] == (1., 2., 3.)
+    assert gen.get_coordinates(segid="W0", resid="4")[1] != (1., 2., 3.)
+
+    gen.delete_atoms(segid="W0", resid="4", atomname="H2")
+    assert gen.get_atom_names(segid="W0", resid="4") == ["OH2", "H1"]
+    assert gen.get_atom_names(segid="W0", resid="5") == ["OH2", "H1", "H2"]
+
+    gen.set_atom_name(segid="W0", resid="5", atomname="H1",
+                      new_atomname="HX")
+    assert gen.get_atom_names(segid="W0", resid="5") == ["OH2", "HX", "H2"]
+    assert gen.get_atom_names(segid="W0", resid="6") == ["OH2", "H1", "H2"]
+
+    # A patch bonding two waters
+    rtf = str(tmpdir.join("bridge.rtf"))
+    with open(rtf, "w") as f:
+        f.write("* water bridge\n*\n36 1\n\nPRES WBRG 0.00\nBOND 1H1 2OH2\n\n"
+                "END\n")
+    gen.read_topology(rtf)
+    gen.patch(patchname="WBRG", targets=[("W0", "7"), ("W0", "8")])
+
+    after = str(tmpdir.join("after.psf"))
+    gen.write_psf(filename=after)
+    assert psf_counts(after) == (natoms - 1, nbonds - 2 + 1)
+    assert gen.get_coordinates(segid="W0", resid="3")[1] == (1., 2., 3.)
+    assert gen.get_atom_indices(segid="W0", resid="5") == [12, 13, 14]
+    del gen
+
+#==============================================================================
+
+ARENAS = ("arena", "angle_arena", "dihedral_arena", "index_arena",
+          "topology_arena", "velocities")
+TABLES = ("segments", "residues", "atom_types", "residue_definitions",
+          "topology_files")
+
+def test_memory_stats(tmpdir):
+    """
+    Tests the memory statistics list every arena and table and count what
+    was built
+    """
+    gen = new_gen(str(tmpdir.join("output.log")))
+    gen.add_segment(segid="P0", pdbfile="psf_protein_P0.pdb")
+    gen.add_segment(segid="W1", pdbfile="psf_wat_1.pdb")
+    stats = gen.get_memory_stats()
+
+    assert sorted(stats) == sorted(ARENAS + TABLES)
+    for arena in ARENAS:
+        assert sorted(stats[arena]) == ["blocks", "oversize_blocks",
+                                        "requested", "reserved", "wasted"]
+        assert stats[arena]["requested"] + stats[arena]["wasted"] \
+            <= stats[arena]["reserved"]
+    for table in TABLES:
+        assert sorted(stats[table]) == ["allocated", "alos", "buckets",
+                                        "count", "entries", "hash_bytes",
+                                        "item_bytes", "key_bytes",
+                                        "max_chain", "used_buckets"]
+        assert stats[table]["entries"] <= stats[table]["buckets"]
+        assert stats[table]["count"] <= stats[table]["allocated"]
+
+    for arena in ("arena", "angle_arena", "dihedral_arena", "topology_arena"):
+        assert stats[arena]["blocks"] > 0
+    assert stats["velocities"]["blocks"] == 0
+    assert stats["segments"]["entries"] == 2
+    assert stats["residues"]["entries"] == len(gen.get_resids("P0")) \
+        + len(gen.get_resids("W1"))
+    assert stats["topology_files"]["entries"] == 3
+    assert stats["residue_definitions"]["entries"] \
+        >= len(gen.get_residue_types())
+    del gen
+
+#==============================================================================
+
+def build_waters(tmpdir, name, rtf):
+    """
+    Returns the psf and pdb of edited waters built from rtf, and the
+    memory the atoms took
+    """
+    from psfgen import PsfGen
+    gen = PsfGen(output=str(tmpdir.join(name + ".log")))
+    gen.read_topology(rtf)
+    gen.add_segment(segid="W0", pdbfile="psf_wat_0.pdb",
+                    auto_angles=False, auto_dihedrals=False)
+    gen.add_segment(segid="W1", pdbfile="psf_wat_1.pdb")
+    gen.read_coords(segid="W0", filename="psf_wat_0.pdb")
+    gen.read_coords(segid="W1", filename="psf_wat_1.pdb")
+    requested = gen.get_memory_stats()["arena"]["requested"]
+
+    gen.set_position(segid="W0", resid="3", atomname="H1",
+                     position=(1., 2., 3.))
+    gen.set_charge(segid="W0", resid="4", atomname="OH2", charge=-0.5)
+    gen.set_mass(segid="W0", resid="4", atomname="H2", mass=2.0)
+    gen.set_beta(segid="W0", resid="5", atomname="H2", beta=1.5)
+    gen.set_atom_name(segid="W0", resid="5", atomname="H1",
+                      new_atomname="HX")
+    gen.set_resname(segid="W0", resid="6", new_resname="TP3M")
+    gen.delete_atoms(segid="W0", resid="7", atomname="H2")
+    gen.delete_atoms(segid="W0", resid="8")
+    gen.delete_atoms(segid="W1", resid=gen.get_resids("W1")[-1])
+
+    psf = str(tmpdir.join(name + ".psf"))
+    pdb = str(tmpdir.join(name + ".pdb"))
+    gen.write_psf(filename=psf)
+    gen.write_pdb(filename=pdb)
+    assert gen.get_charges(segid="W0", resid="4")[0] == pytest.approx(-0.5)
+    assert gen.get_atom_names(segid="W0", resid="7") == ["OH2", "H1"]
+    assert gen.get_atom_names(segid="W0", resid="9") == ["OH2", "H1", "H2"]
+    del gen
+    with open(psf) as f:
+        lines = [l for l in f if "REMARKS topology" not in l]
+    return lines + read_files(pdb), requested
+
+def test_instanced_matches_residues(tmpdir):
+    """
+    Tests water segments built as instances of their first residue come
+    out the same as waters built one residue at a time, after editing
+    single instances
+    """
+    os.chdir(dir)
+    # MASS entries after the residues leave the templates without atom
+    # types, which keeps segments from being instanced
+    with open("top_water_ions.rtf") as f:
+        lines = f.readlines()
+    masses = [l for l in lines if l.startswith("MASS")]
+    lines = [l for l in lines if not l.startswith("MASS")]
+    end = lines.index("END\n")
+    rtf = str(tmpdir.join("residues.rtf"))
+    with open(rtf, "w") as f:
+        f.writelines(lines[:end] + masses + lines[end:])
+
+    residues, residues_size = build_waters(tmpdir, "residues", rtf)
+    instanced, instanced_size = build_waters(tmpdir, "instanced",
+                                             "top_water_ions.rtf")
+    assert instanced == residues
+    assert instanced_size < residues_size
+
+#==============================================================================
+
+def test_arena_mode(tmpdir):
+    """
+    Tests an unsupported mode is refused, and that arenas obtained with
+    mmap give the same structure as the default ones
+    """
+    outputs = []
+    for mode in ("default", "mmap"):
+        gen = new_gen(str(tmpdir.join(mode + ".log")))
+        for arena in ("atoms", "angles", "dihedrals", "all"):
+            with pytest.raises(ValueError):
+                gen.set_arena_mode(arena=arena, mmap=False, hugepages=True)
+        if mode == "mmap":
+            gen.set_arena_mode(arena="all", mmap=True, grow=True)
+        gen.add_segment(segid="P0", pdbfile="psf_protein_P0.pdb")
+        gen.add_segment(segid="W0", pdbfile="psf_wat_0.pdb")
+        psf = str(tmpdir.join(mode + ".psf"))
+        gen.write_psf(filename=psf)
+        outputs.extend(read_files(psf))
+        del gen
+
+    assert outputs[0] == outputs[1]
+
+#==============================================================================
+
+@pytest.mark.parametrize("index", [False, True])
+def test_renamed_lookup(tmpdir, index):
+    """
+    Tests atoms of a residue large enough for a name index are found by
+    their new names after renames and deletions
+    """
+    gen = new_gen(str(tmpdir.join("output.log")))
+    gen.set_atom_index(index)
+    gen.add_segment(segid="P0", pdbfile="psf_protein_P0.pdb")
+    names = gen.get_atom_names(segid="P0", resid="18")
+    assert len(names) == 24
+
+    def position_of(atomname, position):
+        gen.set_position(segid="P0", resid="18", atomname=atomname,
+                         position=position)
+        return gen.get_coordinates(segid="P0", resid="18").index(position)
+
+    # Looked up once so that the index exists before the renames
+    assert position_of("CZ", (1., 0., 0.)) == names.index("CZ")
+    gen.set_atom_name(segid="P0", resid="18", atomname="CZ",
+                      new_atomname="CX")
+    assert position_of("CX", (2., 0., 0.)) == names.index("CZ")
+    with pytest.raises(ValueError):
+        position_of("CZ", (3., 0., 0.))
+
+    # Swap two names through a third
+    for old, new in (("NH1", "NT"), ("NH2", "NH1"), ("NT", "NH2")):
+        gen.set_atom_name(segid="P0", resid="18", atomname=old,
+                          new_atomname=new)
+    assert position_of("NH1", (4., 0., 0.)) == names.index("NH2")
+    assert position_of("NH2", (5., 0., 0.)) == names.index("NH1")
+
+    gen.delete_atoms(segid="P0", resid="18", atomname="HE")
+    names.remove("HE")
+    assert position_of("CX", (6., 0., 0.)) == names.index("CZ")
+    assert position_of("O", (7., 0., 0.)) == names.index("O")
+    with pytest.raises(ValueError):
+        position_of("HE", (8., 0., 0.))
+
+    gen.set_atom_name(segid="P0", resid="18", atomname="CX",
+                      new_atomname="CZ")
+    assert position_of("CZ", (9., 0., 0.)) == names.index("CZ")
+    with pytest.raises(ValueError):
+        position_of("CX", (10., 0., 0.))
+    del gen
+
+#==============================================================================
+
+def test_compact(tmpdir):
+    """
+    Tests compacting leaves the structure as it was, and that tuples it
+    frees are reused across a segment that fails
+    """
+    outputs = []
+    for compact in (False, True):
+        gen = new_gen(str(tmpdir.join("output%d.log" % compact)))
+        gen.add_segment(segid="P0", pdbfile="psf_protein_P0.pdb")
+        gen.add_segment(segid="W0", pdbfile="psf_wat_0.pdb",
+                        auto_angles=False, auto_dihedrals=False)
+        gen.delete_atoms(segid="P0", resid="5")
+        gen.delete_atoms(segid="W0", resid="3", atomname="H1")
+        if compact:
+            assert gen.compact() > 0
+            assert gen.compact() == 0
+
+        with pytest.raises(ValueError):
+            gen.add_segment(**SEGMENTS[3])
+        gen.add_segment(segid="P1", pdbfile="psf_protein_P1.pdb",
+                        first="NTER", last="CTER")
+        gen.patch(patchname="DISU", targets=[("P0", "10"), ("P0", "15")])
+        gen.regenerate_angles()
+        gen.regenerate_dihedrals()
+
+        psf = str(tmpdir.join("compact%d.psf" % compact))
+        gen.write_psf(filename=psf)
+        outputs.extend(read_files(psf))
+        del gen
+
+    assert outputs[0] == outputs[1]
+
+#==============================================================================
+
+def test_compact_tables(tmpdir):
+    """
+    Tests compacting drops deleted segments and residues from their tables,
+    leaving the others where lookups find them
+    """
+    gen = new_gen(str(tmpdir.join("output.log")))
+    for segment in SEGMENTS:
+        if segment["segid"] in ("P0", "W1", "I"):
+            gen.add_segment(**segment)
+    gen.read_coords(segid="W1", filename="psf_wat_1.pdb")
+
+    def counts():
+        stats = gen.get_memory_stats()
+        return [(stats[table]["count"], stats[table]["entries"])
+                for table in ("segments", "residues")]
+
+    gen.delete_atoms(segid="I")
+    resids = gen.get_resids("W1")
+    for resid in resids[::2]:
+        gen.delete_atoms(segid="W1", resid=resid)
+    kept = resids[1::2]
+    nprotein = len(gen.get_resids("P0"))
+    nresidues = nprotein + len(kept)
+    assert counts() == [(3, 2), (nprotein + len(resids), nresidues)]
+    before = str(tmpdir.join("before.psf"))
+    gen.write_psf(filename=before)
+
+    gen.compact()
+    assert counts() == [(2, 2), (nresidues, nresidues)]
+    assert gen.get_segids() == ["P0", "W1"]
+    assert gen.get_resids("W1") == kept
+    for resid in (kept[0], kept[len(kept) // 2], kept[-1]):
+        assert gen.get_resname(segid="W1", resid=resid) == "TIP3"
+    with pytest.raises(ValueError):
+        gen.get_resname(segid="W1", resid=resids[0])
+    after = str(tmpdir.join("after.psf"))
+    gen.write_psf(filename=after)
+    assert read_files(after) == read_files(before)
+
+    # The deleted segment's name can be used again
+    gen.add_segment(segid="I", pdbfile="psf_ions.pdb")
+    assert gen.get_segids() == ["P0", "W1", "I"]
+    assert counts()[0] == (3, 3)
+    del gen
+
+#==============================================================================
+
+def test_delete_lookup(tmpdir):
+    """
+    Tests segments and residues are still found after others are deleted,
+    renamed or added again
+    """
+    gen = new_gen(str(tmpdir.join("output.log")))
+    segids = ["S%d" % i for i in range(200)]
+    for segid in segids:
+        gen.add_segment(segid=segid, pdbfile="psf_ions.pdb")
+
+    for segid in segids[::3]:
+        gen.delete_atoms(segid=segid)
+    for segid in segids[1::3]:
+        gen.set_segid(segid=segid, new_segid="R" + segid)
+    for segid in segids[:30:3]:
+        gen.add_segment(segid=segid, pdbfile="psf_ions.pdb")
+
+    expected = set(segids[2::3]) | set("R" + s for s in segids[1::3]) \
+        | set(segids[:30:3])
+    assert set(gen.get_segids()) == expected
+    for segid in expected:
+        assert gen.get_resname(segid=segid, resid="2") == "SOD"
+    for segid in segids[30::3] + segids[1::3]:
+        with pytest.raises(ValueError):
+            gen.get_resids(segid)
+
+    # Residues, with deletions wrapping around the table
+    gen.add_segment(segid="W0", pdbfile="psf_wat_0.pdb",
+                    auto_angles=False, auto_dihedrals=False)
+    resids = gen.get_resids("W0")
+    for resid in resids[::2] + resids[-4::2]:
+        gen.delete_atoms(segid="W0", resid=resid)
+    kept = resids[1:-4:2]
+    assert gen.get_resids("W0") == kept
+    for resid in kept:
+        assert gen.get_atom_names(segid="W0", resid=resid) \
+            == ["OH2", "H1", "H2"]
+    with pytest.raises(ValueError):
+        gen.get_atom_names(segid="W0", resid=resids[0])
+    del gen
+
+#==============================================================================
+
+def test_resids(tmpdir):
+    """
+    Tests resids that are not plain numbers: leading zeros, negatives and
+    insertion codes
+    """
+    resids = ["-12", "-3", "1", "01", "5A", "5B", "10", "00"]
+    pdb = str(tmpdir.join("resids.pdb"))
+    with open(pdb, "w") as f:
+        for i, resid in enumerate(resids):
+            number, code = (resid[:-1], resid[-1]) if resid[-1].isalpha() \
+                else (resid, " ")
+            for j, name in enumerate(["OH2", "H1", "H2"]):
+                f.write("ATOM  %5d  %-3s TIP3 %4s%s   %8.3f%8.3f%8.3f"
+                        "  1.00  0.00      W0\n"
+                        % (3*i+j+1, name, number, code, i, j, 0.))
+        f.write("END\n")
+
+    gen = new_gen(str(tmpdir.join("output.log")))
+    gen.add_segment(segid="W0", pdbfile=pdb,
+                    auto_angles=False, auto_dihedrals=False)
+    gen.read_coords(segid="W0", filename=pdb)
+    assert gen.get_resids("W0") == resids
+    for i, resid in enumerate(resids):
+        assert gen.get_coordinates(segid="W0", resid=resid)[1] == (i, 1., 0.)
+    for resid in ["5", "-03", "+1", "001", "5a"]:
+        with pytest.raises(ValueError):
+            gen.get_resname(segid="W0", resid=resid)
+
+    def pdb_resids(filename):
+        with open(filename) as f:
+            return [l[22:27] for l in f if l.startswith("ATOM")][::3]
+
+    out = str(tmpdir.join("out.pdb"))
+    gen.write_pdb(filename=out)
+    assert pdb_resids(out) == [" -12 ", "  -3 ", "   1 ", "   1 ", "   5A",
+                               "   5B", "  10 ", "   0 "]
+
+    gen.regenerate_resids()
+    renumbered = ["-12", "-3", "1", "2", "5", "6", "10", "11"]
+    assert gen.get_resids("W0") == renumbered
+    for i, resid in enumerate(renumbered):
+        assert gen.get_coordinates(segid="W0", resid=resid)[1] == (i, 1., 0.)
+    for resid in ["01", "5A", "00"]:
+        with pytest.raises(ValueError):
+            gen.get_resname(segid="W0", resid=resid)
+    gen.write_pdb(filename=out)
+    assert pdb_resids(out) == ["%4s " % r for r in renumbered]
+    del gen
+
+#==============================================================================
+
+def arena_use(gen):
+    """ Returns the bytes taken from the molecule arenas """
+    stats = gen.get_memory_stats()
+    return [stats[k]["requested"]
+            for k in ("arena", "angle_arena", "dihedral_arena")]
+
+@pytest.mark.parametrize("batch", [False, True])
+def test_reuse_deleted(tmpdir, batch):
+    """
+    Tests deleting, compacting and adding segments again reuses the bonds,
+    angles and dihedrals of the deleted ones, a failed segment included
+    """
+    segments = [SEGMENTS[0], SEGMENTS[3], SEGMENTS[2]]
+    use = {}
+    for compact in (False, True):
+        gen = new_gen(str(tmpdir.join("output%d.log" % compact)))
+        use[compact] = []
+        for cycle in range(5):
+            with pytest.raises(ValueError):
+                if batch:
+                    # one thread, for the same free tuples in every run
+                    gen.add_segments(segments, threads=1)
+                else:
+                    for segment in segments:
+                        gen.add_segment(**segment)
+            if not batch:
+                gen.add_segment(**segments[2])
+            use[compact].append(arena_use(gen))
+            gen.delete_atoms(segid="P0")
+            gen.delete_atoms(segid="P1")
+            if compact:
+                assert gen.compact() > 0
+        del gen
+
+    # Angles and dihedrals come from the free lists once they hold enough
+    assert use[True][2][1:] == use[True][-1][1:]
+    assert use[False][-1][1:] == [5 * n for n in use[False][0][1:]]
+
+    # Atoms are not reused, but bonds are
+    grown = [[b[0] - a[0] for a, b in zip(use[compact], use[compact][1:])]
+             for compact in (False, True)]
+    assert grown[1][1:] == [grown[1][1]] * 3
+    assert grown[1][1] < grown[0][1]
+
+#==============================================================================
+
+def test_compact_velocities(tmpdir):
+    """
+    Tests compacting releases the velocities of deleted atoms and keeps
+    those of the others
+    """
+    gen = new_gen(str(tmpdir.join("output.log")))
+    for segid in ("W0", "W1"):
+        gen.add_segment(segid=segid, pdbfile="psf_wat_%s.pdb" % segid[1],
+                        auto_angles=False, auto_dihedrals=False)
+    gen.set_velocity(segid="W0", resid="7", atomname="H1",
+                     velocity=(1., 2., 3.))
+    gen.set_velocity(segid="W1", resid="5", atomname="H2",
+                     velocity=(4., 5., 6.))
+    assert gen.get_memory_stats()["velocities"]["blocks"] == 2
+
+    gen.delete_atoms(segid="W1")
+    gen.compact()
+    assert gen.get_memory_stats()["velocities"]["blocks"] == 1
+    assert gen.get_velocities(segid="W0", resid="7") \
+        == [(0., 0., 0.), (1., 2., 3.), (0., 0., 0.)]
+
+    # The atoms added again take the slots of the deleted ones
+    gen.add_segment(segid="W1", pdbfile="psf_wat_1.pdb",
+                    auto_angles=False, auto_dihedrals=False)
+    gen.set_velocity(segid="W1", resid="5", atomname="H2",
+                     velocity=(4., 5., 6.))
+    stats = gen.get_memory_stats()["velocities"]
+    assert stats["blocks"] == 2
+    assert gen.get_velocities(segid="W1", resid="5")[2] == (4., 5., 6.)
+    assert gen.get_velocities(segid="W0", resid="7")[1] == (1., 2., 3.)
+
+    gen.delete_atoms(segid="W0")
+    gen.delete_atoms(segid="W1")
+    gen.compact()
+    assert gen.get_memory_stats()["velocities"]["blocks"] == 0
+    del gen
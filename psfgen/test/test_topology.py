@@ -0,0 +1,396 @@
+#/usr/bin/env python
+"""
+Tests reading topology definitions: several files at once, the topology
+cache, and definitions shared between PsfGen objects.
+"""
+import pytest
+import os
+
+dir = os.path.dirname(__file__)
+
+#==============================================================================
+
+def test_shared_topology(tmpdir):
+    """
+    Tests that shared definitions report to the object that uses them, once
+    the object that read them is gone
+    """
+    from psfgen import PsfGen
+    os.chdir(dir)
+    first = str(tmpdir.join("first.log"))
+    second = str(tmpdir.join("second.log"))
+    other = str(tmpdir.join("other.log"))
+
+    gen = PsfGen(output=first)
+    gen.read_topology("top_all36_caps.rtf")
+    gen.read_topology("top_all36_prot.rtf")
+    gen2 = PsfGen(output=second, topology=gen)
+    assert gen2.get_residue_types() == gen.get_residue_types()
+    del gen
+
+    # Reuses the file descriptor of the deleted object's output
+    with open(other, "w"):
+        gen2.read_topology("top_all36_prot.rtf")
+        gen2.add_segment(segid="P0", pdbfile="psf_protein_P0.pdb")
+        assert len(gen2.get_resids("P0")) == 25
+        del gen2
+
+    assert os.path.getsize(other) == 0
+    with open(second) as f:
+        assert "duplicate residue key ACE" in f.read()
+
+#==============================================================================
+
+TOPOLOGIES = ["top_all36_caps.rtf", "top_all36_prot.rtf",
+              "top_water_ions.rtf", "top_all36_caps.rtf"]
+
+def read_log(filename):
+    with open(filename) as f:
+        return f.read()
+
+def test_read_topologies(tmpdir):
+    """
+    Tests reading several files at once gives the same definitions and
+    messages, in the same order, as reading them one at a time
+    """
+    from psfgen import PsfGen
+    os.chdir(dir)
+    results = []
+    for threads in (None, 1, 4):
+        log = str(tmpdir.join("multi%s.log" % threads))
+        gen = PsfGen(output=log)
+        if threads is None:
+            for filename in TOPOLOGIES:
+                gen.read_topology(filename)
+        else:
+            gen.read_topologies(TOPOLOGIES, threads=threads)
+        results.append((gen.get_residue_types(),
+                        gen.get_patches(list_all=True)))
+        del gen
+        results.append(read_log(log))
+
+    assert results[0] == results[2] == results[4]
+    assert results[1] == results[3] == results[5]
+
+    # Duplicates are reported while reading the file that repeats them
+    log = results[1]
+    water = log.index("water and ions")
+    assert log.count("duplicate residue key ACE") == 2
+    assert log.index("duplicate residue key ACE") < water
+    assert log.index("duplicate residue key NMA") > water
+    assert log.index("duplicate topology file") > water
+
+def test_read_topologies_missing(tmpdir):
+    """
+    Tests that no file is read if one of them cannot be opened
+    """
+    from psfgen import PsfGen
+    os.chdir(dir)
+    gen = PsfGen(output=str(tmpdir.join("missing.log")))
+    with pytest.raises(OSError):
+        gen.read_topologies(TOPOLOGIES[:2] + ["nonexistent.rtf"])
+    assert gen.get_residue_types() == []
+    del gen
+
+def test_read_topologies_busy(tmpdir):
+    """
+    Tests other threads are turned away while topology files are parsed
+    """
+    from psfgen import PsfGen
+    import threading
+    os.chdir(dir)
+    gen = PsfGen(output=str(tmpdir.join("output.log")))
+    thread = threading.Thread(target=gen.read_topologies,
+                              args=(TOPOLOGIES * 4,), kwargs=dict(threads=1))
+    busy = 0
+    thread.start()
+    while thread.is_alive():
+        try:
+            gen.get_residue_types()
+        except RuntimeError:
+            busy += 1
+    thread.join()
+
+    assert busy
+    assert "TIP3" in gen.get_residue_types()
+    del gen
+
+#==============================================================================
+
+def read_cached(tmpdir, name, cache, filenames):
+    """ Returns the definitions, structure and log from reading filenames """
+    from psfgen import PsfGen
+    log = str(tmpdir.join(name + ".log"))
+    psf = str(tmpdir.join(name + ".psf"))
+    gen = PsfGen(output=log)
+    gen.set_topology_cache(cache)
+    for filename in filenames:
+        gen.read_topology(filename)
+    result = [gen.get_residue_types(), gen.get_patches(list_all=True)]
+    gen.add_segment(segid="P0", pdbfile="psf_protein_P0.pdb")
+    gen.write_psf(filename=psf)
+    del gen
+    return result + [read_log(log), read_log(psf)]
+
+def cache_files(cache):
+    """ Returns the inode of each cache file by name """
+    return dict((f, os.stat(os.path.join(cache, f)).st_ino)
+                for f in os.listdir(cache))
+
+def test_topology_cache(tmpdir):
+    """
+    Tests definitions read from the cache are those of the text, and that
+    a changed or damaged cache file is not used
+    """
+    os.chdir(dir)
+    cache = str(tmpdir.mkdir("cache"))
+    water = str(tmpdir.join("water.rtf"))
+    with open("top_water_ions.rtf") as f:
+        text = f.read()
+    with open(water, "w") as f:
+        f.write(text)
+    filenames = TOPOLOGIES[:2] + [water]
+
+    expected = read_cached(tmpdir, "text", None, filenames)
+    assert read_cached(tmpdir, "miss", cache, filenames) == expected
+    files = cache_files(cache)
+    assert len(files) == 3
+
+    # A hit leaves the cache files alone
+    assert read_cached(tmpdir, "hit", cache, filenames) == expected
+    assert cache_files(cache) == files
+
+    # A damaged cache file is parsed again and replaced
+    name = sorted(files)[0]
+    with open(os.path.join(cache, name), "r+b") as f:
+        f.truncate(64)
+    assert read_cached(tmpdir, "damaged", cache, filenames) == expected
+    assert sorted(cache_files(cache)) == sorted(files)
+    assert cache_files(cache)[name] != files[name]
+
+    # A changed file gets a new cache file
+    with open(water, "w") as f:
+        f.write(text.replace("\nEND", "\nRESI XYZ 0.00\nATOM X1 HT 0.00\n"
+                                      "\nEND"))
+    changed = read_cached(tmpdir, "changed", cache, filenames)
+    assert "XYZ" in changed[0] and "XYZ" not in expected[0]
+    assert changed == read_cached(tmpdir, "changedtext", None, filenames)
+    assert len(cache_files(cache)) == 4
+
+#==============================================================================
+
+ENTRIES = """* residue entries
+*
+36 1
+
+MASS 1 XC 12.01100 C
+MASS 2 XH 1.00800 H
+
+RESI AAA 0.00
+GROUP
+ATOM A3 XH 0.09
+ATOM A1 XC -0.27
+ATOM A2 XH 0.09
+ATOM A4 XH 0.09
+BOND A3 A1 A1 A2 A1 A4
+BOND A4 +A3
+ANGLE A3 A1 A2
+IMPR A1 A2 A3 A4
+PATCHING FIRST NONE LAST NONE
+
+RESI AAA 0.00
+ATOM A1 XC 0.00
+ATOM A2 XH 0.00
+
+PRES SWAP 0.00
+GROUP
+ATOM A5 XC 0.00
+DELETE ATOM A4
+BOND A1 A5
+
+END
+"""
+
+def write_pdb(filename, segid, resname, atomnames, nresidues):
+    """ Writes nresidues residues of the given atoms """
+    with open(filename, "w") as f:
+        for resid in range(1, nresidues + 1):
+            for i, name in enumerate(atomnames):
+                f.write("ATOM  %5d  %-3s %-4s %4d    %8.3f%8.3f%8.3f"
+                        "  1.00  0.00      %-4s\n"
+                        % (i + 1, name, resname, resid, resid, i, 0., segid))
+        f.write("END\n")
+
+def test_residue_entries(tmpdir):
+    """
+    Tests a residue is built from its first definition, with its atoms and
+    other entries in the order of the file, and that patches use theirs
+    """
+    from psfgen import PsfGen
+    log = str(tmpdir.join("output.log"))
+    rtf = str(tmpdir.join("entries.rtf"))
+    pdb = str(tmpdir.join("entries.pdb"))
+    psf = str(tmpdir.join("entries.psf"))
+    with open(rtf, "w") as f:
+        f.write(ENTRIES)
+    write_pdb(pdb, "A", "AAA", ["A1", "A2", "A3", "A4"], 3)
+
+    gen = PsfGen(output=log)
+    gen.read_topology(rtf)
+    assert gen.get_residue_types() == ["AAA"]
+    gen.add_segment(segid="A", pdbfile=pdb, auto_angles=False,
+                    auto_dihedrals=False)
+    assert gen.get_atom_names(segid="A", resid="1") == ["A3", "A1", "A2",
+                                                        "A4"]
+    assert gen.get_charges(segid="A", resid="2") \
+        == pytest.approx([0.09, -0.27, 0.09, 0.09])
+    assert gen.get_masses(segid="A", resid="2") \
+        == pytest.approx([1.008, 12.011, 1.008, 1.008])
+
+    gen.patch(patchname="SWAP", targets=[("A", "3")])
+    assert gen.get_atom_names(segid="A", resid="3") == ["A5", "A3", "A1",
+                                                        "A2"]
+    gen.write_psf(filename=psf)
+    counts = {}
+    with open(psf) as f:
+        for line in f:
+            if "!N" in line:
+                counts[line.split()[1].rstrip(":")] = int(line.split()[0])
+    assert counts["!NATOM"] == 12
+    # Three bonds each, two between residues, one swapped by the patch
+    assert counts["!NBOND"] == 3 * 3 + 2
+    assert counts["!NTHETA"] == 3
+    assert counts["!NIMPHI"] == 2  # the patch deleted an atom of one
+    del gen
+
+    assert "duplicate residue key AAA" in read_log(log)
+
+#==============================================================================
+
+def read_water(tmpdir, name, text, lazy):
+    """ Returns the definitions and ion structure read from text """
+    from psfgen import PsfGen
+    rtf = str(tmpdir.join(name + ".rtf"))
+    psf = str(tmpdir.join(name + ".psf"))
+    with open(rtf, "w", newline="") as f:
+        f.write(text)
+    gen = PsfGen(output=str(tmpdir.join(name + ".log")))
+    gen.set_lazy_topology(lazy)
+    gen.read_topology(rtf)
+    result = [gen.get_residue_types(), gen.get_patches(list_all=True)]
+    gen.add_segment(segid="I", pdbfile="psf_ions.pdb")
+    gen.write_psf(filename=psf)
+    del gen
+    with open(psf) as f:
+        lines = f.read().splitlines()
+    return result + [[l for l in lines if "REMARKS topology" not in l]]
+
+@pytest.mark.parametrize("lazy", [False, True])
+def test_unterminated_topology(tmpdir, lazy):
+    """
+    Tests a topology file that ends without a newline, or with carriage
+    returns, reads the same as the original
+    """
+    os.chdir(dir)
+    with open("top_water_ions.rtf") as f:
+        text = f.read()
+    expected = read_water(tmpdir, "original", text, lazy)
+    last = text.index("ATOM CLA  CLA -1.00") + len("ATOM CLA  CLA -1.00")
+
+    assert read_water(tmpdir, "bare", text[:last], lazy) == expected
+    assert read_water(tmpdir, "comment", text[:last] + " ! no newline",
+                      lazy) == expected
+    assert read_water(tmpdir, "blank", text[:last] + "\n\n  ",
+                      lazy) == expected
+    assert read_water(tmpdir, "crlf", text.replace("\n", "\r\n"),
+                      lazy) == expected
+
+    # Nothing to map, or a title with no newline at all
+    from psfgen import PsfGen
+    for name, text in (("empty", ""), ("title", "* title only")):
+        rtf = str(tmpdir.join(name + ".rtf"))
+        with open(rtf, "w") as f:
+            f.write(text)
+        gen = PsfGen(output=str(tmpdir.join(name + ".log")))
+        gen.set_lazy_topology(lazy)
+        gen.read_topology(rtf)
+        assert gen.get_residue_types() == []
+        del gen
+
+#==============================================================================
+
+def build_system(tmpdir, name, lazy, multi, filenames=TOPOLOGIES[:3]):
+    """
+    Returns the definitions and written structure of a small system, and
+    the topology memory in use once the files are read
+    """
+    from psfgen import PsfGen
+    psf = str(tmpdir.join(name + ".psf"))
+    pdb = str(tmpdir.join(name + ".pdb"))
+    gen = PsfGen(output=str(tmpdir.join(name + ".log")))
+    gen.set_lazy_topology(lazy)
+    if multi:
+        gen.read_topologies(filenames)
+    else:
+        for filename in filenames:
+            gen.read_topology(filename)
+    parsed = gen.get_memory_stats()["topology_arena"]["requested"]
+    gen.add_segment(segid="P0", pdbfile="psf_protein_P0.pdb")
+    gen.add_segment(segid="P1", pdbfile="psf_protein_P1.pdb",
+                    first="NTER", last="CTER")
+    gen.add_segment(segid="W0", pdbfile="psf_wat_0.pdb")
+    gen.add_segment(segid="I", pdbfile="psf_ions.pdb")
+    for segid, filename in (("P0", "psf_protein_P0.pdb"),
+                            ("P1", "psf_protein_P1.pdb"),
+                            ("W0", "psf_wat_0.pdb"), ("I", "psf_ions.pdb")):
+        gen.read_coords(segid=segid, filename=filename)
+    gen.patch(patchname="DISU", targets=[("P0", "10"), ("P0", "15")])
+    gen.guess_coords()
+    gen.write_psf(filename=psf)
+    gen.write_pdb(filename=pdb)
+    result = [gen.get_residue_types(), gen.get_patches(list_all=True)]
+    del gen
+    with open(psf) as f:
+        result.append([l for l in f if "REMARKS topology" not in l])
+    with open(pdb) as f:
+        result.append(f.read())
+    return result, parsed
+
+@pytest.mark.parametrize("multi", [False, True])
+def test_lazy_topology(tmpdir, multi):
+    """
+    Tests residues parsed on first use build the same structure as those
+    parsed when the file is read
+    """
+    os.chdir(dir)
+    lazy, lazy_parsed = build_system(tmpdir, "lazy", True, multi)
+    eager, eager_parsed = build_system(tmpdir, "eager", False, multi)
+    assert lazy == eager
+    assert lazy_parsed < eager_parsed
+
+#==============================================================================
+
+def masses_last(filename, tmpdir):
+    """ Copies a topology file with its MASS lines moved after the residues """
+    with open(filename) as f:
+        lines = f.readlines()
+    masses = [l for l in lines if l.upper().startswith("MASS")]
+    lines = [l for l in lines if not l.upper().startswith("MASS")]
+    ends = [i for i, l in enumerate(lines) if l.strip().upper() == "END"]
+    end = ends[-1] if ends else len(lines)
+    copy = str(tmpdir.join(filename))
+    with open(copy, "w") as f:
+        f.writelines(lines[:end] + masses + lines[end:])
+    return copy
+
+def test_compiled_templates(tmpdir):
+    """
+    Tests residues whose atom types are only known once their MASS entries
+    are read, after the RESI, build the same system as compiled ones
+    """
+    os.chdir(dir)
+    late = [masses_last(filename, tmpdir) for filename in TOPOLOGIES[:3]]
+    expected, _ = build_system(tmpdir, "compiled", False, False)
+    assert build_system(tmpdir, "late", False, False, late)[0] == expected
+    assert build_system(tmpdir, "latelazy", True, False, late)[0] \
+        == expected
@@ -1,3 +1,4 @@
+import sys
 from setuptools import setup
 from setuptools.extension import Extension
 
@@ -5,6 +6,7 @@ from setuptools.extension import Extension
 psfgenfiles = [
     "./src/charmm_file.c",
     "./src/charmm_parse_topo_defs.c",
+    "./src/chunkarray.c",
     "./src/extract_alias.c",
     "./src/hash.c",
     "./src/hasharray.c",
@@ -15,7 +17,9 @@ psfgenfiles = [
     "./src/psf_file_extract.c",
     "./src/python_psfgen.c",
     "./src/stringhash.c",
+    "./src/symtab.c",
     "./src/topo_defs.c",
+    "./src/topo_defs_cache.c",
     "./src/topo_mol.c",
     "./src/topo_mol_output.c",
 ]
@@ -24,7 +28,7 @@ psfext = Extension(
     "_psfgen",
     define_macros=[("PSFGENTCLDLL_EXPORTS", "1")],
     include_dirs=["./src"],
-    libraries=[],
+    libraries=[] if sys.platform == "win32" else ["pthread"],
     library_dirs=[],
     sources=psfgenfiles,
 )
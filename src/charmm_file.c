@@ -1,8 +1,22 @@
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <ctype.h>
 #include "charmm_file.h"
 
+#if defined(__unix__) || defined(__APPLE__)
+#include <sys/mman.h>
+#include <sys/stat.h>
+#define CHARMM_FILE_HAVE_MMAP
+#endif
+
+struct charmm_file {
+  char *map;      /* mapping or malloc'd copy */
+  size_t maplen;  /* length of the mapping, 0 if malloc'd */
+  const char *pos, *end;
+};
+
 /*
    In addition to stream from which to read data, takes token buffer,
    max number of tokens, string buffer, and length of buffer.
@@ -69,3 +83,124 @@ int charmm_get_tokens(char **tok, int toklen,
 
 }
 
+
+charmm_file * charmm_file_open(FILE *stream) {
+  charmm_file *f;
+  size_t n, max, got;
+  char *newmap;
+  if ( ! stream ) return 0;
+  if ( ! ( f = (charmm_file*) malloc(sizeof(charmm_file)) ) ) return 0;
+  f->map = 0;
+  f->maplen = 0;
+#ifdef CHARMM_FILE_HAVE_MMAP
+  {
+    struct stat st;
+    long start = ftell(stream);
+    if ( start >= 0 && ! fstat(fileno(stream),&st) && S_ISREG(st.st_mode) &&
+         st.st_size > start ) {
+      f->map = (char*) mmap(0,st.st_size,PROT_READ,MAP_PRIVATE,
+                            fileno(stream),0);
+      if ( f->map != MAP_FAILED ) {
+#ifdef MADV_SEQUENTIAL
+        madvise(f->map,st.st_size,MADV_SEQUENTIAL);
+#endif
+        f->maplen = st.st_size;
+        f->pos = f->map + start;
+        f->end = f->map + st.st_size;
+        return f;
+      }
+      f->map = 0;
+    }
+  }
+#endif
+  /* pipes, empty files and systems without mmap */
+  n = max = 0;
+  do {
+    if ( n == max ) {
+      max = max ? 2 * max : 65536;
+      if ( ! ( newmap = (char*) realloc(f->map,max) ) ) {
+        free(f->map);
+        free(f);
+        return 0;
+      }
+      f->map = newmap;
+    }
+    got = fread(f->map + n,1,max - n,stream);
+    n += got;
+  } while ( got );
+  f->pos = f->map;
+  f->end = f->map + n;
+  return f;
+}
+
+charmm_file * charmm_file_view(const char *text, size_t len) {
+  charmm_file *f;
+  if ( ! ( f = (charmm_file*) malloc(sizeof(charmm_file)) ) ) return 0;
+  f->map = 0;
+  f->maplen = 0;
+  f->pos = text;
+  f->end = text + len;
+  return f;
+}
+
+void charmm_file_close(charmm_file *f) {
+  if ( ! f ) return;
+#ifdef CHARMM_FILE_HAVE_MMAP
+  if ( f->maplen ) munmap(f->map,f->maplen);
+  else
+#endif
+  free(f->map);
+  free(f);
+}
+
+const char * charmm_file_data(charmm_file *f, size_t *len) {
+  *len = f->end - f->pos;
+  return f->pos;
+}
+
+int charmm_file_tokens(charmm_file *f, char **tok, int toklen,
+			char *sbuf, int sbuflen,
+			const char **line, int *linelen, int *lineno,
+			int all_caps) {
+
+  int ntok;
+  const char *s, *e, *next;
+  char *d;
+
+  ntok = 0;
+  while ( ! ntok ) {
+    if ( f->pos >= f->end ) return 0;  /* EOF */
+    s = f->pos;
+    /* next line, cut where fgets into sbuf would have stopped */
+    next = (const char *) memchr(s,'\n',f->end - s);
+    next = next ? next + 1 : f->end;
+    e = ( next - s > sbuflen - 1 ) ? s + sbuflen - 1 : next;
+    if ( ( d = (char *) memchr(s,0,e - s) ) ) e = d;
+    f->pos = next;
+    if ( line ) *line = s;
+    if ( linelen ) *linelen = e - s;
+    if ( lineno ) ++(*lineno);
+    d = sbuf;
+    while ( s < e && isspace((unsigned char)*s) ) ++s;
+    if ( s < e && *s == '*' ) {
+      tok[ntok] = d;  ++ntok;
+      *(d++) = 0;
+      tok[ntok] = d;  ++ntok;
+      for ( ++s; s < e && *s != '\n'; ++s ) *(d++) = *s;
+      *d = 0;
+      break;
+    }
+    while ( s < e && *s != '!' && *s != '\n' ) {
+      if ( ntok < toklen ) { tok[ntok] = d; ++ntok; }  /* in a token */
+      while ( s < e && *s != '!' && *s != '\n' &&
+              ! isspace((unsigned char)*s) ) {
+        *(d++) = all_caps ? toupper((unsigned char)*s) : *s;
+        ++s;
+      }
+      *(d++) = 0;
+      while ( s < e && isspace((unsigned char)*s) && *s != '\n' ) ++s;
+    }
+  }
+  return ntok;
+
+}
@@ -9,5 +9,27 @@ int charmm_get_tokens(char **tok, int toklen,
 			char *lbuf, int *lineno,
 			FILE *stream, int all_caps);
 
+/* A topology or stream file mapped into memory, for charmm_file_tokens. */
+struct charmm_file;
+typedef struct charmm_file charmm_file;
+
+/* Maps the rest of stream, or reads it if it cannot be mapped. */
+charmm_file * charmm_file_open(FILE *stream);
+void charmm_file_close(charmm_file *f);
+
+/* Reads text in place, which must outlive the charmm_file. */
+charmm_file * charmm_file_view(const char *text, size_t len);
+
+/* The unread contents of the file. */
+const char * charmm_file_data(charmm_file *f, size_t *len);
+
+/* Same tokens as charmm_get_tokens, copied into sbuf in one pass.
+   *line and *linelen give the line they came from, as charmm_get_tokens
+   would have copied it to lbuf, without its terminating null. */
+int charmm_file_tokens(charmm_file *f, char **tok, int toklen,
+			char *sbuf, int sbuflen,
+			const char **line, int *linelen, int *lineno,
+			int all_caps);
+
 #endif
 
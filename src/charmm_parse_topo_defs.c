@@ -34,48 +34,84 @@ static void debug_msg(const char *s) {
 }
 
 #define PRINT_ERROR(MSG) do {\
-    sprintf(msgbuf, "ERROR!  " MSG "  Line %d: %s", lineno, lbuf);\
+    sprintf(msgbuf, "ERROR!  " MSG "  Line %d: %.*s", lineno, llen, lbuf);\
     print_msg(v,msgbuf);\
   } while (0)
 
-int charmm_parse_topo_defs(topo_defs *defs, FILE *file, int all_caps, void *v,
-				void (*print_msg)(void *,const char *)) {
+/* Statements that end the entries of a residue. */
+static int ends_residue(char **tok) {
+  return ( ! strncasecmp("READ",tok[0],4) || ! strncasecmp("END",tok[0],4) ||
+	! strncasecmp("RETURN",tok[0],4) || ! strncasecmp("RESI",tok[0],4) ||
+	! strncasecmp("PRES",tok[0],4) );
+}
+
+/* Statements that do not belong to the residue they appear in. */
+static int is_global(char **tok) {
+  return ( ! strncasecmp("MASS",tok[0],4) || ! strncasecmp("DECL",tok[0],4) ||
+	! strncasecmp("AUTO",tok[0],4) || ! strncasecmp("DEFA",tok[0],4) );
+}
+
+#define PARSE_ALL 0
+#define PARSE_LAZY 1      /* defer residue entries to parse_entries */
+#define PARSE_ENTRIES 2   /* only the entries of one residue */
+
+static int parse_entries(topo_defs *defs, const char *text, int length,
+	int lineno, int all_caps, void *v,
+	void (*print_msg)(void *,const char *));
+
+static void release_file(void *f) {
+  charmm_file_close((charmm_file *) f);
+}
+
+/* Parses cf, returns the number of residues whose entries were deferred. */
+static int parse_topo_defs(topo_defs *defs, charmm_file *cf, int all_caps,
+		void *v, void (*print_msg)(void *,const char *),
+		int mode, int lineno) {
 
   char *tok[TOKLEN];
   char sbuf[BUFLEN];
-  char lbuf[BUFLEN];
+  const char *lbuf;
   char msgbuf[2*BUFLEN];
-  int lineno;
+  const char *next;
+  size_t left;
+  int llen;
   int ntok;
   int itok;
   int first;
   int skip;
   int skipall;
   int stream;
+  int deferring, deferred;
   char *s1, *s2, *s3, *s4;
   int i1, i2, i3, i4; 
   int j1, j2, j3, j4; 
   unsigned int utmp;
 
-  lineno = 0;
-  first = 1;
+  first = ( mode != PARSE_ENTRIES );
   skip = 0;
   skipall = 0;
   stream = 0;
+  deferring = 0;
+  deferred = 0;
 
-  if ( ! defs ) return -1;
-  if ( ! file ) return -2;
-  if ( print_msg == 0 ) print_msg = null_print_msg;
-
-  while ( (ntok = charmm_get_tokens(tok,TOKLEN,sbuf,BUFLEN,lbuf,&lineno,file,all_caps)) ) {
+  while ( (ntok = charmm_file_tokens(cf,tok,TOKLEN,sbuf,BUFLEN,&lbuf,&llen,&lineno,all_caps)) ) {
     if ( ! tok[0][0] ) {
-      print_msg(v,tok[1]);
+      if ( mode != PARSE_ENTRIES ) print_msg(v,tok[1]);
       continue;
     }
     if ( skipall ) {
       print_msg (v, "skipping statements at end of file due to end or return statement");
       break;
     }
+    if ( mode == PARSE_ENTRIES ) {
+      /* already handled when the file was read */
+      if ( is_global(tok) || ends_residue(tok) ) continue;
+    } else if ( deferring ) {
+      if ( ends_residue(tok) ) {
+        topo_defs_defer_end(defs,lbuf);
+        deferring = 0;
+      } else if ( ! is_global(tok) ) continue;
+    }
     if ( first ) {
       first = 0;
       if ( ! strncasecmp("IOFORMAT",tok[0],8) ) {
@@ -409,12 +445,24 @@ int charmm_parse_topo_defs(topo_defs *defs, FILE *file, int all_caps, void *v,
       debug_msg("Recognized residue statement.");
       if ( ntok < 2 || topo_defs_residue(defs,tok[1],0) ) {
         PRINT_ERROR("Failed to parse residue statement.");
+      } else if ( mode == PARSE_LAZY ) {
+        next = charmm_file_data(cf,&left);
+        if ( ! topo_defs_defer(defs,next,lineno,all_caps,parse_entries) ) {
+          deferring = 1;
+          ++deferred;
+        }
       }
     }
     else if ( ! strncasecmp("PRES",tok[0],4) ) {
       debug_msg("Recognized patch residue statement.");
       if ( ntok < 2 || topo_defs_residue(defs,tok[1],1) ) {
         PRINT_ERROR("Failed to parse patch residue statement.");
+      } else if ( mode == PARSE_LAZY ) {
+        next = charmm_file_data(cf,&left);
+        if ( ! topo_defs_defer(defs,next,lineno,all_caps,parse_entries) ) {
+          deferring = 1;
+          ++deferred;
+        }
       }
     }
     else {
@@ -423,7 +471,46 @@ int charmm_parse_topo_defs(topo_defs *defs, FILE *file, int all_caps, void *v,
 
   }
 
-  topo_defs_end(defs);
+  if ( deferring ) {
+    next = charmm_file_data(cf,&left);
+    topo_defs_defer_end(defs,next + left);
+  }
+  if ( mode != PARSE_ENTRIES ) topo_defs_end(defs);
+
+  return deferred;
+
+}
+
+static int parse_entries(topo_defs *defs, const char *text, int length,
+	int lineno, int all_caps, void *v,
+	void (*print_msg)(void *,const char *)) {
+  charmm_file *cf;
+  if ( print_msg == 0 ) print_msg = null_print_msg;
+  if ( ! ( cf = charmm_file_view(text,length) ) ) return -3;
+  parse_topo_defs(defs,cf,all_caps,v,print_msg,PARSE_ENTRIES,lineno);
+  charmm_file_close(cf);
+  return 0;
+}
+
+int charmm_parse_topo_defs(topo_defs *defs, FILE *file, int all_caps, void *v,
+				void (*print_msg)(void *,const char *)) {
+  charmm_file *cf;
+  int lazy;
+
+  if ( ! defs ) return -1;
+  if ( ! file ) return -2;
+  if ( print_msg == 0 ) print_msg = null_print_msg;
+  if ( ! ( cf = charmm_file_open(file) ) ) return -3;
+
+  lazy = topo_defs_is_lazy(defs);
+  if ( parse_topo_defs(defs,cf,all_caps,v,print_msg,
+		lazy ? PARSE_LAZY : PARSE_ALL,0) ) {
+    /* deferred residues point into the file; if it cannot be handed
+       over it is left open rather than freed */
+    topo_defs_add_source(defs,cf,release_file);
+  } else {
+    charmm_file_close(cf);
+  }
 
   return 0;
 
@@ -0,0 +1,54 @@
+
+#include <stdlib.h>
+#include "chunkarray.h"
+
+chunkarray * chunkarray_create(int itemsize) {
+  chunkarray *a;
+  if ( (a = (chunkarray*) malloc(sizeof(chunkarray))) ) {
+    a->chunks = 0;
+    a->nchunks = 0;
+    a->maxchunks = 0;
+    a->itemsize = itemsize;
+  }
+  return a;
+}
+
+void chunkarray_destroy(chunkarray *a) {
+  int i;
+  if ( ! a ) return;
+  for ( i=0; i<a->nchunks; ++i ) free((void*)a->chunks[i]);
+  free((void*)a->chunks);
+  free((void*)a);
+}
+
+int chunkarray_reserve(chunkarray *a, int n) {
+  int need, newmax;
+  char **newchunks, *chunk;
+  need = ( n + CHUNKARRAY_MASK ) >> CHUNKARRAY_SHIFT;
+  if ( need > a->maxchunks ) {
+    newmax = a->maxchunks ? 2 * a->maxchunks : 4;
+    while ( newmax < need ) newmax *= 2;
+    newchunks = (char**) realloc(a->chunks, newmax * sizeof(char*));
+    if ( ! newchunks ) return -1;
+    a->chunks = newchunks;
+    a->maxchunks = newmax;
+  }
+  while ( a->nchunks < need ) {
+    chunk = (char*) malloc((size_t) a->itemsize << CHUNKARRAY_SHIFT);
+    if ( ! chunk ) return -1;
+    a->chunks[a->nchunks++] = chunk;
+  }
+  return 0;
+}
+
+void chunkarray_trim(chunkarray *a, int n) {
+  int need;
+  need = ( n + CHUNKARRAY_MASK ) >> CHUNKARRAY_SHIFT;
+  while ( a->nchunks > need ) free((void*)a->chunks[--a->nchunks]);
+}
+
+long chunkarray_bytes(chunkarray *a) {
+  return ( (long) a->nchunks * a->itemsize << CHUNKARRAY_SHIFT )
+         + (long) a->maxchunks * sizeof(char*);
+}
+
@@ -0,0 +1,36 @@
+
+#ifndef CHUNKARRAY_H
+#define CHUNKARRAY_H
+
+/* Array of fixed size items kept in equal chunks, so growing it never
+   moves an item.  Item i is in chunk i >> CHUNKARRAY_SHIFT. */
+
+#define CHUNKARRAY_SHIFT 6
+#define CHUNKARRAY_MASK ((1 << CHUNKARRAY_SHIFT) - 1)
+
+typedef struct chunkarray {
+  char **chunks;
+  int nchunks, maxchunks;
+  int itemsize;
+} chunkarray;
+
+chunkarray * chunkarray_create(int itemsize);
+void chunkarray_destroy(chunkarray *a);
+
+/* make items 0 to n-1 addressable, returns -1 if out of memory */
+int chunkarray_reserve(chunkarray *a, int n);
+
+/* free the chunks past item n-1 */
+void chunkarray_trim(chunkarray *a, int n);
+
+/* items allocated, a multiple of the chunk size */
+#define chunkarray_alloc(a) ((a)->nchunks << CHUNKARRAY_SHIFT)
+
+#define chunkarray_item(a,i) ((void*) ((a)->chunks[(i) >> CHUNKARRAY_SHIFT] \
+                + (size_t) ((i) & CHUNKARRAY_MASK) * (a)->itemsize))
+
+/* bytes held by the chunks and the chunk table */
+long chunkarray_bytes(chunkarray *a);
+
+#endif
+
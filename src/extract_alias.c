@@ -1,64 +1,204 @@
 
 #include <string.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include "memarena.h"
+#include "hasharray.h"
 #include "stringhash.h"
 #include "extract_alias.h"
 
-int extract_alias_residue_define(stringhash *h,
+#if defined(_MSC_VER)
+#define snprintf _snprintf
+#endif
+
+/* atom names resolved for one residue name */
+typedef struct extract_alias_res_t {
+  const char *resname;
+  hasharray *atom_hash;
+  chunkarray *atom_array;   /* extract_alias_atom_t, never moved */
+} extract_alias_res_t;
+
+struct extract_alias {
+  stringhash *h;            /* definitions, atoms keyed by "RES ATOM" */
+  memarena *arena;          /* strings of resolved names */
+  hasharray *res_hash;
+  chunkarray *res_array;    /* extract_alias_res_t, never moved */
+  int lastres;              /* consecutive atoms share a residue */
+};
+
+static void extract_alias_free_atoms(extract_alias *a) {
+  int i, n;
+  if ( ! a->res_hash ) return;
+  n = hasharray_count(a->res_hash);
+  for ( i=0; i<n; ++i ) {
+    extract_alias_res_t *r = chunkarray_item(a->res_array,i);
+    hasharray_destroy(r->atom_hash);
+  }
+  hasharray_destroy(a->res_hash);
+  a->res_hash = 0;
+}
+
+/* forget resolved names, called when the definitions change */
+static int extract_alias_reset(extract_alias *a) {
+  extract_alias_free_atoms(a);
+  memarena_clear(a->arena);
+  a->lastres = -1;
+  a->res_hash = hasharray_create_chunked(&(a->res_array),
+                        sizeof(extract_alias_res_t), 0);
+  return a->res_hash ? 0 : EXTRACT_ALIAS_FAIL;
+}
+
+extract_alias * extract_alias_create(void) {
+  extract_alias *a;
+  if ( (a = (extract_alias*) malloc(sizeof(extract_alias))) ) {
+    a->res_hash = 0;
+    a->res_array = 0;
+    a->h = stringhash_create();
+    a->arena = memarena_create();
+    if ( ! a->h || ! a->arena || extract_alias_reset(a) ) {
+      extract_alias_destroy(a);
+      return 0;
+    }
+  }
+  return a;
+}
+
+void extract_alias_destroy(extract_alias *a) {
+  if ( ! a ) return;
+  extract_alias_free_atoms(a);
+  memarena_destroy(a->arena);
+  stringhash_destroy(a->h);
+  free((void*)a);
+}
+
+int extract_alias_residue_define(extract_alias *a,
 			const char *altres, const char *realres) {
-  if ( ! h || ! altres || ! realres ||
-       stringhash_insert(h,altres,realres) == STRINGHASH_FAIL ) {
+  if ( ! a || ! altres || ! realres ||
+       stringhash_insert(a->h,altres,realres) == STRINGHASH_FAIL ) {
     return EXTRACT_ALIAS_FAIL;
   }
-  return 0;
+  return extract_alias_reset(a);
 }
 
-int extract_alias_atom_define(stringhash *h, const char *resname,
+int extract_alias_atom_define(extract_alias *a, const char *resname,
 			const char *altatom, const char *realatom) {
   char resatom[24];
   const char *resname2;
-  if ( ! h || ! resname || ! altatom || ! realatom ) return EXTRACT_ALIAS_FAIL;
+  if ( ! a || ! resname || ! altatom || ! realatom ) return EXTRACT_ALIAS_FAIL;
+  if ( extract_alias_reset(a) ) return EXTRACT_ALIAS_FAIL;
   if ( strlen(resname) + strlen(altatom) > 20 ) return EXTRACT_ALIAS_FAIL;
   sprintf(resatom,"%s %s",resname,altatom);
-  if ( stringhash_insert(h,resatom,realatom) == STRINGHASH_FAIL ) {
+  if ( stringhash_insert(a->h,resatom,realatom) == STRINGHASH_FAIL ) {
     return EXTRACT_ALIAS_FAIL;
   }
-  resname2 = extract_alias_residue_check(h,resname);
+  resname2 = extract_alias_residue_check(a,resname);
   if ( resname == resname2 ) return 0;
   resname = resname2;
   if ( strlen(resname) + strlen(altatom) > 20 ) return EXTRACT_ALIAS_FAIL;
   sprintf(resatom,"%s %s",resname,altatom);
-  if ( stringhash_insert(h,resatom,realatom) == STRINGHASH_FAIL ) {
+  if ( stringhash_insert(a->h,resatom,realatom) == STRINGHASH_FAIL ) {
     return EXTRACT_ALIAS_FAIL;
   }
   return 0;
 }
 
-const char * extract_alias_residue_check(stringhash *h,
+const char * extract_alias_residue_check(extract_alias *a,
 						const char *resname) {
   const char *realres;
-  if ( ! h || ! resname ) return resname;
-  realres = stringhash_lookup(h,resname);
+  if ( ! a || ! resname ) return resname;
+  realres = stringhash_lookup(a->h,resname);
   if ( realres != STRINGHASH_FAIL ) return realres;
   return resname;
 }
 
-const char * extract_alias_atom_check(stringhash *h,
+/* the definitions themselves, tried under both residue names */
+static const char * extract_alias_atom_resolve(extract_alias *a,
 			const char *resname, const char *atomname) {
   char resatom[24];
   const char *realatom;
-  if ( ! h || ! resname || ! atomname ) return atomname;
   if ( strlen(resname) + strlen(atomname) < 20 ) {
     sprintf(resatom,"%s %s",resname,atomname);
-    realatom = stringhash_lookup(h,resatom);
+    realatom = stringhash_lookup(a->h,resatom);
     if ( realatom != STRINGHASH_FAIL ) return realatom;
   }
-  resname = extract_alias_residue_check(h,resname);
+  resname = extract_alias_residue_check(a,resname);
   if ( strlen(resname) + strlen(atomname) < 20 ) {
     sprintf(resatom,"%s %s",resname,atomname);
-    realatom = stringhash_lookup(h,resatom);
+    realatom = stringhash_lookup(a->h,resatom);
     if ( realatom != STRINGHASH_FAIL ) return realatom;
   }
   return atomname;
 }
 
+static char * extract_alias_strdup(extract_alias *a, const char *s) {
+  char *t;
+  if ( (t = memarena_alloc(a->arena,strlen(s)+1)) ) strcpy(t,s);
+  return t;
+}
+
+const extract_alias_atom_t * extract_alias_atom_lookup(extract_alias *a,
+			const char *resname, const char *atomname) {
+  extract_alias_res_t *r;
+  extract_alias_atom_t *at;
+  const char *name;
+  char stmp[8], altname[sizeof(stmp)+11];
+  unsigned int utmp;
+  int i;
+
+  if ( ! a || ! resname || ! atomname ) return 0;
+  r = 0;
+  if ( a->lastres >= 0 ) {
+    r = chunkarray_item(a->res_array,a->lastres);
+    if ( strcmp(r->resname,resname) ) r = 0;
+  }
+  if ( ! r ) {
+    i = hasharray_index(a->res_hash,resname);
+    if ( i == HASHARRAY_FAIL ) {
+      i = hasharray_insert(a->res_hash,resname);
+      if ( i == HASHARRAY_FAIL ) return 0;
+      r = chunkarray_item(a->res_array,i);
+      r->resname = extract_alias_strdup(a,resname);
+      r->atom_hash = hasharray_create_chunked(&(r->atom_array),
+                                      sizeof(extract_alias_atom_t), 0);
+      if ( ! r->resname || ! r->atom_hash ) {
+        hasharray_delete(a->res_hash,resname);
+        return 0;
+      }
+    }
+    r = chunkarray_item(a->res_array,i);
+    a->lastres = i;
+  }
+
+  i = hasharray_index(r->atom_hash,atomname);
+  if ( i != HASHARRAY_FAIL ) return chunkarray_item(r->atom_array,i);
+
+  /* first time for this atom name in this residue */
+  name = extract_alias_atom_resolve(a,resname,atomname);
+  if ( name == atomname && ! (name = extract_alias_strdup(a,atomname)) ) {
+    return 0;
+  }
+  altname[0] = '\0';
+  if ( strlen(atomname) < sizeof(stmp) &&
+       sscanf(atomname,"%u%s",&utmp,stmp) == 2 ) {
+    snprintf(altname,sizeof(altname),"%s%u",stmp,utmp);
+  }
+  i = hasharray_insert(r->atom_hash,atomname);
+  if ( i == HASHARRAY_FAIL ) return 0;
+  at = chunkarray_item(r->atom_array,i);
+  at->name = name;
+  at->rotated = 0;
+  if ( altname[0] && ! (at->rotated = extract_alias_strdup(a,altname)) ) {
+    hasharray_delete(r->atom_hash,atomname);
+    return 0;
+  }
+  return at;
+}
+
+const char * extract_alias_atom_check(extract_alias *a,
+			const char *resname, const char *atomname) {
+  const extract_alias_atom_t *at;
+  if ( ! a || ! resname || ! atomname ) return atomname;
+  if ( (at = extract_alias_atom_lookup(a,resname,atomname)) ) return at->name;
+  return extract_alias_atom_resolve(a,resname,atomname);
+}
+
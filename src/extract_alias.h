@@ -4,18 +4,39 @@
 
 #include "stringhash.h"
 
+/* Residue and atom aliases, with the atom names seen so far resolved
+   once per residue name */
+struct extract_alias;
+typedef struct extract_alias extract_alias;
+
+/* an atom name as resolved for one residue name: the name to use, and
+   the original name with its leading number moved to the end
+   (1HE2 -> HE21), 0 if it has none */
+typedef struct extract_alias_atom_t {
+  const char *name;
+  const char *rotated;
+} extract_alias_atom_t;
+
+extract_alias * extract_alias_create(void);
+void extract_alias_destroy(extract_alias *a);
+
 #define EXTRACT_ALIAS_FAIL -1
 
-int extract_alias_residue_define(stringhash *h,
+int extract_alias_residue_define(extract_alias *a,
 			const char *altres, const char *realres);
 
-int extract_alias_atom_define(stringhash *h, const char *resname,
+int extract_alias_atom_define(extract_alias *a, const char *resname,
 			const char *altatom, const char *realatom);
 
-const char * extract_alias_residue_check(stringhash *h,
+const char * extract_alias_residue_check(extract_alias *a,
 						const char *resname);
 
-const char * extract_alias_atom_check(stringhash *h,
+const char * extract_alias_atom_check(extract_alias *a,
+			const char *resname, const char *atomname);
+
+/* resolved names of atomname in residue resname, 0 if out of memory;
+   valid until aliases are next defined */
+const extract_alias_atom_t * extract_alias_atom_lookup(extract_alias *a,
 			const char *resname, const char *atomname);
 
 #endif
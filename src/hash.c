@@ -19,61 +19,90 @@
 /*
  *  Local types
  */
-typedef struct hash_node_t {
-  int data;                           /* data in hash node */
-  const char * key;                   /* key for hash lookup */
-  struct hash_node_t *next;           /* next node in hash chain */
-} hash_node_t;
+typedef struct hash_slot_t {
+  const char * key;                   /* key for hash lookup, 0 if empty */
+  unsigned int code;                  /* full hash code of key */
+  int data;                           /* data in hash slot */
+} hash_slot_t;
 
 /*
- *  hash() - Hash function returns a hash number for a given key.
+ *  hash() - Hash function returns a hash code for a given key.
+ *    FNV-1a followed by the murmur3 finalizer, so that the low bits used
+ *    to pick a slot depend on every character of short, similar keys.
+ *
+ *  key: The key to create a hash code for
+ */
+static unsigned int hash(const char *key) {
+  unsigned int h = 2166136261u;
+
+  while (*key != '\0') {
+    h ^= (unsigned char) *key++;
+    h *= 16777619u;
+  }
+
+  h ^= h >> 16;
+  h *= 0x85ebca6bu;
+  h ^= h >> 13;
+  h *= 0xc2b2ae35u;
+  h ^= h >> 16;
+
+  return h;
+}
+
+/*
+ *  find_slot() - Return the slot holding key, or the empty slot that
+ *    ends its probe sequence.
  *
  *  tptr: Pointer to a hash table
- *  key: The key to create a hash number for
+ *  key: The key to look for
+ *  code: The hash code of key
  */
-static int hash(hash_t *tptr, const char *key) {
-  int i=0;
-  int hashvalue;
- 
-  while (*key != '\0')
-    i=(i<<3)+(*key++ - '0');
- 
-  hashvalue = (((i*1103515249)>>tptr->downshift) & tptr->mask);
-  if (hashvalue < 0) {
-    hashvalue = 0;
-  }    
-
-  return hashvalue;
+static hash_slot_t * find_slot(hash_t *tptr, const char *key,
+                               unsigned int code) {
+  hash_slot_t *slot;
+  int i;
+
+  for (i=code & tptr->mask; ; i=(i+1) & tptr->mask) {
+    slot=tptr->slot+i;
+    if (!slot->key)
+      break;
+    if (slot->code==code && !strcmp(slot->key, key))
+      break;
+  }
+
+  return slot;
 }
 
 /*
- *  rebuild_table() - Create new hash table when old one fills up.
+ *  rebuild_table() - Move the entries into a new table of the given size.
+ *  The old table is kept if the new one cannot be allocated.
  *
  *  tptr: Pointer to a hash table
+ *  size: New number of slots, a power of 2
  */
-static void rebuild_table(hash_t *tptr) {
-  hash_node_t **old_bucket, *old_hash, *tmp;
-  int old_size, h, i;
-
-  old_bucket=tptr->bucket;
-  old_size=tptr->size;
-
-  /* create a new table and rehash old buckets */
-  hash_init(tptr, old_size<<1);
-  for (i=0; i<old_size; i++) {
-    old_hash=old_bucket[i];
-    while(old_hash) {
-      tmp=old_hash;
-      old_hash=old_hash->next;
-      h=hash(tptr, tmp->key);
-      tmp->next=tptr->bucket[h];
-      tptr->bucket[h]=tmp;
-      tptr->entries++;
-    } /* while */
+static void rebuild_table(hash_t *tptr, int size) {
+  hash_t new_table;
+  hash_slot_t *slot;
+  int i, j;
+
+  hash_init(&new_table, size);
+  if (new_table.slot == NULL)
+    return;
+
+  /* move the old entries, reusing their codes */
+  for (i=0; i<tptr->size; i++) {
+    if (!tptr->slot[i].key)
+      continue;
+    for (j=tptr->slot[i].code & new_table.mask; new_table.slot[j].key;
+         j=(j+1) & new_table.mask);
+    slot=new_table.slot+j;
+    *slot=tptr->slot[i];
+    new_table.entries++;
   } /* for */
 
   /* free memory used by old table */
-  free(old_bucket);
+  free(tptr->slot);
+  *tptr=new_table;
 
   return;
 }
@@ -82,7 +111,7 @@ static void rebuild_table(hash_t *tptr) {
  *  hash_init() - Initialize a new hash table.
  *
  *  tptr: Pointer to the hash table to initialize
- *  buckets: The number of initial buckets to create
+ *  buckets: The number of initial slots to create
  */
 void hash_init(hash_t *tptr, int buckets) {
 
@@ -94,21 +123,59 @@ void hash_init(hash_t *tptr, int buckets) {
   tptr->entries=0;
   tptr->size=2;
   tptr->mask=1;
-  tptr->downshift=29;
 
   /* ensure buckets is a power of 2 */
   while (tptr->size<buckets) {
     tptr->size<<=1;
     tptr->mask=(tptr->mask<<1)+1;
-    tptr->downshift--;
   } /* while */
 
   /* allocate memory for table */
-  tptr->bucket=(hash_node_t **) calloc(tptr->size, sizeof(hash_node_t *));
+  tptr->slot=(hash_slot_t *) calloc(tptr->size, sizeof(hash_slot_t));
 
   return;
 }
 
+/*
+ *  hash_reserve() - Grow a hash table so that it holds the given number
+ *  of entries without rebuilding.
+ *
+ *  tptr: Pointer to the hash table
+ *  entries: The number of entries expected
+ */
+void hash_reserve(hash_t *tptr, int entries) {
+  int size;
+
+  size=tptr->size;
+  while (size < (1<<30) && entries>HASH_LIMIT*size)
+    size<<=1;
+  if (size>tptr->size)
+    rebuild_table(tptr, size);
+}
+
+/*
+ *  hash_entries() - Copy out every key and its data, in slot order.
+ *  Returns the number of entries.
+ *
+ *  tptr: Pointer to the hash table
+ *  keys: Room for the keys of all entries
+ *  data: Room for the data of all entries
+ */
+int hash_entries(hash_t *tptr, const char **keys, int *data) {
+  int i, n;
+
+  n=0;
+  for (i=0; i<tptr->size; i++) {
+    if (!tptr->slot[i].key)
+      continue;
+    keys[n]=tptr->slot[i].key;
+    data[n]=tptr->slot[i].data;
+    n++;
+  } /* for */
+
+  return n;
+}
+
 /*
  *  hash_lookup() - Lookup an entry in the hash table and return a pointer to
  *    it or HASH_FAIL if it wasn't found.
@@ -117,22 +184,17 @@ void hash_init(hash_t *tptr, int buckets) {
  *  key: The key to lookup
  */
 int hash_lookup(hash_t *tptr, const char *key) {
-  int h;
-  hash_node_t *node;
+  hash_slot_t *slot;
 
   /* If key is null return failure */
   if (!key)
     return HASH_FAIL;
 
   /* find the entry in the hash table */
-  h=hash(tptr, key);
-  for (node=tptr->bucket[h]; node!=NULL; node=node->next) {
-    if (!strcmp(node->key, key))
-      break;
-  }
+  slot=find_slot(tptr, key, hash(key));
 
   /* return the entry if it exists, or HASH_FAIL */
-  return(node ? node->data : HASH_FAIL);
+  return(slot->key ? slot->data : HASH_FAIL);
 }
 
 /*
@@ -144,26 +206,25 @@ int hash_lookup(hash_t *tptr, const char *key) {
  *  data: A pointer to the data to insert into the hash table
  */
 int hash_insert(hash_t *tptr, const char *key, int data) {
-  int tmp;
-  hash_node_t *node;
-  int h;
-
+  hash_slot_t *slot;
+  unsigned int code;
 
   /* check to see if the entry exists */
-  if ((tmp=hash_lookup(tptr, key)) != HASH_FAIL)
-    return(tmp);
+  code=hash(key);
+  slot=find_slot(tptr, key, code);
+  if (slot->key)
+    return(slot->data);
 
   /* expand the table if needed */
-  while (tptr->entries>=HASH_LIMIT*tptr->size)
-    rebuild_table(tptr);
+  if (tptr->entries+1>HASH_LIMIT*tptr->size) {
+    rebuild_table(tptr, tptr->size<<1);
+    slot=find_slot(tptr, key, code);
+  }
 
   /* insert the new entry */
-  h=hash(tptr, key);
-  node=(struct hash_node_t *) malloc(sizeof(hash_node_t));
-  node->data=data;
-  node->key=key;
-  node->next=tptr->bucket[h];
-  tptr->bucket[h]=node;
+  slot->key=key;
+  slot->code=code;
+  slot->data=data;
   tptr->entries++;
 
   return HASH_FAIL;
@@ -177,36 +238,31 @@ int hash_insert(hash_t *tptr, const char *key, int data) {
  *  key: The key to remove from the hash table
  */
 int hash_delete(hash_t *tptr, const char *key) {
-  hash_node_t *node, *last;
+  hash_slot_t *slot;
   int data;
-  int h;
+  int i, j, home;
 
-  /* find the node to remove */
-  h=hash(tptr, key);
-  for (node=tptr->bucket[h]; node; node=node->next) {
-    if (!strcmp(node->key, key))
-      break;
-  }
+  /* find the slot to empty */
+  slot=find_slot(tptr, key, hash(key));
 
   /* Didn't find anything, return HASH_FAIL */
-  if (node==NULL)
+  if (!slot->key)
     return HASH_FAIL;
 
-  /* if node is at head of bucket, we have it easy */
-  if (node==tptr->bucket[h])
-    tptr->bucket[h]=node->next;
-  else {
-    /* find the node before the node we want to remove */
-    for (last=tptr->bucket[h]; last && last->next; last=last->next) {
-      if (last->next==node)
-        break;
+  data=slot->data;
+
+  /* shift later entries of the probe sequence back into the gap,
+     unless that would move them before their home slot */
+  i=slot-tptr->slot;
+  for (j=(i+1) & tptr->mask; tptr->slot[j].key; j=(j+1) & tptr->mask) {
+    home=tptr->slot[j].code & tptr->mask;
+    if (((j-home) & tptr->mask) >= ((j-i) & tptr->mask)) {
+      tptr->slot[i]=tptr->slot[j];
+      i=j;
     }
-    last->next=node->next;
   }
-
-  /* free memory and return the data */
-  data=node->data;
-  free(node);
+  tptr->slot[i].key=NULL;
+  tptr->entries--;
 
   return(data);
 }
@@ -218,21 +274,10 @@ int hash_delete(hash_t *tptr, const char *key) {
  * 
  */
 void hash_destroy(hash_t *tptr) {
-  hash_node_t *node, *last;
-  int i;
 
-  for (i=0; i<tptr->size; i++) {
-    node = tptr->bucket[i];
-    while (node != NULL) { 
-      last = node;   
-      node = node->next;
-      free(last);
-    }
-  }     
-
-  /* free the entire array of buckets */
-  if (tptr->bucket != NULL) {
-    free(tptr->bucket);
+  /* free the entire array of slots */
+  if (tptr->slot != NULL) {
+    free(tptr->slot);
     memset(tptr, 0, sizeof(hash_t));
   }
 }
@@ -243,15 +288,12 @@ void hash_destroy(hash_t *tptr) {
  *  tptr: Pointer to a hash table
  */
 static float alos(hash_t *tptr) {
-  int i,j;
+  int i;
   float alos=0;
-  hash_node_t *node;
-
 
   for (i=0; i<tptr->size; i++) {
-    for (node=tptr->bucket[i], j=0; node!=NULL; node=node->next, j++);
-    if (j)
-      alos+=((j*(j+1))>>1);
+    if (tptr->slot[i].key)
+      alos+=((i-(int)tptr->slot[i].code) & tptr->mask)+1;
   } /* for */
 
   return(tptr->entries ? alos/tptr->entries : 0);
@@ -272,6 +314,28 @@ char * hash_stats(hash_t *tptr) {
   return(buf);
 }
 
+/*
+ *  hash_get_stats() - Fill in slot, entry and probe length statistics.
+ *
+ *  tptr: A pointer to the hash table
+ *  stats: The statistics to fill in
+ */
+void hash_get_stats(hash_t *tptr, hash_stats_t *stats) {
+  int i,j;
 
-
+  stats->buckets=tptr->size;
+  stats->entries=tptr->entries;
+  stats->used=0;
+  stats->maxchain=0;
+  for (i=0; i<tptr->size; i++) {
+    if (!tptr->slot[i].key)
+      continue;
+    stats->used++;
+    j=((i-(int)tptr->slot[i].code) & tptr->mask)+1;
+    if (j>stats->maxchain)
+      stats->maxchain=j;
+  }
+  stats->alos=alos(tptr);
+  stats->bytes=(long)tptr->size*sizeof(hash_slot_t);
+}
 
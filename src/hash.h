@@ -7,6 +7,10 @@
  * as a C++ template??
  * 
  * Donated by John Stone
+ *
+ * Open addressing with linear probing; the table keeps each key's
+ * hash code so probes and rebuilds rarely touch the key strings.
+ * Keys are not copied and must outlive their entries.
  */
 
 #ifndef HASH_H
@@ -17,21 +21,32 @@ extern "C" {
 #endif
 
 typedef struct hash_t {
-  struct hash_node_t **bucket;        /* array of hash nodes */
-  int size;                           /* size of the array */
+  struct hash_slot_t *slot;           /* open addressed slot array */
+  int size;                           /* size of the array, a power of 2 */
   int entries;                        /* number of entries in table */
-  int downshift;                      /* shift cound, used in hash function */
-  int mask;                           /* used to select bits for hashing */
+  int mask;                           /* size - 1, selects the home slot */
 } hash_t;
 
 #define HASH_FAIL -1
 
+typedef struct hash_stats_t {
+  int buckets;                        /* size of the slot array */
+  int entries;                        /* number of entries in table */
+  int used;                           /* slots holding an entry */
+  int maxchain;                       /* longest probe sequence */
+  float alos;                         /* average length of search */
+  long bytes;                         /* slot array */
+} hash_stats_t;
+
 void hash_init(hash_t *, int);
+void hash_reserve(hash_t *, int);
 int hash_lookup (hash_t *, const char *);
 int hash_insert (hash_t *, const char *, int);
 int hash_delete (hash_t *, const char *);
+int hash_entries (hash_t *, const char **, int *);
 void hash_destroy(hash_t *);
 char *hash_stats (hash_t *);
+void hash_get_stats (hash_t *, hash_stats_t *);
 
 #ifdef __cplusplus
 }
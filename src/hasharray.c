@@ -3,6 +3,7 @@
 #include <string.h>
 #include "hash.h"
 #include "memarena.h"
+#include "chunkarray.h"
 #include "hasharray.h"
 
 struct hasharray {
@@ -12,41 +13,254 @@ struct hasharray {
   int alloc;
   int itemsize;
   void **itemarray;
+  chunkarray **chunks;  /* set instead of itemarray for stable items */
+
+  /* keys that pack to an integer, see hasharray_numeric */
+  int (*pack)(const char *, unsigned int *);
+  struct hasharray_num_t *num;
+  int numsize, numentries;
 };
 
+/* integer key slot, empty when data is negative */
+typedef struct hasharray_num_t {
+  unsigned int key;
+  int data;
+} hasharray_num_t;
+
+static unsigned int hasharray_num_hash(unsigned int k) {
+  k ^= k >> 16;
+  k *= 0x85ebca6bU;
+  k ^= k >> 13;
+  k *= 0xc2b2ae35U;
+  k ^= k >> 16;
+  return k;
+}
+
+/* slot holding key, or the empty slot where it would go */
+static int hasharray_num_find(hasharray *a, unsigned int key) {
+  int j, mask;
+  mask = a->numsize - 1;
+  for ( j = hasharray_num_hash(key) & mask;
+        a->num[j].data >= 0 && a->num[j].key != key; j = (j+1) & mask );
+  return j;
+}
+
+static int hasharray_num_resize(hasharray *a, int size) {
+  hasharray_num_t *old;
+  int i, j, oldsize;
+  old = a->num;
+  oldsize = a->numsize;
+  if ( ! ( a->num = (hasharray_num_t*) malloc(size*sizeof(hasharray_num_t)) ) ) {
+    a->num = old;
+    return HASHARRAY_FAIL;
+  }
+  a->numsize = size;
+  for ( i=0; i<size; ++i ) a->num[i].data = -1;
+  for ( i=0; i<oldsize; ++i ) {
+    if ( old[i].data < 0 ) continue;
+    j = hasharray_num_find(a,old[i].key);
+    a->num[j] = old[i];
+  }
+  free((void*)old);
+  return 0;
+}
+
+/* grow so that n integer keys stay under half full */
+static int hasharray_num_reserve(hasharray *a, int n) {
+  int size;
+  size = a->numsize ? a->numsize : 16;
+  while ( size < (1<<30) && 2*n > size ) size <<= 1;
+  if ( size == a->numsize ) return 0;
+  return hasharray_num_resize(a,size);
+}
+
+static int hasharray_num_lookup(hasharray *a, unsigned int key) {
+  if ( ! a->num ) return HASHARRAY_FAIL;
+  return a->num[hasharray_num_find(a,key)].data;
+}
+
+static int hasharray_num_insert(hasharray *a, unsigned int key, int data) {
+  int j;
+  if ( hasharray_num_reserve(a,a->numentries+1) ) return HASHARRAY_FAIL;
+  j = hasharray_num_find(a,key);
+  if ( a->num[j].data < 0 ) {
+    a->num[j].key = key;
+    a->num[j].data = data;
+    a->numentries++;
+  }
+  return a->num[j].data;
+}
+
+/* backward shift deletion, as in hash_delete */
+static int hasharray_num_delete(hasharray *a, unsigned int key) {
+  int i, j, k, mask, data;
+  if ( ! a->num ) return HASHARRAY_FAIL;
+  mask = a->numsize - 1;
+  i = hasharray_num_find(a,key);
+  if ( (data = a->num[i].data) < 0 ) return HASHARRAY_FAIL;
+  for ( j = (i+1) & mask; a->num[j].data >= 0; j = (j+1) & mask ) {
+    k = hasharray_num_hash(a->num[j].key) & mask;
+    if ( ( (j-k) & mask ) >= ( (j-i) & mask ) ) {
+      a->num[i] = a->num[j];
+      i = j;
+    }
+  }
+  a->num[i].data = -1;
+  a->numentries--;
+  return data;
+}
+
+static int hasharray_packed(hasharray *a, const char *key, unsigned int *k) {
+  return a->pack && a->pack(key,k);
+}
+
 hasharray * hasharray_create(void **itemarray, int itemsize) {
+  return hasharray_create_with_capacity(itemarray, itemsize, 0);
+}
+
+hasharray * hasharray_create_with_capacity(void **itemarray, int itemsize,
+                                           int capacity) {
   hasharray * a;
   if ( (a = (hasharray*) malloc(sizeof(hasharray))) ) {
     a->count = 0;
     a->alloc = 0;
     a->itemsize = itemsize;
     a->itemarray = itemarray;
+    a->chunks = 0;
+    a->pack = 0;
+    a->num = 0;
+    a->numsize = a->numentries = 0;
     *(a->itemarray) = 0;
     if ( ! ( a->keyarena = memarena_create() ) ) {
       free((void*)a);
       return 0;
     }
     hash_init(&(a->hash),0);
+    hasharray_reserve(a,capacity);
   }
   return a;
 }
 
+hasharray * hasharray_create_chunked(chunkarray **items, int itemsize,
+                                     int capacity) {
+  hasharray * a;
+  if ( (a = (hasharray*) malloc(sizeof(hasharray))) ) {
+    a->count = 0;
+    a->alloc = 0;
+    a->itemsize = itemsize;
+    a->itemarray = 0;
+    a->chunks = items;
+    a->pack = 0;
+    a->num = 0;
+    a->numsize = a->numentries = 0;
+    if ( ! ( *(a->chunks) = chunkarray_create(itemsize) ) ) {
+      free((void*)a);
+      return 0;
+    }
+    if ( ! ( a->keyarena = memarena_create() ) ) {
+      chunkarray_destroy(*(a->chunks));
+      *(a->chunks) = 0;
+      free((void*)a);
+      return 0;
+    }
+    hash_init(&(a->hash),0);
+    hasharray_reserve(a,capacity);
+  }
+  return a;
+}
+
+hasharray * hasharray_copy(hasharray *a, void **itemarray) {
+  hasharray *c;
+  const char **keys;
+  int *data;
+  int i, n;
+  char *s;
+  if ( ! a || a->chunks ) return 0;
+  if ( ! ( c = hasharray_create_with_capacity(itemarray,a->itemsize,
+						a->count) ) ) return 0;
+  if ( a->count && ! *itemarray ) goto fail;
+  if ( a->count ) {
+    memcpy(*itemarray,*(a->itemarray),a->count * (size_t) a->itemsize);
+  }
+  c->count = a->count;
+  c->pack = a->pack;
+  if ( a->num ) {
+    c->num = (hasharray_num_t*) malloc(a->numsize*sizeof(hasharray_num_t));
+    if ( ! c->num ) goto fail;
+    memcpy(c->num,a->num,a->numsize*sizeof(hasharray_num_t));
+    c->numsize = a->numsize;
+    c->numentries = a->numentries;
+  }
+  keys = (const char**) malloc((a->hash.entries+1)*sizeof(const char*));
+  data = (int*) malloc((a->hash.entries+1)*sizeof(int));
+  if ( ! keys || ! data ) {
+    free((void*)keys);
+    free((void*)data);
+    goto fail;
+  }
+  n = hash_entries(&(a->hash),keys,data);
+  hash_reserve(&(c->hash),n);
+  for ( i=0; i<n; ++i ) {
+    if ( ! ( s = memarena_alloc(c->keyarena,strlen(keys[i])+1) ) ) break;
+    strcpy(s,keys[i]);
+    hash_insert(&(c->hash),s,data[i]);
+  }
+  free((void*)keys);
+  free((void*)data);
+  if ( i < n ) goto fail;
+  return c;
+fail:
+  hasharray_destroy(c);
+  return 0;
+}
+
+int hasharray_reserve(hasharray *a, int capacity) {
+  void *new_array;
+  if ( ! a ) return HASHARRAY_FAIL;
+  if ( a->chunks ) {
+    if ( chunkarray_reserve(*(a->chunks),capacity) ) return HASHARRAY_FAIL;
+    a->alloc = chunkarray_alloc(*(a->chunks));
+  } else if ( capacity > a->alloc ) {
+    new_array = realloc(*(a->itemarray), capacity * (size_t) a->itemsize);
+    if ( ! new_array ) return HASHARRAY_FAIL;
+    *(a->itemarray) = new_array;
+    a->alloc = capacity;
+  }
+  if ( a->pack ) return hasharray_num_reserve(a,capacity);
+  hash_reserve(&(a->hash),capacity);
+  return 0;
+}
+
+int hasharray_numeric(hasharray *a, int (*pack)(const char *, unsigned int *)) {
+  if ( ! a || a->count ) return HASHARRAY_FAIL;
+  a->pack = pack;
+  return hasharray_num_reserve(a,a->alloc);
+}
+
 int hasharray_clear(hasharray *a) {
+  int i;
   if ( ! a ) return HASHARRAY_FAIL;
+  for ( i=0; i<a->numsize; ++i ) a->num[i].data = -1;
+  a->numentries = 0;
   hash_destroy(&(a->hash));
   memarena_destroy(a->keyarena);
   if ( ! ( a->keyarena = memarena_create() ) ) {
     return HASHARRAY_FAIL;
   }
   hash_init(&(a->hash),0);
+  if ( ! a->pack ) hash_reserve(&(a->hash),a->count);  /* reinserted next */
   return 0;
 }
 
 void hasharray_destroy(hasharray *a) {
   if ( ! a ) return;
+  free((void*)a->num);
   hash_destroy(&(a->hash));
   memarena_destroy(a->keyarena);
-  if ( *(a->itemarray) ) {
+  if ( a->chunks ) {
+    chunkarray_destroy(*(a->chunks));
+    *(a->chunks) = 0;
+  } else if ( *(a->itemarray) ) {
     free(*(a->itemarray));
     *(a->itemarray) = 0;
   }
@@ -55,8 +269,10 @@ void hasharray_destroy(hasharray *a) {
 
 int hasharray_reinsert(hasharray *a, const char *key, int pos) {
   int i;
+  unsigned int k;
   char *s;
   if ( ! a ) return HASHARRAY_FAIL;
+  if ( hasharray_packed(a,key,&k) ) return hasharray_num_insert(a,k,pos);
   i = hash_lookup(&(a->hash),key);
   if ( i != HASH_FAIL ) return i;
   i = pos;
@@ -69,16 +285,24 @@ int hasharray_reinsert(hasharray *a, const char *key, int pos) {
 }
 
 int hasharray_insert(hasharray *a, const char *key) {
-  int i;
+  int i, packed;
   int new_alloc;
   void *new_array;
+  unsigned int k;
   char *s;
   if ( ! a ) return HASHARRAY_FAIL;
-  i = hash_lookup(&(a->hash),key);
+  if ( (packed = hasharray_packed(a,key,&k)) ) {
+    i = hasharray_num_lookup(a,k);
+  } else {
+    i = hash_lookup(&(a->hash),key);
+  }
   if ( i != HASH_FAIL ) return i;
   i = a->count;
   a->count++;
-  if ( a->count > a->alloc ) {
+  if ( a->count > a->alloc && a->chunks ) {
+    if ( chunkarray_reserve(*(a->chunks),a->count) ) return HASHARRAY_FAIL;
+    a->alloc = chunkarray_alloc(*(a->chunks));
+  } else if ( a->count > a->alloc ) {
     if ( a->alloc ) new_alloc = a->alloc * 2;
     else new_alloc = 8;
     new_array = realloc(*(a->itemarray), new_alloc * (size_t) a->itemsize);
@@ -87,6 +311,7 @@ int hasharray_insert(hasharray *a, const char *key) {
       a->alloc = new_alloc;
     } else return HASHARRAY_FAIL;
   }
+  if ( packed ) return hasharray_num_insert(a,k,i);
   if ( ! ( s = memarena_alloc(a->keyarena,strlen(key)+1) ) ) {
     return HASHARRAY_FAIL;
   }
@@ -96,13 +321,92 @@ int hasharray_insert(hasharray *a, const char *key) {
 }
 
 int hasharray_delete(hasharray *a, const char *key) {
+  unsigned int k;
   if (!a) return HASHARRAY_FAIL; /* I think this should be assert(a) */
+  if ( hasharray_packed(a,key,&k) ) return hasharray_num_delete(a,k);
   return hash_delete(&(a->hash), key);
 }
 
+/* the storage of item i */
+static char * hasharray_item(hasharray *a, int i) {
+  if ( a->chunks ) return (char*) chunkarray_item(*(a->chunks),i);
+  return (char*) *(a->itemarray) + (size_t) i * a->itemsize;
+}
+
+int hasharray_compact(hasharray *a) {
+  const char **keys;
+  int *data, *map;
+  int i, n, count;
+  char *s;
+  memarena *keyarena;
+  hash_t hash;
+
+  if ( ! a ) return HASHARRAY_FAIL;
+  if ( a->hash.entries + a->numentries == a->count ) return 0;
+
+  keys = (const char**) malloc((a->hash.entries+1)*sizeof(const char*));
+  data = (int*) malloc((a->hash.entries+1)*sizeof(int));
+  map = (int*) malloc((a->count+1)*sizeof(int));
+  keyarena = memarena_create();
+  hash_init(&hash,0);
+  hash_reserve(&hash,a->hash.entries);
+  if ( ! keys || ! data || ! map || ! keyarena || ! hash.slot ) goto fail;
+
+  /* number the live items in order */
+  n = hash_entries(&(a->hash),keys,data);
+  for ( i=0; i<a->count; ++i ) map[i] = -1;
+  for ( i=0; i<n; ++i ) map[data[i]] = 0;
+  for ( i=0; i<a->numsize; ++i ) {
+    if ( a->num[i].data >= 0 ) map[a->num[i].data] = 0;
+  }
+  for ( count=0, i=0; i<a->count; ++i ) {
+    if ( map[i] >= 0 ) map[i] = count++;
+  }
+
+  /* new keys first, so that failing leaves the array untouched */
+  for ( i=0; i<n; ++i ) {
+    if ( ! ( s = memarena_alloc(keyarena,strlen(keys[i])+1) ) ) goto fail;
+    strcpy(s,keys[i]);
+    hash_insert(&hash,s,map[data[i]]);
+  }
+
+  for ( i=0; i<a->count; ++i ) {
+    if ( map[i] >= 0 && map[i] != i ) {
+      memcpy(hasharray_item(a,map[i]),hasharray_item(a,i),a->itemsize);
+    }
+  }
+  for ( i=0; i<a->numsize; ++i ) {
+    if ( a->num[i].data >= 0 ) a->num[i].data = map[a->num[i].data];
+  }
+  n = a->count - count;
+  a->count = count;
+  if ( a->chunks ) {
+    chunkarray_trim(*(a->chunks),count);
+    a->alloc = chunkarray_alloc(*(a->chunks));
+  }
+  hash_destroy(&(a->hash));
+  a->hash = hash;
+  memarena_destroy(a->keyarena);
+  a->keyarena = keyarena;
+  free((void*)keys);
+  free((void*)data);
+  free((void*)map);
+  return n;
+
+fail:
+  hash_destroy(&hash);
+  memarena_destroy(keyarena);
+  free((void*)keys);
+  free((void*)data);
+  free((void*)map);
+  return HASHARRAY_FAIL;
+}
+
 int hasharray_index(hasharray *a, const char *key) {
   int i;
+  unsigned int k;
   if ( ! a ) return HASHARRAY_FAIL;
+  if ( hasharray_packed(a,key,&k) ) return hasharray_num_lookup(a,k);
   i = hash_lookup(&(a->hash),key);
   if ( i == HASH_FAIL ) i = HASHARRAY_FAIL;
   return i;
@@ -113,3 +417,18 @@ int hasharray_count(hasharray *a) {
   return a->count;
 }
 
+int hasharray_stats(hasharray *a, hasharray_stats_t *s) {
+  if ( ! a ) return HASHARRAY_FAIL;
+  s->count = a->count;
+  s->alloc = a->alloc;
+  if ( a->chunks ) s->itembytes = chunkarray_bytes(*(a->chunks));
+  else s->itembytes = (long) a->alloc * a->itemsize;
+  hash_get_stats(&(a->hash),&(s->hash));
+  s->hash.buckets += a->numsize;
+  s->hash.entries += a->numentries;
+  s->hash.used += a->numentries;
+  s->hash.bytes += (long) a->numsize * sizeof(hasharray_num_t);
+  memarena_stats(a->keyarena,&(s->keys));
+  return 0;
+}
+
@@ -2,11 +2,30 @@
 #ifndef HASHARRAY_H
 #define HASHARRAY_H
 
+#include "hash.h"
+#include "memarena.h"
+#include "chunkarray.h"
+
 struct hasharray;
 typedef struct hasharray hasharray;
 
 hasharray * hasharray_create(void **itemarray, int itemsize);
+hasharray * hasharray_create_with_capacity(void **itemarray, int itemsize,
+                                           int capacity);
+/* items kept in a chunkarray, so that inserting never moves them */
+hasharray * hasharray_create_chunked(chunkarray **items, int itemsize,
+                                     int capacity);
+/* a separate array with the items and keys of a, which must not be
+   chunked, kept in *itemarray */
+hasharray * hasharray_copy(hasharray *a, void **itemarray);
+/* make room for capacity items without reallocating or rehashing */
+int hasharray_reserve(hasharray *a, int capacity);
 int hasharray_clear(hasharray *a);
+
+/* Keys for which pack succeeds are kept in an integer table instead of
+   being hashed and copied as strings.  pack must be one to one; set it
+   while the array is empty. */
+int hasharray_numeric(hasharray *a, int (*pack)(const char *, unsigned int *));
 void hasharray_destroy(hasharray *a);
 
 int hasharray_reinsert(hasharray *a, const char *key, int pos);
@@ -14,11 +33,24 @@ int hasharray_insert(hasharray *a, const char *key);
 
 int hasharray_delete(hasharray *a, const char *key);
 
+/* Drop the items whose keys were deleted and renumber the rest in order,
+   moving them down.  Returns the number of items dropped. */
+int hasharray_compact(hasharray *a);
+
 #define HASHARRAY_FAIL -1
 
 int hasharray_index(hasharray *a, const char *key);
 
 int hasharray_count(hasharray *a);
 
+typedef struct hasharray_stats_t {
+  int count, alloc;        /* items in use and allocated */
+  long itembytes;          /* size of the item array */
+  hash_stats_t hash;
+  memarena_stats_t keys;
+} hasharray_stats_t;
+
+int hasharray_stats(hasharray *a, hasharray_stats_t *s);
+
 #endif
 
@@ -1,58 +1,179 @@
 
 #include <stdlib.h>
+#include <stddef.h>
 #include "memarena.h"
 
+#if defined(__unix__) || defined(__APPLE__)
+#include <sys/mman.h>
+#define MEMARENA_HAVE_MMAP
+#if ! defined(MAP_ANONYMOUS) && defined(MAP_ANON)
+#define MAP_ANONYMOUS MAP_ANON
+#endif
+#endif
+
+/* limit for MEMARENA_GROW */
+#define MEMARENA_MAXBLOCKSIZE (64 << 20)
+/* smallest block worth backing with huge pages */
+#define MEMARENA_HUGEPAGESIZE (2 << 20)
+
 struct memarena_stack_t;
 typedef struct memarena_stack_t memarena_stack_t;
 struct memarena_stack_t {
   memarena_stack_t * next;
   void * data;
+  size_t size;
+  size_t mapped;  /* length of the mapping, 0 if malloc'd */
 };
 
 struct memarena {
   memarena_stack_t * stack;
-  int newblocksize;
+  int blocksize, newblocksize;
   int size, used;
+  int alignment;
+  int mode;
+  memarena_stats_t stats;
 };
 
+/* Block storage comes from malloc, or from anonymous mappings in
+   MEMARENA_MMAP mode. */
+static memarena_stack_t * memarena_block_alloc(memarena *a, size_t size) {
+  memarena_stack_t * s;
+  s = (memarena_stack_t*) malloc(sizeof(memarena_stack_t));
+  if ( ! s ) return 0;
+  s->size = size;
+  s->mapped = 0;
+#ifdef MEMARENA_HAVE_MMAP
+  if ( a->mode & MEMARENA_MMAP ) {
+    s->data = mmap(0, size, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if ( s->data == MAP_FAILED ) {
+      free((void*)s);
+      return 0;
+    }
+#ifdef MADV_HUGEPAGE
+    if ( a->mode & MEMARENA_HUGEPAGES ) madvise(s->data, size, MADV_HUGEPAGE);
+#endif
+    s->mapped = size;
+    return s;
+  }
+#endif
+  s->data = malloc(size);
+  if ( ! s->data ) {
+    free((void*)s);
+    return 0;
+  }
+  return s;
+}
+
+static void memarena_block_free(memarena_stack_t *s) {
+#ifdef MEMARENA_HAVE_MMAP
+  if ( s->mapped ) {
+    munmap(s->data, s->mapped);
+    free((void*)s);
+    return;
+  }
+#endif
+  free((void*)s->data);
+  free((void*)s);
+}
+
+/* block size to start from, at least a huge page when they are used */
+static void memarena_reset_blocksize(memarena *a) {
+  a->newblocksize = a->blocksize;
+  if ( ( a->mode & MEMARENA_HUGEPAGES ) &&
+       a->newblocksize < MEMARENA_HUGEPAGESIZE )
+    a->newblocksize = MEMARENA_HUGEPAGESIZE;
+}
+
 memarena * memarena_create(void) {
   memarena * a;
   if ( (a = (memarena*) malloc(sizeof(memarena))) ) {
     a->stack = 0;
+    a->blocksize = 128000;
     a->newblocksize = 128000;
     a->size = 0;
     a->used = 0;
+    a->alignment = 1;
+    a->mode = 0;
+    a->stats.requested = 0;
+    a->stats.reserved = 0;
+    a->stats.wasted = 0;
+    a->stats.blocks = 0;
+    a->stats.oversize = 0;
   }
   return a;
 }
 
-void memarena_destroy(memarena *a) {
+void memarena_clear(memarena *a) {
   memarena_stack_t * s;
-  if ( ! a ) return;
   while ( a->stack ) {
     s = a->stack;
     a->stack = s->next;
-    free((void*)s->data);
-    free((void*)s);
+    memarena_block_free(s);
   }
+  memarena_reset_blocksize(a);
+  a->size = 0;
+  a->used = 0;
+  a->stats.requested = 0;
+  a->stats.reserved = 0;
+  a->stats.wasted = 0;
+  a->stats.blocks = 0;
+  a->stats.oversize = 0;
+}
+
+void memarena_destroy(memarena *a) {
+  if ( ! a ) return;
+  memarena_clear(a);
   free((void*)a);
 }
 
 void memarena_blocksize(memarena *a, int blocksize) {
-  a->newblocksize = blocksize;
+  a->blocksize = blocksize;
+  memarena_reset_blocksize(a);
+}
+
+int memarena_mode_check(int mode) {
+#ifndef MEMARENA_HAVE_MMAP
+  if ( mode & MEMARENA_MMAP ) return -1;
+#endif
+  if ( ( mode & MEMARENA_HUGEPAGES ) && ! ( mode & MEMARENA_MMAP ) ) return -1;
+  return 0;
+}
+
+int memarena_mode(memarena *a, int mode) {
+  if ( memarena_mode_check(mode) ) return -1;
+  a->mode = mode;
+  if ( ( mode & MEMARENA_HUGEPAGES ) && a->newblocksize < MEMARENA_HUGEPAGESIZE )
+    a->newblocksize = MEMARENA_HUGEPAGESIZE;
+  return 0;
+}
+
+int memarena_get_mode(memarena *a) {
+  return a->mode;
+}
+
+int memarena_alignment(memarena *a, int alignment) {
+  if ( alignment < 1 || ( alignment & ( alignment - 1 ) ) ) return -1;
+  a->alignment = alignment;
+  return 0;
 }
 
-void * memarena_alloc(memarena *a, int size) {
+/* number of bytes needed to bring m up to a multiple of alignment */
+static int memarena_pad(const void *m, int alignment) {
+  return (int) ( ( alignment - ( (size_t) m & ( alignment - 1 ) ) )
+                                              & ( alignment - 1 ) );
+}
+
+static void * memarena_alloc_internal(memarena *a, size_t size,
+							int alignment) {
   memarena_stack_t * s;
   void * m;
-  if ( size > a->newblocksize / 2 ) {
-    s = (memarena_stack_t*) malloc(sizeof(memarena_stack_t));
+  int pad;
+  if ( size > (size_t) -1 - alignment ) return 0;
+  /* anything over half a block, however large, gets a block of its own */
+  if ( size + alignment - 1 > (size_t) a->newblocksize / 2 ) {
+    s = memarena_block_alloc(a, size + alignment - 1);
     if ( ! s ) return 0;
-    s->data = malloc(size);
-    if ( ! s->data ) {
-      free((void*)s);
-      return 0;
-    }
     if ( a->stack ) {
       s->next = a->stack->next;
       a->stack->next = s;
@@ -60,27 +181,129 @@ void * memarena_alloc(memarena *a, int size) {
       s->next = 0;
       a->stack = s;
     }
-    return s->data;
-  } else if ( a->used + size > a->size ) {
-    s = (memarena_stack_t*) malloc(sizeof(memarena_stack_t));
+    a->stats.requested += size;
+    a->stats.reserved += size + alignment - 1;
+    a->stats.wasted += alignment - 1;
+    a->stats.oversize++;
+    return (void*) ( (char*) s->data + memarena_pad(s->data, alignment) );
+  }
+  pad = a->stack ?
+        memarena_pad((char*) a->stack->data + a->used, alignment) : 0;
+  if ( a->used + pad + (int) size > a->size ) {
+    s = memarena_block_alloc(a, a->newblocksize);
     if ( ! s ) return 0;
     s->next = a->stack;
-    s->data = malloc(a->newblocksize);
-    if ( ! s->data ) {
-      free((void*)s);
-      return 0;
-    }
+    a->stats.wasted += a->size - a->used;
+    a->stats.reserved += a->newblocksize;
+    a->stats.blocks++;
     a->stack = s;
     a->size = a->newblocksize;
     a->used = 0;
+    pad = memarena_pad(s->data, alignment);
+    if ( ( a->mode & MEMARENA_GROW ) &&
+         a->newblocksize <= MEMARENA_MAXBLOCKSIZE / 2 ) {
+      a->newblocksize *= 2;
+    }
   }
-  m = (void*) ( (char*) a->stack->data + a->used );
-  a->used += size;
+  a->stats.requested += size;
+  a->stats.wasted += pad;
+  m = (void*) ( (char*) a->stack->data + a->used + pad );
+  a->used += pad + (int) size;
   return m;
 }
 
-void * memarena_alloc_aligned(memarena *a, int size, int alignment) {
+void * memarena_alloc(memarena *a, size_t size) {
+  return memarena_alloc_internal(a, size, a->alignment);
+}
+
+void * memarena_alloc_aligned(memarena *a, size_t size, int alignment) {
+  if ( alignment < 1 || ( alignment & ( alignment - 1 ) ) ) return 0;
+  return memarena_alloc_internal(a, size, alignment);
+}
+
+void memarena_mark(memarena *a, memarena_mark_t *m) {
+  m->stack = a->stack;
+  m->next = a->stack ? a->stack->next : 0;
+  m->size = a->size;
+  m->used = a->used;
+  m->stats = a->stats;
+}
+
+void memarena_rewind(memarena *a, const memarena_mark_t *m) {
+  memarena_stack_t * s;
+  /* blocks pushed since the mark */
+  while ( a->stack != m->stack ) {
+    s = a->stack;
+    a->stack = s->next;
+    memarena_block_free(s);
+  }
+  /* oversize blocks slipped in below the marked block */
+  while ( a->stack && a->stack->next != m->next ) {
+    s = a->stack->next;
+    a->stack->next = s->next;
+    memarena_block_free(s);
+  }
+  a->size = m->size;
+  a->used = m->used;
+  a->stats = m->stats;
+}
+
+/* nonzero if p lies in a block of s up to but excluding end */
+static int memarena_in_blocks(memarena_stack_t *s, memarena_stack_t *end,
+							const char *p) {
+  for ( ; s && s != end; s = s->next ) {
+    if ( p >= (char*) s->data && p < (char*) s->data + s->size ) return 1;
+  }
   return 0;
 }
 
+int memarena_since(memarena *a, const memarena_mark_t *m, const void *p) {
+  const char *c = (const char *) p;
+  /* blocks pushed since the mark */
+  if ( memarena_in_blocks(a->stack, m->stack, c) ) return 1;
+  if ( ! m->stack ) return 0;
+  /* the marked block past what was used, and oversize blocks below it */
+  if ( c >= (char*) m->stack->data + m->used &&
+       c < (char*) m->stack->data + m->stack->size ) return 1;
+  return memarena_in_blocks(m->stack->next, m->next, c);
+}
+
+memarena * memarena_spawn(memarena *a) {
+  memarena * b;
+  if ( (b = memarena_create()) ) {
+    b->blocksize = a->blocksize;
+    b->alignment = a->alignment;
+    b->mode = a->mode;
+    memarena_reset_blocksize(b);
+  }
+  return b;
+}
+
+void memarena_adopt(memarena *a, memarena *b) {
+  memarena_stack_t * s;
+  if ( ! b->stack ) return;
+  if ( a->stack ) {
+    /* below the current block of a, like oversize blocks, so that a
+       keeps filling it; the rest of the current block of b is lost */
+    for ( s = b->stack; s->next; s = s->next );
+    s->next = a->stack->next;
+    a->stack->next = b->stack;
+    a->stats.wasted += b->size - b->used;
+  } else {
+    a->stack = b->stack;
+    a->size = b->size;
+    a->used = b->used;
+  }
+  a->stats.requested += b->stats.requested;
+  a->stats.reserved += b->stats.reserved;
+  a->stats.wasted += b->stats.wasted;
+  a->stats.blocks += b->stats.blocks;
+  a->stats.oversize += b->stats.oversize;
+  b->stack = 0;
+  memarena_clear(b);
+}
+
+void memarena_stats(memarena *a, memarena_stats_t *s) {
+  *s = a->stats;
+}
 
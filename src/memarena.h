@@ -1,16 +1,72 @@
-
 #ifndef MEMARENA_H
 #define MEMARENA_H
 
+#include <stddef.h>
+
 struct memarena;
 typedef struct memarena memarena;
 
 memarena * memarena_create(void);
 void memarena_destroy(memarena *a);
 
+/* release every block but keep the configuration */
+void memarena_clear(memarena *a);
+
 void memarena_blocksize(memarena *a, int blocksize);
-void * memarena_alloc(memarena *a, int size);
-void * memarena_alloc_aligned(memarena *a, int size, int alignment);
+
+/* block allocation modes, may be combined */
+#define MEMARENA_MMAP 1       /* anonymous mmap instead of malloc */
+#define MEMARENA_HUGEPAGES 2  /* advise transparent huge pages, needs MMAP */
+#define MEMARENA_GROW 4       /* double the block size with each block */
+
+/* affects blocks allocated from now on; -1 if unsupported here */
+int memarena_mode(memarena *a, int mode);
+
+/* -1 if memarena_mode would refuse the mode, 0 otherwise */
+int memarena_mode_check(int mode);
+
+int memarena_get_mode(memarena *a);
+
+/* sizes beyond the block size get a block of their own; 0 on failure */
+void * memarena_alloc(memarena *a, size_t size);
+
+/* alignment must be a power of two; returns 0 otherwise */
+void * memarena_alloc_aligned(memarena *a, size_t size, int alignment);
+
+/* default alignment applied by memarena_alloc (1 = packed, the default) */
+int memarena_alignment(memarena *a, int alignment);
+
+typedef struct memarena_stats_t {
+  long requested;  /* bytes handed out */
+  long reserved;   /* bytes obtained for blocks */
+  long wasted;     /* alignment padding and abandoned block tails */
+  int blocks;      /* regular blocks */
+  int oversize;    /* blocks holding a single oversize allocation */
+} memarena_stats_t;
+
+void memarena_stats(memarena *a, memarena_stats_t *s);
+
+/* checkpoint; rewinding frees everything allocated since the mark */
+struct memarena_stack_t;
+typedef struct memarena_mark_t {
+  struct memarena_stack_t *stack, *next;
+  int size, used;
+  memarena_stats_t stats;
+} memarena_mark_t;
+
+void memarena_mark(memarena *a, memarena_mark_t *m);
+void memarena_rewind(memarena *a, const memarena_mark_t *m);
+
+/* nonzero if p was allocated since the mark, so a rewind would free it */
+int memarena_since(memarena *a, const memarena_mark_t *m, const void *p);
+
+/* empty arena with the configuration of a, to be filled elsewhere
+   (e.g. on another thread) and handed back with memarena_adopt */
+memarena * memarena_spawn(memarena *a);
+
+/* moves every block of b into a, leaving b empty; allocations from b
+   stay valid and are freed with a */
+void memarena_adopt(memarena *a, memarena *b);
 
 #endif
 
@@ -228,9 +228,9 @@ void write_pdb_end(FILE *outfile) {
 }
 
 void write_pdb_atom(FILE *outfile,
-    int index,char *atomname,char *resname,int resid, char *insertion, float x,
+    int index,const char *atomname,char *resname,int resid, char *insertion, float x,
     float y, float z, float occ, float beta, char *chain, char *segname,
-    char *element) {
+    const char *element) {
 
   char name[6], rname[5], sname[5];
   char chainc, insertionc;
@@ -5,15 +5,35 @@
 #include "pdb_file.h"
 #include "extract_alias.h"
 
-#if defined(_MSC_VER)
-#define snprintf _snprintf
-#endif
-
 static void strtoupper(char *s) {
   while ( *s ) { *s = toupper(*s); ++s; }
 }
 
-int pdb_file_extract_residues(topo_mol *mol, FILE *file, stringhash *h, int all_caps,
+/* Residues left in a seekable file, counted from changes in the raw
+   resid columns; -1 if the file cannot be rewound */
+static int pdb_file_count_residues(FILE *file) {
+  char record[PDB_RECORD_LENGTH+2];
+  char oldresid[8];
+  long start;
+  int indx, count;
+
+  start = ftell(file);
+  if ( start < 0 ) return -1;
+  count = 0;
+  oldresid[0] = '\0';
+  do {
+    if ( (indx = read_pdb_record(file, record)) == PDB_ATOM &&
+         strlen(record) > 22 && strncmp(oldresid, record + 22, 5) ) {
+      strncpy(oldresid, record + 22, 5);
+      oldresid[5] = '\0';
+      ++count;
+    }
+  } while (indx != PDB_END && indx != PDB_EOF);
+  if ( fseek(file, start, SEEK_SET) ) return -1;
+  return count;
+}
+
+int pdb_file_extract_residues(topo_mol *mol, FILE *file, extract_alias *h, int all_caps,
                                 void *v,void (*print_msg)(void *,const char *)) {
 
   char record[PDB_RECORD_LENGTH+2];
@@ -29,6 +49,11 @@ int pdb_file_extract_residues(topo_mol *mol, FILE *file, stringhash *h, int all_
   rcount = 0;
   oldresid[0] = '\0';
 
+  if ( (rcount = pdb_file_count_residues(file)) > 0 ) {
+    topo_mol_reserve(mol, 0, rcount);
+  }
+  rcount = 0;
+
   do {
     if((indx = read_pdb_record(file, record)) == PDB_ATOM) {
       get_pdb_fields(record, name, resname, chain,
@@ -53,20 +78,24 @@ int pdb_file_extract_residues(topo_mol *mol, FILE *file, stringhash *h, int all_
 }
 
 int pdb_file_extract_coordinates(topo_mol *mol, FILE *file, FILE *namdbinfile,
-                                const char *segid, stringhash *h, int all_caps,
+                                const char *segid, extract_alias *h, int all_caps,
                                 void *v,void (*print_msg)(void *,const char *)) {
 
   char record[PDB_RECORD_LENGTH+2];
   int indx;
   topo_mol_ident_t target;
   char msg[128];
-  unsigned int utmp;
-  char stmp[128];
+  const extract_alias_atom_t *alias;
 
   int numatoms = 0;
   int pdbnatoms = 0;
   double *atomcoords = 0;
 
+  if ( topo_mol_queued(mol) ) {
+    print_msg(v,"ERROR: segments are queued and must be ended first");
+    return -1;
+  }
+
   if ( namdbinfile ) {
     int filen;
     int wrongendian;
@@ -126,7 +155,7 @@ int pdb_file_extract_coordinates(topo_mol *mol, FILE *file, FILE *namdbinfile,
     if((indx = read_pdb_record(file, record)) == PDB_ATOM) {
       float xf,yf,zf,o,b;
       double x,y,z;
-      char name[8], altname[8], resname[8], chain[8];
+      char name[8], resname[8], chain[8];
       char segname[8], element[8], resid[8], insertion[8];
       int found;
       get_pdb_fields(record, name, resname, chain,
@@ -147,20 +176,24 @@ int pdb_file_extract_coordinates(topo_mol *mol, FILE *file, FILE *namdbinfile,
       if ( all_caps ) strtoupper(resname);
       if ( all_caps ) strtoupper(name);
       if ( all_caps ) strtoupper(chain);
-      target.aname = extract_alias_atom_check(h,resname,name);
+      if ( ! (alias = extract_alias_atom_lookup(h,resname,name)) ) {
+        print_msg(v,"ERROR: out of memory resolving atom aliases");
+        free(atomcoords);
+        return -1;
+      }
+      target.aname = alias->name;
       /* Use PDB segid if no segid given */
       if (!segid) {
         target.segid = segname;
       }
       found = ! topo_mol_set_xyz(mol,&target,x,y,z);
       /* Try reversing order so 1HE2 in pdb matches HE21 in topology */
-      if ( ! found && sscanf(name,"%u%s",&utmp,stmp) == 2 ) {
-        snprintf(altname,8,"%s%u",stmp,utmp);
-        target.aname = altname;
+      if ( ! found && alias->rotated ) {
+        target.aname = alias->rotated;
         if ( ! topo_mol_set_xyz(mol,&target,x,y,z) ) {
           found = 1;
           /*  too much information
-          sprintf(msg,"Warning: changed atom name for atom %s\t %s:%s\t  %s to %s",name,resname,resid,segid ? segid : segname,altname);
+          sprintf(msg,"Warning: changed atom name for atom %s\t %s:%s\t  %s to %s",name,resname,resid,segid ? segid : segname,alias->rotated);
           print_msg(v,msg);
           */
         }
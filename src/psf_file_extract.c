@@ -167,7 +167,7 @@ static int extract_bonds(FILE *file, int fw, topo_mol *mol, int natoms,
     atom1 = molatomlist[ind1];
     atom2 = molatomlist[ind2];
 
-    tuple = memarena_alloc(mol->arena,sizeof(topo_mol_bond_t));
+    tuple = topo_mol_bond_alloc(mol);
     tuple->next[0] = atom1->bonds;
     tuple->atom[0] = atom1;
     tuple->next[1] = atom2->bonds;
@@ -204,7 +204,7 @@ static int extract_angles(FILE *file, int fw, topo_mol *mol, int natoms,
     atom2 = molatomlist[angles[3*i+1]-1];
     atom3 = molatomlist[angles[3*i+2]-1];
 
-    tuple = memarena_alloc(mol->angle_arena,sizeof(topo_mol_angle_t));
+    tuple = topo_mol_angle_alloc(mol);
     tuple->next[0] = atom1->angles;
     tuple->atom[0] = atom1;
     tuple->next[1] = atom2->angles;
@@ -245,7 +245,7 @@ static int extract_dihedrals(FILE *file, int fw, topo_mol *mol, int natoms,
     atom3 = molatomlist[dihedrals[4*i+2]-1];
     atom4 = molatomlist[dihedrals[4*i+3]-1];
 
-    tuple = memarena_alloc(mol->dihedral_arena,sizeof(topo_mol_dihedral_t));
+    tuple = topo_mol_dihedral_alloc(mol);
     tuple->next[0] = atom1->dihedrals;
     tuple->atom[0] = atom1;
     tuple->next[1] = atom2->dihedrals;
@@ -402,10 +402,25 @@ static int extract_exclusions(FILE *file, int fw, topo_mol *mol, int natoms,
   return 0;
 }
 
+/* Number of residues in the run of atoms from first sharing its segname,
+   and the index of the atom after that run */
+static int count_segment_residues(const psfatom *atomlist, int first,
+                                  int natoms, int *end) {
+  int i, nres;
+  nres = 1;
+  for ( i=first+1; i<natoms &&
+        !strcmp(atomlist[i].segname, atomlist[first].segname); ++i ) {
+    if ( strcmp(atomlist[i].resid, atomlist[i-1].resid) ) ++nres;
+  }
+  *end = i;
+  return nres;
+}
+
 /* Return the segment corresponding to the given segname.  If the segname
-   doesn't exist, add it.  Return NULL on error.
+   doesn't exist, add it with room for nres residues.  Return NULL on error.
 */
-static topo_mol_segment_t *get_segment(topo_mol *mol, const char *segname) {
+static topo_mol_segment_t *get_segment(topo_mol *mol, const char *segname,
+                                       int nres) {
   int id;
   topo_mol_segment_t *seg = NULL;
 
@@ -419,12 +434,15 @@ static topo_mol_segment_t *get_segment(topo_mol *mol, const char *segname) {
       seg = mol->segment_array[id] =
             (topo_mol_segment_t *) malloc(sizeof(topo_mol_segment_t));
       strcpy(seg->segid, segname);
-      seg->residue_hash = hasharray_create(
-        (void**) &(seg->residue_array), sizeof(topo_mol_residue_t));
+      seg->residue_hash = hasharray_create_chunked(&(seg->residues),
+        sizeof(topo_mol_residue_t), 0);
+      hasharray_numeric(seg->residue_hash, topo_mol_resid_pack);
+      hasharray_reserve(seg->residue_hash, nres);
       strcpy(seg->pfirst,"");
       strcpy(seg->plast,"");
       seg->auto_angles = 0;
       seg->auto_dihedrals = 0;
+      seg->proto = 0;
     }
   }
   return seg;
@@ -448,22 +466,46 @@ static topo_mol_residue_t *get_residue(topo_mol_segment_t *seg,
   if (id == HASHARRAY_FAIL) {
     return NULL;
   }
-  res = &(seg->residue_array[id]);
+  res = topo_mol_seg_residue(seg,id);
   strcpy(res->resid, resid);
+  res->inst = 0;
+  res->index = 0;
+  res->nindex = 0;
+  res->maxindex = 0;
+  res->indexstamp = 0;
 
   return res;
 }
 
 
+/* Coordinate and velocity buffers come from an aligned scratch arena */
+static double *alloc_xyz(memarena **arena, int natoms) {
+  if ( ! *arena ) {
+    if ( ! (*arena = memarena_create()) ) return 0;
+    memarena_alignment(*arena, TOPO_MOL_XYZ_ALIGN);
+  }
+  if ( natoms < 0 || (size_t) natoms > (size_t) -1 / ( 3 * sizeof(double) ) )
+    return 0;
+  return (double *) memarena_alloc(*arena,
+					3 * (size_t) natoms * sizeof(double));
+}
+
 int psf_file_extract(topo_mol *mol, FILE *file, FILE *pdbfile, FILE *namdbinfile, FILE *velnamdbinfile,
                                 void *v, void (*print_msg)(void *, const char *)) {
   int i, natoms, charmmext;
+  int nsegs, segend, segres;
   psfatom *atomlist;
   double *atomcoords, *atomvels;
+  memarena *xyzarena;
   topo_mol_atom_t **molatomlist;
   long filepos;
   char inbuf[PSF_RECORD_LENGTH+2];
 
+  if ( topo_mol_queued(mol) ) {
+    print_msg(v,"ERROR: segments are queued and must be ended first");
+    return -1;
+  }
+
   /* Read header flags */
   if (feof(file) || (inbuf != fgets(inbuf, PSF_RECORD_LENGTH+1, file))) {
     print_msg(v,"ERROR: Unable to read psf file");
@@ -500,6 +542,7 @@ int psf_file_extract(topo_mol *mol, FILE *file, FILE *pdbfile, FILE *namdbinfile
   }
 
   /* Optionally read coordinates, insertion code, and element symbol from PDB file */
+  xyzarena = 0;
   atomcoords = 0;
   if ( pdbfile ) {
     char record[PDB_RECORD_LENGTH+2];
@@ -508,7 +551,12 @@ int psf_file_extract(topo_mol *mol, FILE *file, FILE *pdbfile, FILE *namdbinfile
     char name[8], resname[8], chain[8];
     char segname[8], element[8], resid[8], insertion[8];
 
-    atomcoords = (double *)malloc(natoms * 3 * sizeof(double));
+    if ( ! (atomcoords = alloc_xyz(&xyzarena, natoms)) ) {
+      print_msg(v,"ERROR: unable to allocate coordinates");
+      free(atomlist);
+      memarena_destroy(xyzarena);
+      return -1;
+    }
 
     insertions = 0;
     i=0;
@@ -518,7 +566,7 @@ int psf_file_extract(topo_mol *mol, FILE *file, FILE *pdbfile, FILE *namdbinfile
         if ( i >= natoms ) {
           print_msg(v,"too many atoms in pdb file");
           free(atomlist);
-          free(atomcoords);
+          memarena_destroy(xyzarena);
           return -1;
         }
         get_pdb_fields(record, name, resname, chain,
@@ -529,7 +577,7 @@ int psf_file_extract(topo_mol *mol, FILE *file, FILE *pdbfile, FILE *namdbinfile
           print_msg(v,"atom mismatch in pdb file");
           print_msg(v,record);
           free(atomlist);
-          free(atomcoords);
+          memarena_destroy(xyzarena);
           return -1;
         }
         if ( insertion[0] != ' ' && insertion[0] != '\0' ) {
@@ -556,7 +604,7 @@ int psf_file_extract(topo_mol *mol, FILE *file, FILE *pdbfile, FILE *namdbinfile
     if ( i < natoms ) {
       print_msg(v,"too few atoms in pdb file");
       free(atomlist);
-      free(atomcoords);
+      memarena_destroy(xyzarena);
       return -1;
     }
   }
@@ -567,15 +615,18 @@ int psf_file_extract(topo_mol *mol, FILE *file, FILE *pdbfile, FILE *namdbinfile
     int wrongendian;
     char lenbuf[4];
     char tmpc;
-    if ( ! atomcoords ) {
-      atomcoords = (double *)malloc(natoms * 3L * sizeof(double));
+    if ( ! atomcoords && ! (atomcoords = alloc_xyz(&xyzarena, natoms)) ) {
+      print_msg(v,"ERROR: unable to allocate coordinates");
+      free(atomlist);
+      memarena_destroy(xyzarena);
+      return -1;
     }
     fseek(namdbinfile,0,SEEK_END);
     numatoms = (ftell(namdbinfile)-4)/24;
     if (numatoms < 1) {
       print_msg(v,"namdbin file is too short");
       free(atomlist);
-      free(atomcoords);
+      memarena_destroy(xyzarena);
       return -1;
     }
     fseek(namdbinfile,0,SEEK_SET);
@@ -591,19 +642,19 @@ int psf_file_extract(topo_mol *mol, FILE *file, FILE *pdbfile, FILE *namdbinfile
     if (filen != numatoms) {
       print_msg(v,"inconsistent atom count in namdbin file");
       free(atomlist);
-      free(atomcoords);
+      memarena_destroy(xyzarena);
       return -1;
     }
     if (numatoms < natoms) {
       print_msg(v,"too few atoms in namdbin file");
       free(atomlist);
-      free(atomcoords);
+      memarena_destroy(xyzarena);
       return -1;
     }
     if (numatoms > natoms) {
       print_msg(v,"too many atoms in namdbin file");
       free(atomlist);
-      free(atomcoords);
+      memarena_destroy(xyzarena);
       return -1;
     }
     if (wrongendian) {
@@ -613,7 +664,7 @@ int psf_file_extract(topo_mol *mol, FILE *file, FILE *pdbfile, FILE *namdbinfile
                                  != (size_t)(3L * natoms)) {
       print_msg(v,"error reading data from namdbin file");
       free(atomlist);
-      free(atomcoords);
+      memarena_destroy(xyzarena);
       return -1;
     }
     if (wrongendian) {
@@ -645,7 +696,7 @@ int psf_file_extract(topo_mol *mol, FILE *file, FILE *pdbfile, FILE *namdbinfile
     if (numatoms < 1) {
       print_msg(v,"velnamdbin file is too short");
       free(atomlist);
-      free(atomcoords);
+      memarena_destroy(xyzarena);
       return -1;
     }
     fseek(velnamdbinfile,0,SEEK_SET);
@@ -661,31 +712,35 @@ int psf_file_extract(topo_mol *mol, FILE *file, FILE *pdbfile, FILE *namdbinfile
     if (filen != numatoms) {
       print_msg(v,"inconsistent atom count in namdbin file");
       free(atomlist);
-      free(atomcoords);
+      memarena_destroy(xyzarena);
       return -1;
     }
     if (numatoms < natoms) {
       print_msg(v,"too few atoms in namdbin file");
       free(atomlist);
-      free(atomcoords);
+      memarena_destroy(xyzarena);
       return -1;
     }
     if (numatoms > natoms) {
       print_msg(v,"too many atoms in namdbin file");
       free(atomlist);
-      free(atomcoords);
+      memarena_destroy(xyzarena);
       return -1;
     }
     if (wrongendian) {
       print_msg(v,"namdbin file appears to be other-endian");
     }
-    atomvels = (double *)malloc(natoms * 3L * sizeof(double));
+    if ( ! (atomvels = alloc_xyz(&xyzarena, natoms)) ) {
+      print_msg(v,"ERROR: unable to allocate velocities");
+      free(atomlist);
+      memarena_destroy(xyzarena);
+      return -1;
+    }
     if (fread(atomvels, sizeof(double), 3L * natoms, velnamdbinfile)
                                  != (size_t)(3L * natoms)) {
       print_msg(v,"error reading data from namdbin file");
       free(atomlist);
-      free(atomcoords);
-      free(atomvels);
+      memarena_destroy(xyzarena);
       return -1;
     }
     if (wrongendian) {
@@ -706,7 +761,15 @@ int psf_file_extract(topo_mol *mol, FILE *file, FILE *pdbfile, FILE *namdbinfile
 
   molatomlist = (topo_mol_atom_t **)malloc(natoms * sizeof(topo_mol_atom_t *));
 
+  /* size the segment table once; residue tables are sized per segment */
+  nsegs = ( natoms > 0 );
+  for ( i=1; i<natoms; ++i ) {
+    if ( strcmp(atomlist[i].segname, atomlist[i-1].segname) ) ++nsegs;
+  }
+  topo_mol_reserve(mol, nsegs, 0);
+
   i=0;
+  segend = segres = 0;
   while (i < natoms) {
     topo_mol_segment_t *seg;
     topo_mol_residue_t *res;
@@ -716,7 +779,10 @@ int psf_file_extract(topo_mol *mol, FILE *file, FILE *pdbfile, FILE *namdbinfile
 
     resid = atomlist[i].resid;
     segname = atomlist[i].segname;
-    seg = get_segment(mol, segname);
+    if ( i == segend ) {
+      segres = count_segment_residues(atomlist, i, natoms, &segend);
+    }
+    seg = get_segment(mol, segname, segres);
     if (!seg) {
       print_msg(v,"ERROR: unable to get segment!");
       break;
@@ -738,7 +804,7 @@ int psf_file_extract(topo_mol *mol, FILE *file, FILE *pdbfile, FILE *namdbinfile
     while (i<natoms && !strcmp(resid, atomlist[i].resid) &&
                        !strcmp(segname, atomlist[i].segname)) {
       /* Add atoms to residue */
-      atomtmp = memarena_alloc(mol->arena, sizeof(topo_mol_atom_t));
+      atomtmp = topo_mol_atom_alloc(mol);
       atomtmp->bonds = 0;
       atomtmp->angles = 0;
       atomtmp->dihedrals = 0;
@@ -746,9 +812,9 @@ int psf_file_extract(topo_mol *mol, FILE *file, FILE *pdbfile, FILE *namdbinfile
       atomtmp->cmaps = 0;
       atomtmp->exclusions = 0;
       atomtmp->conformations = 0;
-      strcpy(atomtmp->name, atomlist[i].name);
-      strcpy(atomtmp->type, atomlist[i].atype);
-      strcpy(atomtmp->element, atomlist[i].element);
+      atomtmp->name = topo_mol_intern(mol, atomlist[i].name);
+      atomtmp->type = topo_mol_intern(mol, atomlist[i].atype);
+      atomtmp->element = topo_mol_intern(mol, atomlist[i].element);
       atomtmp->mass = atomlist[i].mass;
       atomtmp->charge = atomlist[i].charge;
       if (atomcoords) {
@@ -762,14 +828,9 @@ int psf_file_extract(topo_mol *mol, FILE *file, FILE *pdbfile, FILE *namdbinfile
         atomtmp->z = 0;
         atomtmp->xyz_state = TOPO_MOL_XYZ_VOID;
       }
-      if (atomvels) {
-        atomtmp->vx = atomvels[i*3    ];
-        atomtmp->vy = atomvels[i*3 + 1];
-        atomtmp->vz = atomvels[i*3 + 2];
-      } else {
-        atomtmp->vx = 0;
-        atomtmp->vy = 0;
-        atomtmp->vz = 0;
+      if (atomvels && topo_mol_put_vel(mol, atomtmp, atomvels[i*3    ],
+                                       atomvels[i*3 + 1], atomvels[i*3 + 2])) {
+        print_msg(v,"ERROR: unable to store velocities");
       }
       atomtmp->partition = 0;
       atomtmp->copy = 0;
@@ -789,11 +850,11 @@ int psf_file_extract(topo_mol *mol, FILE *file, FILE *pdbfile, FILE *namdbinfile
       atomtmp->next = res->atoms;
       res->atoms = atomtmp;
     }
+    ++mol->atom_edits;
   }
 
-  if (atomcoords) free(atomcoords);
+  memarena_destroy(xyzarena);
   atomcoords = 0;
-  if (atomvels) free(atomvels);
   atomvels = 0;
 
   /* Check to see if we broke out of the loop prematurely */
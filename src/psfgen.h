@@ -9,14 +9,16 @@
 
 #include "topo_defs.h"
 #include "topo_mol.h"
-#include "stringhash.h"
+#include "extract_alias.h"
 
 /* psfgen-specific data */
 struct psfgen_data {
   int id, in_use, all_caps;
   topo_defs *defs;
   topo_mol *mol;
-  stringhash *aliases;
+  extract_alias *aliases;
+  char *topocache;  /* directory of topology cache files, or NULL */
+  int batch;        /* segments are queued to be ended together */
   FILE* outstream;
 };
 typedef struct psfgen_data psfgen_data;
@@ -11,7 +11,7 @@
 #include "topo_mol_struct.h"
 #include "topo_mol_output.h"
 #include "charmm_parse_topo_defs.h"
-#include "stringhash.h"
+#include "topo_defs_cache.h"
 #include "extract_alias.h"
 
 /* Helper functions */
@@ -32,7 +32,7 @@ static char* as_charptr(PyObject *target)
 }
 
 /* Wrapper function for turning char* into a python string */
-static PyObject* as_pystring(char *target)
+static PyObject* as_pystring(const char *target)
 {
     PyObject *result;
     if (!target) {
@@ -80,32 +80,77 @@ int convert_bool(PyObject *obj, void *boolval)
   return 1; // success
 }
 
+/* The psfgen_data in a capsule, or NULL with an exception set.  While
+ * a call has released the GIL, in_use is set and the data may not be
+ * touched from other threads */
+static psfgen_data* get_data(PyObject *stateptr)
+{
+    psfgen_data *data;
+    data = PyCapsule_GetPointer(stateptr, NULL);
+    if (!data || PyErr_Occurred())
+        return NULL;
+    if (data->in_use) {
+        PyErr_SetString(PyExc_RuntimeError,
+                        "PsfGen object is in use by another thread");
+        return NULL;
+    }
+    return data;
+}
+
+/* Gives the molecule topology definitions it may change, copying them
+ * first if they are shared with other PsfGen objects */
+static int unshare_topology(psfgen_data *data)
+{
+    topo_defs *defs;
+    if (topo_mol_queued(data->mol)) {
+        PyErr_SetString(PyExc_ValueError,
+                        "segments are queued and must be ended first");
+        return -1;
+    }
+    defs = topo_mol_unshare_defs(data->mol);
+    if (!defs) {
+        PyErr_NoMemory();
+        return -1;
+    }
+    data->defs = defs;
+    return 0;
+}
+
 /* Initialization / destruction functions */
 static PyObject* py_init_mol(PyObject *self, PyObject *args, PyObject *kwargs)
 {
-    const char *kwnames[] = {"outfd", NULL};
+    const char *kwnames[] = {"outfd", "shared", NULL};
     PyObject *capsule;
-    psfgen_data *data;
+    PyObject *shared = NULL;
+    psfgen_data *data, *other = NULL;
     int outfd = 0;
 
-    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "|i:__init__",
-                                     (char**) kwnames, &outfd)) {
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "|iO:__init__",
+                                     (char**) kwnames, &outfd, &shared)) {
         return NULL;
     }
 
+    if (shared && shared != Py_None) {
+        other = get_data(shared);
+        if (!other)
+            return NULL;
+    }
+
     data = malloc(sizeof(psfgen_data));
 
-    // Initialize topologies
-    data->defs = topo_defs_create();
+    // Initialize topologies, reading those of another instance if given
+    data->defs = other ? topo_defs_share(other->defs) : topo_defs_create();
 
     // Initialize aliases
-    data->aliases = stringhash_create();
+    data->aliases = extract_alias_create();
     data->mol = topo_mol_create(data->defs);
 
     // Initialize other stuffs
     data->id = 0; // Doesn't matter since data is per class instance
     data->in_use = 0;
-    data->all_caps = 1;
+    data->all_caps = other ? other->all_caps : 1;
+    data->topocache = NULL;
+    data->batch = 0;
 
     /*
      * Handle output file argument.. Default to stdout
@@ -128,14 +173,18 @@ static PyObject* py_del_mol(PyObject *self, PyObject *stateptr)
     psfgen_data *data;
 
     // Unpack molecule capsule
-    data = PyCapsule_GetPointer(stateptr, NULL);
-    if (!data || PyErr_Occurred())
+    data = get_data(stateptr);
+    if (!data)
        return NULL;
 
+    // The output file belongs to Python, but its buffer is ours
+    fflush(data->outstream);
+
     // Invoke cleanup functions
     topo_mol_destroy(data->mol);
     topo_defs_destroy(data->defs);
-    stringhash_destroy(data->aliases);
+    extract_alias_destroy(data->aliases);
+    free(data->topocache);
     free(data);
 
     Py_INCREF(Py_None);
@@ -157,8 +206,8 @@ static PyObject* py_alias(PyObject *self, PyObject *args, PyObject *kwargs)
                                      &newname, &resname)) {
         return NULL;
     }
-    data = PyCapsule_GetPointer(stateptr, NULL);
-    if (!data || PyErr_Occurred())
+    data = get_data(stateptr);
+    if (!data)
         return NULL;
 
     name = strtoupper(name, data->all_caps);
@@ -206,8 +255,8 @@ static PyObject* py_set_allcaps(PyObject *self, PyObject *args, PyObject *kwargs
         return NULL;
     }
 
-    data = PyCapsule_GetPointer(stateptr, NULL);
-    if (!data || PyErr_Occurred())
+    data = get_data(stateptr);
+    if (!data)
         return NULL;
 
     data->all_caps = allcaps ? 1 : 0;
@@ -216,6 +265,134 @@ static PyObject* py_set_allcaps(PyObject *self, PyObject *args, PyObject *kwargs
     return Py_None;
 }
 
+static PyObject* py_set_arena_mode(PyObject *self, PyObject *args,
+                                   PyObject *kwargs)
+{
+    const char *kwnames[] = {"psfstate", "arena", "mmap", "hugepages", "grow",
+                             NULL};
+    PyObject *stateptr;
+    psfgen_data *data;
+    char *arena;
+    int usemmap = 0, hugepages = 0, grow = 0;
+    int mode, rc = 0;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "Os|O&O&O&:set_arena_mode",
+                                     (char**) kwnames, &stateptr, &arena,
+                                     convert_bool, &usemmap,
+                                     convert_bool, &hugepages,
+                                     convert_bool, &grow)) {
+        return NULL;
+    }
+
+    data = get_data(stateptr);
+    if (!data)
+        return NULL;
+
+    mode = (usemmap ? MEMARENA_MMAP : 0) | (hugepages ? MEMARENA_HUGEPAGES : 0)
+         | (grow ? MEMARENA_GROW : 0);
+
+    if (!strcasecmp(arena, "atoms")) {
+        rc = topo_mol_arena_mode(data->mol, TOPO_MOL_ARENA, mode);
+    } else if (!strcasecmp(arena, "angles")) {
+        rc = topo_mol_arena_mode(data->mol, TOPO_MOL_ANGLE_ARENA, mode);
+    } else if (!strcasecmp(arena, "dihedrals")) {
+        rc = topo_mol_arena_mode(data->mol, TOPO_MOL_DIHEDRAL_ARENA, mode);
+    } else if (!strcasecmp(arena, "all")) {
+        rc = topo_mol_arena_mode(data->mol, TOPO_MOL_ALL_ARENAS, mode);
+    } else {
+        PyErr_Format(PyExc_ValueError,
+                     "arena must be [atoms,angles,dihedrals,all], got '%s'",
+                     arena);
+        return NULL;
+    }
+    if (rc) {
+        PyErr_SetString(PyExc_ValueError,
+                        "arena mode not supported on this platform");
+        return NULL;
+    }
+
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
+static PyObject* py_set_atom_index(PyObject *self, PyObject *args,
+                                   PyObject *kwargs)
+{
+    const char *kwnames[] = {"psfstate", "enabled", NULL};
+    PyObject *stateptr;
+    psfgen_data *data;
+    int enabled = 1;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O|O&:set_atom_index",
+                                     (char**) kwnames, &stateptr, convert_bool,
+                                     &enabled)) {
+        return NULL;
+    }
+
+    data = get_data(stateptr);
+    if (!data)
+        return NULL;
+
+    if (topo_mol_atom_index(data->mol, enabled)) {
+        PyErr_NoMemory();
+        return NULL;
+    }
+
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
+static PyObject* py_set_topology_cache(PyObject *self, PyObject *args,
+                                       PyObject *kwargs)
+{
+    const char *kwnames[] = {"psfstate", "directory", NULL};
+    PyObject *stateptr;
+    psfgen_data *data;
+    char *directory = NULL;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O|z:set_topology_cache",
+                                     (char**) kwnames, &stateptr,
+                                     &directory)) {
+        return NULL;
+    }
+
+    data = get_data(stateptr);
+    if (!data)
+        return NULL;
+
+    free(data->topocache);
+    data->topocache = directory ? strdup(directory) : NULL;
+
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
+static PyObject* py_set_lazy_topology(PyObject *self, PyObject *args,
+                                      PyObject *kwargs)
+{
+    const char *kwnames[] = {"psfstate", "enabled", NULL};
+    PyObject *stateptr;
+    psfgen_data *data;
+    int enabled = 1;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O|O&:set_lazy_topology",
+                                     (char**) kwnames, &stateptr, convert_bool,
+                                     &enabled)) {
+        return NULL;
+    }
+
+    data = get_data(stateptr);
+    if (!data)
+        return NULL;
+
+    if (unshare_topology(data))
+        return NULL;
+    topo_defs_lazy(data->defs, enabled);
+
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
 static PyObject* py_regenerate(PyObject *self, PyObject *args, PyObject *kwargs)
 {
     const char *kwnames[] = {"psfstate", "task", NULL};
@@ -229,8 +406,8 @@ static PyObject* py_regenerate(PyObject *self, PyObject *args, PyObject *kwargs)
         return NULL;
     }
 
-    data = PyCapsule_GetPointer(stateptr, NULL);
-    if (!data || PyErr_Occurred())
+    data = get_data(stateptr);
+    if (!data)
         return NULL;
 
     if (!strcasecmp(task, "angles")) {
@@ -272,8 +449,8 @@ static PyObject* py_write_namdbin(PyObject *self, PyObject *args, PyObject *kwar
         return NULL;
     }
 
-    data = PyCapsule_GetPointer(stateptr, NULL);
-    if (!data || PyErr_Occurred())
+    data = get_data(stateptr);
+    if (!data)
         return NULL;
 
     // Open files for writing, with some error checking
@@ -325,8 +502,8 @@ static PyObject* py_write_pdb(PyObject *self, PyObject *args, PyObject *kwargs)
         return NULL;
     }
 
-    data = PyCapsule_GetPointer(stateptr, NULL);
-    if (!data || PyErr_Occurred())
+    data = get_data(stateptr);
+    if (!data)
         return NULL;
 
     fd = fopen(filename, "w");
@@ -361,8 +538,8 @@ static PyObject* py_write_psf(PyObject *self, PyObject *args, PyObject *kwargs)
                                      &type)) {
         return NULL;
     }
-    data = PyCapsule_GetPointer(stateptr, NULL);
-    if (!data || PyErr_Occurred())
+    data = get_data(stateptr);
+    if (!data)
         return NULL;
 
     if (!strcasecmp(type, "charmm")) {
@@ -411,8 +588,12 @@ static PyObject* py_read_psf(PyObject *self, PyObject *args, PyObject *kwargs)
         return NULL;
     }
 
-    data = PyCapsule_GetPointer(stateptr, NULL);
-    if (!data || PyErr_Occurred())
+    data = get_data(stateptr);
+    if (!data)
+        return NULL;
+
+    // The topology file names in the psf are added to the definitions
+    if (unshare_topology(data))
         return NULL;
 
     // Open files as psf_file_extract takes file pointers
@@ -474,8 +655,8 @@ static PyObject* py_read_coords(PyObject *self, PyObject *args, PyObject *kwargs
                                      &segid)) {
         return NULL;
     }
-    data = PyCapsule_GetPointer(stateptr, NULL);
-    if (!data || PyErr_Occurred())
+    data = get_data(stateptr);
+    if (!data)
         return NULL;
 
     fd = fopen(filename, "r");
@@ -504,24 +685,25 @@ static PyObject* py_add_segment(PyObject *self, PyObject *args, PyObject *kwargs
 {
     const char *kwnames[] = {"psfstate", "segid", "pdbfile", "first", "last",
                              "auto_angles", "auto_dihedrals", "residues",
-                             "mutate", NULL};
+                             "mutate", "defer", NULL};
     char *first = NULL, *last = NULL, *filename = NULL;
     PyObject *mutate = NULL, *residues = NULL;
-    int autoang = 1, autodih = 1;
+    int autoang = 1, autodih = 1, defer = 0;
     PyObject *stateptr;
     psfgen_data *data;
     char *segname;
     FILE *fd;
 
-    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "Os|sssO&O&OO:add_segment",
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "Os|sssO&O&OOO&:add_segment",
                                      (char**) kwnames, &stateptr, &segname,
                                      &filename, &first, &last, convert_bool,
                                      &autoang, convert_bool, &autodih,
-                                     &residues, &mutate)) {
+                                     &residues, &mutate, convert_bool,
+                                     &defer)) {
         return NULL;
     }
-    data = PyCapsule_GetPointer(stateptr, NULL);
-    if (!data || PyErr_Occurred()) return NULL;
+    data = get_data(stateptr);
+    if (!data) return NULL;
 
     // Sanity check segment name
     segname = strtoupper(segname, data->all_caps);
@@ -655,6 +837,14 @@ static PyObject* py_add_segment(PyObject *self, PyObject *args, PyObject *kwargs
         }
     }
 
+    // Deferred segments are ended together by end_segments
+    if (defer) {
+        if (topo_mol_end_later(data->mol))
+            return PyErr_NoMemory();
+        Py_INCREF(Py_None);
+        return Py_None;
+    }
+
     // Check result
     if (topo_mol_end(data->mol)) {
         PyErr_Format(PyExc_ValueError, "failed building segment '%s'", segname);
@@ -664,6 +854,37 @@ static PyObject* py_add_segment(PyObject *self, PyObject *args, PyObject *kwargs
     return Py_None;
 }
 
+static PyObject* py_end_segments(PyObject *self, PyObject *args,
+                                 PyObject *kwargs)
+{
+    const char *kwnames[] = {"psfstate", "threads", NULL};
+    PyObject *stateptr;
+    psfgen_data *data;
+    int nthreads = 0;
+    int nfailed;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O|i:end_segments",
+                                     (char**) kwnames, &stateptr, &nthreads)) {
+        return NULL;
+    }
+    data = get_data(stateptr);
+    if (!data) return NULL;
+
+    // Other threads are kept out of data while the lock is dropped
+    data->in_use = 1;
+    Py_BEGIN_ALLOW_THREADS
+    nfailed = topo_mol_end_queued(data->mol, nthreads);
+    Py_END_ALLOW_THREADS
+    data->in_use = 0;
+    if (nfailed) {
+        PyErr_Format(PyExc_ValueError, "failed building %d segment(s)",
+                     nfailed);
+        return NULL;
+    }
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
 static PyObject* py_query_segment(PyObject *self, PyObject *args,
                                   PyObject *kwargs)
 {
@@ -681,8 +902,8 @@ static PyObject* py_query_segment(PyObject *self, PyObject *args,
         return NULL;
     }
 
-    data = PyCapsule_GetPointer(stateptr, NULL);
-    if (!data || PyErr_Occurred())
+    data = get_data(stateptr);
+    if (!data)
         return NULL;
 
     // Ensure task argument is valid
@@ -747,9 +968,9 @@ static PyObject* py_query_segment(PyObject *self, PyObject *args,
     } else if (!strcasecmp(task, "resids")) {
         result = PyList_New(0);
         for (int i = 0; i < hasharray_count(seg->residue_hash); i++) {
-            if (hasharray_index(seg->residue_hash, seg->residue_array[i].resid)
+            if (hasharray_index(seg->residue_hash, topo_mol_seg_residue(seg,i)->resid)
              != HASHARRAY_FAIL) {
-                objid = as_pystring(seg->residue_array[i].resid);
+                objid = as_pystring(topo_mol_seg_residue(seg,i)->resid);
                 if (PyList_Append(result, objid))
                     return NULL;
             }
@@ -769,12 +990,116 @@ static PyObject* py_query_segment(PyObject *self, PyObject *args,
                          "'%s'", resid, segid);
             return NULL;
         }
-        result = as_pystring(seg->residue_array[residx].name);
+        result = as_pystring(topo_mol_seg_residue(seg,residx)->name);
     }
     return result;
 }
 
 /* Module topology functions */
+/* Helpers for turning memory statistics into python dictionaries */
+static int set_dict_long(PyObject *dict, const char *key, long value)
+{
+    PyObject *item;
+    int rc;
+    item = PyLong_FromLong(value);
+    if (!item)
+        return -1;
+    rc = PyDict_SetItemString(dict, key, item);
+    Py_DECREF(item);
+    return rc;
+}
+
+static PyObject* arena_stats_dict(const memarena_stats_t *s)
+{
+    PyObject *result = PyDict_New();
+    if (!result
+     || set_dict_long(result, "requested", s->requested)
+     || set_dict_long(result, "reserved", s->reserved)
+     || set_dict_long(result, "wasted", s->wasted)
+     || set_dict_long(result, "blocks", s->blocks)
+     || set_dict_long(result, "oversize_blocks", s->oversize)) {
+        Py_XDECREF(result);
+        return NULL;
+    }
+    return result;
+}
+
+static PyObject* hash_stats_dict(const hasharray_stats_t *s)
+{
+    PyObject *result, *alos;
+    result = PyDict_New();
+    if (!result
+     || set_dict_long(result, "count", s->count)
+     || set_dict_long(result, "allocated", s->alloc)
+     || set_dict_long(result, "item_bytes", s->itembytes)
+     || set_dict_long(result, "buckets", s->hash.buckets)
+     || set_dict_long(result, "entries", s->hash.entries)
+     || set_dict_long(result, "used_buckets", s->hash.used)
+     || set_dict_long(result, "max_chain", s->hash.maxchain)
+     || set_dict_long(result, "hash_bytes", s->hash.bytes)
+     || set_dict_long(result, "key_bytes", s->keys.reserved)) {
+        Py_XDECREF(result);
+        return NULL;
+    }
+    alos = PyFloat_FromDouble(s->hash.alos);
+    if (!alos || PyDict_SetItemString(result, "alos", alos)) {
+        Py_XDECREF(alos);
+        Py_DECREF(result);
+        return NULL;
+    }
+    Py_DECREF(alos);
+    return result;
+}
+
+static PyObject* memory_stats_dict(topo_mol *mol)
+{
+    topo_mol_memory_t m;
+    PyObject *result, *item;
+    int i;
+    struct { const char *name; PyObject *stats; } entries[11];
+
+    if (topo_mol_memory_stats(mol, &m)) {
+        PyErr_SetString(PyExc_ValueError, "cannot get memory statistics");
+        return NULL;
+    }
+    entries[0].name = "arena";
+    entries[0].stats = arena_stats_dict(&m.arena);
+    entries[1].name = "angle_arena";
+    entries[1].stats = arena_stats_dict(&m.angle_arena);
+    entries[2].name = "dihedral_arena";
+    entries[2].stats = arena_stats_dict(&m.dihedral_arena);
+    entries[3].name = "index_arena";
+    entries[3].stats = arena_stats_dict(&m.index_arena);
+    entries[4].name = "segments";
+    entries[4].stats = hash_stats_dict(&m.segments);
+    entries[5].name = "residues";
+    entries[5].stats = hash_stats_dict(&m.residues);
+    entries[6].name = "topology_arena";
+    entries[6].stats = arena_stats_dict(&m.defs_arena);
+    entries[7].name = "atom_types";
+    entries[7].stats = hash_stats_dict(&m.types);
+    entries[8].name = "residue_definitions";
+    entries[8].stats = hash_stats_dict(&m.resdefs);
+    entries[9].name = "topology_files";
+    entries[9].stats = hash_stats_dict(&m.topofiles);
+    entries[10].name = "velocities";
+    entries[10].stats = arena_stats_dict(&m.velocities);
+
+    result = PyDict_New();
+    for (i = 0; i < 11; i++) {
+        item = entries[i].stats;
+        if (result && (!item || PyDict_SetItemString(result, entries[i].name,
+                                                     item))) {
+            Py_DECREF(result);
+            result = NULL;
+        }
+        Py_XDECREF(item);
+    }
+    if (!result && !PyErr_Occurred())
+        PyErr_SetString(PyExc_ValueError, "cannot get memory statistics");
+    return result;
+}
+
 static PyObject* py_query_system(PyObject *self, PyObject *args, PyObject *kwargs)
 {
     const char *kwnames[] = {"psfstate", "task", NULL};
@@ -788,10 +1113,13 @@ static PyObject* py_query_system(PyObject *self, PyObject *args, PyObject *kwarg
         return NULL;
     }
 
-    data = PyCapsule_GetPointer(stateptr, NULL);
-    if (!data || PyErr_Occurred())
+    data = get_data(stateptr);
+    if (!data)
         return NULL;
 
+    if (!strcasecmp(task, "memory"))
+        return memory_stats_dict(data->mol);
+
     result = PyList_New(0);
     if (!result)
         return NULL;
@@ -839,8 +1167,11 @@ static PyObject* py_parse_topology(PyObject *self, PyObject *args, PyObject *kwa
         return NULL;
     }
 
-    data = PyCapsule_GetPointer(stateptr, NULL);
-    if (!data || PyErr_Occurred())
+    data = get_data(stateptr);
+    if (!data)
+        return NULL;
+
+    if (unshare_topology(data))
         return NULL;
 
     fd = fopen(filename, "r");
@@ -848,9 +1179,15 @@ static PyObject* py_parse_topology(PyObject *self, PyObject *args, PyObject *kwa
         PyErr_Format(PyExc_OSError, "cannot open topology file '%s'", filename);
         return NULL;
     }
-    rc = charmm_parse_topo_defs(data->defs, fd, data->all_caps,
-                                data->outstream, python_msg);
-    fclose(fd);
+    if (data->topocache) {
+        fclose(fd);
+        rc = topo_defs_cache_read(data->defs, data->topocache, filename,
+                                  data->all_caps, data->outstream, python_msg);
+    } else {
+        rc = charmm_parse_topo_defs(data->defs, fd, data->all_caps,
+                                    data->outstream, python_msg);
+        fclose(fd);
+    }
     if (rc) {
         PyErr_Format(PyExc_ValueError, "error parsing topology file '%s'",
                     filename);
@@ -863,6 +1200,78 @@ static PyObject* py_parse_topology(PyObject *self, PyObject *args, PyObject *kwa
     return Py_None;
 }
 
+static PyObject* py_parse_topologies(PyObject *self, PyObject *args,
+                                     PyObject *kwargs)
+{
+    const char *kwnames[] = {"psfstate", "filenames", "threads", NULL};
+    PyObject *stateptr, *filelist;
+    psfgen_data *data = NULL;
+    const char **filenames;
+    int i, nfiles, rc;
+    int nthreads = 0;
+    FILE *fd;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "OO|i:parse_topologies",
+                                     (char**) kwnames, &stateptr, &filelist,
+                                     &nthreads)) {
+        return NULL;
+    }
+
+    data = get_data(stateptr);
+    if (!data)
+        return NULL;
+
+    if (!PyList_Check(filelist)) {
+        PyErr_SetString(PyExc_ValueError, "filenames must be a list!");
+        return NULL;
+    }
+    if (unshare_topology(data))
+        return NULL;
+    nfiles = (int) PyList_Size(filelist);
+    filenames = (const char**) malloc((nfiles + 1) * sizeof(const char*));
+    if (!filenames)
+        return PyErr_NoMemory();
+
+    for (i = 0; i < nfiles; i++) {
+        filenames[i] = as_charptr(PyList_GetItem(filelist, i));
+        if (!filenames[i]) {
+            free(filenames);
+            return NULL;
+        }
+
+        // Report unreadable files by name before reading any of them
+        fd = fopen(filenames[i], "r");
+        if (!fd) {
+            PyErr_Format(PyExc_OSError, "cannot open topology file '%s'",
+                         filenames[i]);
+            free(filenames);
+            return NULL;
+        }
+        fclose(fd);
+    }
+
+    // Other threads are kept out of data while the lock is dropped
+    data->in_use = 1;
+    Py_BEGIN_ALLOW_THREADS
+    rc = topo_defs_cache_read_files(data->defs, data->topocache, nfiles,
+                                    filenames, nthreads, data->all_caps,
+                                    data->outstream, python_msg, NULL);
+    Py_END_ALLOW_THREADS
+    data->in_use = 0;
+    if (rc) {
+        PyErr_Format(PyExc_ValueError, "error parsing topology files");
+        free(filenames);
+        return NULL;
+    }
+
+    for (i = 0; i < nfiles; i++)
+        topo_defs_add_topofile(data->defs, filenames[i]);
+    free(filenames);
+
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
 static PyObject* py_get_patches(PyObject *self, PyObject *args, PyObject *kwargs)
 {
     const char *kwnames[] = {"psfstate", "listall", NULL};
@@ -878,8 +1287,8 @@ static PyObject* py_get_patches(PyObject *self, PyObject *args, PyObject *kwargs
         return NULL;
     }
 
-    data = PyCapsule_GetPointer(stateptr, NULL);
-    if (!data || PyErr_Occurred())
+    data = get_data(stateptr);
+    if (!data)
         return NULL;
 
     result = PyList_New(0);
@@ -930,8 +1339,8 @@ static PyObject* py_patch(PyObject *self, PyObject *args, PyObject *kwargs)
         return NULL;
     }
 
-    data = PyCapsule_GetPointer(stateptr, NULL);
-    if (!data || PyErr_Occurred())
+    data = get_data(stateptr);
+    if (!data)
         return NULL;
 
     if (!(target_seq = PySequence_Fast(targlist, "patch targets must be a list "
@@ -990,7 +1399,8 @@ static PyObject* py_query_atoms(PyObject *self, PyObject *args, PyObject *kwargs
     PyObject *stateptr, *result, *atomresult;
     char *segid, *resid, *task;
     topo_mol_segment_t *seg;
-    topo_mol_atom_t *atoms;
+    topo_mol_residue_t *res;
+    topo_mol_atom_t *atoms, *atom, copy;
     int segidx, residx;
     psfgen_data* data;
 
@@ -1000,9 +1410,16 @@ static PyObject* py_query_atoms(PyObject *self, PyObject *args, PyObject *kwargs
         return NULL;
     }
 
-    data = PyCapsule_GetPointer(stateptr, NULL);
-    if (!data || PyErr_Occurred())
+    data = get_data(stateptr);
+    if (!data)
+        return NULL;
+
+    // Queued segments have no atoms yet
+    if (topo_mol_queued(data->mol)) {
+        PyErr_SetString(PyExc_ValueError,
+                        "segments are queued and must be ended first");
         return NULL;
+    }
 
     // Get segment index from segid
     segidx = hasharray_index(data->mol->segment_hash, segid);
@@ -1020,31 +1437,35 @@ static PyObject* py_query_atoms(PyObject *self, PyObject *args, PyObject *kwargs
         return NULL;
     }
 
-    // Loop through atoms in residue and add names to list
+    // Loop through atoms in residue and add names to list, reading
+    // residues that share their atoms in place
     result = PyList_New(0);
-    atoms = seg->residue_array[residx].atoms;
-    while (atoms) {
+    res = topo_mol_seg_residue(seg,residx);
+    for (atoms = topo_mol_res_list(res); atoms; atoms = atoms->next) {
+        atom = topo_mol_inst_atom(res, atoms, &copy);
         if (!strcasecmp(task, "name")) {
-            atomresult = as_pystring(atoms->name);
+            atomresult = as_pystring(topo_mol_symbol(data->mol, atom->name));
 
         } else if (!strcmp(task, "coordinates")) {
-            atomresult = PyTuple_Pack(3, PyFloat_FromDouble(atoms->x),
-                                      PyFloat_FromDouble(atoms->y),
-                                      PyFloat_FromDouble(atoms->z));
+            atomresult = PyTuple_Pack(3, PyFloat_FromDouble(atom->x),
+                                      PyFloat_FromDouble(atom->y),
+                                      PyFloat_FromDouble(atom->z));
 
         } else if (!strcmp(task, "velocities")) {
-            atomresult = PyTuple_Pack(3, PyFloat_FromDouble(atoms->vx),
-                                      PyFloat_FromDouble(atoms->vy),
-                                      PyFloat_FromDouble(atoms->vz));
+            double vel[3];
+            topo_mol_get_vel(data->mol, atom, vel);
+            atomresult = PyTuple_Pack(3, PyFloat_FromDouble(vel[0]),
+                                      PyFloat_FromDouble(vel[1]),
+                                      PyFloat_FromDouble(vel[2]));
 
         } else if (!strcmp(task, "mass")) {
-            atomresult = PyFloat_FromDouble(atoms->mass);
+            atomresult = PyFloat_FromDouble(atom->mass);
 
         } else if (!strcmp(task, "charge")) {
-            atomresult = PyFloat_FromDouble(atoms->charge);
+            atomresult = PyFloat_FromDouble(atom->charge);
 
         } else if (!strcmp(task, "atomid")) {
-            atomresult = as_pyint(atoms->atomid);
+            atomresult = as_pyint(atom->atomid);
 
         } else {
             PyErr_Format(PyExc_ValueError, "invalid atom task '%s'", task);
@@ -1055,7 +1476,6 @@ static PyObject* py_query_atoms(PyObject *self, PyObject *args, PyObject *kwargs
             PyErr_SetString(PyExc_ValueError, "cannot gather atoms");
             return NULL;
         }
-        atoms = atoms->next;
     }
     return result;
 }
@@ -1075,8 +1495,8 @@ static PyObject* py_delete_atoms(PyObject *self, PyObject *args, PyObject *kwarg
         return NULL;
     }
 
-    data = PyCapsule_GetPointer(stateptr, NULL);
-    if (!data || PyErr_Occurred())
+    data = get_data(stateptr);
+    if (!data)
         return NULL;
 
     // Build target object
@@ -1110,8 +1530,8 @@ static PyObject* py_set_atom_attr(PyObject *self, PyObject *args, PyObject *kwar
         return NULL;
     }
 
-    data = PyCapsule_GetPointer(stateptr, NULL);
-    if (!data || PyErr_Occurred())
+    data = get_data(stateptr);
+    if (!data)
         return NULL;
 
     // Build target object with correct case sensitivity
@@ -1200,8 +1620,8 @@ static PyObject* py_set_coord(PyObject *self, PyObject *args, PyObject *kwargs)
         return NULL;
     }
 
-    data = PyCapsule_GetPointer(stateptr, NULL);
-    if (!data || PyErr_Occurred())
+    data = get_data(stateptr);
+    if (!data)
         return NULL;
 
     // Unpack position tuple to x, y, z
@@ -1236,8 +1656,8 @@ static PyObject* py_guess_coords(PyObject *self, PyObject *stateptr)
     psfgen_data* data;
 
     // Unpack molecule capsule
-    data = PyCapsule_GetPointer(stateptr, NULL);
-    if (!data || PyErr_Occurred())
+    data = get_data(stateptr);
+    if (!data)
        return NULL;
 
     if (topo_mol_guess_xyz(data->mol)) {
@@ -1249,16 +1669,38 @@ static PyObject* py_guess_coords(PyObject *self, PyObject *stateptr)
     return Py_None;
 }
 
+static PyObject* py_compact(PyObject *self, PyObject *stateptr)
+{
+    psfgen_data* data;
+    int count;
+
+    // Unpack molecule capsule
+    data = get_data(stateptr);
+    if (!data)
+       return NULL;
+
+    count = topo_mol_compact(data->mol);
+    if (count < 0) {
+        PyErr_SetString(PyExc_ValueError, "failed to compact structure");
+        return NULL;
+    }
+
+    return as_pyint(count);
+}
+
 /* Method definitions */
 static PyMethodDef methods[] = {
     {"add_segment", (PyCFunction)py_add_segment, METH_VARARGS | METH_KEYWORDS},
     {"alias", (PyCFunction)py_alias, METH_VARARGS | METH_KEYWORDS},
+    {"compact", (PyCFunction)py_compact, METH_O},
     {"del_mol", (PyCFunction)py_del_mol, METH_O},
     {"delete_atoms", (PyCFunction)py_delete_atoms, METH_VARARGS | METH_KEYWORDS},
+    {"end_segments", (PyCFunction)py_end_segments, METH_VARARGS | METH_KEYWORDS},
     {"init_mol", (PyCFunction)py_init_mol, METH_VARARGS | METH_KEYWORDS},
     {"get_patches", (PyCFunction)py_get_patches, METH_VARARGS | METH_KEYWORDS},
     {"guess_coords", (PyCFunction)py_guess_coords, METH_O},
     {"parse_topology", (PyCFunction)py_parse_topology, METH_VARARGS | METH_KEYWORDS},
+    {"parse_topologies", (PyCFunction)py_parse_topologies, METH_VARARGS | METH_KEYWORDS},
     {"patch", (PyCFunction)py_patch, METH_VARARGS | METH_KEYWORDS},
     {"query_system", (PyCFunction)py_query_system, METH_VARARGS | METH_KEYWORDS},
     {"query_segment", (PyCFunction)py_query_segment, METH_VARARGS | METH_KEYWORDS},
@@ -1267,6 +1709,10 @@ static PyMethodDef methods[] = {
     {"read_psf", (PyCFunction)py_read_psf, METH_VARARGS | METH_KEYWORDS},
     {"regenerate", (PyCFunction)py_regenerate, METH_VARARGS | METH_KEYWORDS},
     {"set_allcaps", (PyCFunction)py_set_allcaps, METH_VARARGS | METH_KEYWORDS},
+    {"set_arena_mode", (PyCFunction)py_set_arena_mode, METH_VARARGS | METH_KEYWORDS},
+    {"set_atom_index", (PyCFunction)py_set_atom_index, METH_VARARGS | METH_KEYWORDS},
+    {"set_topology_cache", (PyCFunction)py_set_topology_cache, METH_VARARGS | METH_KEYWORDS},
+    {"set_lazy_topology", (PyCFunction)py_set_lazy_topology, METH_VARARGS | METH_KEYWORDS},
     {"set_coord", (PyCFunction)py_set_coord, METH_VARARGS | METH_KEYWORDS},
     {"set_atom_attr", (PyCFunction)py_set_atom_attr, METH_VARARGS | METH_KEYWORDS},
     {"write_psf", (PyCFunction)py_write_psf, METH_VARARGS | METH_KEYWORDS},
@@ -0,0 +1,108 @@
+
+#include <string.h>
+#include <stdlib.h>
+#include "memarena.h"
+#include "hasharray.h"
+#include "symtab.h"
+
+struct symtab {
+  memarena *namearena;
+  char **namearray;
+  hasharray *ha;
+  symtab *parent;  /* ids below base are names of parent */
+  int base;
+};
+
+symtab * symtab_create(void) {
+  symtab *t;
+  if ( (t = (symtab*) malloc(sizeof(symtab))) ) {
+    if ( ! ( t->namearena = memarena_create() ) ) {
+      free((void*)t);
+      return 0;
+    }
+    t->namearray = 0;
+    t->parent = 0;
+    t->base = 0;
+    if ( ! ( t->ha = hasharray_create((void**)&(t->namearray),sizeof(char*)) ) ) {
+      memarena_destroy(t->namearena);
+      free((void*)t);
+      return 0;
+    }
+  }
+  return t;
+}
+
+symtab * symtab_extend(symtab *parent) {
+  symtab *t;
+  if ( ! parent ) return 0;
+  if ( (t = symtab_create()) ) {
+    t->parent = parent;
+    t->base = symtab_count(parent);
+  }
+  return t;
+}
+
+symtab * symtab_copy(symtab *t) {
+  symtab *c;
+  int i, n;
+  if ( ! t ) return 0;
+  if ( ! ( c = symtab_create() ) ) return 0;
+  n = symtab_count(t);
+  for ( i=0; i<n; ++i ) {
+    if ( symtab_intern(c,symtab_name(t,i)) != i ) {
+      symtab_destroy(c);
+      return 0;
+    }
+  }
+  return c;
+}
+
+void symtab_destroy(symtab *t) {
+  if ( ! t ) return;
+  memarena_destroy(t->namearena);
+  hasharray_destroy(t->ha);
+  free((void*)t);
+}
+
+int symtab_intern(symtab *t, const char *name) {
+  int i;
+  char *s;
+  if ( ! t || ! name ) return SYMTAB_FAIL;
+  if ( t->parent && (i = symtab_lookup(t->parent,name)) != SYMTAB_FAIL ) {
+    return i;
+  }
+  i = hasharray_index(t->ha,name);
+  if ( i != HASHARRAY_FAIL ) return t->base + i;
+  if ( ! ( s = memarena_alloc(t->namearena,strlen(name)+1) ) ) {
+    return SYMTAB_FAIL;
+  }
+  strcpy(s,name);
+  i = hasharray_insert(t->ha,name);
+  if ( i == HASHARRAY_FAIL ) return SYMTAB_FAIL;
+  t->namearray[i] = s;
+  return t->base + i;
+}
+
+int symtab_lookup(symtab *t, const char *name) {
+  int i;
+  if ( ! t || ! name ) return SYMTAB_FAIL;
+  if ( t->parent && (i = symtab_lookup(t->parent,name)) != SYMTAB_FAIL ) {
+    return i;
+  }
+  i = hasharray_index(t->ha,name);
+  if ( i == HASHARRAY_FAIL ) return SYMTAB_FAIL;
+  return t->base + i;
+}
+
+const char * symtab_name(symtab *t, int id) {
+  if ( ! t || id < 0 ) return "";
+  if ( id < t->base ) return symtab_name(t->parent,id);
+  if ( id - t->base >= hasharray_count(t->ha) ) return "";
+  return t->namearray[id - t->base];
+}
+
+int symtab_count(symtab *t) {
+  if ( ! t ) return 0;
+  return t->base + hasharray_count(t->ha);
+}
+
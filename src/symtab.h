@@ -0,0 +1,36 @@
+
+#ifndef SYMTAB_H
+#define SYMTAB_H
+
+/* Interned strings, each distinct string is given a small integer id.
+   Ids are never reused, so equal ids mean equal strings. */
+
+struct symtab;
+typedef struct symtab symtab;
+
+symtab * symtab_create(void);
+void symtab_destroy(symtab *t);
+
+/* A table holding the names of parent, under the same ids, whose new
+   names are numbered after them.  parent must not change while the
+   extension exists, and is only read. */
+symtab * symtab_extend(symtab *parent);
+
+/* A separate table with the same names and ids as t. */
+symtab * symtab_copy(symtab *t);
+
+#define SYMTAB_FAIL -1
+
+/* id of name, adding it if needed */
+int symtab_intern(symtab *t, const char *name);
+
+/* id of name, SYMTAB_FAIL if it was never interned */
+int symtab_lookup(symtab *t, const char *name);
+
+/* the string for id, "" if id is not valid */
+const char * symtab_name(symtab *t, int id);
+
+int symtab_count(symtab *t);
+
+#endif
+
@@ -5,6 +5,7 @@
 #include <ctype.h>
 #include "psfgen.h"
 #include "charmm_parse_topo_defs.h"
+#include "topo_defs_cache.h"
 #include "topo_mol_output.h"
 #include "topo_mol_pluginio.h"
 #include "pdb_file_extract.h"
@@ -109,13 +110,54 @@ int psfgen_test_mol(Tcl_Interp *interp, psfgen_data *data) {
 #define PSFGEN_TEST_MOL(INTERP,DATA) \
   if ( psfgen_test_mol(INTERP,DATA) ) return TCL_ERROR
 
+/* Segments queued in a batch have no atoms until the batch ends, so only
+   segment building commands may run inside one. */
+static int psfgen_test_queue(Tcl_Interp *interp, psfgen_data *data) {
+  if ( topo_mol_queued(data->mol) ) {
+    Tcl_SetResult(interp,"ERROR: only segments may be built inside a batch",
+							TCL_VOLATILE);
+    return -1;
+  }
+  return 0;
+}
+
+#define PSFGEN_TEST_QUEUE(INTERP,DATA) \
+  if ( psfgen_test_queue(INTERP,DATA) ) return TCL_ERROR
+
+/* Copies topology definitions shared with other contexts before they
+   are changed. */
+static int psfgen_unshare_topology(Tcl_Interp *interp, psfgen_data *data) {
+  topo_defs *defs;
+  if ( topo_mol_queued(data->mol) ) {
+    Tcl_SetResult(interp,"ERROR: segments are queued and must be ended first",
+							TCL_VOLATILE);
+    return -1;
+  }
+  defs = topo_mol_unshare_defs(data->mol);
+  if ( ! defs ) {
+    Tcl_SetResult(interp,"ERROR: unable to copy shared topology",TCL_VOLATILE);
+    psfgen_kill_mol(interp,data);
+    return -1;
+  }
+  data->defs = defs;
+  return 0;
+}
+
+/* Announces each of several topology files as its messages begin */
+static void psfgen_reading_msg(void *v, const char *filename) {
+  char msg[2048];
+  sprintf(msg,"reading topology file %.2000s\n",filename);
+  newhandle_msg(v,msg);
+}
+
 /* This function gets called if/when the Tcl interpreter is deleted. */
 static void psfgen_deleteproc(ClientData cd, Tcl_Interp *interp) {
   int *countptr;
   psfgen_data *data = (psfgen_data *)cd;
   topo_mol_destroy(data->mol);
   topo_defs_destroy(data->defs);
-  stringhash_destroy(data->aliases);
+  extract_alias_destroy(data->aliases);
+  free(data->topocache);
   free(data);
   countptr = Tcl_GetAssocData(interp, "Psfgen_count", 0);
   if (countptr) {
@@ -132,7 +174,8 @@ static void count_delete_proc(ClientData data, Tcl_Interp *interp) {
   free(data);
 }
 
-psfgen_data* psfgen_data_create(Tcl_Interp *interp) {
+/* share, if given, is a context whose topology the new one reads */
+psfgen_data* psfgen_data_create(Tcl_Interp *interp, psfgen_data *share) {
   char namebuf[128];
   int *countptr;
   int id;
@@ -147,14 +190,16 @@ psfgen_data* psfgen_data_create(Tcl_Interp *interp) {
   } 
   id = *countptr;
   data = (psfgen_data *)malloc(sizeof(psfgen_data));
-  data->defs = topo_defs_create();
+  data->defs = share ? topo_defs_share(share->defs) : topo_defs_create();
   topo_defs_error_handler(data->defs,interp,newhandle_msg);
-  data->aliases = stringhash_create();
+  data->aliases = extract_alias_create();
   data->mol = topo_mol_create(data->defs);
   topo_mol_error_handler(data->mol,interp,newhandle_msg);
   data->id = id;
   data->in_use = 0;
-  data->all_caps = 1;
+  data->all_caps = share ? share->all_caps : 1;
+  data->topocache = 0;
+  data->batch = 0;
   *countptr = id+1;
   sprintf(namebuf,"Psfgen_%d",id);
   Tcl_SetAssocData(interp,namebuf,psfgen_deleteproc,(ClientData)data);
@@ -164,10 +209,10 @@ psfgen_data* psfgen_data_create(Tcl_Interp *interp) {
 void psfgen_data_reset(Tcl_Interp *interp, psfgen_data *data) {
   topo_mol_destroy(data->mol);
   topo_defs_destroy(data->defs);
-  stringhash_destroy(data->aliases);
+  extract_alias_destroy(data->aliases);
   data->defs = topo_defs_create();
   topo_defs_error_handler(data->defs,interp,newhandle_msg);
-  data->aliases = stringhash_create();
+  data->aliases = extract_alias_create();
   data->mol = topo_mol_create(data->defs);
   topo_mol_error_handler(data->mol,interp,newhandle_msg);
   data->all_caps = 1;
@@ -187,6 +232,7 @@ int tcl_alias(ClientData data, Tcl_Interp *interp, int argc, CONST84 char *argv[
 int tcl_pdb(ClientData data, Tcl_Interp *interp, int argc, CONST84 char *argv[]);
 int tcl_coordpdb(ClientData data, Tcl_Interp *interp, int argc, CONST84 char *argv[]);
 int tcl_guesscoord(ClientData data, Tcl_Interp *interp, int argc, CONST84 char *argv[]);
+int tcl_compact(ClientData data, Tcl_Interp *interp, int argc, CONST84 char *argv[]);
 int tcl_readpsf(ClientData data, Tcl_Interp *interp, int argc, CONST84 char *argv[]);
 int tcl_readplugin(ClientData data, Tcl_Interp *interp, int argc, CONST84 char *argv[]);
 int tcl_writepsf(ClientData data, Tcl_Interp *interp, int argc, CONST84 char *argv[]);
@@ -230,7 +276,7 @@ int Psfgen_Init(Tcl_Interp *interp) {
   data = (psfgen_data **)malloc(sizeof(psfgen_data *));
   Tcl_SetAssocData(interp, (char *)"Psfgen_pointer",
 		psfgen_data_delete_pointer,(ClientData)data);
-  *data = psfgen_data_create(interp);
+  *data = psfgen_data_create(interp,0);
   (*data)->in_use++;
 
   Tcl_CreateCommand(interp,"psfcontext",tcl_psfcontext,
@@ -267,6 +313,8 @@ int Psfgen_Init(Tcl_Interp *interp) {
 	(ClientData)data, (Tcl_CmdDeleteProc*)NULL);
   Tcl_CreateCommand(interp,"guesscoord",tcl_guesscoord,
 	(ClientData)data, (Tcl_CmdDeleteProc*)NULL);
+  Tcl_CreateCommand(interp,"compact",tcl_compact,
+	(ClientData)data, (Tcl_CmdDeleteProc*)NULL);
   Tcl_CreateCommand(interp,"writepsf",tcl_writepsf,
 	(ClientData)data, (Tcl_CmdDeleteProc*)NULL);
   Tcl_CreateCommand(interp,"writepdb",tcl_writepdb,
@@ -330,12 +378,50 @@ int psfgen_static_init(Tcl_Interp *interp) {
     psfcontext reset    (clears all state from current context)
 
     set mycontext [psfcontext create]
+    set shared [psfcontext create share]   (reads current topology)
     psfcontext eval $mycontext { ... }
     psfcontext delete $mycontext
 
-    psfcontext stats    (returns numbers of contexts created and destroyed)
+    psfcontext stats    (returns numbers of contexts created and destroyed,
+                         followed by memory use of the current context)
 */
 
+static void append_stat(Tcl_Interp *interp, Tcl_Obj *list,
+					const char *key, long value) {
+  Tcl_ListObjAppendElement(interp, list, Tcl_NewStringObj(key, -1));
+  Tcl_ListObjAppendElement(interp, list, Tcl_NewLongObj(value));
+}
+
+static void append_arena_stats(Tcl_Interp *interp, Tcl_Obj *list,
+			const char *name, const memarena_stats_t *s) {
+  Tcl_Obj *stats = Tcl_NewListObj(0, NULL);
+  append_stat(interp, stats, "requested", s->requested);
+  append_stat(interp, stats, "reserved", s->reserved);
+  append_stat(interp, stats, "wasted", s->wasted);
+  append_stat(interp, stats, "blocks", s->blocks);
+  append_stat(interp, stats, "oversize_blocks", s->oversize);
+  Tcl_ListObjAppendElement(interp, list, Tcl_NewStringObj(name, -1));
+  Tcl_ListObjAppendElement(interp, list, stats);
+}
+
+static void append_hash_stats(Tcl_Interp *interp, Tcl_Obj *list,
+			const char *name, const hasharray_stats_t *s) {
+  Tcl_Obj *stats = Tcl_NewListObj(0, NULL);
+  append_stat(interp, stats, "count", s->count);
+  append_stat(interp, stats, "allocated", s->alloc);
+  append_stat(interp, stats, "item_bytes", s->itembytes);
+  append_stat(interp, stats, "buckets", s->hash.buckets);
+  append_stat(interp, stats, "entries", s->hash.entries);
+  append_stat(interp, stats, "used_buckets", s->hash.used);
+  append_stat(interp, stats, "max_chain", s->hash.maxchain);
+  append_stat(interp, stats, "hash_bytes", s->hash.bytes);
+  append_stat(interp, stats, "key_bytes", s->keys.reserved);
+  Tcl_ListObjAppendElement(interp, stats, Tcl_NewStringObj("alos", -1));
+  Tcl_ListObjAppendElement(interp, stats, Tcl_NewDoubleObj(s->hash.alos));
+  Tcl_ListObjAppendElement(interp, list, Tcl_NewStringObj(name, -1));
+  Tcl_ListObjAppendElement(interp, list, stats);
+}
+
 int tcl_psfcontext(ClientData data, Tcl_Interp *interp,
 					int argc, CONST84 char *argv[]) {
 
@@ -360,8 +446,27 @@ int tcl_psfcontext(ClientData data, Tcl_Interp *interp,
       nc = countptr[0];
       nd = countptr[1];
     }
-    sprintf(msg,"%d created %d destroyed",countptr[0],countptr[1]);
+    sprintf(msg,"%d created %d destroyed",nc,nd);
     Tcl_SetResult(interp,msg,TCL_VOLATILE);
+    if ( (*cur)->mol ) {
+      /* memory of the current context follows as name {key value ...} */
+      topo_mol_memory_t m;
+      Tcl_Obj *result = Tcl_GetObjResult(interp);
+      result = Tcl_DuplicateObj(result);
+      topo_mol_memory_stats((*cur)->mol, &m);
+      append_arena_stats(interp, result, "arena", &m.arena);
+      append_arena_stats(interp, result, "angle_arena", &m.angle_arena);
+      append_arena_stats(interp, result, "dihedral_arena", &m.dihedral_arena);
+      append_arena_stats(interp, result, "index_arena", &m.index_arena);
+      append_arena_stats(interp, result, "velocities", &m.velocities);
+      append_hash_stats(interp, result, "segments", &m.segments);
+      append_hash_stats(interp, result, "residues", &m.residues);
+      append_arena_stats(interp, result, "topology_arena", &m.defs_arena);
+      append_hash_stats(interp, result, "atom_types", &m.types);
+      append_hash_stats(interp, result, "residue_definitions", &m.resdefs);
+      append_hash_stats(interp, result, "topology_files", &m.topofiles);
+      Tcl_SetObjResult(interp, result);
+    }
     return TCL_OK;
   }
 
@@ -386,9 +491,11 @@ int tcl_psfcontext(ClientData data, Tcl_Interp *interp,
     return TCL_OK;
   }
 
-  if ( argc == 2 && ! strcmp(argv[1],"create") ) {
+  if ( ( argc == 2 || ( argc == 3 && ! strcmp(argv[2],"share") ) )
+				&& ! strcmp(argv[1],"create") ) {
+    /* "create share" reads the topology of the current context */
     char msg[128];
-    psfgen_data *newdata = psfgen_data_create(interp);
+    psfgen_data *newdata = psfgen_data_create(interp,argc == 3 ? *cur : 0);
     sprintf(msg,"%d",newdata->id);
     Tcl_SetResult(interp,msg,TCL_VOLATILE);
     return TCL_OK;
@@ -468,7 +575,7 @@ int tcl_psfcontext(ClientData data, Tcl_Interp *interp,
   }
 
   if (strcmp(argv[1],"new") == 0) {
-    psfgen_data *newdata = psfgen_data_create(interp);
+    psfgen_data *newdata = psfgen_data_create(interp,0);
     (*cur)->in_use--;
     *cur = newdata;
     (*cur)->in_use++;
@@ -558,15 +665,49 @@ int tcl_topology(ClientData data, Tcl_Interp *interp,
       psfgen_kill_mol(interp,psf);
       return TCL_ERROR;
     }
+    if ( psfgen_unshare_topology(interp,psf) ) return TCL_ERROR;
+    defs = psf->defs;
     sprintf(msg,"aliasing residue %s to %s in topology definitions",argv[2],argv[3]);
     newhandle_msg(interp,msg);
     hasharray_reinsert(defs->residue_hash, argv[2], pos);
     return TCL_OK;
   }
+  if ( argc == 3 && !strcasecmp(argv[1], "cache") ) {
+    /* an empty directory turns the cache off */
+    free(psf->topocache);
+    psf->topocache = argv[2][0] ? strdup(argv[2]) : 0;
+    return TCL_OK;
+  }
+  if ( argc == 3 && !strcasecmp(argv[1], "lazy") ) {
+    int lazy;
+    if ( Tcl_GetBoolean(interp,argv[2],&lazy) != TCL_OK ) return TCL_ERROR;
+    if ( psfgen_unshare_topology(interp,psf) ) return TCL_ERROR;
+    topo_defs_lazy(psf->defs,lazy);
+    return TCL_OK;
+  }
   if ( argc > 2 ) {
-    Tcl_SetResult(interp,"too many arguments specified",TCL_VOLATILE);
-    psfgen_kill_mol(interp,psf);
-    return TCL_ERROR;
+    /* several files are parsed at once and added in order */
+    for ( itopo=1; itopo<argc; ++itopo ) {
+      if ( ! ( defs_file = fopen(argv[itopo],"r") ) ) {
+        sprintf(msg,"ERROR: Unable to open topology file %s\n",argv[itopo]);
+        Tcl_SetResult(interp,msg,TCL_VOLATILE);
+        psfgen_kill_mol(interp,psf);
+        return TCL_ERROR;
+      }
+      fclose(defs_file);
+    }
+    if ( psfgen_unshare_topology(interp,psf) ) return TCL_ERROR;
+    if ( topo_defs_cache_read_files(psf->defs,psf->topocache,argc-1,
+		(const char * const *) argv+1,0,psf->all_caps,interp,
+		newhandle_msg,psfgen_reading_msg) ) {
+      Tcl_SetResult(interp,"ERROR: failed reading topology files",
+							TCL_VOLATILE);
+      return TCL_ERROR;
+    }
+    for ( itopo=1; itopo<argc; ++itopo ) {
+      topo_defs_add_topofile(psf->defs, argv[itopo]);
+    }
+    return TCL_OK;
   }
   if (argc == 2 && !strcasecmp(argv[1], "residues") ) {
     psfgen_data *psf = *(psfgen_data **)data;
@@ -610,9 +751,19 @@ int tcl_topology(ClientData data, Tcl_Interp *interp,
   } else {
     sprintf(msg,"reading topology file %s\n",filename);
     newhandle_msg(interp,msg);
-    charmm_parse_topo_defs(psf->defs,defs_file,psf->all_caps,interp,newhandle_msg);
+    if ( psfgen_unshare_topology(interp,psf) ) {
+      fclose(defs_file);
+      return TCL_ERROR;
+    }
+    if ( psf->topocache ) {
+      fclose(defs_file);
+      topo_defs_cache_read(psf->defs,psf->topocache,filename,
+		psf->all_caps,interp,newhandle_msg);
+    } else {
+      charmm_parse_topo_defs(psf->defs,defs_file,psf->all_caps,interp,newhandle_msg);
+      fclose(defs_file);
+    }
     topo_defs_add_topofile(psf->defs, filename);
-    fclose(defs_file);
   }
   return TCL_OK;
 }
@@ -625,6 +776,7 @@ int tcl_readpsf(ClientData data, Tcl_Interp *interp,
   char msg[2048];
   psfgen_data *psf = *(psfgen_data **)data;
   PSFGEN_TEST_MOL(interp,psf);
+  PSFGEN_TEST_QUEUE(interp,psf);
 
   if ( argc == 1 ) {
     Tcl_SetResult(interp,"no psf file specified",TCL_VOLATILE);
@@ -709,6 +861,14 @@ int tcl_readpsf(ClientData data, Tcl_Interp *interp,
     sprintf(msg,"reading velocities from velnamdbin file %s",velnamdbinfilename);
     newhandle_msg(interp,msg);
   }
+  /* topology file names in the psf are added to the definitions */
+  if ( psfgen_unshare_topology(interp,psf) ) {
+    fclose(psf_file);
+    if ( pdb_file ) fclose(pdb_file);
+    if ( namdbin_file ) fclose(namdbin_file);
+    if ( velnamdbin_file ) fclose(velnamdbin_file);
+    return TCL_ERROR;
+  }
   retval = psf_file_extract(psf->mol, psf_file, pdb_file, namdbin_file, velnamdbin_file, interp, newhandle_msg);
   fclose(psf_file);
   if ( pdb_file ) fclose(pdb_file);
@@ -734,6 +894,7 @@ int tcl_readplugin(ClientData data, Tcl_Interp *interp,
   int coordinatesonly=0;
   int residuesonly=0;
   PSFGEN_TEST_MOL(interp,psf);
+  PSFGEN_TEST_QUEUE(interp,psf);
 
   if ( argc < 3 ) {
     Tcl_SetResult(interp,"missing file format and/or input filename",TCL_VOLATILE);
@@ -849,8 +1010,8 @@ int tcl_segment(ClientData data, Tcl_Interp *interp,
       int n = hasharray_count(seg->residue_hash);
       int i;
       for (i=0; i<n; i++) {
-        if (hasharray_index(seg->residue_hash, seg->residue_array[i].resid) != HASHARRAY_FAIL) {
-          Tcl_AppendElement(interp, seg->residue_array[i].resid);
+        if (hasharray_index(seg->residue_hash, topo_mol_seg_residue(seg,i)->resid) != HASHARRAY_FAIL) {
+          Tcl_AppendElement(interp, topo_mol_seg_residue(seg,i)->resid);
         }
       }
       return TCL_OK;
@@ -870,14 +1031,16 @@ int tcl_segment(ClientData data, Tcl_Interp *interp,
             argv[1], "'.", NULL);
         return TCL_ERROR;
       }
-      Tcl_SetResult(interp, seg->residue_array[resindex].name, TCL_VOLATILE);
+      Tcl_SetResult(interp, topo_mol_seg_residue(seg,resindex)->name, TCL_VOLATILE);
       return TCL_OK;
     }
     Tcl_AppendResult(interp, "Invalid segid: ", argv[2], NULL);
     return TCL_ERROR;
   } else if (argc == 4 && !strcasecmp(argv[1], "atoms")) {
     topo_mol *mol = psf->mol;
-    int segindex = (mol ? 
+    int segindex;
+    PSFGEN_TEST_QUEUE(interp,psf);
+    segindex = (mol ? 
         hasharray_index(mol->segment_hash, argv[2]) :
         HASHARRAY_FAIL);
     if (segindex != HASHARRAY_FAIL) {
@@ -889,9 +1052,10 @@ int tcl_segment(ClientData data, Tcl_Interp *interp,
             argv[1], "'.", NULL);
         return TCL_ERROR;
       }
-      atoms = seg->residue_array[resindex].atoms;
+      /* instances are read through their proto, which has the names */
+      atoms = topo_mol_res_list(topo_mol_seg_residue(seg,resindex));
       while (atoms) {
-        Tcl_AppendElement(interp, atoms->name);
+        Tcl_AppendElement(interp, topo_mol_symbol(mol, atoms->name));
         atoms = atoms->next;
       }
       return TCL_OK;
@@ -907,11 +1071,15 @@ int tcl_segment(ClientData data, Tcl_Interp *interp,
              )
             ) {
     topo_mol *mol = psf->mol;
-    int segindex = (mol ? 
+    int segindex;
+    PSFGEN_TEST_QUEUE(interp,psf);
+    segindex = (mol ? 
         hasharray_index(mol->segment_hash, argv[2]) :
         HASHARRAY_FAIL);
     if (segindex != HASHARRAY_FAIL) {
-      topo_mol_atom_t *atoms;
+      topo_mol_atom_t *atoms, copy;
+      topo_mol_residue_t *res;
+      int aname;
       topo_mol_segment_t *seg = mol->segment_array[segindex];
       int resindex = hasharray_index(seg->residue_hash, argv[3]);
       if (resindex == HASHARRAY_FAIL) {
@@ -922,9 +1090,13 @@ int tcl_segment(ClientData data, Tcl_Interp *interp,
       /*
        * XXX Ouch, no hasharray for atom names
        */
-      atoms = seg->residue_array[resindex].atoms;
+      aname = symtab_lookup(mol->symbols, argv[4]);
+      res = topo_mol_seg_residue(seg,resindex);
+      atoms = topo_mol_res_list(res);
       while (atoms) {
-        if (!strcmp(atoms->name, argv[4])) {
+        if (atoms->name == aname) {
+          /* the coordinates and ids of an instance are its own */
+          atoms = topo_mol_inst_atom(res, atoms, &copy);
           if (!strcasecmp(argv[1], "coordinates")) { 
 #if TCL_MINOR_VERSION >= 6
             char buf[512];
@@ -935,12 +1107,15 @@ int tcl_segment(ClientData data, Tcl_Interp *interp,
 #endif
             return TCL_OK;
           } else if (!strcasecmp(argv[1], "velocities")) {
+            double vel[3];
 #if TCL_MINOR_VERSION >= 6
             char buf[512];
-            sprintf(buf, "%f %f %f", atoms->vx, atoms->vy, atoms->vz);
+            topo_mol_get_vel(mol, atoms, vel);
+            sprintf(buf, "%f %f %f", vel[0], vel[1], vel[2]);
             Tcl_AppendResult(interp, buf, NULL);
 #else
-            sprintf(interp->result, "%f %f %f", atoms->vx, atoms->vy, atoms->vz);
+            topo_mol_get_vel(mol, atoms, vel);
+            sprintf(interp->result, "%f %f %f", vel[0], vel[1], vel[2]);
 #endif
             return TCL_OK;
           } else if (!strcasecmp(argv[1], "mass")) {
@@ -982,6 +1157,41 @@ int tcl_segment(ClientData data, Tcl_Interp *interp,
     return TCL_ERROR;
   }
 
+  /*
+   * 'segment batch ?threads? { commands }' builds the segments of the
+   * commands and generates their structures together at the end
+   */
+  if ( ( argc == 3 || argc == 4 ) && ! strcasecmp(argv[1], "batch") ) {
+    int nthreads = 0, rc, nfailed;
+    Tcl_Obj *result;
+    if ( argc == 4 && Tcl_GetInt(interp,argv[2],&nthreads) != TCL_OK )
+      return TCL_ERROR;
+    if ( psf->batch ) {
+      Tcl_SetResult(interp,"segment batches cannot be nested",TCL_VOLATILE);
+      return TCL_ERROR;
+    }
+    psf->batch = 1;
+    rc = Tcl_Eval(interp,argv[argc-1]);
+    psf->batch = 0;
+    if ( ! psf->mol ) return TCL_ERROR;
+    /* the messages below are printed by evaluating puts */
+    result = Tcl_GetObjResult(interp);
+    Tcl_IncrRefCount(result);
+    newhandle_msg_ex(interp, "Info: generating structures...", 1, 0);
+    nfailed = topo_mol_end_queued(psf->mol,nthreads);
+    newhandle_msg_ex(interp, nfailed ? "failed!" : "segments complete.", 0, 1);
+    Tcl_SetObjResult(interp,result);
+    Tcl_DecrRefCount(result);
+    if ( nfailed ) {
+      /* failed segments have been rolled back, the molecule survives */
+      sprintf(msg,"ERROR: failed on end of %d segment(s)",nfailed);
+      if ( rc != TCL_OK ) Tcl_AppendResult(interp,"\n",NULL);
+      Tcl_AppendResult(interp,msg,NULL);
+      return TCL_ERROR;
+    }
+    return rc;
+  }
+
   /*
    * Fall through to segment-building commands
    */
@@ -1019,11 +1229,19 @@ int tcl_segment(ClientData data, Tcl_Interp *interp,
     return TCL_ERROR;
   }
 
+  if ( psf->batch ) {
+    if ( topo_mol_end_later(psf->mol) ) {
+      Tcl_AppendResult(interp,"ERROR: failed on end of segment",NULL);
+      return TCL_ERROR;
+    }
+    return TCL_OK;
+  }
+
   newhandle_msg_ex(interp, "Info: generating structure...", 1, 0);
   if ( topo_mol_end(psf->mol) ) {
+    /* the failed segment has been rolled back, the molecule survives */
     newhandle_msg_ex(interp, "failed!", 0, 1);
     Tcl_AppendResult(interp,"ERROR: failed on end of segment",NULL);
-    psfgen_kill_mol(interp,psf);
     return TCL_ERROR;
   }
   newhandle_msg_ex(interp, "segment complete.", 0, 1);
@@ -1103,6 +1321,7 @@ int tcl_multiply(ClientData data, Tcl_Interp *interp,
   char msg[2048];
   psfgen_data *psf = *(psfgen_data **)data;
   PSFGEN_TEST_MOL(interp,psf);
+  PSFGEN_TEST_QUEUE(interp,psf);
 
   if ( argc<3 || Tcl_GetInt(interp,argv[1],&ncopies) != TCL_OK || ncopies<2 ) {
     Tcl_SetResult(interp,"arguments: ncopies segid?:resid?:atomname? ...",TCL_VOLATILE);
@@ -1155,6 +1374,7 @@ int tcl_coord(ClientData data, Tcl_Interp *interp,
   int rc;
   psfgen_data *psf = *(psfgen_data **)data;
   PSFGEN_TEST_MOL(interp,psf);
+  PSFGEN_TEST_QUEUE(interp,psf);
 
   if ( argc < 5 ) {
     Tcl_SetResult(interp,"arguments: segid resid atomname { x y z }",TCL_VOLATILE);
@@ -1202,6 +1422,7 @@ int tcl_psfset(ClientData data, Tcl_Interp *interp,
   double x, y, z;
 
   PSFGEN_TEST_MOL(interp, psf);
+  PSFGEN_TEST_QUEUE(interp,psf);
 
   /*
     psfset <attribute keyword> <segid> <resid> [<atomname>] <new value>
@@ -1337,6 +1558,7 @@ int tcl_regenerate(ClientData data, Tcl_Interp *interp,
   int i, angles, dihedrals, resids;
   psfgen_data *psf = *(psfgen_data **)data;
   PSFGEN_TEST_MOL(interp,psf);
+  PSFGEN_TEST_QUEUE(interp,psf);
 
   if ( argc < 2 ) {
     Tcl_SetResult(interp,"arguments: ?angles? ?dihedrals? ?resids?",TCL_VOLATILE);
@@ -1491,6 +1713,7 @@ int tcl_coordpdb(ClientData data, Tcl_Interp *interp,
   int rc;
   psfgen_data *psf = *(psfgen_data **)data;
   PSFGEN_TEST_MOL(interp,psf);
+  PSFGEN_TEST_QUEUE(interp,psf);
 
   if ( argc < 2 ) {
     Tcl_SetResult(interp,"arguments: pdbfile ?segid? [namdbin <file>]",TCL_VOLATILE);
@@ -1559,6 +1782,7 @@ int tcl_guesscoord(ClientData data, Tcl_Interp *interp,
 					int argc, CONST84 char *argv[]) {
   psfgen_data *psf = *(psfgen_data **)data;
   PSFGEN_TEST_MOL(interp,psf);
+  PSFGEN_TEST_QUEUE(interp,psf);
   if ( argc > 1 ) {
     Tcl_SetResult(interp,"too many arguments specified",TCL_VOLATILE);
     psfgen_kill_mol(interp,psf);
@@ -1573,6 +1797,28 @@ int tcl_guesscoord(ClientData data, Tcl_Interp *interp,
   return TCL_OK;
 }
 
+int tcl_compact(ClientData data, Tcl_Interp *interp,
+					int argc, CONST84 char *argv[]) {
+  int count;
+  char msg[128];
+  psfgen_data *psf = *(psfgen_data **)data;
+  PSFGEN_TEST_MOL(interp,psf);
+  PSFGEN_TEST_QUEUE(interp,psf);
+  if ( argc > 1 ) {
+    Tcl_SetResult(interp,"too many arguments specified",TCL_VOLATILE);
+    return TCL_ERROR;
+  }
+  count = topo_mol_compact(psf->mol);
+  if ( count < 0 ) {
+    Tcl_AppendResult(interp,"ERROR: failed on compacting structure",NULL);
+    return TCL_ERROR;
+  }
+  sprintf(msg,"reclaimed %d deleted bonds, angles and dihedrals",count);
+  newhandle_msg(interp,msg);
+  Tcl_SetObjResult(interp, Tcl_NewIntObj(count));
+  return TCL_OK;
+}
+
 int tcl_writepsf(ClientData data, Tcl_Interp *interp,
 					int argc, CONST84 char *argv[]) {
   FILE *res_file;
@@ -1581,6 +1827,7 @@ int tcl_writepsf(ClientData data, Tcl_Interp *interp,
   char msg[2048];
   psfgen_data *psf = *(psfgen_data **)data;
   PSFGEN_TEST_MOL(interp,psf);
+  PSFGEN_TEST_QUEUE(interp,psf);
 
   if ( argc == 1 ) {
     Tcl_SetResult(interp,"no psf file specified",TCL_VOLATILE);
@@ -1639,6 +1886,7 @@ int tcl_writepdb(ClientData data, Tcl_Interp *interp,
   char msg[2048];
   psfgen_data *psf = *(psfgen_data **)data;
   PSFGEN_TEST_MOL(interp,psf);
+  PSFGEN_TEST_QUEUE(interp,psf);
 
   if ( argc == 1 ) {
     Tcl_SetResult(interp,"no pdb file specified",TCL_VOLATILE);
@@ -1680,6 +1928,7 @@ int tcl_writenamdbin(ClientData data, Tcl_Interp *interp,
   char msg[2048];
   psfgen_data *psf = *(psfgen_data **)data;
   PSFGEN_TEST_MOL(interp,psf);
+  PSFGEN_TEST_QUEUE(interp,psf);
 
   if ( argc == 1 ) {
     Tcl_SetResult(interp,"no namdbin file specified",TCL_VOLATILE);
@@ -1744,6 +1993,7 @@ int tcl_writeplugin(ClientData data, Tcl_Interp *interp,
   struct image_spec images;
   psfgen_data *psf = *(psfgen_data **)data;
   PSFGEN_TEST_MOL(interp,psf);
+  PSFGEN_TEST_QUEUE(interp,psf);
 
   images.na = 1; images.nb = 1; images.nc = 1;
   images.ax = 0.; images.ay = 0.; images.az = 0.; 
@@ -1915,7 +2165,7 @@ static int tcl_num_patch_targets(psfgen_data *psf, Tcl_Interp *interp,
     return TCL_ERROR;
   }
 
-  resdef = &(defs->residue_array[idef]);
+  resdef = topo_defs_get_residue(defs,idef);
   if (!resdef->patch) {
     Tcl_AppendResult(interp, "Residue '", presname, "' is not  patch.", NULL);
     return TCL_ERROR;
@@ -1965,6 +2215,7 @@ int tcl_patch(ClientData data, Tcl_Interp *interp,
   Tcl_Obj *tcl_result;
   psfgen_data *psf = *(psfgen_data **)data;
   PSFGEN_TEST_MOL(interp,psf);
+  PSFGEN_TEST_QUEUE(interp,psf);
 
   tcl_result = Tcl_NewListObj(0, NULL);
 
@@ -2031,7 +2282,7 @@ int tcl_patch(ClientData data, Tcl_Interp *interp,
   for (j=0; j<argc-2; j++) free(tmp[j]);
   if (rc) {
     Tcl_AppendResult(interp,"ERROR: failed to apply patch",NULL);
-    psfgen_kill_mol(interp,psf);
+    if ( rc == -9 ) psfgen_kill_mol(interp,psf);
     return TCL_ERROR;
   }
 
@@ -2054,6 +2305,7 @@ int tcl_delatom(ClientData data, Tcl_Interp *interp,
   topo_mol_ident_t target;
   psfgen_data *psf = *(psfgen_data **)data;
   PSFGEN_TEST_MOL(interp,psf);
+  PSFGEN_TEST_QUEUE(interp,psf);
 
   if ( argc < 2 ) {
     Tcl_SetResult(interp,"arguments: segid [ resid? [ aname? ]]", TCL_VOLATILE);
@@ -4,6 +4,12 @@
 #include <string.h>
 #include "topo_defs_struct.h"
 
+#if defined(_MSC_VER)
+#include <windows.h>
+#define topo_defs_refs(P,N) (InterlockedExchangeAdd((volatile LONG *)(P),(N))+(N))
+#else
+#define topo_defs_refs(P,N) __sync_add_and_fetch((P),(N))
+#endif
 
 topo_defs * topo_defs_create(void) {
   topo_defs *defs;
@@ -17,6 +23,11 @@ topo_defs * topo_defs_create(void) {
     strcpy(defs->plast,"");
     defs->buildres = 0;
     defs->buildres_no_errors = 0;
+    defs->cache = 0;
+    defs->lazy = 0;
+    defs->sources = 0;
+    defs->frozen = 0;
+    defs->refcount = 1;
     defs->topo_hash = hasharray_create(
 	(void**) &(defs->topo_array), sizeof(topo_defs_topofile_t));
     defs->type_hash = hasharray_create(
@@ -24,8 +35,13 @@ topo_defs * topo_defs_create(void) {
     defs->residue_hash = hasharray_create(
 	(void**) &(defs->residue_array), sizeof(topo_defs_residue_t));
     defs->arena = memarena_create();
+    defs->buildarena = memarena_create();
+    defs->symbols = symtab_create();
+    if ( defs->arena ) memarena_alignment(defs->arena,sizeof(double));
+    if ( defs->buildarena ) memarena_alignment(defs->buildarena,sizeof(double));
     if ( ! defs->type_hash || ! defs->residue_hash ||
-	! defs->arena || ! defs->topo_hash ||
+	! defs->arena || ! defs->buildarena || ! defs->symbols ||
+	! defs->topo_hash ||
 	topo_defs_residue(defs,"NONE",1) ||
 	topo_defs_residue(defs,"None",1) ||
 	topo_defs_residue(defs,"none",1) ) {
@@ -37,73 +53,26 @@ topo_defs * topo_defs_create(void) {
   return defs;
 }
 
+static void topo_defs_release_sources(topo_defs *defs) {
+  topo_defs_source_t *src, *next;
+  for ( src = defs->sources; src; src = next ) {
+    next = src->next;
+    src->release(src->data);
+    free((void*)src);
+  }
+  defs->sources = 0;
+}
+
 void topo_defs_destroy(topo_defs *defs) {
-  int i,n;
-  struct topo_defs_atom_t *a, *a2;
-  struct topo_defs_bond_t *b, *b2;
-  struct topo_defs_angle_t *an, *an2;
-  struct topo_defs_dihedral_t *di, *di2;
-  struct topo_defs_improper_t *im, *im2;
-  struct topo_defs_cmap_t *cm, *cm2;
-  struct topo_defs_exclusion_t *ex, *ex2;
-  struct topo_defs_conformation_t *c, *c2;
-  
   if ( ! defs ) return;
+  if ( topo_defs_refs(&defs->refcount,-1) > 0 ) return;
+  topo_defs_release_sources(defs);
   hasharray_destroy(defs->topo_hash);
   hasharray_destroy(defs->type_hash);
-  n = hasharray_count(defs->residue_hash);
-  for ( i=0; i<n; ++i ) {
-    a = defs->residue_array[i].atoms;
-    while ( a ) {
-      a2 = a->next;
-      free((void*)a);
-      a = a2;
-    }
-    b = defs->residue_array[i].bonds;
-    while ( b ) {
-      b2 = b->next;
-      free((void*)b);
-      b = b2;
-    }
-    an = defs->residue_array[i].angles;
-    while ( an ) {
-      an2 = an->next;
-      free((void*)an);
-      an = an2;
-    }
-    di = defs->residue_array[i].dihedrals;
-    while ( di ) {
-      di2 = di->next;
-      free((void*)di);
-      di = di2;
-    }
-    im = defs->residue_array[i].impropers;
-    while ( im ) {
-      im2 = im->next;
-      free((void*)im);
-      im = im2;
-    }
-    cm = defs->residue_array[i].cmaps;
-    while ( cm ) {
-      cm2 = cm->next;
-      free((void*)cm);
-      cm = cm2;
-    }
-    ex = defs->residue_array[i].exclusions;
-    while ( ex ) {
-      ex2 = ex->next;
-      free((void*)ex);
-      ex = ex2;
-    }
-    c = defs->residue_array[i].conformations;
-    while ( c ) {
-      c2 = c->next;
-      free((void*)c);
-      c = c2;
-    }
-  }
   hasharray_destroy(defs->residue_hash);
   memarena_destroy(defs->arena);
+  memarena_destroy(defs->buildarena);
+  symtab_destroy(defs->symbols);
   free((void*)defs);
 }
 
@@ -122,18 +91,25 @@ void topo_defs_log_error(topo_defs *defs, const char *msg) {
 }
 
 void topo_defs_auto_angles(topo_defs *defs, int autogen) {
-  if ( defs ) defs->auto_angles = ! ! autogen;
+  if ( ! defs || defs->frozen ) return;
+  if ( defs->cache ) topo_defs_cache_setting(defs->cache,
+	TOPO_DEFS_CACHE_AUTO_ANGLES,autogen,0);
+  defs->auto_angles = ! ! autogen;
 }
 
 void topo_defs_auto_dihedrals(topo_defs *defs, int autogen) {
-  if ( defs ) defs->auto_dihedrals = ! ! autogen;
+  if ( ! defs || defs->frozen ) return;
+  if ( defs->cache ) topo_defs_cache_setting(defs->cache,
+	TOPO_DEFS_CACHE_AUTO_DIHEDRALS,autogen,0);
+  defs->auto_dihedrals = ! ! autogen;
 }
 
 int topo_defs_type(topo_defs *defs, const char *atype, const char *element, double mass, int id) {
   int i;
   topo_defs_type_t *newitem;
   char errmsg[64 + NAMEMAXLEN];
-  if ( ! defs ) return -1;
+  if ( ! defs || defs->frozen ) return -1;
+  if ( defs->cache ) topo_defs_cache_type(defs->cache,atype,element,mass,id);
   if ( NAMETOOLONG(atype) ) return -2;
   if ( NAMETOOLONG(element) ) return -3;
   if ( ( i = hasharray_index(defs->type_hash,atype) ) != HASHARRAY_FAIL ) {
@@ -146,18 +122,194 @@ int topo_defs_type(topo_defs *defs, const char *atype, const char *element, doub
     newitem = &defs->type_array[i];
     strcpy(newitem->name,atype);
   }
+  newitem->elementsym = symtab_intern(defs->symbols,element);
+  if ( newitem->elementsym == SYMTAB_FAIL ) return -4;
   newitem->id = id;
   strcpy(newitem->element,element);
   newitem->mass = mass;
   return 0;
 }
 
+/* Copy a list into one contiguous array, keeping its order. */
+static int topo_defs_pack_list(memarena *arena, void **head, int size) {
+  void *item;
+  char *array;
+  int i, n;
+  if ( ! *head ) return 0;
+  for ( n=0, item=*head; item; item=*(void**)item ) ++n;
+  array = (char*) memarena_alloc(arena,n*size);
+  if ( ! array ) return -1;
+  for ( i=0, item=*head; item; item=*(void**)item, ++i ) {
+    memcpy(array+i*size,item,size);
+    *(void**)(array+i*size) = ( i+1 < n ? array+(i+1)*size : 0 );
+  }
+  *head = array;
+  return 0;
+}
+
+static int topo_defs_pack_entries(memarena *arena, topo_defs_residue_t *res) {
+  int rc = 0;
+#define PACK(LIST,TYPE) \
+  rc |= topo_defs_pack_list(arena,(void**)&res->LIST,sizeof(TYPE))
+  PACK(atoms,topo_defs_atom_t);
+  PACK(bonds,topo_defs_bond_t);
+  PACK(angles,topo_defs_angle_t);
+  PACK(dihedrals,topo_defs_dihedral_t);
+  PACK(impropers,topo_defs_improper_t);
+  PACK(cmaps,topo_defs_cmap_t);
+  PACK(exclusions,topo_defs_exclusion_t);
+  PACK(conformations,topo_defs_conformation_t);
+#undef PACK
+  return rc;
+}
+
+int topo_defs_template_slot(const topo_defs_template_t *t, int name) {
+  int i;
+  for ( i = t->natoms - 1; i >= 0 && t->names[i] != name; --i );
+  return i;
+}
+
+static void topo_defs_ref(topo_defs *defs, topo_defs_template_t *t,
+		topo_defs_ref_t *ref, const char *aname, int res, int rel) {
+  ref->rel = rel;
+  ref->name = ( res ? -1 : symtab_lookup(defs->symbols,aname) );
+  ref->slot = -1;
+  if ( ref->name >= 0 && ! rel ) {
+    ref->slot = topo_defs_template_slot(t,ref->name);
+    if ( ref->slot < 0 ) ref->name = -1;
+  }
+  if ( ref->slot < 0 ) t->closed = 0;
+}
+
+/* Allocates N items for PTR from the arena, failing the compile if
+   there is no memory. */
+#define TEMPLATE_ALLOC(PTR,TYPE,N) \
+  if ( (N) > 0 && ! ( PTR = (TYPE *) memarena_alloc(defs->arena, \
+				(N)*sizeof(TYPE)) ) ) return 0
+
+#define TEMPLATE_COUNT(N,LIST) \
+  for ( N = 0, LIST = res->LIST ## s; LIST; LIST = LIST->next ) ++N
+
+static topo_defs_template_t * topo_defs_compile(topo_defs *defs,
+					topo_defs_residue_t *res) {
+  topo_defs_template_t *t;
+  topo_defs_atom_t *atom;
+  topo_defs_bond_t *bond;
+  topo_defs_angle_t *angle;
+  topo_defs_dihedral_t *dihedral;
+  topo_defs_improper_t *improper;
+  topo_defs_cmap_t *cmap;
+  topo_defs_exclusion_t *exclusion;
+  topo_defs_conformation_t *conformation;
+  topo_defs_ref_t *r;
+  int i, n;
+
+  t = (topo_defs_template_t*) memarena_alloc(defs->arena,
+	sizeof(topo_defs_template_t));
+  if ( ! t ) return 0;
+  memset(t,0,sizeof(topo_defs_template_t));
+  t->closed = 1;
+
+  TEMPLATE_COUNT(n,atom);
+  TEMPLATE_ALLOC(t->names,int,n);
+  TEMPLATE_ALLOC(t->types,int,n);
+  for ( i=0, atom = res->atoms; atom; atom = atom->next, ++i ) {
+    t->names[i] = atom->namesym;
+    t->types[i] = hasharray_index(defs->type_hash,atom->type);
+  }
+  t->natoms = n;
+
+  TEMPLATE_COUNT(n,bond);
+  TEMPLATE_ALLOC(t->bonds,topo_defs_ref_t,2*n);
+  t->nbonds = n;
+  for ( r = t->bonds, bond = res->bonds; bond; bond = bond->next, r += 2 ) {
+    topo_defs_ref(defs,t,r,bond->atom1,bond->res1,bond->rel1);
+    topo_defs_ref(defs,t,r+1,bond->atom2,bond->res2,bond->rel2);
+  }
+  TEMPLATE_COUNT(n,angle);
+  TEMPLATE_ALLOC(t->angles,topo_defs_ref_t,3*n);
+  t->nangles = n;
+  for ( r = t->angles, angle = res->angles; angle;
+					angle = angle->next, r += 3 ) {
+    topo_defs_ref(defs,t,r,angle->atom1,angle->res1,angle->rel1);
+    topo_defs_ref(defs,t,r+1,angle->atom2,angle->res2,angle->rel2);
+    topo_defs_ref(defs,t,r+2,angle->atom3,angle->res3,angle->rel3);
+  }
+  TEMPLATE_COUNT(n,dihedral);
+  TEMPLATE_ALLOC(t->dihedrals,topo_defs_ref_t,4*n);
+  t->ndihedrals = n;
+  for ( r = t->dihedrals, dihedral = res->dihedrals; dihedral;
+					dihedral = dihedral->next, r += 4 ) {
+    topo_defs_ref(defs,t,r,dihedral->atom1,dihedral->res1,dihedral->rel1);
+    topo_defs_ref(defs,t,r+1,dihedral->atom2,dihedral->res2,dihedral->rel2);
+    topo_defs_ref(defs,t,r+2,dihedral->atom3,dihedral->res3,dihedral->rel3);
+    topo_defs_ref(defs,t,r+3,dihedral->atom4,dihedral->res4,dihedral->rel4);
+  }
+  TEMPLATE_COUNT(n,improper);
+  TEMPLATE_ALLOC(t->impropers,topo_defs_ref_t,4*n);
+  t->nimpropers = n;
+  for ( r = t->impropers, improper = res->impropers; improper;
+					improper = improper->next, r += 4 ) {
+    topo_defs_ref(defs,t,r,improper->atom1,improper->res1,improper->rel1);
+    topo_defs_ref(defs,t,r+1,improper->atom2,improper->res2,improper->rel2);
+    topo_defs_ref(defs,t,r+2,improper->atom3,improper->res3,improper->rel3);
+    topo_defs_ref(defs,t,r+3,improper->atom4,improper->res4,improper->rel4);
+  }
+  TEMPLATE_COUNT(n,cmap);
+  TEMPLATE_ALLOC(t->cmaps,topo_defs_ref_t,8*n);
+  t->ncmaps = n;
+  for ( r = t->cmaps, cmap = res->cmaps; cmap; cmap = cmap->next, r += 8 ) {
+    for ( i=0; i<8; ++i ) {
+      topo_defs_ref(defs,t,r+i,cmap->atoml[i],cmap->resl[i],cmap->rell[i]);
+    }
+  }
+  TEMPLATE_COUNT(n,exclusion);
+  TEMPLATE_ALLOC(t->exclusions,topo_defs_ref_t,2*n);
+  t->nexclusions = n;
+  for ( r = t->exclusions, exclusion = res->exclusions; exclusion;
+					exclusion = exclusion->next, r += 2 ) {
+    topo_defs_ref(defs,t,r,exclusion->atom1,exclusion->res1,exclusion->rel1);
+    topo_defs_ref(defs,t,r+1,exclusion->atom2,exclusion->res2,exclusion->rel2);
+  }
+  TEMPLATE_COUNT(n,conformation);
+  TEMPLATE_ALLOC(t->conformations,topo_defs_ref_t,4*n);
+  t->nconformations = n;
+  for ( r = t->conformations, conformation = res->conformations;
+		conformation; conformation = conformation->next, r += 4 ) {
+    topo_defs_ref(defs,t,r,conformation->atom1,
+			conformation->res1,conformation->rel1);
+    topo_defs_ref(defs,t,r+1,conformation->atom2,
+			conformation->res2,conformation->rel2);
+    topo_defs_ref(defs,t,r+2,conformation->atom3,
+			conformation->res3,conformation->rel3);
+    topo_defs_ref(defs,t,r+3,conformation->atom4,
+			conformation->res4,conformation->rel4);
+  }
+  return t;
+}
+
+#undef TEMPLATE_ALLOC
+#undef TEMPLATE_COUNT
+
+/* Move the entries of the residue in progress out of the build arena,
+   which is reused once nothing in it is referenced any more, and compile
+   the residue unless it is a patch. */
+static void topo_defs_pack_residue(topo_defs *defs) {
+  topo_defs_residue_t *res = defs->buildres;
+  if ( res && ! topo_defs_pack_entries(defs->arena,res) ) {
+    memarena_clear(defs->buildarena);
+    if ( ! res->patch ) res->compiled = topo_defs_compile(defs,res);
+  }
+  defs->buildres = 0;
+}
+
 int topo_defs_residue(topo_defs *defs, const char *rname, int patch) {
   int i;
   topo_defs_residue_t *newitem;
   char errmsg[64 + NAMEMAXLEN];
-  if ( ! defs ) return -1;
-  defs->buildres = 0;
+  if ( ! defs || defs->frozen ) return -1;
+  if ( defs->cache ) topo_defs_cache_residue(defs->cache,rname,patch);
+  topo_defs_pack_residue(defs);
   defs->buildres_no_errors = 0;
   if ( NAMETOOLONG(rname) ) return -2;
   if ( ( i = hasharray_index(defs->residue_hash,rname) ) != HASHARRAY_FAIL ) {
@@ -179,6 +331,8 @@ int topo_defs_residue(topo_defs *defs, const char *rname, int patch) {
   newitem = &defs->residue_array[i];
   strcpy(newitem->name,rname);
   newitem->patch = patch;
+  newitem->lazy = 0;
+  newitem->compiled = 0;
   newitem->atoms = 0;
   newitem->bonds = 0;
   newitem->angles = 0;
@@ -195,7 +349,8 @@ int topo_defs_residue(topo_defs *defs, const char *rname, int patch) {
 
 int topo_defs_end(topo_defs *defs) {
   if ( ! defs ) return -1;
-  defs->buildres = 0;
+  if ( defs->cache ) topo_defs_cache_end(defs->cache);
+  topo_defs_pack_residue(defs);
   defs->buildres_no_errors = 0;
   return 0;
 }
@@ -205,6 +360,8 @@ int topo_defs_atom(topo_defs *defs, const char *rname, int del,
 	const char *atype, double charge) {
   topo_defs_atom_t *newitem;
   if ( ! defs ) return -1;
+  if ( defs->cache ) topo_defs_cache_atom(defs->cache,del,
+	aname,ares,arel,atype,charge);
   if ( ! defs->buildres ) {
     if ( defs->buildres_no_errors ) return 0;
     topo_defs_log_error(defs,"no residue in progress for atom");
@@ -215,8 +372,13 @@ int topo_defs_atom(topo_defs *defs, const char *rname, int del,
   if ( ares && ! defs->buildres->patch ) return -4;
   if ( arel && ! defs->buildres->patch ) return -4;
   if ( del && ! defs->buildres->patch ) return -5;
-  newitem = (topo_defs_atom_t*) malloc(sizeof(topo_defs_atom_t));
+  newitem = (topo_defs_atom_t*) memarena_alloc(defs->buildarena,
+	sizeof(topo_defs_atom_t));
   if ( ! newitem )  return -6;
+  newitem->namesym = symtab_intern(defs->symbols,aname);
+  newitem->typesym = symtab_intern(defs->symbols,atype);
+  if ( newitem->namesym == SYMTAB_FAIL || newitem->typesym == SYMTAB_FAIL )
+    return -6;
   newitem->res = ares;
   newitem->rel = arel;
   newitem->del = del;
@@ -233,6 +395,8 @@ int topo_defs_bond(topo_defs *defs, const char *rname, int del,
 	const char *a2name, int a2res, int a2rel) {
   topo_defs_bond_t *newitem;
   if ( ! defs ) return -1;
+  if ( defs->cache ) topo_defs_cache_bond(defs->cache,del,
+	a1name,a1res,a1rel,a2name,a2res,a2rel);
   if ( ! defs->buildres ) {
     if ( defs->buildres_no_errors ) return 0;
     topo_defs_log_error(defs,"no residue in progress for bond");
@@ -274,7 +438,8 @@ int topo_defs_bond(topo_defs *defs, const char *rname, int del,
     topo_defs_log_error(defs,errmsg);
     return -8;
   }
-  newitem = (topo_defs_bond_t*) malloc(sizeof(topo_defs_bond_t));
+  newitem = (topo_defs_bond_t*) memarena_alloc(defs->buildarena,
+	sizeof(topo_defs_bond_t));
   if ( ! newitem )  return -5;
   newitem->res1 = a1res;
   newitem->rel1 = a1rel;
@@ -294,6 +459,8 @@ int topo_defs_angle(topo_defs *defs, const char *rname, int del,
 	const char *a3name, int a3res, int a3rel) {
   topo_defs_angle_t *newitem;
   if ( ! defs ) return -1;
+  if ( defs->cache ) topo_defs_cache_angle(defs->cache,del,
+	a1name,a1res,a1rel,a2name,a2res,a2rel,a3name,a3res,a3rel);
   if ( ! defs->buildres ) {
     if ( defs->buildres_no_errors ) return 0;
     topo_defs_log_error(defs,"no residue in progress for angle");
@@ -304,7 +471,8 @@ int topo_defs_angle(topo_defs *defs, const char *rname, int del,
   if ( NAMETOOLONG(a3name) ) return -4;
   if ( del && ! defs->buildres->patch ) return -5;
   if ( ( a1res || a2res || a3res ) && ! defs->buildres->patch ) return -6;
-  newitem = (topo_defs_angle_t*) malloc(sizeof(topo_defs_angle_t));
+  newitem = (topo_defs_angle_t*) memarena_alloc(defs->buildarena,
+	sizeof(topo_defs_angle_t));
   if ( ! newitem )  return -7;
   newitem->res1 = a1res;
   newitem->rel1 = a1rel;
@@ -328,6 +496,9 @@ int topo_defs_dihedral(topo_defs *defs, const char *rname, int del,
 	const char *a4name, int a4res, int a4rel) {
   topo_defs_dihedral_t *newitem;
   if ( ! defs ) return -1;
+  if ( defs->cache ) topo_defs_cache_dihedral(defs->cache,del,0,
+	a1name,a1res,a1rel,a2name,a2res,a2rel,
+	a3name,a3res,a3rel,a4name,a4res,a4rel);
   if ( ! defs->buildres ) {
     if ( defs->buildres_no_errors ) return 0;
     topo_defs_log_error(defs,"no residue in progress for dihedral");
@@ -340,7 +511,8 @@ int topo_defs_dihedral(topo_defs *defs, const char *rname, int del,
   if ( del && ! defs->buildres->patch ) return -6;
   if ( ( a1res || a2res || a3res || a4res ) &&
 			! defs->buildres->patch ) return -7;
-  newitem = (topo_defs_dihedral_t*) malloc(sizeof(topo_defs_dihedral_t));
+  newitem = (topo_defs_dihedral_t*) memarena_alloc(defs->buildarena,
+	sizeof(topo_defs_dihedral_t));
   if ( ! newitem )  return -8;
   newitem->res1 = a1res;
   newitem->rel1 = a1rel;
@@ -367,6 +539,9 @@ int topo_defs_improper(topo_defs *defs, const char *rname, int del,
 	const char *a4name, int a4res, int a4rel) {
   topo_defs_improper_t *newitem;
   if ( ! defs ) return -1;
+  if ( defs->cache ) topo_defs_cache_dihedral(defs->cache,del,1,
+	a1name,a1res,a1rel,a2name,a2res,a2rel,
+	a3name,a3res,a3rel,a4name,a4res,a4rel);
   if ( ! defs->buildres ) {
     if ( defs->buildres_no_errors ) return 0;
     topo_defs_log_error(defs,"no residue in progress for improper");
@@ -379,7 +554,8 @@ int topo_defs_improper(topo_defs *defs, const char *rname, int del,
   if ( del && ! defs->buildres->patch ) return -6;
   if ( ( a1res || a2res || a3res || a4res ) &&
 			! defs->buildres->patch ) return -7;
-  newitem = (topo_defs_improper_t*) malloc(sizeof(topo_defs_improper_t));
+  newitem = (topo_defs_improper_t*) memarena_alloc(defs->buildarena,
+	sizeof(topo_defs_improper_t));
   if ( ! newitem )  return -8;
   newitem->res1 = a1res;
   newitem->rel1 = a1rel;
@@ -404,6 +580,7 @@ int topo_defs_cmap(topo_defs *defs, const char *rname, int del,
   int i;
   topo_defs_cmap_t *newitem;
   if ( ! defs ) return -1;
+  if ( defs->cache ) topo_defs_cache_cmap(defs->cache,del,anamel,aresl,arell);
   if ( ! defs->buildres ) {
     if ( defs->buildres_no_errors ) return 0;
     topo_defs_log_error(defs,"no residue in progress for cmap");
@@ -416,7 +593,8 @@ int topo_defs_cmap(topo_defs *defs, const char *rname, int del,
   if ( ( aresl[0] || aresl[1] || aresl[2] || aresl[3] ||
          aresl[4] || aresl[5] || aresl[6] || aresl[7] ) &&
 			! defs->buildres->patch ) return -11;
-  newitem = (topo_defs_cmap_t*) malloc(sizeof(topo_defs_cmap_t));
+  newitem = (topo_defs_cmap_t*) memarena_alloc(defs->buildarena,
+	sizeof(topo_defs_cmap_t));
   if ( ! newitem )  return -12;
   for ( i=0; i<8; ++i ) {
     newitem->resl[i] = aresl[i];
@@ -438,6 +616,8 @@ int topo_defs_exclusion(topo_defs *defs, const char *rname, int del,
 	const char *a2name, int a2res, int a2rel) {
   topo_defs_exclusion_t *newitem;
   if ( ! defs ) return -1;
+  if ( defs->cache ) topo_defs_cache_exclusion(defs->cache,del,
+	a1name,a1res,a1rel,a2name,a2res,a2rel);
   if ( ! defs->buildres ) {
     if ( defs->buildres_no_errors ) return 0;
     topo_defs_log_error(defs,"no residue in progress for explicit exclusion");
@@ -447,7 +627,8 @@ int topo_defs_exclusion(topo_defs *defs, const char *rname, int del,
   if ( NAMETOOLONG(a2name) ) return -3;
   if ( del && ! defs->buildres->patch ) return -4;
   if ( ( a1res || a2res ) && ! defs->buildres->patch ) return -4;
-  newitem = (topo_defs_exclusion_t*) malloc(sizeof(topo_defs_exclusion_t));
+  newitem = (topo_defs_exclusion_t*) memarena_alloc(defs->buildarena,
+	sizeof(topo_defs_exclusion_t));
   if ( ! newitem )  return -5;
   newitem->res1 = a1res;
   newitem->rel1 = a1rel;
@@ -470,6 +651,10 @@ int topo_defs_conformation(topo_defs *defs, const char *rname, int del,
 	double angle234, double dist34) {
   topo_defs_conformation_t *newitem;
   if ( ! defs ) return -1;
+  if ( defs->cache ) topo_defs_cache_conformation(defs->cache,del,
+	a1name,a1res,a1rel,a2name,a2res,a2rel,
+	a3name,a3res,a3rel,a4name,a4res,a4rel,
+	dist12,angle123,dihedral,improper,angle234,dist34);
   if ( ! defs->buildres ) {
     if ( defs->buildres_no_errors ) return 0;
     topo_defs_log_error(defs,"no residue in progress for conformation");
@@ -482,7 +667,8 @@ int topo_defs_conformation(topo_defs *defs, const char *rname, int del,
   if ( del && ! defs->buildres->patch ) return -6;
   if ( ( a1res || a2res || a3res || a4res ) &&
 			! defs->buildres->patch ) return -7;
-  newitem = (topo_defs_conformation_t*)malloc(sizeof(topo_defs_conformation_t));
+  newitem = (topo_defs_conformation_t*) memarena_alloc(defs->buildarena,
+	sizeof(topo_defs_conformation_t));
   if ( ! newitem )  return -8;
   newitem->res1 = a1res;
   newitem->rel1 = a1rel;
@@ -510,14 +696,18 @@ int topo_defs_conformation(topo_defs *defs, const char *rname, int del,
 
 
 int topo_defs_default_patching_first(topo_defs *defs, const char *pname) {
-  if ( ! defs ) return -1;
+  if ( ! defs || defs->frozen ) return -1;
+  if ( defs->cache ) topo_defs_cache_setting(defs->cache,
+	TOPO_DEFS_CACHE_DEFAULT_FIRST,0,pname);
   if ( NAMETOOLONG(pname) ) return -2;
   strcpy(defs->pfirst,pname);
   return 0;
 }
 
 int topo_defs_default_patching_last(topo_defs *defs, const char *pname) {
-  if ( ! defs ) return -1;
+  if ( ! defs || defs->frozen ) return -1;
+  if ( defs->cache ) topo_defs_cache_setting(defs->cache,
+	TOPO_DEFS_CACHE_DEFAULT_LAST,0,pname);
   if ( NAMETOOLONG(pname) ) return -2;
   strcpy(defs->plast,pname);
   return 0;
@@ -526,6 +716,8 @@ int topo_defs_default_patching_last(topo_defs *defs, const char *pname) {
 int topo_defs_patching_first(topo_defs *defs, const char *rname,
 	const char *pname) {
   if ( ! defs ) return -1;
+  if ( defs->cache ) topo_defs_cache_setting(defs->cache,
+	TOPO_DEFS_CACHE_PATCHING_FIRST,0,pname);
   if ( ! defs->buildres ) {
     if ( defs->buildres_no_errors ) return 0;
     topo_defs_log_error(defs,"no residue in progress for patching");
@@ -540,6 +732,8 @@ int topo_defs_patching_first(topo_defs *defs, const char *rname,
 int topo_defs_patching_last(topo_defs *defs, const char *rname,
 	const char *pname) {
   if ( ! defs ) return -1;
+  if ( defs->cache ) topo_defs_cache_setting(defs->cache,
+	TOPO_DEFS_CACHE_PATCHING_LAST,0,pname);
   if ( ! defs->buildres ) {
     if ( defs->buildres_no_errors ) return 0;
     topo_defs_log_error(defs,"no residue in progress for patching");
@@ -590,7 +784,7 @@ int topo_defs_add_topofile(topo_defs *defs, const char *filename) {
   int i;
   topo_defs_topofile_t *newitem;
   char errmsg[64 + 256];
-  if ( ! defs ) return -1;
+  if ( ! defs || defs->frozen ) return -1;
   if ( strlen(filename)>=256 ) return -2;
   if ( ( i = hasharray_index(defs->topo_hash,filename) ) != HASHARRAY_FAIL ) {
     sprintf(errmsg,"duplicate topology file %s",filename);
@@ -605,3 +799,142 @@ int topo_defs_add_topofile(topo_defs *defs, const char *filename) {
   return 0;
 }
 
+
+void topo_defs_lazy(topo_defs *defs, int lazy) {
+  if ( defs && ! defs->frozen ) defs->lazy = ! ! lazy;
+}
+
+int topo_defs_is_lazy(topo_defs *defs) {
+  return defs ? defs->lazy : 0;
+}
+
+int topo_defs_defer(topo_defs *defs, const char *text, int lineno,
+	int all_caps, topo_defs_loader load) {
+  topo_defs_lazy_t *lazy;
+  if ( ! defs || ! defs->lazy || ! defs->buildres ) return -1;
+  lazy = (topo_defs_lazy_t*) memarena_alloc(defs->arena,
+	sizeof(topo_defs_lazy_t));
+  if ( ! lazy ) return -1;
+  lazy->text = text;
+  lazy->length = 0;
+  lazy->lineno = lineno;
+  lazy->all_caps = all_caps;
+  lazy->load = load;
+  defs->buildres->lazy = lazy;
+  return 0;
+}
+
+void topo_defs_defer_end(topo_defs *defs, const char *end) {
+  if ( defs && defs->buildres && defs->buildres->lazy ) {
+    defs->buildres->lazy->length = end - defs->buildres->lazy->text;
+  }
+}
+
+int topo_defs_add_source(topo_defs *defs, void *data,
+	void (*release)(void *)) {
+  topo_defs_source_t *src;
+  if ( ! defs ) return -1;
+  if ( ! ( src = (topo_defs_source_t*) malloc(sizeof(topo_defs_source_t)) ) )
+    return -2;
+  src->data = data;
+  src->release = release;
+  src->next = defs->sources;
+  defs->sources = src;
+  return 0;
+}
+
+topo_defs_residue_t * topo_defs_get_residue(topo_defs *defs, int i) {
+  topo_defs_residue_t *res = &defs->residue_array[i];
+  topo_defs_lazy_t *lazy = res->lazy;
+  if ( lazy ) {
+    res->lazy = 0;
+    topo_defs_pack_residue(defs);
+    defs->buildres = res;
+    defs->buildres_no_errors = 0;
+    lazy->load(defs,lazy->text,lazy->length,lazy->lineno,lazy->all_caps,
+	defs->newerror_handler_data,defs->newerror_handler);
+    topo_defs_pack_residue(defs);
+  }
+  return res;
+}
+
+void topo_defs_freeze(topo_defs *defs) {
+  int i, n;
+  if ( ! defs || defs->frozen ) return;
+  if ( defs->buildres ) topo_defs_pack_residue(defs);
+  n = hasharray_count(defs->residue_hash);
+  for ( i=0; i<n; ++i ) topo_defs_get_residue(defs,i);
+  topo_defs_release_sources(defs);
+  defs->buildres_no_errors = 0;
+  defs->frozen = 1;
+}
+
+int topo_defs_frozen(topo_defs *defs) {
+  return defs ? defs->frozen : 0;
+}
+
+topo_defs * topo_defs_share(topo_defs *defs) {
+  if ( ! defs ) return 0;
+  topo_defs_freeze(defs);
+  topo_defs_refs(&defs->refcount,1);
+  return defs;
+}
+
+topo_defs * topo_defs_copy(topo_defs *defs) {
+  topo_defs *c;
+  topo_defs_residue_t *res;
+  int i, n, rc;
+  if ( ! defs ) return 0;
+  if ( defs->buildres ) topo_defs_pack_residue(defs);
+  n = hasharray_count(defs->residue_hash);
+  if ( ! defs->frozen ) {
+    for ( i=0; i<n; ++i ) topo_defs_get_residue(defs,i);
+  }
+  if ( ! (c = (topo_defs*) malloc(sizeof(topo_defs))) ) return 0;
+  *c = *defs;
+  c->topo_hash = c->type_hash = c->residue_hash = 0;
+  c->topo_array = 0;
+  c->type_array = 0;
+  c->residue_array = 0;
+  c->buildres = 0;
+  c->buildres_no_errors = 0;
+  c->cache = 0;
+  c->sources = 0;
+  c->frozen = 0;
+  c->refcount = 1;
+  c->topo_hash = hasharray_copy(defs->topo_hash,(void**) &(c->topo_array));
+  c->type_hash = hasharray_copy(defs->type_hash,(void**) &(c->type_array));
+  c->residue_hash = hasharray_copy(defs->residue_hash,
+	(void**) &(c->residue_array));
+  c->arena = memarena_create();
+  c->buildarena = memarena_create();
+  c->symbols = symtab_copy(defs->symbols);
+  if ( c->arena ) memarena_alignment(c->arena,sizeof(double));
+  if ( c->buildarena ) memarena_alignment(c->buildarena,sizeof(double));
+  if ( ! c->topo_hash || ! c->type_hash || ! c->residue_hash ||
+	! c->arena || ! c->buildarena || ! c->symbols ) {
+    topo_defs_destroy(c);
+    return 0;
+  }
+  /* entries are shared with defs until repacked into the new arena */
+  for ( rc=0, i=0; i<n; ++i ) {
+    res = &c->residue_array[i];
+    res->compiled = 0;
+    rc |= topo_defs_pack_entries(c->arena,res);
+    if ( ! rc && ! res->patch ) res->compiled = topo_defs_compile(c,res);
+  }
+  if ( rc ) {
+    topo_defs_destroy(c);
+    return 0;
+  }
+  return c;
+}
+
+topo_defs * topo_defs_unshare(topo_defs *defs) {
+  if ( ! defs ) return 0;
+  if ( topo_defs_refs(&defs->refcount,0) == 1 ) {
+    defs->frozen = 0;
+    return defs;
+  }
+  return topo_defs_copy(defs);
+}
@@ -71,5 +71,40 @@ int topo_defs_patching_last(topo_defs *defs, const char *rname,
 
 int topo_defs_add_topofile(topo_defs *defs, const char *filename);
 
+/* A frozen topo_defs is never changed again, so any number of molecules
+   and threads may read it.  topo_defs_share freezes defs and returns it
+   with a reference added; topo_defs_destroy releases one reference. */
+void topo_defs_freeze(topo_defs *defs);
+int topo_defs_frozen(topo_defs *defs);
+topo_defs * topo_defs_share(topo_defs *defs);
+
+/* A private, unfrozen copy of defs. */
+topo_defs * topo_defs_copy(topo_defs *defs);
+
+/* Unfreezes and returns defs if no one else holds a reference to it,
+   otherwise returns a private copy and leaves defs alone. */
+topo_defs * topo_defs_unshare(topo_defs *defs);
+
+/* Lazy mode: parsers hand over the text of each residue's entries, which
+   load parses into the residue in progress the first time it is used. */
+typedef int (*topo_defs_loader)(topo_defs *defs, const char *text,
+	int length, int lineno, int all_caps, void *v,
+	void (*print_msg)(void *, const char *));
+
+void topo_defs_lazy(topo_defs *defs, int lazy);
+int topo_defs_is_lazy(topo_defs *defs);
+
+/* Defers the entries of the residue in progress, which start at text.
+   Returns -1 if not in lazy mode or no residue is in progress. */
+int topo_defs_defer(topo_defs *defs, const char *text, int lineno,
+	int all_caps, topo_defs_loader load);
+
+/* Ends the deferred text of the residue in progress. */
+void topo_defs_defer_end(topo_defs *defs, const char *end);
+
+/* Keeps data, the text of deferred residues, until defs is destroyed. */
+int topo_defs_add_source(topo_defs *defs, void *data,
+	void (*release)(void *));
+
 #endif
 
@@ -0,0 +1,731 @@
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include "topo_defs_struct.h"
+#include "topo_defs_cache.h"
+#include "charmm_parse_topo_defs.h"
+#include "charmm_file.h"
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#define TOPO_DEFS_CACHE_HAVE_MMAP
+#define TOPO_DEFS_CACHE_HAVE_THREADS
+#define cache_pid() ((unsigned long) getpid())
+#elif defined(_WIN32)
+#include <process.h>
+#define cache_pid() ((unsigned long) _getpid())
+#else
+#define cache_pid() 0UL
+#endif
+
+/* record ops beyond the TOPO_DEFS_CACHE_* settings */
+#define CACHE_OP_TYPE 16
+#define CACHE_OP_RESIDUE 17
+#define CACHE_OP_END 18
+#define CACHE_OP_ATOM 19
+#define CACHE_OP_BOND 20
+#define CACHE_OP_ANGLE 21
+#define CACHE_OP_DIHEDRAL 22
+#define CACHE_OP_IMPROPER 23
+#define CACHE_OP_CMAP 24
+#define CACHE_OP_EXCLUSION 25
+#define CACHE_OP_CONFORMATION 26
+#define CACHE_OP_MESSAGE 27
+
+#define CACHE_NSIZES 10
+
+/* Records are an op and a payload size, followed by the payload padded
+   to a multiple of 8 bytes.  Entry payloads reuse the topo_defs structs
+   with pointers and symbols zeroed, so the file layout is tied to the
+   struct sizes stored in the header. */
+typedef struct cache_rec_t {
+  int op;
+  int size;
+} cache_rec_t;
+
+typedef struct cache_residue_t {
+  char name[NAMEMAXLEN];
+  int patch;
+} cache_residue_t;
+
+typedef struct cache_setting_t {
+  char name[NAMEMAXLEN];
+  int flag;
+} cache_setting_t;
+
+typedef struct cache_header_t {
+  char magic[8];
+  int version;
+  int byteorder;
+  int all_caps;
+  int length;  /* bytes of records following the header */
+  int sizes[CACHE_NSIZES];
+  unsigned int key[2];  /* source file and all_caps */
+  unsigned int sum[2];  /* records */
+} cache_header_t;
+
+static const char cache_magic[8] = "PSFGTOP";
+
+struct topo_defs_cache {
+  char *data;
+  int length, max;
+  int failed;  /* something could not be recorded, do not save */
+  int quiet;  /* record messages without passing them on */
+  void *v;
+  void (*print_msg)(void *, const char *);
+};
+
+#define CACHE_PAD(N) (((N) + 7) & ~7)
+
+typedef unsigned long long cache_hash_t;
+#define CACHE_HASH_INIT 14695981039346656037ULL
+
+static cache_hash_t cache_hash(cache_hash_t h, const void *data, size_t n) {
+  const unsigned char *p = (const unsigned char *) data;
+  while ( n-- ) {
+    h ^= *(p++);
+    h *= 1099511628211ULL;
+  }
+  return h;
+}
+
+static void cache_header_init(cache_header_t *h, int all_caps) {
+  memset(h,0,sizeof(cache_header_t));
+  memcpy(h->magic,cache_magic,8);
+  h->version = TOPO_DEFS_CACHE_VERSION;
+  h->byteorder = 0x01020304;
+  h->all_caps = all_caps;
+  h->sizes[0] = NAMEMAXLEN;
+  h->sizes[1] = sizeof(topo_defs_type_t);
+  h->sizes[2] = sizeof(topo_defs_atom_t);
+  h->sizes[3] = sizeof(topo_defs_bond_t);
+  h->sizes[4] = sizeof(topo_defs_angle_t);
+  h->sizes[5] = sizeof(topo_defs_dihedral_t);
+  h->sizes[6] = sizeof(topo_defs_cmap_t);
+  h->sizes[7] = sizeof(topo_defs_exclusion_t);
+  h->sizes[8] = sizeof(topo_defs_conformation_t);
+  h->sizes[9] = sizeof(cache_setting_t);
+}
+
+static void cache_split(cache_hash_t h, unsigned int *words) {
+  words[0] = (unsigned int) (h >> 32);
+  words[1] = (unsigned int) (h & 0xffffffffUL);
+}
+
+/* Appends a zeroed record and returns its payload. */
+static void * cache_record(topo_defs_cache *c, int op, int size) {
+  cache_rec_t *rec;
+  int need = sizeof(cache_rec_t) + CACHE_PAD(size);
+  if ( c->failed ) return 0;
+  if ( c->length + need > c->max ) {
+    int newmax = c->max ? 2 * c->max : 65536;
+    char *newdata;
+    while ( newmax < c->length + need ) newmax *= 2;
+    newdata = (char*) realloc(c->data,newmax);
+    if ( ! newdata ) {
+      c->failed = 1;
+      return 0;
+    }
+    c->data = newdata;
+    c->max = newmax;
+  }
+  rec = (cache_rec_t*) (c->data + c->length);
+  memset(rec,0,need);
+  rec->op = op;
+  rec->size = size;
+  c->length += need;
+  return rec + 1;
+}
+
+static void cache_name(topo_defs_cache *c, char *dst, const char *src) {
+  if ( ! src ) src = "";
+  if ( NAMETOOLONG(src) ) c->failed = 1;
+  else strcpy(dst,src);
+}
+
+void topo_defs_cache_type(topo_defs_cache *c, const char *atype,
+	const char *element, double mass, int id) {
+  topo_defs_type_t *r;
+  if ( ! ( r = cache_record(c,CACHE_OP_TYPE,sizeof(*r)) ) ) return;
+  cache_name(c,r->name,atype);
+  cache_name(c,r->element,element);
+  r->mass = mass;
+  r->id = id;
+}
+
+void topo_defs_cache_residue(topo_defs_cache *c, const char *rname,
+	int patch) {
+  cache_residue_t *r;
+  if ( ! ( r = cache_record(c,CACHE_OP_RESIDUE,sizeof(*r)) ) ) return;
+  cache_name(c,r->name,rname);
+  r->patch = patch;
+}
+
+void topo_defs_cache_end(topo_defs_cache *c) {
+  cache_record(c,CACHE_OP_END,0);
+}
+
+void topo_defs_cache_atom(topo_defs_cache *c, int del,
+	const char *aname, int ares, int arel,
+	const char *atype, double charge) {
+  topo_defs_atom_t *r;
+  if ( ! ( r = cache_record(c,CACHE_OP_ATOM,sizeof(*r)) ) ) return;
+  cache_name(c,r->name,aname);
+  cache_name(c,r->type,atype);
+  r->res = ares;  r->rel = arel;
+  r->charge = charge;
+  r->del = del;
+}
+
+void topo_defs_cache_bond(topo_defs_cache *c, int del,
+	const char *a1name, int a1res, int a1rel,
+	const char *a2name, int a2res, int a2rel) {
+  topo_defs_bond_t *r;
+  if ( ! ( r = cache_record(c,CACHE_OP_BOND,sizeof(*r)) ) ) return;
+  cache_name(c,r->atom1,a1name);  r->res1 = a1res;  r->rel1 = a1rel;
+  cache_name(c,r->atom2,a2name);  r->res2 = a2res;  r->rel2 = a2rel;
+  r->del = del;
+}
+
+void topo_defs_cache_angle(topo_defs_cache *c, int del,
+	const char *a1name, int a1res, int a1rel,
+	const char *a2name, int a2res, int a2rel,
+	const char *a3name, int a3res, int a3rel) {
+  topo_defs_angle_t *r;
+  if ( ! ( r = cache_record(c,CACHE_OP_ANGLE,sizeof(*r)) ) ) return;
+  cache_name(c,r->atom1,a1name);  r->res1 = a1res;  r->rel1 = a1rel;
+  cache_name(c,r->atom2,a2name);  r->res2 = a2res;  r->rel2 = a2rel;
+  cache_name(c,r->atom3,a3name);  r->res3 = a3res;  r->rel3 = a3rel;
+  r->del = del;
+}
+
+/* dihedrals and impropers share a layout */
+void topo_defs_cache_dihedral(topo_defs_cache *c, int del, int improper,
+	const char *a1name, int a1res, int a1rel,
+	const char *a2name, int a2res, int a2rel,
+	const char *a3name, int a3res, int a3rel,
+	const char *a4name, int a4res, int a4rel) {
+  topo_defs_dihedral_t *r;
+  r = cache_record(c,improper ? CACHE_OP_IMPROPER : CACHE_OP_DIHEDRAL,
+	sizeof(*r));
+  if ( ! r ) return;
+  cache_name(c,r->atom1,a1name);  r->res1 = a1res;  r->rel1 = a1rel;
+  cache_name(c,r->atom2,a2name);  r->res2 = a2res;  r->rel2 = a2rel;
+  cache_name(c,r->atom3,a3name);  r->res3 = a3res;  r->rel3 = a3rel;
+  cache_name(c,r->atom4,a4name);  r->res4 = a4res;  r->rel4 = a4rel;
+  r->del = del;
+}
+
+void topo_defs_cache_cmap(topo_defs_cache *c, int del,
+	const char* const anamel[8], const int aresl[8], const int arell[8]) {
+  topo_defs_cmap_t *r;
+  int i;
+  if ( ! ( r = cache_record(c,CACHE_OP_CMAP,sizeof(*r)) ) ) return;
+  for ( i=0; i<8; ++i ) {
+    cache_name(c,r->atoml[i],anamel[i]);
+    r->resl[i] = aresl[i];
+    r->rell[i] = arell[i];
+  }
+  r->del = del;
+}
+
+void topo_defs_cache_exclusion(topo_defs_cache *c, int del,
+	const char *a1name, int a1res, int a1rel,
+	const char *a2name, int a2res, int a2rel) {
+  topo_defs_exclusion_t *r;
+  if ( ! ( r = cache_record(c,CACHE_OP_EXCLUSION,sizeof(*r)) ) ) return;
+  cache_name(c,r->atom1,a1name);  r->res1 = a1res;  r->rel1 = a1rel;
+  cache_name(c,r->atom2,a2name);  r->res2 = a2res;  r->rel2 = a2rel;
+  r->del = del;
+}
+
+void topo_defs_cache_conformation(topo_defs_cache *c, int del,
+	const char *a1name, int a1res, int a1rel,
+	const char *a2name, int a2res, int a2rel,
+	const char *a3name, int a3res, int a3rel,
+	const char *a4name, int a4res, int a4rel,
+	double dist12, double angle123, double dihedral, int improper,
+	double angle234, double dist34) {
+  topo_defs_conformation_t *r;
+  if ( ! ( r = cache_record(c,CACHE_OP_CONFORMATION,sizeof(*r)) ) ) return;
+  cache_name(c,r->atom1,a1name);  r->res1 = a1res;  r->rel1 = a1rel;
+  cache_name(c,r->atom2,a2name);  r->res2 = a2res;  r->rel2 = a2rel;
+  cache_name(c,r->atom3,a3name);  r->res3 = a3res;  r->rel3 = a3rel;
+  cache_name(c,r->atom4,a4name);  r->res4 = a4res;  r->rel4 = a4rel;
+  r->del = del;
+  r->improper = improper;
+  r->dist12 = dist12;
+  r->angle123 = angle123;
+  r->dihedral = dihedral;
+  r->angle234 = angle234;
+  r->dist34 = dist34;
+}
+
+void topo_defs_cache_setting(topo_defs_cache *c, int op, int flag,
+	const char *pname) {
+  cache_setting_t *r;
+  if ( ! ( r = cache_record(c,op,sizeof(*r)) ) ) return;
+  cache_name(c,r->name,pname);
+  r->flag = flag;
+}
+
+/* Records parser messages and passes them on. */
+static void cache_print_msg(void *v, const char *s) {
+  topo_defs_cache *c = (topo_defs_cache *) v;
+  char *r;
+  int n = strlen(s) + 1;
+  if ( ( r = cache_record(c,CACHE_OP_MESSAGE,n) ) ) memcpy(r,s,n);
+  if ( c->quiet ) return;
+  if ( c->print_msg ) c->print_msg(c->v,s);
+  else printf("%s\n",s);
+}
+
+/* Repeats the recorded calls on defs; the records have been checked. */
+static void cache_replay(topo_defs *defs, const char *data, int length,
+	void *v, void (*print_msg)(void *, const char *)) {
+  const char *end = data + length;
+  while ( data < end ) {
+    const cache_rec_t *rec = (const cache_rec_t *) data;
+    const void *p = rec + 1;
+    data += sizeof(cache_rec_t) + CACHE_PAD(rec->size);
+    switch ( rec->op ) {
+    case CACHE_OP_TYPE: {
+      const topo_defs_type_t *r = p;
+      topo_defs_type(defs,r->name,r->element,r->mass,r->id);
+      } break;
+    case CACHE_OP_RESIDUE: {
+      const cache_residue_t *r = p;
+      topo_defs_residue(defs,r->name,r->patch);
+      } break;
+    case CACHE_OP_END:
+      topo_defs_end(defs);
+      break;
+    case CACHE_OP_ATOM: {
+      const topo_defs_atom_t *r = p;
+      topo_defs_atom(defs,0,r->del,r->name,r->res,r->rel,r->type,r->charge);
+      } break;
+    case CACHE_OP_BOND: {
+      const topo_defs_bond_t *r = p;
+      topo_defs_bond(defs,0,r->del,r->atom1,r->res1,r->rel1,
+	r->atom2,r->res2,r->rel2);
+      } break;
+    case CACHE_OP_ANGLE: {
+      const topo_defs_angle_t *r = p;
+      topo_defs_angle(defs,0,r->del,r->atom1,r->res1,r->rel1,
+	r->atom2,r->res2,r->rel2,r->atom3,r->res3,r->rel3);
+      } break;
+    case CACHE_OP_DIHEDRAL:
+    case CACHE_OP_IMPROPER: {
+      const topo_defs_dihedral_t *r = p;
+      if ( rec->op == CACHE_OP_IMPROPER )
+        topo_defs_improper(defs,0,r->del,r->atom1,r->res1,r->rel1,
+	  r->atom2,r->res2,r->rel2,r->atom3,r->res3,r->rel3,
+	  r->atom4,r->res4,r->rel4);
+      else
+        topo_defs_dihedral(defs,0,r->del,r->atom1,r->res1,r->rel1,
+	  r->atom2,r->res2,r->rel2,r->atom3,r->res3,r->rel3,
+	  r->atom4,r->res4,r->rel4);
+      } break;
+    case CACHE_OP_CMAP: {
+      const topo_defs_cmap_t *r = p;
+      const char *anamel[8];
+      int i;
+      for ( i=0; i<8; ++i ) anamel[i] = r->atoml[i];
+      topo_defs_cmap(defs,0,r->del,anamel,r->resl,r->rell);
+      } break;
+    case CACHE_OP_EXCLUSION: {
+      const topo_defs_exclusion_t *r = p;
+      topo_defs_exclusion(defs,0,r->del,r->atom1,r->res1,r->rel1,
+	r->atom2,r->res2,r->rel2);
+      } break;
+    case CACHE_OP_CONFORMATION: {
+      const topo_defs_conformation_t *r = p;
+      topo_defs_conformation(defs,0,r->del,r->atom1,r->res1,r->rel1,
+	r->atom2,r->res2,r->rel2,r->atom3,r->res3,r->rel3,
+	r->atom4,r->res4,r->rel4,r->dist12,r->angle123,r->dihedral,
+	r->improper,r->angle234,r->dist34);
+      } break;
+    case TOPO_DEFS_CACHE_AUTO_ANGLES:
+      topo_defs_auto_angles(defs,((const cache_setting_t *)p)->flag);
+      break;
+    case TOPO_DEFS_CACHE_AUTO_DIHEDRALS:
+      topo_defs_auto_dihedrals(defs,((const cache_setting_t *)p)->flag);
+      break;
+    case TOPO_DEFS_CACHE_DEFAULT_FIRST:
+      topo_defs_default_patching_first(defs,((const cache_setting_t *)p)->name);
+      break;
+    case TOPO_DEFS_CACHE_DEFAULT_LAST:
+      topo_defs_default_patching_last(defs,((const cache_setting_t *)p)->name);
+      break;
+    case TOPO_DEFS_CACHE_PATCHING_FIRST:
+      topo_defs_patching_first(defs,0,((const cache_setting_t *)p)->name);
+      break;
+    case TOPO_DEFS_CACHE_PATCHING_LAST:
+      topo_defs_patching_last(defs,0,((const cache_setting_t *)p)->name);
+      break;
+    case CACHE_OP_MESSAGE:
+      if ( print_msg ) print_msg(v,(const char *)p);
+      else printf("%s\n",(const char *)p);
+      break;
+    }
+  }
+}
+
+/* Checks that every record has a known op and fits in the data. */
+static int cache_check(const char *data, int length) {
+  int pos = 0;
+  while ( pos < length ) {
+    const cache_rec_t *rec = (const cache_rec_t *) (data + pos);
+    if ( length - pos < (int) sizeof(cache_rec_t) ) return -1;
+    if ( rec->size < 0 || rec->size > length - pos ) return -1;
+    if ( ! ( ( rec->op >= TOPO_DEFS_CACHE_AUTO_ANGLES &&
+               rec->op <= TOPO_DEFS_CACHE_PATCHING_LAST ) ||
+             ( rec->op >= CACHE_OP_TYPE && rec->op <= CACHE_OP_MESSAGE ) ) )
+      return -1;
+    pos += sizeof(cache_rec_t) + CACHE_PAD(rec->size);
+  }
+  return pos == length ? 0 : -1;
+}
+
+/* Maps or reads a whole file; *mapped tells cache_unmap which. */
+static char * cache_map(const char *path, size_t *len, int *mapped) {
+  char *data;
+#ifdef TOPO_DEFS_CACHE_HAVE_MMAP
+  struct stat st;
+  int fd = open(path,O_RDONLY);
+  if ( fd < 0 ) return 0;
+  if ( fstat(fd,&st) || st.st_size < (off_t) sizeof(cache_header_t) ) {
+    close(fd);
+    return 0;
+  }
+  data = (char*) mmap(0,st.st_size,PROT_READ,MAP_PRIVATE,fd,0);
+  close(fd);
+  if ( data == MAP_FAILED ) return 0;
+  *len = st.st_size;
+  *mapped = 1;
+  return data;
+#else
+  FILE *f;
+  long n;
+  if ( ! ( f = fopen(path,"rb") ) ) return 0;
+  if ( fseek(f,0,SEEK_END) || ( n = ftell(f) ) < (long) sizeof(cache_header_t)
+	|| fseek(f,0,SEEK_SET) || ! ( data = (char*) malloc(n) ) ) {
+    fclose(f);
+    return 0;
+  }
+  if ( fread(data,1,n,f) != (size_t) n ) {
+    free(data);
+    fclose(f);
+    return 0;
+  }
+  fclose(f);
+  *len = n;
+  *mapped = 0;
+  return data;
+#endif
+}
+
+static void cache_unmap(char *data, size_t len, int mapped) {
+#ifdef TOPO_DEFS_CACHE_HAVE_MMAP
+  if ( mapped ) {
+    munmap(data,len);
+    return;
+  }
+#endif
+  free(data);
+}
+
+/* Maps the cache file if it matches header, returns 0 if it does not. */
+static char * cache_open(const char *path, const cache_header_t *header,
+	size_t *len, int *mapped) {
+  const cache_header_t *h;
+  unsigned int sum[2];
+  char *data = cache_map(path,len,mapped);
+  if ( ! data ) return 0;
+  h = (const cache_header_t *) data;
+  if ( memcmp(h,header,offsetof(cache_header_t,length)) ||
+       memcmp(h->sizes,header->sizes,sizeof(h->sizes)) ||
+       memcmp(h->key,header->key,sizeof(h->key)) ||
+       h->length < 0 || *len != sizeof(cache_header_t) + h->length ) {
+    cache_unmap(data,*len,*mapped);
+    return 0;
+  }
+  cache_split(cache_hash(CACHE_HASH_INIT,h+1,h->length),sum);
+  if ( memcmp(h->sum,sum,sizeof(sum)) ||
+       cache_check((const char *)(h+1),h->length) ) {
+    cache_unmap(data,*len,*mapped);
+    return 0;
+  }
+  return data;
+}
+
+/* Replays the cache file if it matches header, returns 0 if it did. */
+static int cache_load(topo_defs *defs, const char *path,
+	const cache_header_t *header, void *v,
+	void (*print_msg)(void *, const char *)) {
+  size_t len;
+  int mapped;
+  char *data = cache_open(path,header,&len,&mapped);
+  if ( ! data ) return -1;
+  cache_replay(defs,data + sizeof(cache_header_t),
+	((const cache_header_t *) data)->length,v,print_msg);
+  cache_unmap(data,len,mapped);
+  return 0;
+}
+
+/* Writes under a temporary name and renames, so that concurrent jobs
+   never see a partial file.  The name includes the recorder address for
+   threads of one process.  Failures only cost the cache. */
+static void cache_save(const char *path, cache_header_t *header,
+	const topo_defs_cache *c) {
+  char tmppath[1024];
+  FILE *f;
+  int rc;
+  header->length = c->length;
+  cache_split(cache_hash(CACHE_HASH_INIT,c->data,c->length),header->sum);
+  if ( strlen(path) + 48 > sizeof(tmppath) ) return;
+  sprintf(tmppath,"%s.%lu.%lx.tmp",path,cache_pid(),
+	(unsigned long) (size_t) c);
+  if ( ! ( f = fopen(tmppath,"wb") ) ) return;
+  rc = ( fwrite(header,sizeof(cache_header_t),1,f) != 1 );
+  if ( c->length && fwrite(c->data,c->length,1,f) != 1 ) rc = 1;
+  if ( fclose(f) ) rc = 1;
+  if ( rc || rename(tmppath,path) ) remove(tmppath);
+}
+
+/* Fills in the header and cache file path for the topology file f;
+   returns -1 if there is no usable cache. */
+static int cache_key(FILE *f, const char *cachedir, int all_caps,
+	cache_header_t *header, char *path, int pathlen) {
+  charmm_file *text;
+  const char *data;
+  cache_hash_t key;
+  size_t len;
+  if ( ! cachedir || strlen(cachedir) + 32 > (size_t) pathlen ) return -1;
+  if ( ! ( text = charmm_file_open(f) ) ) {
+    rewind(f);
+    return -1;
+  }
+  data = charmm_file_data(text,&len);
+  key = cache_hash(CACHE_HASH_INIT,data,len);
+  key = cache_hash(key,&all_caps,sizeof(all_caps));
+  charmm_file_close(text);
+  rewind(f);
+  cache_header_init(header,all_caps);
+  cache_split(key,header->key);
+  sprintf(path,"%s/%08x%08x.psftop",cachedir,header->key[0],header->key[1]);
+  return 0;
+}
+
+int topo_defs_cache_read(topo_defs *defs, const char *cachedir,
+	const char *filename, int all_caps, void *v,
+	void (*print_msg)(void *, const char *)) {
+  cache_header_t header;
+  topo_defs_cache c;
+  char path[1024];
+  FILE *f;
+  int rc;
+
+  if ( ! defs ) return -1;
+  if ( ! ( f = fopen(filename,"r") ) ) return -2;
+  /* lazy residues point into the text, which a cache cannot provide */
+  if ( defs->lazy || cache_key(f,cachedir,all_caps,&header,path,sizeof(path)) ) {
+    rc = charmm_parse_topo_defs(defs,f,all_caps,v,print_msg);
+    fclose(f);
+    return rc;
+  }
+
+  if ( ! cache_load(defs,path,&header,v,print_msg) ) {
+    fclose(f);
+    return 0;
+  }
+
+  /* stale or missing, parse the text and record what it does */
+  memset(&c,0,sizeof(c));
+  c.v = v;
+  c.print_msg = print_msg;
+  defs->cache = &c;
+  rc = charmm_parse_topo_defs(defs,f,all_caps,&c,cache_print_msg);
+  defs->cache = 0;
+  fclose(f);
+  if ( ! rc && ! c.failed ) cache_save(path,&header,&c);
+  free(c.data);
+  return rc;
+}
+
+/* One file of topo_defs_cache_read_files.  Its definition calls come
+   from a cache file or from parsing into a private topo_defs. */
+typedef struct cache_job_t {
+  const char *filename;
+  const char *cachedir;
+  int all_caps;
+  int rc;
+  int fallback;  /* not recorded, parse it when applying */
+  topo_defs_cache log;
+  char *map;  /* cache file, records follow its header */
+  size_t maplen;
+  int mapped;
+} cache_job_t;
+
+static void cache_job_run(cache_job_t *job) {
+  cache_header_t header;
+  topo_defs *scratch;
+  char path[1024];
+  int havekey;
+  FILE *f;
+
+  if ( ! ( f = fopen(job->filename,"r") ) ) {
+    job->rc = -2;
+    return;
+  }
+  havekey = ! cache_key(f,job->cachedir,job->all_caps,&header,path,sizeof(path));
+  if ( havekey &&
+       ( job->map = cache_open(path,&header,&job->maplen,&job->mapped) ) ) {
+    fclose(f);
+    return;
+  }
+  if ( ! ( scratch = topo_defs_create() ) ) {
+    job->fallback = 1;
+    fclose(f);
+    return;
+  }
+  job->log.quiet = 1;
+  scratch->cache = &job->log;
+  job->rc = charmm_parse_topo_defs(scratch,f,job->all_caps,
+	&job->log,cache_print_msg);
+  scratch->cache = 0;
+  topo_defs_destroy(scratch);
+  fclose(f);
+  if ( job->rc || job->log.failed ) {
+    job->fallback = 1;
+    return;
+  }
+  if ( havekey ) cache_save(path,&header,&job->log);
+}
+
+#ifdef TOPO_DEFS_CACHE_HAVE_THREADS
+typedef struct cache_worker_t {
+  cache_job_t *jobs;
+  int njobs, first, stride;
+} cache_worker_t;
+
+static void * cache_worker(void *arg) {
+  cache_worker_t *w = (cache_worker_t *) arg;
+  int i;
+  for ( i = w->first; i < w->njobs; i += w->stride ) cache_job_run(&w->jobs[i]);
+  return 0;
+}
+#endif
+
+/* Runs the jobs on up to nthreads threads, returns when all are done. */
+static void cache_run_jobs(cache_job_t *jobs, int njobs, int nthreads) {
+#ifdef TOPO_DEFS_CACHE_HAVE_THREADS
+  pthread_t *threads;
+  cache_worker_t *workers;
+  int i, started;
+  if ( nthreads <= 0 ) {
+    long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    nthreads = ncpu > 0 ? (int) ncpu : 1;
+  }
+  if ( nthreads > njobs ) nthreads = njobs;
+  threads = (pthread_t *) malloc(nthreads * sizeof(pthread_t));
+  workers = (cache_worker_t *) malloc(nthreads * sizeof(cache_worker_t));
+  if ( nthreads > 1 && threads && workers ) {
+    for ( i=0; i<nthreads; ++i ) {
+      workers[i].jobs = jobs;
+      workers[i].njobs = njobs;
+      workers[i].first = i;
+      workers[i].stride = nthreads;
+    }
+    /* thread 0 is this one; a worker that fails to start runs here */
+    for ( started=1; started<nthreads; ++started ) {
+      if ( pthread_create(&threads[started],0,cache_worker,&workers[started]) )
+        break;
+    }
+    for ( i=started; i<nthreads; ++i ) cache_worker(&workers[i]);
+    cache_worker(&workers[0]);
+    for ( i=1; i<started; ++i ) pthread_join(threads[i],0);
+    free(threads);
+    free(workers);
+    return;
+  }
+  free(threads);
+  free(workers);
+#endif
+  for ( ; njobs; --njobs, ++jobs ) cache_job_run(jobs);
+}
+
+/* Lazy parsing only scans each file, so it is done in order here. */
+static int read_files_lazy(topo_defs *defs, int nfiles,
+	const char * const *filenames, int all_caps, void *v,
+	void (*print_msg)(void *, const char *),
+	void (*print_file)(void *, const char *)) {
+  FILE *f;
+  int i, rc;
+
+  for ( i=0; i<nfiles; ++i ) {
+    if ( ! ( f = fopen(filenames[i],"r") ) ) return -2;
+    fclose(f);
+  }
+  rc = 0;
+  for ( i=0; i<nfiles && ! rc; ++i ) {
+    if ( ! ( f = fopen(filenames[i],"r") ) ) return -2;
+    if ( print_file ) print_file(v,filenames[i]);
+    rc = charmm_parse_topo_defs(defs,f,all_caps,v,print_msg);
+    fclose(f);
+  }
+  return rc;
+}
+
+int topo_defs_cache_read_files(topo_defs *defs, const char *cachedir,
+	int nfiles, const char * const *filenames, int nthreads,
+	int all_caps, void *v, void (*print_msg)(void *, const char *),
+	void (*print_file)(void *, const char *)) {
+  cache_job_t *jobs;
+  int i, rc;
+
+  if ( ! defs ) return -1;
+  if ( nfiles <= 0 ) return 0;
+  if ( defs->lazy ) return read_files_lazy(defs,nfiles,filenames,
+	all_caps,v,print_msg,print_file);
+  if ( ! ( jobs = (cache_job_t *) calloc(nfiles,sizeof(cache_job_t)) ) )
+    return -3;
+  for ( i=0; i<nfiles; ++i ) {
+    jobs[i].filename = filenames[i];
+    jobs[i].cachedir = cachedir;
+    jobs[i].all_caps = all_caps;
+  }
+  cache_run_jobs(jobs,nfiles,nthreads);
+
+  /* apply in order, as if the files had been read one by one */
+  rc = 0;
+  for ( i=0; i<nfiles; ++i ) {
+    if ( jobs[i].rc == -2 ) rc = -2;
+  }
+  for ( i=0; i<nfiles; ++i ) {
+    cache_job_t *job = &jobs[i];
+    if ( ! rc ) {
+      if ( print_file ) print_file(v,job->filename);
+      if ( job->map ) {
+        cache_replay(defs,job->map + sizeof(cache_header_t),
+		((const cache_header_t *) job->map)->length,v,print_msg);
+      } else if ( job->fallback ) {
+        job->rc = topo_defs_cache_read(defs,0,job->filename,all_caps,
+		v,print_msg);
+        if ( job->rc ) rc = job->rc;
+      } else {
+        cache_replay(defs,job->log.data,job->log.length,v,print_msg);
+      }
+    }
+    if ( job->map ) cache_unmap(job->map,job->maplen,job->mapped);
+    free(job->log.data);
+  }
+  free(jobs);
+  return rc;
+}
@@ -0,0 +1,84 @@
+
+#ifndef TOPO_DEFS_CACHE_H
+#define TOPO_DEFS_CACHE_H
+
+#include "topo_defs.h"
+
+/*
+ Binary cache of parsed topology files.  A cache file holds the
+ definition calls and messages that parsing one topology file produced,
+ keyed by a hash of the file contents and the all_caps setting, and is
+ replayed in place of the text parser.  Stale, damaged or foreign cache
+ files are ignored and rewritten from a fresh parse.
+*/
+
+#define TOPO_DEFS_CACHE_VERSION 1
+
+struct topo_defs_cache;
+typedef struct topo_defs_cache topo_defs_cache;
+
+/* Parses filename into defs like charmm_parse_topo_defs, using cache
+   files in cachedir.  Returns -2 if filename cannot be read. */
+int topo_defs_cache_read(topo_defs *defs, const char *cachedir,
+	const char *filename, int all_caps, void *v,
+	void (*print_msg)(void *, const char *));
+
+/* Reads several topology files with the same result, messages included,
+   as calling topo_defs_cache_read on each in turn.  The files are parsed
+   into private topo_defs on up to nthreads threads (all processors if
+   nthreads is 0) and their definitions applied to defs in order.
+   cachedir may be NULL.  If print_file is not NULL it is given each
+   file name just before the messages of that file.  Returns -2 without
+   changing defs if a file cannot be read. */
+int topo_defs_cache_read_files(topo_defs *defs, const char *cachedir,
+	int nfiles, const char * const *filenames, int nthreads,
+	int all_caps, void *v, void (*print_msg)(void *, const char *),
+	void (*print_file)(void *, const char *));
+
+/* Recording hooks, called by the topo_defs functions while defs->cache
+   is set. */
+void topo_defs_cache_type(topo_defs_cache *c, const char *atype,
+	const char *element, double mass, int id);
+void topo_defs_cache_residue(topo_defs_cache *c, const char *rname,
+	int patch);
+void topo_defs_cache_end(topo_defs_cache *c);
+void topo_defs_cache_atom(topo_defs_cache *c, int del,
+	const char *aname, int ares, int arel,
+	const char *atype, double charge);
+void topo_defs_cache_bond(topo_defs_cache *c, int del,
+	const char *a1name, int a1res, int a1rel,
+	const char *a2name, int a2res, int a2rel);
+void topo_defs_cache_angle(topo_defs_cache *c, int del,
+	const char *a1name, int a1res, int a1rel,
+	const char *a2name, int a2res, int a2rel,
+	const char *a3name, int a3res, int a3rel);
+void topo_defs_cache_dihedral(topo_defs_cache *c, int del, int improper,
+	const char *a1name, int a1res, int a1rel,
+	const char *a2name, int a2res, int a2rel,
+	const char *a3name, int a3res, int a3rel,
+	const char *a4name, int a4res, int a4rel);
+void topo_defs_cache_cmap(topo_defs_cache *c, int del,
+	const char* const anamel[8], const int aresl[8], const int arell[8]);
+void topo_defs_cache_exclusion(topo_defs_cache *c, int del,
+	const char *a1name, int a1res, int a1rel,
+	const char *a2name, int a2res, int a2rel);
+void topo_defs_cache_conformation(topo_defs_cache *c, int del,
+	const char *a1name, int a1res, int a1rel,
+	const char *a2name, int a2res, int a2rel,
+	const char *a3name, int a3res, int a3rel,
+	const char *a4name, int a4res, int a4rel,
+	double dist12, double angle123, double dihedral, int improper,
+	double angle234, double dist34);
+void topo_defs_cache_setting(topo_defs_cache *c, int op, int flag,
+	const char *pname);
+
+/* ops for topo_defs_cache_setting */
+#define TOPO_DEFS_CACHE_AUTO_ANGLES 1
+#define TOPO_DEFS_CACHE_AUTO_DIHEDRALS 2
+#define TOPO_DEFS_CACHE_DEFAULT_FIRST 3
+#define TOPO_DEFS_CACHE_DEFAULT_LAST 4
+#define TOPO_DEFS_CACHE_PATCHING_FIRST 5
+#define TOPO_DEFS_CACHE_PATCHING_LAST 6
+
+#endif
+
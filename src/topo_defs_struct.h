@@ -4,7 +4,9 @@
 
 #include "memarena.h"
 #include "hasharray.h"
+#include "symtab.h"
 #include "topo_defs.h"
+#include "topo_defs_cache.h"
 
 #define NAMEMAXLEN 10
 #define NAMETOOLONG(X) ( strlen(X) >= NAMEMAXLEN )
@@ -14,12 +16,17 @@ typedef struct topo_defs_type_t {
   char element[NAMEMAXLEN];
   int id;
   double mass;
+  int elementsym;
 } topo_defs_type_t;
 
+/* The entry types below must keep next as their first member, finished
+   residues store each list as a contiguous array linked in order. */
+
 typedef struct topo_defs_atom_t {
   struct topo_defs_atom_t *next;
   char name[NAMEMAXLEN];
   char type[NAMEMAXLEN];
+  int namesym, typesym;  /* name and type in defs->symbols */
   double charge;
   int res, rel;
   int del;
@@ -102,9 +109,56 @@ typedef struct topo_defs_conformation_t {
   double dist12, angle123, dihedral, angle234, dist34;
 } topo_defs_conformation_t;
 
+/* Entries of a residue that have not been parsed yet. */
+typedef struct topo_defs_lazy_t {
+  const char *text;  /* in a topology file kept in defs->sources */
+  int length;
+  int lineno;  /* of the line before text */
+  int all_caps;
+  topo_defs_loader load;
+} topo_defs_lazy_t;
+
+typedef struct topo_defs_source_t {
+  struct topo_defs_source_t *next;
+  void *data;
+  void (*release)(void *);
+} topo_defs_source_t;
+
+/* An atom of an entry in a compiled residue.  Atoms of the residue
+   itself are given by slot, their place in the atom list; those of
+   neighbours only by name.  name is -1 if the atom can only be found
+   the slow way, e.g. because it is not in the residue. */
+typedef struct topo_defs_ref_t {
+  int rel;
+  int name;  /* symbol */
+  int slot;  /* -1 if rel is not 0 */
+} topo_defs_ref_t;
+
+/* A residue compiled for building molecules: the name and type of each
+   atom slot, and the atoms of each entry, 2 per bond and exclusion, 3
+   per angle, 4 per dihedral, improper and conformation and 8 per cmap,
+   in list order. */
+typedef struct topo_defs_template_t {
+  int natoms;
+  int nbonds, nangles, ndihedrals, nimpropers, ncmaps;
+  int nexclusions, nconformations;
+  int closed;  /* every entry is between atoms of the residue */
+  int *names;  /* symbols */
+  int *types;  /* index in type_array, -1 if unknown when compiled */
+  topo_defs_ref_t *bonds;
+  topo_defs_ref_t *angles;
+  topo_defs_ref_t *dihedrals;
+  topo_defs_ref_t *impropers;
+  topo_defs_ref_t *cmaps;
+  topo_defs_ref_t *exclusions;
+  topo_defs_ref_t *conformations;
+} topo_defs_template_t;
+
 typedef struct topo_defs_residue_t {
   char name[NAMEMAXLEN];
   int patch;
+  topo_defs_lazy_t *lazy;  /* entries are parsed on first use if set */
+  topo_defs_template_t *compiled;  /* 0 for patches */
   topo_defs_atom_t *atoms;
   topo_defs_bond_t *bonds;
   topo_defs_angle_t *angles;
@@ -142,7 +196,26 @@ struct topo_defs {
   topo_defs_residue_t *buildres;
   int buildres_no_errors;
   memarena *arena;
+  memarena *buildarena;  /* entries of the residue in progress */
+
+  /* atom, type and element names of definitions and molecules */
+  symtab *symbols;
+
+  topo_defs_cache *cache;  /* records definition calls while set */
+
+  int lazy;  /* defer residue entries until first use */
+  topo_defs_source_t *sources;  /* text of deferred residues */
+  int frozen;  /* read only, see topo_defs_freeze */
+  int refcount;
 };
 
+/* The residue definition at index i, parsing its entries if they were
+   deferred.  Use this rather than residue_array when reading entries. */
+topo_defs_residue_t * topo_defs_get_residue(topo_defs *defs, int i);
+
+/* The slot of the last atom named name, which is the one found first in
+   a residue built from t, or -1. */
+int topo_defs_template_slot(const topo_defs_template_t *t, int name);
+
 #endif
 
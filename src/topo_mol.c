@@ -1,5 +1,6 @@
 //
 #include <math.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -11,6 +12,12 @@
 #define strncasecmp strnicmp
 #endif
 
+#if defined(__unix__) || defined(__APPLE__)
+#include <unistd.h>
+#include <pthread.h>
+#define TOPO_MOL_HAVE_THREADS
+#endif
+
 topo_mol * topo_mol_create(topo_defs *defs) {
   topo_mol *mol;
   if ( ! defs ) return 0;
@@ -18,19 +25,42 @@ topo_mol * topo_mol_create(topo_defs *defs) {
     mol->newerror_handler_data = 0;
     mol->newerror_handler = 0;
     mol->defs = defs;
+    mol->symbols = defs->symbols;
     mol->npatch = 0;
     mol->patches = 0;
     mol->curpatch = 0;
     mol->segment_hash = hasharray_create(
 	(void**) &(mol->segment_array), sizeof(topo_mol_segment_t*));
     mol->buildseg = 0;
+    mol->nqueued = 0;
+    mol->maxqueued = 0;
+    mol->queued = 0;
+    mol->job = 0;
     mol->arena = memarena_create();
     mol->angle_arena = memarena_create();
     mol->dihedral_arena = memarena_create();
-    if ( ! mol->segment_hash || ! mol->arena ) {
+    mol->index_arena = memarena_create();
+    mol->atom_edits = 1;
+    mol->atom_index_on = 0;
+    mol->atom_index_stamp = 0;
+    memset(&(mol->atom_index),0,sizeof(hash_t));
+    mol->atom_index_atoms = 0;
+    mol->atom_index_res = 0;
+    mol->atom_index_keys = 0;
+    mol->deleted_atoms = 0;
+    mol->bond_free = 0;
+    mol->angle_free = 0;
+    mol->dihedral_free = 0;
+    mol->poplog = 0;
+    mol->pool = 0;
+    mol->nserial = 0;
+    mol->nvelblocks = 0;
+    mol->velblocks = 0;
+    if ( ! mol->segment_hash || ! mol->arena || ! mol->index_arena ) {
       topo_mol_destroy(mol);
       return 0;
     }
+    memarena_alignment(mol->index_arena,sizeof(void*));
   }
   return mol;
 }
@@ -48,12 +78,58 @@ void topo_mol_destroy(topo_mol *mol) {
     hasharray_destroy(s->residue_hash);
   }
   hasharray_destroy(mol->segment_hash);
+  free((void*)mol->queued);
   memarena_destroy(mol->arena);
   memarena_destroy(mol->angle_arena);
   memarena_destroy(mol->dihedral_arena);
+  memarena_destroy(mol->index_arena);
+  topo_mol_atom_index(mol,0);
+  for ( i=0; i<mol->nvelblocks; ++i ) free((void*)mol->velblocks[i]);
+  free((void*)mol->velblocks);
+  if ( mol->symbols != mol->defs->symbols ) symtab_destroy(mol->symbols);
   free((void*)mol);
 }
 
+int topo_mol_intern(topo_mol *mol, const char *name) {
+  symtab *t;
+  /* frozen definitions are shared, new names go in a private extension */
+  if ( mol->symbols == mol->defs->symbols && topo_defs_frozen(mol->defs) ) {
+    if ( ! ( t = symtab_extend(mol->defs->symbols) ) ) return SYMTAB_FAIL;
+    mol->symbols = t;
+  }
+  return symtab_intern(mol->symbols,name);
+}
+
+static int topo_mol_queue_busy(topo_mol *mol);
+
+topo_defs * topo_mol_unshare_defs(topo_mol *mol) {
+  topo_defs *defs;
+  int i, n;
+  if ( ! mol || topo_mol_queue_busy(mol) ) return 0;
+  if ( ! topo_defs_frozen(mol->defs) ) return mol->defs;
+  if ( ! ( defs = topo_defs_unshare(mol->defs) ) ) return 0;
+  /* a sole owner gets the definitions back in place, still printing
+     through whichever context set their handler last */
+  topo_defs_error_handler(defs,mol->newerror_handler_data,
+			mol->newerror_handler);
+  /* names added by the molecule keep their ids */
+  n = symtab_count(mol->symbols);
+  for ( i = symtab_count(defs->symbols); i < n; ++i ) {
+    if ( symtab_intern(defs->symbols,symtab_name(mol->symbols,i)) != i ) {
+      if ( defs == mol->defs ) topo_defs_freeze(defs);
+      else topo_defs_destroy(defs);
+      return 0;
+    }
+  }
+  if ( mol->symbols != mol->defs->symbols ) symtab_destroy(mol->symbols);
+  mol->symbols = defs->symbols;
+  if ( defs != mol->defs ) {
+    topo_defs_destroy(mol->defs);
+    mol->defs = defs;
+  }
+  return defs;
+}
+
 void topo_mol_error_handler(topo_mol *mol, void *v, void (*print_msg)(void *,const char *)) {
   if ( mol ) {
     mol->newerror_handler = print_msg;
@@ -61,12 +137,37 @@ void topo_mol_error_handler(topo_mol *mol, void *v, void (*print_msg)(void *,con
   }
 }
 
+static void topo_mol_job_msg(struct topo_mol_job_t *job, int out,
+						const char *text);
+
 /* internal method */
 static void topo_mol_log_error(topo_mol *mol, const char *msg) {
-  if (mol && msg && mol->newerror_handler)
+  if ( mol && msg && mol->job ) topo_mol_job_msg(mol->job,0,msg);
+  else if (mol && msg && mol->newerror_handler)
     mol->newerror_handler(mol->newerror_handler_data, msg);
 }
 
+/* Queued segments have no atoms until topo_mol_end_queued, so anything
+   but building more segments has to wait for it. */
+static int topo_mol_queue_busy(topo_mol *mol) {
+  char errmsg[96];
+  if ( ! mol->nqueued ) return 0;
+  sprintf(errmsg,"%d segments are queued and must be ended first",
+							mol->nqueued);
+  topo_mol_log_error(mol,errmsg);
+  return 1;
+}
+
+int topo_mol_queued(topo_mol *mol) {
+  return mol ? mol->nqueued : 0;
+}
+
+/* text for stdout, held back like messages while ending queued segments */
+static void topo_mol_print(topo_mol *mol, const char *text) {
+  if ( mol->job ) topo_mol_job_msg(mol->job,1,text);
+  else printf("%s",text);
+}
+
 static topo_mol_segment_t * topo_mol_get_seg(topo_mol *mol,
 			const topo_mol_ident_t *target) {
   int iseg;
@@ -99,7 +200,7 @@ static topo_mol_residue_t * topo_mol_get_res(topo_mol *mol,
     return 0;
   }
   if ( (ires+irel) < 0 || (ires+irel) >= nres ) {
-    res = seg->residue_array + ires;
+    res = topo_mol_seg_residue(seg,ires);
     if ( irel < 0 )
       sprintf(errmsg,"no residue %d before %s:%s of segment %s",
 		-1*irel,res->name,res->resid,target->segid);
@@ -110,7 +211,210 @@ static topo_mol_residue_t * topo_mol_get_res(topo_mol *mol,
     return 0;
   }
 
-  return (seg->residue_array + ires + irel);
+  return topo_mol_seg_residue(seg,ires + irel);
+}
+
+static int topo_mol_atom_key_cmp(const void *a, const void *b) {
+  const topo_mol_atom_key_t *ka = (const topo_mol_atom_key_t *) a;
+  const topo_mol_atom_key_t *kb = (const topo_mol_atom_key_t *) b;
+  if ( ka->name != kb->name ) return ( ka->name < kb->name ? -1 : 1 );
+  return ( ka->order < kb->order ? -1 : ka->order > kb->order );
+}
+
+/* Rebuild the atom name index of a residue; small residues and
+   residues whose index cannot be allocated are left with nindex 0. */
+static void topo_mol_index_res(topo_mol *mol, topo_mol_residue_t *res) {
+  topo_mol_atom_t *atom;
+  topo_mol_atom_key_t *key;
+  int n;
+  res->indexstamp = mol->atom_edits;
+  res->nindex = 0;
+  for ( n = 0, atom = res->atoms; atom; atom = atom->next ) ++n;
+  if ( n < TOPO_MOL_INDEX_MIN ) return;
+  if ( n > res->maxindex ) {
+    key = memarena_alloc(mol->index_arena,n*sizeof(topo_mol_atom_key_t));
+    if ( ! key ) return;
+    res->index = key;
+    res->maxindex = n;
+  }
+  for ( n = 0, atom = res->atoms; atom; atom = atom->next, ++n ) {
+    res->index[n].name = atom->name;
+    res->index[n].order = n;
+    res->index[n].atom = atom;
+  }
+  qsort(res->index,n,sizeof(topo_mol_atom_key_t),topo_mol_atom_key_cmp);
+  res->nindex = n;
+}
+
+/* first atom of the residue named sym */
+static topo_mol_atom_t *topo_mol_find_res_atom(topo_mol *mol,
+    topo_mol_residue_t *res, int sym) {
+  topo_mol_atom_t *atom;
+  topo_mol_atom_key_t *key;
+  int lo, hi, mid;
+  if ( res->inst ) topo_mol_res_atoms(mol,res);
+  if ( res->indexstamp != mol->atom_edits ) topo_mol_index_res(mol,res);
+  if ( ! res->nindex ) {
+    for ( atom = res->atoms; atom; atom = atom->next ) {
+      if ( atom->name == sym ) break;
+    }
+    return atom;
+  }
+  key = res->index;
+  lo = 0;  hi = res->nindex;
+  while ( lo < hi ) {
+    mid = ( lo + hi ) / 2;
+    if ( key[mid].name < sym ) lo = mid + 1;
+    else hi = mid;
+  }
+  if ( lo < res->nindex && key[lo].name == sym ) return key[lo].atom;
+  return 0;
+}
+
+static topo_mol_atom_t *topo_mol_get_atom_from_res(topo_mol *mol,
+    topo_mol_residue_t *res, const char *aname) {
+  int sym;
+  sym = symtab_lookup(mol->symbols,aname);
+  if ( sym == SYMTAB_FAIL ) return 0;
+  return topo_mol_find_res_atom(mol,res,sym);
+}
+
+/* atom index key: segid, resid and atom name separated by \001;
+   returns the key size or -1 if a name is too long to exist */
+static int topo_mol_atom_index_key(char *key, const char *segid,
+    const char *resid, const char *aname) {
+  int ls, lr, la;
+  ls = strlen(segid);  lr = strlen(resid);  la = strlen(aname);
+  if ( ls >= NAMEMAXLEN || lr >= NAMEMAXLEN || la >= NAMEMAXLEN ) return -1;
+  memcpy(key,segid,ls);
+  key[ls] = '\001';
+  memcpy(key+ls+1,resid,lr);
+  key[ls+1+lr] = '\001';
+  memcpy(key+ls+lr+2,aname,la+1);
+  return ls+lr+la+3;
+}
+
+/* index every live atom; the first of several equal names wins.
+   Instances are indexed by the atoms of their proto, which keeps them
+   from being expanded. */
+static int topo_mol_build_atom_index(topo_mol *mol) {
+  int iseg, nseg, ires, nres, natoms, n, len;
+  topo_mol_segment_t *seg;
+  topo_mol_residue_t *res, **resv;
+  topo_mol_atom_t *atom, **atoms;
+  char key[3*NAMEMAXLEN], *k;
+
+  hash_destroy(&(mol->atom_index));
+  memarena_clear(mol->atom_index_keys);
+  nseg = hasharray_count(mol->segment_hash);
+  natoms = 0;
+  for ( iseg=0; iseg<nseg; ++iseg ) {
+    if ( ! (seg = mol->segment_array[iseg]) ) continue;
+    nres = hasharray_count(seg->residue_hash);
+    for ( ires=0; ires<nres; ++ires ) {
+      res = topo_mol_seg_residue(seg,ires);
+      if ( res->inst ) natoms += res->inst->proto->natoms;
+      for ( atom = res->atoms; atom; atom = atom->next ) ++natoms;
+    }
+  }
+  atoms = (topo_mol_atom_t **) realloc(mol->atom_index_atoms,
+                                (natoms+1)*sizeof(topo_mol_atom_t*));
+  if ( ! atoms ) return -1;
+  mol->atom_index_atoms = atoms;
+  resv = (topo_mol_residue_t **) realloc(mol->atom_index_res,
+                                (natoms+1)*sizeof(topo_mol_residue_t*));
+  if ( ! resv ) return -1;
+  mol->atom_index_res = resv;
+  hash_init(&(mol->atom_index),2*natoms+2);
+  if ( ! mol->atom_index.slot ) return -1;
+
+  n = 0;
+  for ( iseg=0; iseg<nseg; ++iseg ) {
+    if ( ! (seg = mol->segment_array[iseg]) ) continue;
+    nres = hasharray_count(seg->residue_hash);
+    for ( ires=0; ires<nres; ++ires ) {
+      res = topo_mol_seg_residue(seg,ires);
+      atom = ( res->inst ? res->inst->proto->atoms : res->atoms );
+      if ( ! atom ) continue;
+      if ( hasharray_index(seg->residue_hash,res->resid) != ires ) continue;
+      for ( ; atom; atom = atom->next ) {
+        len = topo_mol_atom_index_key(key,seg->segid,res->resid,
+                                      topo_mol_symbol(mol,atom->name));
+        if ( len < 0 ) continue;
+        if ( ! (k = memarena_alloc(mol->atom_index_keys,len)) ) {
+          hash_destroy(&(mol->atom_index));
+          return -1;
+        }
+        memcpy(k,key,len);
+        if ( hash_insert(&(mol->atom_index),k,n) == HASH_FAIL ) {
+          resv[n] = ( res->inst ? res : 0 );
+          atoms[n++] = atom;
+        }
+      }
+    }
+  }
+  mol->atom_index_stamp = mol->atom_edits;
+  return 0;
+}
+
+int topo_mol_atom_index(topo_mol *mol, int enable) {
+  if ( ! mol ) return -1;
+  if ( enable ) {
+    if ( ! mol->atom_index_keys ) {
+      if ( ! (mol->atom_index_keys = memarena_create()) ) return -2;
+    }
+    if ( ! mol->atom_index_on ) mol->atom_index_stamp = mol->atom_edits - 1;
+    mol->atom_index_on = 1;
+    return 0;
+  }
+  hash_destroy(&(mol->atom_index));
+  free((void*)mol->atom_index_atoms);
+  mol->atom_index_atoms = 0;
+  free((void*)mol->atom_index_res);
+  mol->atom_index_res = 0;
+  memarena_destroy(mol->atom_index_keys);
+  mol->atom_index_keys = 0;
+  mol->atom_index_on = 0;
+  return 0;
+}
+
+/* atom named by target, through the atom index when it is enabled;
+   if inst is given, an instance residue is not expanded but returned
+   there with the atom of its proto */
+static topo_mol_atom_t * topo_mol_target_atom(topo_mol *mol,
+			const topo_mol_ident_t *target,
+			topo_mol_residue_t **inst) {
+  topo_mol_residue_t *res;
+  char key[3*NAMEMAXLEN];
+  int i, slot;
+  if ( mol->atom_index_on && ( mol->atom_index_stamp == mol->atom_edits ||
+                               ! topo_mol_build_atom_index(mol) ) &&
+       topo_mol_atom_index_key(key,target->segid,target->resid,
+                               target->aname) > 0 &&
+       ( i = hash_lookup(&(mol->atom_index),key) ) != HASH_FAIL ) {
+    res = mol->atom_index_res[i];
+    if ( ! res ) return mol->atom_index_atoms[i];
+    /* an instance expanded since the index was built is looked up below */
+    if ( res->inst ) {
+      if ( inst ) {
+        *inst = res;
+        return mol->atom_index_atoms[i];
+      }
+      /* expanded atoms are laid out in proto order */
+      slot = mol->atom_index_atoms[i] - res->inst->proto->atoms;
+      if ( ! topo_mol_res_atoms(mol,res) ) return 0;
+      return res->atoms + slot;
+    }
+  }
+  /* misses take the slow path, which reports what is missing */
+  res = topo_mol_get_res(mol,target,0);
+  if ( ! res ) return 0;
+  if ( inst && res->inst ) {
+    *inst = res;
+    return topo_mol_get_atom_from_res(mol,&(res->inst->proto->res),
+							target->aname);
+  }
+  return topo_mol_get_atom_from_res(mol,res,target->aname);
 }
 
 static topo_mol_atom_t * topo_mol_get_atom(topo_mol *mol,
@@ -120,9 +424,7 @@ static topo_mol_atom_t * topo_mol_get_atom(topo_mol *mol,
   char errmsg[64 + 3*NAMEMAXLEN];
   res = topo_mol_get_res(mol,target,irel);
   if ( ! res ) return 0;
-  for ( atom = res->atoms; atom; atom = atom->next ) {
-    if ( ! strcmp(target->aname,atom->name) ) break;
-  }
+  atom = topo_mol_get_atom_from_res(mol,res,target->aname);
   if ( ! atom ) {
     sprintf(errmsg,"no atom %s in residue %s:%s of segment %s",
 		target->aname,res->name,res->resid,target->segid);
@@ -131,13 +433,32 @@ static topo_mol_atom_t * topo_mol_get_atom(topo_mol *mol,
   return atom;
 }
 
-static topo_mol_atom_t *topo_mol_get_atom_from_res(
-    const topo_mol_residue_t *res, const char *aname) {
-  topo_mol_atom_t *atom;
-  for ( atom = res->atoms; atom; atom = atom->next ) {
-    if ( ! strcmp(aname,atom->name) ) break;
+int topo_mol_resid_pack(const char *resid, unsigned int *packed) {
+  const char *s;
+  int neg;
+  unsigned int n;
+  s = resid;
+  neg = ( *s == '-' );
+  if ( neg ) ++s;
+  if ( *s < '0' || *s > '9' ) return 0;
+  if ( *s == '0' && ( neg || ( s[1] >= '0' && s[1] <= '9' ) ) ) return 0;
+  for ( n = 0; *s >= '0' && *s <= '9'; ++s ) {
+    n = 10 * n + ( *s - '0' );
+    if ( n > TOPO_MOL_RESID_MAX ) return 0;
   }
-  return atom;
+  if ( *s && s[1] ) return 0;
+  if ( neg ) n = 0 - n;
+  *packed = ( n << 8 ) | (unsigned char) *s;
+  return 1;
+}
+
+int topo_mol_resid_unpack(unsigned int packed, char *insertion) {
+  int resid;
+  insertion[0] = (char) ( packed & 0xff );
+  insertion[1] = '\0';
+  resid = (int) ( ( packed >> 8 ) & 0xffffff );
+  if ( resid > TOPO_MOL_RESID_MAX ) resid -= 0x1000000;
+  return resid;
 }
 
 int topo_mol_segment(topo_mol *mol, const char *segid) {
@@ -159,12 +480,14 @@ int topo_mol_segment(topo_mol *mol, const char *segid) {
     if ( ! newitem ) return -5;
   }
   strcpy(newitem->segid,segid);
-  newitem->residue_hash = hasharray_create(
-	(void**) &(newitem->residue_array), sizeof(topo_mol_residue_t));
+  newitem->residue_hash = hasharray_create_chunked(
+	&(newitem->residues), sizeof(topo_mol_residue_t), 0);
+  hasharray_numeric(newitem->residue_hash,topo_mol_resid_pack);
   strcpy(newitem->pfirst,"");
   strcpy(newitem->plast,"");
   newitem->auto_angles = mol->defs->auto_angles;
   newitem->auto_dihedrals = mol->defs->auto_dihedrals;
+  newitem->proto = 0;
   mol->buildseg = newitem;
   return 0;
 }
@@ -239,11 +562,16 @@ int topo_mol_residue(topo_mol *mol, const char *resid, const char *rname,
 
   i = hasharray_insert(seg->residue_hash,resid);
   if ( i == HASHARRAY_FAIL ) return -4;
-  newitem = &(seg->residue_array[i]);
+  newitem = topo_mol_seg_residue(seg,i);
   strcpy(newitem->resid,resid);
   strcpy(newitem->name,rname);
   strcpy(newitem->chain,chain);
   newitem->atoms = 0;
+  newitem->inst = 0;
+  newitem->index = 0;
+  newitem->nindex = 0;
+  newitem->maxindex = 0;
+  newitem->indexstamp = 0;
 
   return 0;
 }
@@ -269,7 +597,7 @@ int topo_mol_mutate(topo_mol *mol, const char *resid, const char *rname) {
     topo_mol_log_error(mol,errmsg);
     return -1;
   }
-  res = seg->residue_array + ires;
+  res = topo_mol_seg_residue(seg,ires);
   sprintf(errmsg,"mutating residue %s from %s to %s",resid,res->name,rname);
   topo_mol_log_error(mol,errmsg);
 
@@ -284,53 +612,56 @@ int topo_mol_mutate(topo_mol *mol, const char *resid, const char *rname) {
 }
 
 static topo_mol_atom_t * topo_mol_unlink_atom(
-		topo_mol_atom_t **atoms, const char *aname) {
+		topo_mol_atom_t **atoms, int aname) {
   topo_mol_atom_t **atom;
   topo_mol_atom_t *oldatom;
   if ( ! atoms ) return 0;
   for ( atom = atoms ; *atom; atom = &((*atom)->next) ) {
-    if ( ! strcmp(aname,(*atom)->name) ) break;
+    if ( (*atom)->name == aname ) break;
   }
   oldatom = *atom;
   if ( *atom ) *atom = ((*atom)->next);
   return oldatom;
 }
 
-static topo_mol_atom_t * topo_mol_find_atom(topo_mol_atom_t **newatoms,
-		topo_mol_atom_t *oldatoms, const char *aname) {
+static topo_mol_atom_t * topo_mol_find_atom(topo_mol *mol,
+		topo_mol_atom_t **newatoms, topo_mol_atom_t *oldatoms, int aname) {
   topo_mol_atom_t *atom, **newatom;
   if ( ! oldatoms ) return 0;
   for ( atom = oldatoms; atom; atom = atom->next ) {
-    if ( ! strcmp(aname,atom->name) ) break;
+    if ( atom->name == aname ) break;
   }
   if ( atom && *newatoms != oldatoms ) {
     for ( newatom = newatoms; *newatom != oldatoms; newatom = &(*newatom)->next );
     *newatom = atom->next;
     atom->next = *newatoms;
     *newatoms = oldatoms;
+    ++mol->atom_edits;  /* order matters for repeated names */
   }
   return atom;
 }
 
+/* itype is the index of the atom type if known, otherwise -1 */
 static int topo_mol_add_atom(topo_mol *mol, topo_mol_atom_t **atoms,
-		topo_mol_atom_t *oldatoms, topo_defs_atom_t *atomdef) {
+		topo_mol_atom_t *oldatoms, topo_defs_atom_t *atomdef, int itype) {
   int idef;
   topo_mol_atom_t *atomtmp;
   topo_defs_type_t *atype;
   char errmsg[128];
   if ( ! mol || ! atoms ) return -1;
-  idef = hasharray_index(mol->defs->type_hash,atomdef->type);
+  idef = itype;
+  if ( idef < 0 ) idef = hasharray_index(mol->defs->type_hash,atomdef->type);
   if ( idef == HASHARRAY_FAIL ) {
     sprintf(errmsg,"unknown atom type %s",atomdef->type);
     topo_mol_log_error(mol,errmsg);
     return -3;
   }
   atomtmp = 0;
-  if ( oldatoms ) atomtmp = topo_mol_find_atom(atoms, oldatoms, atomdef->name);
+  if ( oldatoms ) atomtmp = topo_mol_find_atom(mol, atoms, oldatoms, atomdef->namesym);
   if ( ! atomtmp ) {
-    atomtmp = memarena_alloc(mol->arena,sizeof(topo_mol_atom_t));
+    atomtmp = topo_mol_atom_alloc(mol);
     if ( ! atomtmp ) return -2;
-    strcpy(atomtmp->name,atomdef->name);
+    atomtmp->name = atomdef->namesym;
     atomtmp->bonds = 0;
     atomtmp->angles = 0;
     atomtmp->dihedrals = 0;
@@ -341,20 +672,18 @@ static int topo_mol_add_atom(topo_mol *mol, topo_mol_atom_t **atoms,
     atomtmp->x = 0;
     atomtmp->y = 0;
     atomtmp->z = 0;
-    atomtmp->vx = 0;
-    atomtmp->vy = 0;
-    atomtmp->vz = 0;
     atomtmp->xyz_state = TOPO_MOL_XYZ_VOID;
     atomtmp->partition = 0;
     atomtmp->atomid = 0;
     atomtmp->next = *atoms;
     *atoms = atomtmp;
+    ++mol->atom_edits;
   }
   atomtmp->copy = 0;
   atomtmp->charge = atomdef->charge;
-  strcpy(atomtmp->type,atomdef->type);
+  atomtmp->type = atomdef->typesym;
   atype = &(mol->defs->type_array[idef]);
-  strcpy(atomtmp->element,atype->element);
+  atomtmp->element = atype->elementsym;
   atomtmp->mass = atype->mass;
   return 0;
 }
@@ -413,6 +742,145 @@ topo_mol_exclusion_t * topo_mol_exclusion_next(
 }
 
 
+topo_mol_atom_t * topo_mol_atom_alloc(topo_mol *mol) {
+  topo_mol_atom_t *atom;
+  atom = memarena_alloc(mol->arena,sizeof(topo_mol_atom_t));
+  if ( atom ) atom->serial = mol->nserial++;
+  return atom;
+}
+
+static double * topo_mol_vel_slot(double **blocks, int nblocks, int serial) {
+  int iblock = serial / TOPO_MOL_VEL_BLOCK;
+  if ( iblock < nblocks && blocks[iblock] )
+    return blocks[iblock] + 3 * ( serial % TOPO_MOL_VEL_BLOCK );
+  return 0;
+}
+
+void topo_mol_get_vel(topo_mol *mol, const topo_mol_atom_t *atom, double *v) {
+  double *slot;
+  if ( (slot = topo_mol_vel_slot(mol->velblocks,mol->nvelblocks,atom->serial)) ) {
+    v[0] = slot[0];  v[1] = slot[1];  v[2] = slot[2];
+  } else {
+    v[0] = v[1] = v[2] = 0.;
+  }
+}
+
+int topo_mol_put_vel(topo_mol *mol, const topo_mol_atom_t *atom,
+                                    double vx, double vy, double vz) {
+  int i, iblock = atom->serial / TOPO_MOL_VEL_BLOCK;
+  double **blocks, *block;
+  if ( iblock >= mol->nvelblocks ) {
+    if ( ! vx && ! vy && ! vz ) return 0;
+    blocks = (double**) realloc(mol->velblocks, (iblock+1) * sizeof(double*));
+    if ( ! blocks ) return -2;
+    for ( i=mol->nvelblocks; i<=iblock; ++i ) blocks[i] = 0;
+    mol->velblocks = blocks;
+    mol->nvelblocks = iblock + 1;
+  }
+  if ( ! (block = mol->velblocks[iblock]) ) {
+    if ( ! vx && ! vy && ! vz ) return 0;
+    block = (double*) calloc(3 * TOPO_MOL_VEL_BLOCK, sizeof(double));
+    if ( ! block ) return -2;
+    mol->velblocks[iblock] = block;
+  }
+  block += 3 * ( atom->serial % TOPO_MOL_VEL_BLOCK );
+  block[0] = vx;  block[1] = vy;  block[2] = vz;
+  return 0;
+}
+
+/* Free bonds, angles and dihedrals are linked through next[0], their
+   first member, so the lists can be handled alike. */
+static void * topo_mol_free_next(void *tuple) {
+  void *next;
+  memcpy(&next,tuple,sizeof(void*));
+  return next;
+}
+
+static void topo_mol_free_link(void *tuple, void *next) {
+  memcpy(tuple,&next,sizeof(void*));
+}
+
+/* Free lists shared by the jobs that end queued segments.  A job whose
+   own list runs dry takes a run of tuples from here. */
+#define TOPO_MOL_POOL_RUN 64
+
+typedef struct topo_mol_pool_t {
+#ifdef TOPO_MOL_HAVE_THREADS
+  pthread_mutex_t lock;
+#endif
+  void *free[3];
+} topo_mol_pool_t;
+
+static void * topo_mol_pool_take(topo_mol *mol, int kind) {
+  topo_mol_pool_t *pool = mol->pool;
+  void *run, *tail, *next;
+  int i;
+#ifdef TOPO_MOL_HAVE_THREADS
+  pthread_mutex_lock(&(pool->lock));
+#endif
+  if ( (run = pool->free[kind]) ) {
+    tail = run;
+    for ( i=1; i<TOPO_MOL_POOL_RUN && (next = topo_mol_free_next(tail)); ++i )
+      tail = next;
+    pool->free[kind] = topo_mol_free_next(tail);
+    topo_mol_free_link(tail,0);
+  }
+#ifdef TOPO_MOL_HAVE_THREADS
+  pthread_mutex_unlock(&(pool->lock));
+#endif
+  return run;
+}
+
+/* Notes a tuple taken from a free list during a segment build; if there
+   is no room to note it, it must stay on the list. */
+static int topo_mol_log_pop(topo_mol *mol, int kind, void *tuple) {
+  topo_mol_poplog_t *log;
+  void **tuples;
+  if ( ! mol->poplog ) return 0;
+  log = mol->poplog + kind;
+  if ( log->count == log->max ) {
+    tuples = (void**) realloc(log->tuples, (2*log->max+64)*sizeof(void*));
+    if ( ! tuples ) return -1;
+    log->tuples = tuples;
+    log->max = 2*log->max+64;
+  }
+  log->tuples[log->count++] = tuple;
+  return 0;
+}
+
+topo_mol_bond_t * topo_mol_bond_alloc(topo_mol *mol) {
+  topo_mol_bond_t *tuple;
+  if ( ! mol->bond_free && mol->pool )
+    mol->bond_free = (topo_mol_bond_t*) topo_mol_pool_take(mol,0);
+  if ( (tuple = mol->bond_free) && ! topo_mol_log_pop(mol,0,tuple) ) {
+    mol->bond_free = tuple->next[0];
+    return tuple;
+  }
+  return memarena_alloc(mol->arena,sizeof(topo_mol_bond_t));
+}
+
+topo_mol_angle_t * topo_mol_angle_alloc(topo_mol *mol) {
+  topo_mol_angle_t *tuple;
+  if ( ! mol->angle_free && mol->pool )
+    mol->angle_free = (topo_mol_angle_t*) topo_mol_pool_take(mol,1);
+  if ( (tuple = mol->angle_free) && ! topo_mol_log_pop(mol,1,tuple) ) {
+    mol->angle_free = tuple->next[0];
+    return tuple;
+  }
+  return memarena_alloc(mol->angle_arena,sizeof(topo_mol_angle_t));
+}
+
+topo_mol_dihedral_t * topo_mol_dihedral_alloc(topo_mol *mol) {
+  topo_mol_dihedral_t *tuple;
+  if ( ! mol->dihedral_free && mol->pool )
+    mol->dihedral_free = (topo_mol_dihedral_t*) topo_mol_pool_take(mol,2);
+  if ( (tuple = mol->dihedral_free) && ! topo_mol_log_pop(mol,2,tuple) ) {
+    mol->dihedral_free = tuple->next[0];
+    return tuple;
+  }
+  return memarena_alloc(mol->dihedral_arena,sizeof(topo_mol_dihedral_t));
+}
+
 static topo_mol_conformation_t * topo_mol_conformation_next(
 		topo_mol_conformation_t *tuple, topo_mol_atom_t *atom) {
   if ( tuple->atom[0] == atom ) return tuple->next[0];
@@ -422,7 +890,169 @@ static topo_mol_conformation_t * topo_mol_conformation_next(
   return 0;
 }
 
-static void topo_mol_destroy_atom(topo_mol_atom_t *atom) {
+/* Every kind of entry starts with its next and atom arrays, which is all
+   that copying the entries of a proto needs. */
+typedef struct topo_mol_kind_t {
+  size_t list;  /* offset of the atom's list of entries */
+  int n;
+  size_t size;
+} topo_mol_kind_t;
+
+static const topo_mol_kind_t topo_mol_kinds[] = {
+  { offsetof(topo_mol_atom_t,bonds), 2, sizeof(topo_mol_bond_t) },
+  { offsetof(topo_mol_atom_t,angles), 3, sizeof(topo_mol_angle_t) },
+  { offsetof(topo_mol_atom_t,dihedrals), 4, sizeof(topo_mol_dihedral_t) },
+  { offsetof(topo_mol_atom_t,impropers), 4, sizeof(topo_mol_improper_t) },
+  { offsetof(topo_mol_atom_t,cmaps), 8, sizeof(topo_mol_cmap_t) },
+  { offsetof(topo_mol_atom_t,exclusions), 2, sizeof(topo_mol_exclusion_t) },
+  { offsetof(topo_mol_atom_t,conformations), 4,
+					sizeof(topo_mol_conformation_t) }
+};
+
+#define TOPO_MOL_NKINDS 7
+
+#define topo_mol_kind_list(atom,kind) \
+  ((void***) ((char*)(atom) + topo_mol_kinds[kind].list))
+
+static void * topo_mol_kind_alloc(topo_mol *mol, int kind) {
+  switch ( kind ) {
+  case 0: return topo_mol_bond_alloc(mol);
+  case 1: return topo_mol_angle_alloc(mol);
+  case 2: return topo_mol_dihedral_alloc(mol);
+  }
+  return memarena_alloc(mol->arena,topo_mol_kinds[kind].size);
+}
+
+static int topo_mol_ptr_cmp(const void *a, const void *b) {
+  const char *pa = *(const char * const *) a;
+  const char *pb = *(const char * const *) b;
+  return ( pa < pb ? -1 : pa > pb );
+}
+
+/* copy of a proto entry, given the sorted entries and their copies */
+static void * topo_mol_kind_copy(void **tuples, void **copies, int count,
+						void *tuple) {
+  void **t;
+  if ( ! tuple ) return 0;
+  t = (void**) bsearch(&tuple,tuples,count,sizeof(void*),topo_mol_ptr_cmp);
+  return ( t ? copies[t - tuples] : 0 );
+}
+
+/* Turn an instance back into an ordinary residue with its own copies of
+   the proto atoms and entries, linked in the same order. */
+static int topo_mol_expand_res(topo_mol *mol, topo_mol_residue_t *res) {
+  topo_mol_instance_t *inst;
+  topo_mol_proto_t *proto;
+  topo_mol_atom_t *atoms, *atom;
+  void **tuples, **copies, **t, **c, **newtuples;
+  int kind, n, nk, k, i, j, count, max, rc;
+
+  inst = res->inst;
+  proto = inst->proto;
+  n = proto->natoms;
+  atoms = (topo_mol_atom_t*) memarena_alloc(mol->arena,
+					n*sizeof(topo_mol_atom_t));
+  if ( ! atoms ) return -2;
+  for ( k=0; k<n; ++k ) {
+    atom = atoms + k;
+    *atom = proto->atoms[k];
+    atom->next = ( k+1 < n ? atom + 1 : 0 );
+    atom->serial = inst->serial + k;
+    atom->x = inst->atoms[k].x;
+    atom->y = inst->atoms[k].y;
+    atom->z = inst->atoms[k].z;
+    atom->xyz_state = inst->atoms[k].xyz_state;
+    atom->atomid = ( inst->atomid < 0 ? 0 : inst->atomid + k + 1 );
+  }
+
+  rc = 0;
+  tuples = 0;  max = 0;
+  for ( kind=0; kind<TOPO_MOL_NKINDS && ! rc; ++kind ) {
+    nk = topo_mol_kinds[kind].n;
+
+    /* every entry once, sorted for the lookups below */
+    count = 0;
+    for ( k=0; k<n && ! rc; ++k ) {
+      atom = proto->atoms + k;
+      for ( t = *topo_mol_kind_list(atom,kind); t; t = (void**) t[j] ) {
+        if ( 2*count+2 > max ) {
+          newtuples = (void**) realloc(tuples,(2*max+64)*sizeof(void*));
+          if ( ! newtuples ) { rc = -2;  break; }
+          tuples = newtuples;
+          max = 2*max+64;
+        }
+        tuples[count++] = t;
+        for ( j=0; j<nk && t[nk+j] != atom; ++j );
+        if ( j == nk ) break;
+      }
+    }
+    if ( rc || ! count ) continue;
+    qsort(tuples,count,sizeof(void*),topo_mol_ptr_cmp);
+    for ( i=1, j=1; i<count; ++i ) {
+      if ( tuples[i] != tuples[j-1] ) tuples[j++] = tuples[i];
+    }
+    count = j;
+
+    copies = tuples + count;
+    for ( i=0; i<count; ++i ) {
+      if ( ! (copies[i] = topo_mol_kind_alloc(mol,kind)) ) { rc = -2;  break; }
+      memcpy(copies[i],tuples[i],topo_mol_kinds[kind].size);
+    }
+    for ( i=0; i<count && ! rc; ++i ) {
+      c = (void**) copies[i];
+      for ( j=0; j<nk; ++j ) {
+        c[j] = topo_mol_kind_copy(tuples,copies,count,c[j]);
+        c[nk+j] = atoms + ( (topo_mol_atom_t*) c[nk+j] - proto->atoms );
+      }
+    }
+    for ( k=0; k<n && ! rc; ++k ) {
+      *topo_mol_kind_list(atoms+k,kind) = (void**) topo_mol_kind_copy(
+		tuples,copies,count,*topo_mol_kind_list(proto->atoms+k,kind));
+    }
+  }
+  free((void*)tuples);
+  if ( rc ) return rc;
+
+  res->atoms = atoms;
+  res->inst = 0;
+  res->indexstamp = mol->atom_edits - 1;
+  return 0;
+}
+
+topo_mol_atom_t * topo_mol_res_atoms(topo_mol *mol, topo_mol_residue_t *res) {
+  char errmsg[64 + 2*NAMEMAXLEN];
+  if ( res->inst && topo_mol_expand_res(mol,res) ) {
+    sprintf(errmsg,"out of memory expanding residue %s:%s",
+						res->name,res->resid);
+    topo_mol_log_error(mol,errmsg);
+  }
+  return res->atoms;
+}
+
+topo_mol_atom_t * topo_mol_res_list(topo_mol_residue_t *res) {
+  return ( res->inst ? res->inst->proto->atoms : res->atoms );
+}
+
+topo_mol_atom_t * topo_mol_inst_atom(topo_mol_residue_t *res,
+		topo_mol_atom_t *atom, topo_mol_atom_t *copy) {
+  topo_mol_instance_t *inst = res->inst;
+  int k;
+  if ( ! inst ) return atom;
+  k = atom - inst->proto->atoms;
+  *copy = *atom;
+  copy->serial = inst->serial + k;
+  copy->x = inst->atoms[k].x;
+  copy->y = inst->atoms[k].y;
+  copy->z = inst->atoms[k].z;
+  copy->xyz_state = inst->atoms[k].xyz_state;
+  copy->atomid = ( inst->atomid < 0 ? 0 : inst->atomid + k + 1 );
+  return copy;
+}
+
+/* Marks the tuples of an atom that has been unlinked from its residue
+   as deleted and keeps the atom on mol->deleted_atoms, so that
+   topo_mol_compact can still reach those tuples. */
+static void topo_mol_destroy_atom(topo_mol *mol, topo_mol_atom_t *atom) {
   topo_mol_bond_t *bondtmp;
   topo_mol_angle_t *angletmp;
   topo_mol_dihedral_t *dihetmp;
@@ -431,6 +1061,7 @@ static void topo_mol_destroy_atom(topo_mol_atom_t *atom) {
   topo_mol_exclusion_t *excltmp;
   topo_mol_conformation_t *conftmp;
   if ( ! atom ) return;
+  ++mol->atom_edits;
   for ( bondtmp = atom->bonds; bondtmp;
 		bondtmp = topo_mol_bond_next(bondtmp,atom) ) {
     bondtmp->del = 1;
@@ -459,58 +1090,22 @@ static void topo_mol_destroy_atom(topo_mol_atom_t *atom) {
 		conftmp = topo_mol_conformation_next(conftmp,atom) ) {
     conftmp->del = 1;
   }
+  atom->next = mol->deleted_atoms;
+  mol->deleted_atoms = atom;
 }
 
-static void topo_mol_del_atom(topo_mol_residue_t *res, const char *aname) {
+static void topo_mol_del_atom(topo_mol *mol, topo_mol_residue_t *res,
+                                                int aname) {
   if ( ! res ) return;
-  topo_mol_destroy_atom(topo_mol_unlink_atom(&(res->atoms),aname));
-}
-
-/*
- * The add_xxx_to_residues routines exist because topo_mol_end can do
- * more intelligent error checking than what's done in the add_xxx
- * routines.  The add_xxx routines are called by topo_mol_patch, which
- * has to be more general (and more paranoid) about its input.  Returning
- * nonzero from add_xxx_to_residues is always a serious error.
- */
-static int add_bond_to_residues(topo_mol *mol,
-    const topo_mol_residue_t *res1, const char *aname1,
-    const topo_mol_residue_t *res2, const char *aname2) {
-  topo_mol_bond_t *tuple;
-  topo_mol_atom_t *a1, *a2;
-
-  a1 = topo_mol_get_atom_from_res(res1, aname1);
-  a2 = topo_mol_get_atom_from_res(res2, aname2);
-  if (!a1 || !a2) return -1;
-  tuple = memarena_alloc(mol->arena,sizeof(topo_mol_bond_t));
-  if ( ! tuple ) return -10;
-  tuple->next[0] = a1->bonds;
-  tuple->atom[0] = a1;
-  tuple->next[1] = a2->bonds;
-  tuple->atom[1] = a2;
-  tuple->del = 0;
-  a1->bonds = tuple;
-  a2->bonds = tuple;
-  return 0;
+  topo_mol_res_atoms(mol,res);
+  topo_mol_destroy_atom(mol,topo_mol_unlink_atom(&(res->atoms),aname));
 }
 
-static int topo_mol_add_bond(topo_mol *mol, const topo_mol_ident_t *targets,
-				int ntargets, topo_defs_bond_t *def) {
+/* Link a tuple of atoms into their lists; nonzero only if out of memory. */
+static int topo_mol_link_bond(topo_mol *mol,
+		topo_mol_atom_t *a1, topo_mol_atom_t *a2) {
   topo_mol_bond_t *tuple;
-  topo_mol_atom_t *a1, *a2;
-  topo_mol_ident_t t1, t2;
-  if (! mol) return -1;
-  if ( def->res1 < 0 || def->res1 >= ntargets ) return -2;
-  t1 = targets[def->res1];
-  t1.aname = def->atom1;
-  a1 = topo_mol_get_atom(mol,&t1,def->rel1);
-  if ( ! a1 ) return -3;
-  if ( def->res2 < 0 || def->res2 >= ntargets ) return -4;
-  t2 = targets[def->res2];
-  t2.aname = def->atom2;
-  a2 = topo_mol_get_atom(mol,&t2,def->rel2);
-  if ( ! a2 ) return -5;
-  tuple = memarena_alloc(mol->arena,sizeof(topo_mol_bond_t));
+  tuple = topo_mol_bond_alloc(mol);
   if ( ! tuple ) return -10;
   tuple->next[0] = a1->bonds;
   tuple->atom[0] = a1;
@@ -522,51 +1117,10 @@ static int topo_mol_add_bond(topo_mol *mol, const topo_mol_ident_t *targets,
   return 0;
 }
 
-static void topo_mol_del_bond(topo_mol *mol, const topo_mol_ident_t *targets,
-				int ntargets, topo_defs_bond_t *def) {
-  topo_mol_bond_t *tuple;
-  topo_mol_atom_t *a1, *a2;
-  topo_mol_ident_t t1, t2;
-  if (! mol) return;
-  if ( def->res1 < 0 || def->res1 >= ntargets ) return;
-  t1 = targets[def->res1];
-  t1.aname = def->atom1;
-  a1 = topo_mol_get_atom(mol,&t1,def->rel1);
-  if ( ! a1 ) return;
-  if ( def->res2 < 0 || def->res2 >= ntargets ) return;
-  t2 = targets[def->res2];
-  t2.aname = def->atom2;
-  a2 = topo_mol_get_atom(mol,&t2,def->rel2);
-  for ( tuple = a1->bonds; tuple;
-		tuple = topo_mol_bond_next(tuple,a1) ) {
-    if ( tuple->atom[0] == a1 && tuple->atom[1] == a2 ) tuple->del = 1;
-    if ( tuple->atom[0] == a2 && tuple->atom[1] == a1 ) tuple->del = 1;
-  }
-}
-
-
-static int topo_mol_add_angle(topo_mol *mol, const topo_mol_ident_t *targets,
-				int ntargets, topo_defs_angle_t *def) {
+static int topo_mol_link_angle(topo_mol *mol, topo_mol_atom_t *a1,
+		topo_mol_atom_t *a2, topo_mol_atom_t *a3) {
   topo_mol_angle_t *tuple;
-  topo_mol_atom_t *a1, *a2, *a3;
-  topo_mol_ident_t t1, t2, t3;
-  if (! mol) return -1;
-  if ( def->res1 < 0 || def->res1 >= ntargets ) return -2;
-  t1 = targets[def->res1];
-  t1.aname = def->atom1;
-  a1 = topo_mol_get_atom(mol,&t1,def->rel1);
-  if ( ! a1 ) return -3;
-  if ( def->res2 < 0 || def->res2 >= ntargets ) return -4;
-  t2 = targets[def->res2];
-  t2.aname = def->atom2;
-  a2 = topo_mol_get_atom(mol,&t2,def->rel2);
-  if ( ! a2 ) return -5;
-  if ( def->res3 < 0 || def->res3 >= ntargets ) return -6;
-  t3 = targets[def->res3];
-  t3.aname = def->atom3;
-  a3 = topo_mol_get_atom(mol,&t3,def->rel3);
-  if ( ! a3 ) return -7;
-  tuple = memarena_alloc(mol->angle_arena,sizeof(topo_mol_angle_t));
+  tuple = topo_mol_angle_alloc(mol);
   if ( ! tuple ) return -10;
   tuple->next[0] = a1->angles;
   tuple->atom[0] = a1;
@@ -581,20 +1135,204 @@ static int topo_mol_add_angle(topo_mol *mol, const topo_mol_ident_t *targets,
   return 0;
 }
 
-static void topo_mol_del_angle(topo_mol *mol, const topo_mol_ident_t *targets,
-				int ntargets, topo_defs_angle_t *def) {
-  topo_mol_angle_t *tuple;
-  topo_mol_atom_t *a1, *a2, *a3;
-  topo_mol_ident_t t1, t2, t3;
-  if (! mol) return;
-  if ( def->res1 < 0 || def->res1 >= ntargets ) return;
-  t1 = targets[def->res1];
-  t1.aname = def->atom1;
-  a1 = topo_mol_get_atom(mol,&t1,def->rel1);
-  if ( ! a1 ) return;
-  if ( def->res2 < 0 || def->res2 >= ntargets ) return;
-  t2 = targets[def->res2];
-  t2.aname = def->atom2;
+static int topo_mol_link_dihedral(topo_mol *mol, topo_mol_atom_t *a1,
+		topo_mol_atom_t *a2, topo_mol_atom_t *a3, topo_mol_atom_t *a4) {
+  topo_mol_dihedral_t *tuple;
+  tuple = topo_mol_dihedral_alloc(mol);
+  if ( ! tuple ) return -10;
+  tuple->next[0] = a1->dihedrals;
+  tuple->atom[0] = a1;
+  tuple->next[1] = a2->dihedrals;
+  tuple->atom[1] = a2;
+  tuple->next[2] = a3->dihedrals;
+  tuple->atom[2] = a3;
+  tuple->next[3] = a4->dihedrals;
+  tuple->atom[3] = a4;
+  tuple->del = 0;
+  a1->dihedrals = tuple;
+  a2->dihedrals = tuple;
+  a3->dihedrals = tuple;
+  a4->dihedrals = tuple;
+  return 0;
+}
+
+static int topo_mol_link_improper(topo_mol *mol, topo_mol_atom_t *a1,
+		topo_mol_atom_t *a2, topo_mol_atom_t *a3, topo_mol_atom_t *a4) {
+  topo_mol_improper_t *tuple;
+  tuple = memarena_alloc(mol->arena,sizeof(topo_mol_improper_t));
+  if ( ! tuple ) return -10;
+  tuple->next[0] = a1->impropers;
+  tuple->atom[0] = a1;
+  tuple->next[1] = a2->impropers;
+  tuple->atom[1] = a2;
+  tuple->next[2] = a3->impropers;
+  tuple->atom[2] = a3;
+  tuple->next[3] = a4->impropers;
+  tuple->atom[3] = a4;
+  tuple->del = 0;
+  a1->impropers = tuple;
+  a2->impropers = tuple;
+  a3->impropers = tuple;
+  a4->impropers = tuple;
+  return 0;
+}
+
+static int topo_mol_link_cmap(topo_mol *mol, topo_mol_atom_t *al[8]) {
+  int i;
+  topo_mol_cmap_t *tuple;
+  tuple = memarena_alloc(mol->arena,sizeof(topo_mol_cmap_t));
+  if ( ! tuple ) return -20;
+  for ( i=0; i<8; ++i ) {
+    tuple->next[i] = al[i]->cmaps;
+    tuple->atom[i] = al[i];
+  }
+  for ( i=0; i<8; ++i ) {
+    /* This must be in a separate loop because atoms may be repeated. */
+    al[i]->cmaps = tuple;
+  }
+  tuple->del = 0;
+  return 0;
+}
+
+static int topo_mol_link_exclusion(topo_mol *mol,
+		topo_mol_atom_t *a1, topo_mol_atom_t *a2) {
+  topo_mol_exclusion_t *tuple;
+  tuple = memarena_alloc(mol->arena,sizeof(topo_mol_exclusion_t));
+  if ( ! tuple ) return -10;
+  tuple->next[0] = a1->exclusions;
+  tuple->atom[0] = a1;
+  tuple->next[1] = a2->exclusions;
+  tuple->atom[1] = a2;
+  tuple->del = 0;
+  a1->exclusions = tuple;
+  a2->exclusions = tuple;
+  return 0;
+}
+
+static int topo_mol_link_conformation(topo_mol *mol, topo_mol_atom_t *a1,
+		topo_mol_atom_t *a2, topo_mol_atom_t *a3, topo_mol_atom_t *a4,
+		topo_defs_conformation_t *def) {
+  topo_mol_conformation_t *tuple;
+  tuple = memarena_alloc(mol->arena,sizeof(topo_mol_conformation_t));
+  if ( ! tuple ) return -10;
+  tuple->next[0] = a1->conformations;
+  tuple->atom[0] = a1;
+  tuple->next[1] = a2->conformations;
+  tuple->atom[1] = a2;
+  tuple->next[2] = a3->conformations;
+  tuple->atom[2] = a3;
+  tuple->next[3] = a4->conformations;
+  tuple->atom[3] = a4;
+  tuple->del = 0;
+  tuple->improper = def->improper;
+  tuple->dist12 = def->dist12;
+  tuple->angle123 = def->angle123;
+  tuple->dihedral = def->dihedral;
+  tuple->angle234 = def->angle234;
+  tuple->dist34 = def->dist34;
+  a1->conformations = tuple;
+  a2->conformations = tuple;
+  a3->conformations = tuple;
+  a4->conformations = tuple;
+  return 0;
+}
+
+/*
+ * The add_xxx_to_residues routines exist because topo_mol_end can do
+ * more intelligent error checking than what's done in the add_xxx
+ * routines.  The add_xxx routines are called by topo_mol_patch, which
+ * has to be more general (and more paranoid) about its input.  Returning
+ * nonzero from add_xxx_to_residues is always a serious error.
+ */
+static int add_bond_to_residues(topo_mol *mol,
+    topo_mol_residue_t *res1, const char *aname1,
+    topo_mol_residue_t *res2, const char *aname2) {
+  topo_mol_atom_t *a1, *a2;
+
+  a1 = topo_mol_get_atom_from_res(mol, res1, aname1);
+  a2 = topo_mol_get_atom_from_res(mol, res2, aname2);
+  if (!a1 || !a2) return -1;
+  return topo_mol_link_bond(mol,a1,a2);
+}
+
+static int topo_mol_add_bond(topo_mol *mol, const topo_mol_ident_t *targets,
+				int ntargets, topo_defs_bond_t *def) {
+  topo_mol_atom_t *a1, *a2;
+  topo_mol_ident_t t1, t2;
+  if (! mol) return -1;
+  if ( def->res1 < 0 || def->res1 >= ntargets ) return -2;
+  t1 = targets[def->res1];
+  t1.aname = def->atom1;
+  a1 = topo_mol_get_atom(mol,&t1,def->rel1);
+  if ( ! a1 ) return -3;
+  if ( def->res2 < 0 || def->res2 >= ntargets ) return -4;
+  t2 = targets[def->res2];
+  t2.aname = def->atom2;
+  a2 = topo_mol_get_atom(mol,&t2,def->rel2);
+  if ( ! a2 ) return -5;
+  return topo_mol_link_bond(mol,a1,a2);
+}
+
+static void topo_mol_del_bond(topo_mol *mol, const topo_mol_ident_t *targets,
+				int ntargets, topo_defs_bond_t *def) {
+  topo_mol_bond_t *tuple;
+  topo_mol_atom_t *a1, *a2;
+  topo_mol_ident_t t1, t2;
+  if (! mol) return;
+  if ( def->res1 < 0 || def->res1 >= ntargets ) return;
+  t1 = targets[def->res1];
+  t1.aname = def->atom1;
+  a1 = topo_mol_get_atom(mol,&t1,def->rel1);
+  if ( ! a1 ) return;
+  if ( def->res2 < 0 || def->res2 >= ntargets ) return;
+  t2 = targets[def->res2];
+  t2.aname = def->atom2;
+  a2 = topo_mol_get_atom(mol,&t2,def->rel2);
+  for ( tuple = a1->bonds; tuple;
+		tuple = topo_mol_bond_next(tuple,a1) ) {
+    if ( tuple->atom[0] == a1 && tuple->atom[1] == a2 ) tuple->del = 1;
+    if ( tuple->atom[0] == a2 && tuple->atom[1] == a1 ) tuple->del = 1;
+  }
+}
+
+
+static int topo_mol_add_angle(topo_mol *mol, const topo_mol_ident_t *targets,
+				int ntargets, topo_defs_angle_t *def) {
+  topo_mol_atom_t *a1, *a2, *a3;
+  topo_mol_ident_t t1, t2, t3;
+  if (! mol) return -1;
+  if ( def->res1 < 0 || def->res1 >= ntargets ) return -2;
+  t1 = targets[def->res1];
+  t1.aname = def->atom1;
+  a1 = topo_mol_get_atom(mol,&t1,def->rel1);
+  if ( ! a1 ) return -3;
+  if ( def->res2 < 0 || def->res2 >= ntargets ) return -4;
+  t2 = targets[def->res2];
+  t2.aname = def->atom2;
+  a2 = topo_mol_get_atom(mol,&t2,def->rel2);
+  if ( ! a2 ) return -5;
+  if ( def->res3 < 0 || def->res3 >= ntargets ) return -6;
+  t3 = targets[def->res3];
+  t3.aname = def->atom3;
+  a3 = topo_mol_get_atom(mol,&t3,def->rel3);
+  if ( ! a3 ) return -7;
+  return topo_mol_link_angle(mol,a1,a2,a3);
+}
+
+static void topo_mol_del_angle(topo_mol *mol, const topo_mol_ident_t *targets,
+				int ntargets, topo_defs_angle_t *def) {
+  topo_mol_angle_t *tuple;
+  topo_mol_atom_t *a1, *a2, *a3;
+  topo_mol_ident_t t1, t2, t3;
+  if (! mol) return;
+  if ( def->res1 < 0 || def->res1 >= ntargets ) return;
+  t1 = targets[def->res1];
+  t1.aname = def->atom1;
+  a1 = topo_mol_get_atom(mol,&t1,def->rel1);
+  if ( ! a1 ) return;
+  if ( def->res2 < 0 || def->res2 >= ntargets ) return;
+  t2 = targets[def->res2];
+  t2.aname = def->atom2;
   a2 = topo_mol_get_atom(mol,&t2,def->rel2);
   if ( def->res3 < 0 || def->res3 >= ntargets ) return;
   t3 = targets[def->res3];
@@ -612,7 +1350,6 @@ static void topo_mol_del_angle(topo_mol *mol, const topo_mol_ident_t *targets,
 
 static int topo_mol_add_dihedral(topo_mol *mol, const topo_mol_ident_t *targets,
 				int ntargets, topo_defs_dihedral_t *def) {
-  topo_mol_dihedral_t *tuple;
   topo_mol_atom_t *a1, *a2, *a3, *a4;
   topo_mol_ident_t t1, t2, t3, t4;
   if (! mol) return -1;
@@ -636,22 +1373,7 @@ static int topo_mol_add_dihedral(topo_mol *mol, const topo_mol_ident_t *targets,
   t4.aname = def->atom4;
   a4 = topo_mol_get_atom(mol,&t4,def->rel4);
   if ( ! a4 ) return -9;
-  tuple = memarena_alloc(mol->dihedral_arena,sizeof(topo_mol_dihedral_t));
-  if ( ! tuple ) return -10;
-  tuple->next[0] = a1->dihedrals;
-  tuple->atom[0] = a1;
-  tuple->next[1] = a2->dihedrals;
-  tuple->atom[1] = a2;
-  tuple->next[2] = a3->dihedrals;
-  tuple->atom[2] = a3;
-  tuple->next[3] = a4->dihedrals;
-  tuple->atom[3] = a4;
-  tuple->del = 0;
-  a1->dihedrals = tuple;
-  a2->dihedrals = tuple;
-  a3->dihedrals = tuple;
-  a4->dihedrals = tuple;
-  return 0;
+  return topo_mol_link_dihedral(mol,a1,a2,a3,a4);
 }
 
 static void topo_mol_del_dihedral(topo_mol *mol, const topo_mol_ident_t *targets,
@@ -687,39 +1409,22 @@ static void topo_mol_del_dihedral(topo_mol *mol, const topo_mol_ident_t *targets
 }
 
 static int add_improper_to_residues(topo_mol *mol,
-    const topo_mol_residue_t *res1, const char *aname1,
-    const topo_mol_residue_t *res2, const char *aname2,
-    const topo_mol_residue_t *res3, const char *aname3,
-    const topo_mol_residue_t *res4, const char *aname4) {
-  topo_mol_improper_t *tuple;
+    topo_mol_residue_t *res1, const char *aname1,
+    topo_mol_residue_t *res2, const char *aname2,
+    topo_mol_residue_t *res3, const char *aname3,
+    topo_mol_residue_t *res4, const char *aname4) {
   topo_mol_atom_t *a1, *a2, *a3, *a4;
 
-  a1 = topo_mol_get_atom_from_res(res1, aname1);
-  a2 = topo_mol_get_atom_from_res(res2, aname2);
-  a3 = topo_mol_get_atom_from_res(res3, aname3);
-  a4 = topo_mol_get_atom_from_res(res4, aname4);
+  a1 = topo_mol_get_atom_from_res(mol, res1, aname1);
+  a2 = topo_mol_get_atom_from_res(mol, res2, aname2);
+  a3 = topo_mol_get_atom_from_res(mol, res3, aname3);
+  a4 = topo_mol_get_atom_from_res(mol, res4, aname4);
   if (!a1 || !a2 || !a3 || !a4) return -1;
-  tuple = memarena_alloc(mol->arena,sizeof(topo_mol_improper_t));
-  if ( ! tuple ) return -10;
-  tuple->next[0] = a1->impropers;
-  tuple->atom[0] = a1;
-  tuple->next[1] = a2->impropers;
-  tuple->atom[1] = a2;
-  tuple->next[2] = a3->impropers;
-  tuple->atom[2] = a3;
-  tuple->next[3] = a4->impropers;
-  tuple->atom[3] = a4;
-  tuple->del = 0;
-  a1->impropers = tuple;
-  a2->impropers = tuple;
-  a3->impropers = tuple;
-  a4->impropers = tuple;
-  return 0;
+  return topo_mol_link_improper(mol,a1,a2,a3,a4);
 }
 
 static int topo_mol_add_improper(topo_mol *mol, const topo_mol_ident_t *targets,
 				int ntargets, topo_defs_improper_t *def) {
-  topo_mol_improper_t *tuple;
   topo_mol_atom_t *a1, *a2, *a3, *a4;
   topo_mol_ident_t t1, t2, t3, t4;
   if (! mol) return -1;
@@ -743,22 +1448,7 @@ static int topo_mol_add_improper(topo_mol *mol, const topo_mol_ident_t *targets,
   t4.aname = def->atom4;
   a4 = topo_mol_get_atom(mol,&t4,def->rel4);
   if ( ! a4 ) return -9;
-  tuple = memarena_alloc(mol->arena,sizeof(topo_mol_improper_t));
-  if ( ! tuple ) return -10;
-  tuple->next[0] = a1->impropers;
-  tuple->atom[0] = a1;
-  tuple->next[1] = a2->impropers;
-  tuple->atom[1] = a2;
-  tuple->next[2] = a3->impropers;
-  tuple->atom[2] = a3;
-  tuple->next[3] = a4->impropers;
-  tuple->atom[3] = a4;
-  tuple->del = 0;
-  a1->impropers = tuple;
-  a2->impropers = tuple;
-  a3->impropers = tuple;
-  a4->impropers = tuple;
-  return 0;
+  return topo_mol_link_improper(mol,a1,a2,a3,a4);
 }
 
 static void topo_mol_del_improper(topo_mol *mol, const topo_mol_ident_t *targets,
@@ -794,34 +1484,21 @@ static void topo_mol_del_improper(topo_mol *mol, const topo_mol_ident_t *targets
 }
 
 static int add_cmap_to_residues(topo_mol *mol,
-    const topo_mol_residue_t *resl[8], const char *anamel[8]) {
+    topo_mol_residue_t *resl[8], const char *anamel[8]) {
   int i;
-  topo_mol_cmap_t *tuple;
   topo_mol_atom_t *al[8];
 
   if (! mol) return -1;
   for ( i=0; i<8; ++i ) {
-    al[i] = topo_mol_get_atom_from_res(resl[i], anamel[i]);
+    al[i] = topo_mol_get_atom_from_res(mol, resl[i], anamel[i]);
     if (!al[i]) return -2-2*i;
   }
-  tuple = memarena_alloc(mol->arena,sizeof(topo_mol_cmap_t));
-  if ( ! tuple ) return -20;
-  for ( i=0; i<8; ++i ) {
-    tuple->next[i] = al[i]->cmaps;
-    tuple->atom[i] = al[i];
-  }
-  for ( i=0; i<8; ++i ) {
-    /* This must be in a separate loop because atoms may be repeated. */
-    al[i]->cmaps = tuple;
-  }
-  tuple->del = 0;
-  return 0;
+  return topo_mol_link_cmap(mol,al);
 }
 
 static int topo_mol_add_cmap(topo_mol *mol, const topo_mol_ident_t *targets,
 				int ntargets, topo_defs_cmap_t *def) {
   int i;
-  topo_mol_cmap_t *tuple;
   topo_mol_atom_t *al[8];
   topo_mol_ident_t tl[8];
   if (! mol) return -1;
@@ -832,18 +1509,7 @@ static int topo_mol_add_cmap(topo_mol *mol, const topo_mol_ident_t *targets,
     al[i] = topo_mol_get_atom(mol,&tl[i],def->rell[i]);
     if ( ! al[i] ) return -3-2*i;
   }
-  tuple = memarena_alloc(mol->arena,sizeof(topo_mol_cmap_t));
-  if ( ! tuple ) return -20;
-  for ( i=0; i<8; ++i ) {
-    tuple->next[i] = al[i]->cmaps;
-    tuple->atom[i] = al[i];
-  }
-  for ( i=0; i<8; ++i ) {
-    /* This must be in a separate loop because atoms may be repeated. */
-    al[i]->cmaps = tuple;
-  }
-  tuple->del = 0;
-  return 0;
+  return topo_mol_link_cmap(mol,al);
 }
 
 static void topo_mol_del_cmap(topo_mol *mol, const topo_mol_ident_t *targets,
@@ -879,29 +1545,18 @@ static void topo_mol_del_cmap(topo_mol *mol, const topo_mol_ident_t *targets,
 
 
 static int add_exclusion_to_residues(topo_mol *mol,
-    const topo_mol_residue_t *res1, const char *aname1,
-    const topo_mol_residue_t *res2, const char *aname2) {
-  topo_mol_exclusion_t *tuple;
+    topo_mol_residue_t *res1, const char *aname1,
+    topo_mol_residue_t *res2, const char *aname2) {
   topo_mol_atom_t *a1, *a2;
 
-  a1 = topo_mol_get_atom_from_res(res1, aname1);
-  a2 = topo_mol_get_atom_from_res(res2, aname2);
+  a1 = topo_mol_get_atom_from_res(mol, res1, aname1);
+  a2 = topo_mol_get_atom_from_res(mol, res2, aname2);
   if (!a1 || !a2) return -1;
-  tuple = memarena_alloc(mol->arena,sizeof(topo_mol_exclusion_t));
-  if ( ! tuple ) return -10;
-  tuple->next[0] = a1->exclusions;
-  tuple->atom[0] = a1;
-  tuple->next[1] = a2->exclusions;
-  tuple->atom[1] = a2;
-  tuple->del = 0;
-  a1->exclusions = tuple;
-  a2->exclusions = tuple;
-  return 0;
+  return topo_mol_link_exclusion(mol,a1,a2);
 }
 
 static int topo_mol_add_exclusion(topo_mol *mol, const topo_mol_ident_t *targets,
 				int ntargets, topo_defs_exclusion_t *def) {
-  topo_mol_exclusion_t *tuple;
   topo_mol_atom_t *a1, *a2;
   topo_mol_ident_t t1, t2;
   if (! mol) return -1;
@@ -915,16 +1570,7 @@ static int topo_mol_add_exclusion(topo_mol *mol, const topo_mol_ident_t *targets
   t2.aname = def->atom2;
   a2 = topo_mol_get_atom(mol,&t2,def->rel2);
   if ( ! a2 ) return -5;
-  tuple = memarena_alloc(mol->arena,sizeof(topo_mol_exclusion_t));
-  if ( ! tuple ) return -10;
-  tuple->next[0] = a1->exclusions;
-  tuple->atom[0] = a1;
-  tuple->next[1] = a2->exclusions;
-  tuple->atom[1] = a2;
-  tuple->del = 0;
-  a1->exclusions = tuple;
-  a2->exclusions = tuple;
-  return 0;
+  return topo_mol_link_exclusion(mol,a1,a2);
 }
 
 static void topo_mol_del_exclusion(topo_mol *mol, const topo_mol_ident_t *targets,
@@ -951,46 +1597,23 @@ static void topo_mol_del_exclusion(topo_mol *mol, const topo_mol_ident_t *target
 
 
 static int add_conformation_to_residues(topo_mol *mol,
-    const topo_mol_residue_t *res1, const char *aname1,
-    const topo_mol_residue_t *res2, const char *aname2,
-    const topo_mol_residue_t *res3, const char *aname3,
-    const topo_mol_residue_t *res4, const char *aname4,
+    topo_mol_residue_t *res1, const char *aname1,
+    topo_mol_residue_t *res2, const char *aname2,
+    topo_mol_residue_t *res3, const char *aname3,
+    topo_mol_residue_t *res4, const char *aname4,
     topo_defs_conformation_t *def) {
 
-  topo_mol_conformation_t *tuple;
   topo_mol_atom_t *a1, *a2, *a3, *a4;
-  a1 = topo_mol_get_atom_from_res(res1, aname1);
-  a2 = topo_mol_get_atom_from_res(res2, aname2);
-  a3 = topo_mol_get_atom_from_res(res3, aname3);
-  a4 = topo_mol_get_atom_from_res(res4, aname4);
+  a1 = topo_mol_get_atom_from_res(mol, res1, aname1);
+  a2 = topo_mol_get_atom_from_res(mol, res2, aname2);
+  a3 = topo_mol_get_atom_from_res(mol, res3, aname3);
+  a4 = topo_mol_get_atom_from_res(mol, res4, aname4);
   if (!a1 || !a2 || !a3 || !a4) return -1;
-  tuple = memarena_alloc(mol->arena,sizeof(topo_mol_conformation_t));
-  if ( ! tuple ) return -10;
-  tuple->next[0] = a1->conformations;
-  tuple->atom[0] = a1;
-  tuple->next[1] = a2->conformations;
-  tuple->atom[1] = a2;
-  tuple->next[2] = a3->conformations;
-  tuple->atom[2] = a3;
-  tuple->next[3] = a4->conformations;
-  tuple->atom[3] = a4;
-  tuple->del = 0;
-  tuple->improper = def->improper;
-  tuple->dist12 = def->dist12;
-  tuple->angle123 = def->angle123;
-  tuple->dihedral = def->dihedral;
-  tuple->angle234 = def->angle234;
-  tuple->dist34 = def->dist34;
-  a1->conformations = tuple;
-  a2->conformations = tuple;
-  a3->conformations = tuple;
-  a4->conformations = tuple;
-  return 0;
+  return topo_mol_link_conformation(mol,a1,a2,a3,a4,def);
 }
 
 static int topo_mol_add_conformation(topo_mol *mol, const topo_mol_ident_t *targets,
 				int ntargets, topo_defs_conformation_t *def) {
-  topo_mol_conformation_t *tuple;
   topo_mol_atom_t *a1, *a2, *a3, *a4;
   topo_mol_ident_t t1, t2, t3, t4;
   if (! mol) return -1;
@@ -1014,72 +1637,675 @@ static int topo_mol_add_conformation(topo_mol *mol, const topo_mol_ident_t *targ
   t4.aname = def->atom4;
   a4 = topo_mol_get_atom(mol,&t4,def->rel4);
   if ( ! a4 ) return -9;
-  tuple = memarena_alloc(mol->arena,sizeof(topo_mol_conformation_t));
-  if ( ! tuple ) return -10;
-  tuple->next[0] = a1->conformations;
-  tuple->atom[0] = a1;
-  tuple->next[1] = a2->conformations;
-  tuple->atom[1] = a2;
-  tuple->next[2] = a3->conformations;
-  tuple->atom[2] = a3;
-  tuple->next[3] = a4->conformations;
-  tuple->atom[3] = a4;
-  tuple->del = 0;
-  tuple->improper = def->improper;
-  tuple->dist12 = def->dist12;
-  tuple->angle123 = def->angle123;
-  tuple->dihedral = def->dihedral;
-  tuple->angle234 = def->angle234;
-  tuple->dist34 = def->dist34;
-  a1->conformations = tuple;
-  a2->conformations = tuple;
-  a3->conformations = tuple;
-  a4->conformations = tuple;
+  return topo_mol_link_conformation(mol,a1,a2,a3,a4,def);
+}
+
+static void topo_mol_del_conformation(topo_mol *mol, const topo_mol_ident_t *targets,
+				int ntargets, topo_defs_conformation_t *def) {
+  topo_mol_conformation_t *tuple;
+  topo_mol_atom_t *a1, *a2, *a3, *a4;
+  topo_mol_ident_t t1, t2, t3, t4;
+  if (! mol) return;
+  if ( def->res1 < 0 || def->res1 >= ntargets ) return;
+  t1 = targets[def->res1];
+  t1.aname = def->atom1;
+  a1 = topo_mol_get_atom(mol,&t1,def->rel1);
+  if ( ! a1 ) return;
+  if ( def->res2 < 0 || def->res2 >= ntargets ) return;
+  t2 = targets[def->res2];
+  t2.aname = def->atom2;
+  a2 = topo_mol_get_atom(mol,&t2,def->rel2);
+  if ( def->res3 < 0 || def->res3 >= ntargets ) return;
+  t3 = targets[def->res3];
+  t3.aname = def->atom3;
+  a3 = topo_mol_get_atom(mol,&t3,def->rel3);
+  if ( def->res4 < 0 || def->res4 >= ntargets ) return;
+  t4 = targets[def->res4];
+  t4.aname = def->atom4;
+  a4 = topo_mol_get_atom(mol,&t4,def->rel4);
+  for ( tuple = a1->conformations; tuple;
+		tuple = topo_mol_conformation_next(tuple,a1) ) {
+    if ( tuple->improper == def->improper
+	&&  tuple->atom[0] == a1 && tuple->atom[1] == a2
+	&& tuple->atom[2] == a3 && tuple->atom[3] == a4 ) tuple->del = 1;
+    if ( tuple->improper == def->improper
+	&& tuple->atom[0] == a4 && tuple->atom[1] == a3
+	&& tuple->atom[2] == a2 && tuple->atom[3] == a1 ) tuple->del = 1;
+  }
+}
+
+static int topo_mol_auto_angles(topo_mol *mol, topo_mol_segment_t *segp);
+static int topo_mol_auto_dihedrals(topo_mol *mol, topo_mol_segment_t *segp);
+
+static int topo_mol_end_segment(topo_mol *mol, topo_mol_segment_t *seg);
+static int topo_mol_apply_patch(topo_mol *mol,
+			const topo_mol_ident_t *targets,
+                        int ntargets, const char *rname, int prepend,
+			int warn_angles, int warn_dihedrals, int deflt);
+
+/* Returns the free list as it was at the mark: tuples allocated since
+   the mark leave it and those the build popped go back on.  Tuples are
+   only freed by topo_mol_compact, never during a build, so a popped
+   tuple is not on the list twice. */
+static void * topo_mol_free_rewind(void *head, topo_mol_poplog_t *log,
+			memarena *arena, const memarena_mark_t *mark) {
+  void *list, *prev, *tuple;
+  int i;
+  list = prev = 0;
+  for ( tuple = head; tuple; tuple = topo_mol_free_next(tuple) ) {
+    if ( memarena_since(arena,mark,tuple) ) continue;
+    if ( prev ) topo_mol_free_link(prev,tuple);
+    else list = tuple;
+    prev = tuple;
+  }
+  if ( prev ) topo_mol_free_link(prev,0);
+  for ( i=0; i<log->count; ++i ) {
+    if ( memarena_since(arena,mark,log->tuples[i]) ) continue;
+    topo_mol_free_link(log->tuples[i],list);
+    list = log->tuples[i];
+  }
+  return list;
+}
+
+/* Puts list a in front of list b. */
+static void * topo_mol_free_join(void *a, void *b) {
+  void *tuple, *next;
+  if ( ! a ) return b;
+  for ( tuple = a; (next = topo_mol_free_next(tuple)); tuple = next );
+  topo_mol_free_link(tuple,b);
+  return a;
+}
+
+static void topo_mol_poplog_free(topo_mol_poplog_t *log) {
+  int i;
+  for ( i=0; i<3; ++i ) {
+    free((void*)log[i].tuples);
+    log[i].tuples = 0;
+    log[i].count = log[i].max = 0;
+  }
+}
+
+/* Forget a segment whose build failed; its atoms and tuples are gone
+   with the arena rewind, so only the hash entries need to be dropped. */
+static void topo_mol_drop_segment(topo_mol *mol, topo_mol_segment_t *seg) {
+  int iseg;
+  iseg = hasharray_index(mol->segment_hash,seg->segid);
+  if ( iseg == HASHARRAY_FAIL ) return;
+  hasharray_destroy(seg->residue_hash);
+  mol->segment_array[iseg] = 0;
+  hasharray_delete(mol->segment_hash,seg->segid);
+}
+
+int topo_mol_end(topo_mol *mol) {
+  int rc, npatch;
+  topo_mol_patch_t *curpatch;
+  topo_mol_atom_t *deleted_atoms;
+  topo_mol_segment_t *seg;
+  memarena_mark_t mark, angle_mark, dihedral_mark;
+  topo_mol_poplog_t poplog[3];
+  char errmsg[64 + NAMEMAXLEN];
+
+  if ( ! mol ) return -1;
+  if ( ! mol->buildseg ) {
+    topo_mol_log_error(mol,"no segment in progress for end");
+    return -1;
+  }
+  seg = mol->buildseg;
+  mol->buildseg = 0;
+
+  memarena_mark(mol->arena,&mark);
+  memarena_mark(mol->angle_arena,&angle_mark);
+  memarena_mark(mol->dihedral_arena,&dihedral_mark);
+  npatch = mol->npatch;
+  curpatch = mol->curpatch;
+  deleted_atoms = mol->deleted_atoms;
+  memset(poplog,0,sizeof(poplog));
+  mol->poplog = poplog;
+
+  rc = topo_mol_end_segment(mol,seg);
+  mol->poplog = 0;
+  if ( rc ) {
+    /* everything built for this segment lives above the marks, apart
+       from the tuples it took from the free lists */
+    mol->bond_free = topo_mol_free_rewind(mol->bond_free,&poplog[0],
+					mol->arena,&mark);
+    mol->angle_free = topo_mol_free_rewind(mol->angle_free,&poplog[1],
+					mol->angle_arena,&angle_mark);
+    mol->dihedral_free = topo_mol_free_rewind(mol->dihedral_free,&poplog[2],
+					mol->dihedral_arena,&dihedral_mark);
+    memarena_rewind(mol->arena,&mark);
+    memarena_rewind(mol->angle_arena,&angle_mark);
+    memarena_rewind(mol->dihedral_arena,&dihedral_mark);
+    mol->npatch = npatch;
+    mol->curpatch = curpatch;
+    if ( curpatch ) curpatch->next = 0;
+    else mol->patches = 0;
+    mol->deleted_atoms = deleted_atoms;
+    ++mol->atom_edits;
+    sprintf(errmsg,"segment %s rolled back",seg->segid);
+    topo_mol_log_error(mol,errmsg);
+    topo_mol_drop_segment(mol,seg);
+  }
+  topo_mol_poplog_free(poplog);
+  return rc;
+}
+
+int topo_mol_end_later(topo_mol *mol) {
+  topo_mol_segment_t **queued;
+  if ( ! mol ) return -1;
+  if ( ! mol->buildseg ) {
+    topo_mol_log_error(mol,"no segment in progress for end");
+    return -1;
+  }
+  if ( mol->nqueued == mol->maxqueued ) {
+    queued = (topo_mol_segment_t **) realloc(mol->queued,
+		(2*mol->maxqueued+16)*sizeof(topo_mol_segment_t*));
+    if ( ! queued ) return -2;
+    mol->queued = queued;
+    mol->maxqueued = 2*mol->maxqueued+16;
+  }
+  mol->queued[mol->nqueued++] = mol->buildseg;
+  mol->buildseg = 0;
+  return 0;
+}
+
+/* A message or stdout text of a job, replayed when the job is merged */
+typedef struct topo_mol_msg_t {
+  struct topo_mol_msg_t *next;
+  int out;
+  char text[1];
+} topo_mol_msg_t;
+
+/* One queued segment, ended on a private shallow copy of the molecule
+   that shares its definitions and segments but allocates from arenas
+   of its own and numbers atom serials from 0. */
+typedef struct topo_mol_job_t {
+  topo_mol mol;
+  topo_mol_segment_t *seg;
+  int rc;
+  /* tuples taken from the free lists, and the arenas when empty */
+  topo_mol_poplog_t poplog[3];
+  memarena_mark_t marks[3];
+  memarena *msgarena;
+  topo_mol_msg_t *msgs, **lastmsg;
+} topo_mol_job_t;
+
+static void topo_mol_job_msg(topo_mol_job_t *job, int out, const char *text) {
+  topo_mol_msg_t *m;
+  m = memarena_alloc(job->msgarena,sizeof(topo_mol_msg_t)+strlen(text));
+  if ( ! m ) return;
+  m->next = 0;
+  m->out = out;
+  strcpy(m->text,text);
+  *(job->lastmsg) = m;
+  job->lastmsg = &(m->next);
+}
+
+static int topo_mol_job_init(topo_mol_job_t *job, topo_mol *mol,
+					topo_mol_segment_t *seg) {
+  topo_mol *jmol = &(job->mol);
+  *jmol = *mol;
+  jmol->npatch = 0;
+  jmol->patches = 0;
+  jmol->curpatch = 0;
+  jmol->buildseg = 0;
+  jmol->nqueued = 0;
+  jmol->maxqueued = 0;
+  jmol->queued = 0;
+  jmol->job = job;
+  jmol->arena = memarena_spawn(mol->arena);
+  jmol->angle_arena = memarena_spawn(mol->angle_arena);
+  jmol->dihedral_arena = memarena_spawn(mol->dihedral_arena);
+  jmol->index_arena = memarena_spawn(mol->index_arena);
+  jmol->atom_index_on = 0;
+  jmol->atom_index_stamp = 0;
+  memset(&(jmol->atom_index),0,sizeof(hash_t));
+  jmol->atom_index_atoms = 0;
+  jmol->atom_index_res = 0;
+  jmol->atom_index_keys = 0;
+  jmol->deleted_atoms = 0;
+  jmol->bond_free = 0;
+  jmol->angle_free = 0;
+  jmol->dihedral_free = 0;
+  jmol->poplog = job->poplog;
+  jmol->nserial = 0;
+  jmol->nvelblocks = 0;
+  jmol->velblocks = 0;
+  job->seg = seg;
+  job->rc = 0;
+  job->msgarena = memarena_create();
+  job->msgs = 0;
+  job->lastmsg = &(job->msgs);
+  if ( ! jmol->arena || ! jmol->angle_arena || ! jmol->dihedral_arena ||
+       ! jmol->index_arena || ! job->msgarena ) return -2;
+  memarena_mark(jmol->arena,&(job->marks[0]));
+  memarena_mark(jmol->angle_arena,&(job->marks[1]));
+  memarena_mark(jmol->dihedral_arena,&(job->marks[2]));
+  return 0;
+}
+
+static void topo_mol_job_free(topo_mol_job_t *job) {
+  memarena_destroy(job->mol.arena);
+  memarena_destroy(job->mol.angle_arena);
+  memarena_destroy(job->mol.dihedral_arena);
+  memarena_destroy(job->mol.index_arena);
+  memarena_destroy(job->msgarena);
+  topo_mol_poplog_free(job->poplog);
+}
+
+/* Takes back the free tuples a job holds, and those a failed job
+   popped. */
+static void topo_mol_job_give_back(topo_mol *mol, topo_mol_job_t *job) {
+  topo_mol *jmol = &(job->mol);
+  if ( job->rc ) {
+    jmol->bond_free = topo_mol_free_rewind(jmol->bond_free,
+		&(job->poplog[0]),jmol->arena,&(job->marks[0]));
+    jmol->angle_free = topo_mol_free_rewind(jmol->angle_free,
+		&(job->poplog[1]),jmol->angle_arena,&(job->marks[1]));
+    jmol->dihedral_free = topo_mol_free_rewind(jmol->dihedral_free,
+		&(job->poplog[2]),jmol->dihedral_arena,&(job->marks[2]));
+  }
+  mol->bond_free = topo_mol_free_join(jmol->bond_free,mol->bond_free);
+  mol->angle_free = topo_mol_free_join(jmol->angle_free,mol->angle_free);
+  mol->dihedral_free = topo_mol_free_join(jmol->dihedral_free,
+						mol->dihedral_free);
+}
+
+static void topo_mol_job_run(topo_mol_job_t *job) {
+  job->rc = topo_mol_end_segment(&(job->mol),job->seg);
+}
+
+/* Lazy definitions are parsed on first use, so those of the queued
+   segments are looked up here before the jobs share them. */
+static topo_defs_residue_t * topo_mol_job_def(topo_mol *mol,
+						const char *name) {
+  int idef;
+  idef = hasharray_index(mol->defs->residue_hash,name);
+  if ( idef == HASHARRAY_FAIL ) return 0;
+  return topo_defs_get_residue(mol->defs,idef);
+}
+
+static void topo_mol_job_defs(topo_mol *mol, topo_mol_segment_t *seg) {
+  topo_defs_residue_t *first, *last;
+  int i, n;
+  n = hasharray_count(seg->residue_hash);
+  if ( n < 1 ) return;
+  for ( i=1; i<n-1; ++i )
+    topo_mol_job_def(mol,topo_mol_seg_residue(seg,i)->name);
+  first = topo_mol_job_def(mol,topo_mol_seg_residue(seg,0)->name);
+  last = topo_mol_job_def(mol,topo_mol_seg_residue(seg,n-1)->name);
+  if ( strlen(seg->pfirst) ) topo_mol_job_def(mol,seg->pfirst);
+  else if ( first ) topo_mol_job_def(mol,first->pfirst);
+  if ( strlen(seg->plast) ) topo_mol_job_def(mol,seg->plast);
+  else if ( last ) topo_mol_job_def(mol,last->plast);
+}
+
+#ifdef TOPO_MOL_HAVE_THREADS
+typedef struct topo_mol_worker_t {
+  topo_mol_job_t *jobs;
+  int njobs, first, stride;
+} topo_mol_worker_t;
+
+static void * topo_mol_worker(void *arg) {
+  topo_mol_worker_t *w = (topo_mol_worker_t *) arg;
+  int i;
+  for ( i = w->first; i < w->njobs; i += w->stride )
+    topo_mol_job_run(&w->jobs[i]);
+  return 0;
+}
+#endif
+
+/* Runs the jobs on up to nthreads threads, returns when all are done. */
+static void topo_mol_run_jobs(topo_mol_job_t *jobs, int njobs, int nthreads) {
+#ifdef TOPO_MOL_HAVE_THREADS
+  pthread_t *threads;
+  topo_mol_worker_t *workers;
+  int i, started;
+  if ( njobs < 1 ) return;
+  if ( nthreads <= 0 ) {
+    long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    nthreads = ncpu > 0 ? (int) ncpu : 1;
+  }
+  if ( nthreads > njobs ) nthreads = njobs;
+  threads = (pthread_t *) malloc(nthreads * sizeof(pthread_t));
+  workers = (topo_mol_worker_t *) malloc(nthreads * sizeof(topo_mol_worker_t));
+  if ( nthreads > 1 && threads && workers ) {
+    for ( i=0; i<nthreads; ++i ) {
+      workers[i].jobs = jobs;
+      workers[i].njobs = njobs;
+      workers[i].first = i;
+      workers[i].stride = nthreads;
+    }
+    /* thread 0 is this one; a worker that fails to start runs here */
+    for ( started=1; started<nthreads; ++started ) {
+      if ( pthread_create(&threads[started],0,topo_mol_worker,&workers[started]) )
+        break;
+    }
+    for ( i=started; i<nthreads; ++i ) topo_mol_worker(&workers[i]);
+    topo_mol_worker(&workers[0]);
+    for ( i=1; i<started; ++i ) pthread_join(threads[i],0);
+    free(threads);
+    free(workers);
+    return;
+  }
+  free(threads);
+  free(workers);
+#endif
+  for ( ; njobs; --njobs, ++jobs ) topo_mol_job_run(jobs);
+}
+
+/* Moves what a successful job built into the molecule as if it had
+   been built there: serials continue from mol->nserial, patches and
+   deleted atoms are appended, and every atom index the job made is
+   stale. */
+static void topo_mol_job_merge(topo_mol *mol, topo_mol_job_t *job) {
+  topo_mol *jmol = &(job->mol);
+  topo_mol_segment_t *seg = job->seg;
+  topo_mol_residue_t *res;
+  topo_mol_atom_t *atom;
+  int i, n;
+
+  if ( jmol->atom_edits > mol->atom_edits ) mol->atom_edits = jmol->atom_edits;
+  ++mol->atom_edits;
+  n = hasharray_count(seg->residue_hash);
+  for ( i=0; i<n; ++i ) {
+    res = topo_mol_seg_residue(seg,i);
+    res->indexstamp = mol->atom_edits - 1;
+    if ( res->inst ) res->inst->serial += mol->nserial;
+    for ( atom = res->atoms; atom; atom = atom->next ) {
+      atom->serial += mol->nserial;
+    }
+  }
+  if ( seg->proto ) seg->proto->res.indexstamp = mol->atom_edits - 1;
+  if ( jmol->deleted_atoms ) {
+    for ( atom = jmol->deleted_atoms; ; atom = atom->next ) {
+      atom->serial += mol->nserial;
+      if ( ! atom->next ) break;
+    }
+    atom->next = mol->deleted_atoms;
+    mol->deleted_atoms = jmol->deleted_atoms;
+  }
+  mol->nserial += jmol->nserial;
+
+  if ( jmol->npatch ) {
+    if ( mol->npatch ) mol->curpatch->next = jmol->patches;
+    else mol->patches = jmol->patches;
+    mol->curpatch = jmol->curpatch;
+    mol->npatch += jmol->npatch;
+  }
+
+  memarena_adopt(mol->arena,jmol->arena);
+  memarena_adopt(mol->angle_arena,jmol->angle_arena);
+  memarena_adopt(mol->dihedral_arena,jmol->dihedral_arena);
+  memarena_adopt(mol->index_arena,jmol->index_arena);
+}
+
+int topo_mol_end_queued(topo_mol *mol, int nthreads) {
+  topo_mol_pool_t pool;
+  topo_mol_job_t *jobs;
+  topo_mol_msg_t *m;
+  int i, njobs, nfailed;
+  char errmsg[64 + NAMEMAXLEN];
+
+  if ( ! mol ) return -1;
+  njobs = mol->nqueued;
+  mol->nqueued = 0;
+  if ( ! njobs ) return 0;
+  jobs = (topo_mol_job_t *) calloc(njobs,sizeof(topo_mol_job_t));
+  for ( i=0; jobs && i<njobs; ++i ) {
+    if ( topo_mol_job_init(&jobs[i],mol,mol->queued[i]) ) {
+      for ( ; i>=0; --i ) topo_mol_job_free(&jobs[i]);
+      free((void*)jobs);
+      jobs = 0;
+    }
+  }
+  if ( ! jobs ) {
+    /* no room for the jobs, end the segments here */
+    for ( nfailed=0, i=0; i<njobs; ++i ) {
+      mol->buildseg = mol->queued[i];
+      if ( topo_mol_end(mol) ) ++nfailed;
+    }
+    return nfailed;
+  }
+
+  for ( i=0; i<njobs; ++i ) topo_mol_job_defs(mol,jobs[i].seg);
+#ifdef TOPO_MOL_HAVE_THREADS
+  pthread_mutex_init(&(pool.lock),0);
+#endif
+  pool.free[0] = mol->bond_free;  mol->bond_free = 0;
+  pool.free[1] = mol->angle_free;  mol->angle_free = 0;
+  pool.free[2] = mol->dihedral_free;  mol->dihedral_free = 0;
+  for ( i=0; i<njobs; ++i ) jobs[i].mol.pool = &pool;
+  topo_mol_run_jobs(jobs,njobs,nthreads);
+#ifdef TOPO_MOL_HAVE_THREADS
+  pthread_mutex_destroy(&(pool.lock));
+#endif
+  mol->bond_free = (topo_mol_bond_t*) pool.free[0];
+  mol->angle_free = (topo_mol_angle_t*) pool.free[1];
+  mol->dihedral_free = (topo_mol_dihedral_t*) pool.free[2];
+
+  /* merge in order, as if the segments had been ended one by one */
+  nfailed = 0;
+  for ( i=0; i<njobs; ++i ) {
+    for ( m = jobs[i].msgs; m; m = m->next ) {
+      if ( m->out ) printf("%s",m->text);
+      else topo_mol_log_error(mol,m->text);
+    }
+    if ( jobs[i].rc ) {
+      /* everything built for the segment is in the job arenas */
+      ++mol->atom_edits;
+      sprintf(errmsg,"segment %s rolled back",jobs[i].seg->segid);
+      topo_mol_log_error(mol,errmsg);
+      topo_mol_drop_segment(mol,jobs[i].seg);
+      ++nfailed;
+    } else {
+      topo_mol_job_merge(mol,&jobs[i]);
+    }
+    topo_mol_job_give_back(mol,&jobs[i]);
+    topo_mol_job_free(&jobs[i]);
+  }
+  free((void*)jobs);
+  return nfailed;
+}
+
+/* The residues of a segment being built, with the atoms added for each
+   slot of their compiled templates. */
+typedef struct topo_mol_build_t {
+  int n;
+  int *idef;  /* residue definition of each residue */
+  int *base;  /* first slot of each residue, -1 if not compiled */
+  topo_mol_atom_t **slots;
+  int nslots, maxslots;
+} topo_mol_build_t;
+
+static int topo_mol_build_slot(topo_mol_build_t *b, topo_mol_atom_t *atom) {
+  topo_mol_atom_t **slots;
+  if ( b->nslots == b->maxslots ) {
+    slots = (topo_mol_atom_t **) realloc(b->slots,
+		(2*b->maxslots+64)*sizeof(topo_mol_atom_t*));
+    if ( ! slots ) return -1;
+    b->slots = slots;
+    b->maxslots = 2*b->maxslots+64;
+  }
+  b->slots[b->nslots++] = atom;
+  return 0;
+}
+
+/* The count atoms of an entry of residue i from the compiled templates;
+   nonzero if any of them has to be found by name, which is how missing
+   atoms and residues get reported. */
+static int topo_mol_build_atoms(topo_mol *mol, const topo_mol_build_t *b,
+		int i, const topo_defs_ref_t *ref, int count,
+		topo_mol_atom_t **al) {
+  topo_defs_residue_t *resdef;
+  int j, ires, slot;
+  for ( j=0; j<count; ++j ) {
+    ires = i + ref[j].rel;
+    if ( ref[j].name < 0 || ires < 0 || ires >= b->n ) return -1;
+    if ( b->base[ires] < 0 ) return -1;
+    slot = ref[j].slot;
+    if ( ref[j].rel ) {
+      resdef = topo_defs_get_residue(mol->defs,b->idef[ires]);
+      slot = topo_defs_template_slot(resdef->compiled,ref[j].name);
+      if ( slot < 0 ) return -1;
+    }
+    al[j] = b->slots[b->base[ires] + slot];
+  }
   return 0;
 }
 
-static void topo_mol_del_conformation(topo_mol *mol, const topo_mol_ident_t *targets,
-				int ntargets, topo_defs_conformation_t *def) {
-  topo_mol_conformation_t *tuple;
-  topo_mol_atom_t *a1, *a2, *a3, *a4;
-  topo_mol_ident_t t1, t2, t3, t4;
-  if (! mol) return;
-  if ( def->res1 < 0 || def->res1 >= ntargets ) return;
-  t1 = targets[def->res1];
-  t1.aname = def->atom1;
-  a1 = topo_mol_get_atom(mol,&t1,def->rel1);
-  if ( ! a1 ) return;
-  if ( def->res2 < 0 || def->res2 >= ntargets ) return;
-  t2 = targets[def->res2];
-  t2.aname = def->atom2;
-  a2 = topo_mol_get_atom(mol,&t2,def->rel2);
-  if ( def->res3 < 0 || def->res3 >= ntargets ) return;
-  t3 = targets[def->res3];
-  t3.aname = def->atom3;
-  a3 = topo_mol_get_atom(mol,&t3,def->rel3);
-  if ( def->res4 < 0 || def->res4 >= ntargets ) return;
-  t4 = targets[def->res4];
-  t4.aname = def->atom4;
-  a4 = topo_mol_get_atom(mol,&t4,def->rel4);
-  for ( tuple = a1->conformations; tuple;
-		tuple = topo_mol_conformation_next(tuple,a1) ) {
-    if ( tuple->improper == def->improper
-	&&  tuple->atom[0] == a1 && tuple->atom[1] == a2
-	&& tuple->atom[2] == a3 && tuple->atom[3] == a4 ) tuple->del = 1;
-    if ( tuple->improper == def->improper
-	&& tuple->atom[0] == a4 && tuple->atom[1] == a3
-	&& tuple->atom[2] == a2 && tuple->atom[3] == a1 ) tuple->del = 1;
+/* Segments of many copies of one residue with no entries between
+   residues, like water and ions, share the atoms and entries of one
+   proto residue built from the template, and each residue only keeps
+   its coordinates; see topo_mol_instance_t.  Returns 1 if the segment
+   was built, 0 if it has to be built residue by residue, or an error
+   code. */
+static int topo_mol_instance_segment(topo_mol *mol, topo_mol_segment_t *seg,
+				int *firstdefault, int *lastdefault) {
+  int i, j, k, n, idef, natoms, rc;
+  topo_mol_residue_t *res;
+  topo_defs_residue_t *resdef;
+  topo_defs_template_t *t;
+  topo_defs_atom_t *atomdef;
+  topo_defs_type_t *atype;
+  topo_defs_conformation_t *confdef;
+  topo_defs_ref_t *r;
+  topo_mol_proto_t *proto;
+  topo_mol_instance_t *inst;
+  topo_mol_atom_t *atom, **a, *al[8];
+  char errmsg[128];
+
+  n = hasharray_count(seg->residue_hash);
+  if ( n < 2 ) return 0;
+  res = topo_mol_seg_residue(seg,0);
+  idef = hasharray_index(mol->defs->residue_hash,res->name);
+  if ( idef == HASHARRAY_FAIL ) return 0;
+  resdef = topo_defs_get_residue(mol->defs,idef);
+  t = resdef->compiled;
+  if ( resdef->patch || ! t || ! t->closed || ! t->natoms ) return 0;
+  for ( k=0; k<t->natoms && t->types[k] >= 0; ++k );
+  if ( k < t->natoms ) return 0;
+  for ( i=1; i<n; ++i ) {
+    if ( strcmp(topo_mol_seg_residue(seg,i)->name,res->name) ) return 0;
+  }
+
+  natoms = t->natoms;
+  a = (topo_mol_atom_t**) malloc(natoms*sizeof(topo_mol_atom_t*));
+  if ( ! a ) return 0;
+  proto = (topo_mol_proto_t*) memarena_alloc(mol->arena,
+		sizeof(topo_mol_proto_t) + natoms*sizeof(topo_mol_atom_t));
+  if ( ! proto ) {
+    free((void*)a);
+    return -2;
+  }
+  memset(proto,0,sizeof(topo_mol_proto_t));
+  strcpy(proto->res.name,res->name);
+  proto->natoms = natoms;
+  proto->atoms = (topo_mol_atom_t*) ( proto + 1 );
+  proto->res.atoms = proto->atoms;
+
+  if ( ! strlen(seg->pfirst) ) {
+    strcpy(seg->pfirst,resdef->pfirst);
+    *firstdefault = 1;
+  }
+  if ( ! strlen(seg->plast) ) {
+    strcpy(seg->plast,resdef->plast);
+    *lastdefault = 1;
+  }
+
+  /* atoms in list order, each added at the head as topo_mol_add_atom does */
+  for ( k=0, atomdef = resdef->atoms; atomdef; atomdef = atomdef->next, ++k ) {
+    atom = a[k] = proto->atoms + natoms - 1 - k;
+    memset(atom,0,sizeof(topo_mol_atom_t));
+    atom->next = ( k ? a[k-1] : 0 );
+    atom->name = atomdef->namesym;
+    atom->type = atomdef->typesym;
+    atom->charge = atomdef->charge;
+    atype = &(mol->defs->type_array[t->types[k]]);
+    atom->element = atype->elementsym;
+    atom->mass = atype->mass;
+    atom->xyz_state = TOPO_MOL_XYZ_VOID;
+  }
+  ++mol->atom_edits;
+
+  /* entries, in the order topo_mol_build_segment links them */
+  rc = 0;
+  for ( j=0, r = t->bonds; j<t->nbonds; ++j, r += 2 ) {
+    rc |= topo_mol_link_bond(mol,a[r[0].slot],a[r[1].slot]);
+  }
+  for ( j=0, r = t->angles; j<t->nangles; ++j, r += 3 ) {
+    rc |= topo_mol_link_angle(mol,a[r[0].slot],a[r[1].slot],a[r[2].slot]);
   }
+  for ( j=0, r = t->dihedrals; j<t->ndihedrals; ++j, r += 4 ) {
+    rc |= topo_mol_link_dihedral(mol,a[r[0].slot],a[r[1].slot],
+					a[r[2].slot],a[r[3].slot]);
+  }
+  for ( j=0, r = t->impropers; j<t->nimpropers; ++j, r += 4 ) {
+    rc |= topo_mol_link_improper(mol,a[r[0].slot],a[r[1].slot],
+					a[r[2].slot],a[r[3].slot]);
+  }
+  for ( j=0, r = t->cmaps; j<t->ncmaps; ++j, r += 8 ) {
+    for ( k=0; k<8; ++k ) al[k] = a[r[k].slot];
+    rc |= topo_mol_link_cmap(mol,al);
+  }
+  for ( j=0, r = t->exclusions; j<t->nexclusions; ++j, r += 2 ) {
+    rc |= topo_mol_link_exclusion(mol,a[r[0].slot],a[r[1].slot]);
+  }
+  for ( r = t->conformations, confdef = resdef->conformations; confdef;
+				confdef = confdef->next, r += 4 ) {
+    rc |= topo_mol_link_conformation(mol,a[r[0].slot],a[r[1].slot],
+					a[r[2].slot],a[r[3].slot],confdef);
+  }
+  free((void*)a);
+  if ( rc ) return -2;
+
+  for ( i=0; i<n; ++i ) {
+    res = topo_mol_seg_residue(seg,i);
+    inst = (topo_mol_instance_t*) memarena_alloc(mol->arena,
+		sizeof(topo_mol_instance_t) +
+		(natoms-1)*sizeof(topo_mol_instatom_t));
+    if ( ! inst ) return -2;
+    inst->proto = proto;
+    inst->serial = mol->nserial;
+    inst->atomid = -1;
+    memset(inst->atoms,0,natoms*sizeof(topo_mol_instatom_t));
+    mol->nserial += natoms;
+    res->inst = inst;
+    if ( seg->auto_angles && t->nangles ) {
+      sprintf(errmsg,"Warning: explicit angles in residue %s:%s will be deleted during autogeneration",res->name,res->resid);
+      topo_mol_log_error(mol,errmsg);
+    }
+    if ( seg->auto_dihedrals && t->ndihedrals ) {
+      sprintf(errmsg,"Warning: explicit dihedrals in residue %s:%s will be deleted during autogeneration",res->name,res->resid);
+      topo_mol_log_error(mol,errmsg);
+    }
+  }
+  seg->proto = proto;
+  return 1;
 }
 
-static int topo_mol_auto_angles(topo_mol *mol, topo_mol_segment_t *segp);
-static int topo_mol_auto_dihedrals(topo_mol *mol, topo_mol_segment_t *segp);
+static int topo_mol_build_segment(topo_mol *mol, topo_mol_segment_t *seg,
+						topo_mol_build_t *b);
+
+static int topo_mol_end_segment(topo_mol *mol, topo_mol_segment_t *seg) {
+  topo_mol_build_t b;
+  int rc;
+  memset(&b,0,sizeof(b));
+  rc = topo_mol_build_segment(mol,seg,&b);
+  free((void*)b.idef);
+  free((void*)b.slots);
+  return rc;
+}
 
-int topo_mol_end(topo_mol *mol) {
-  int i,n;
-  int idef;
+static int topo_mol_build_segment(topo_mol *mol, topo_mol_segment_t *seg,
+						topo_mol_build_t *b) {
+  int i,n,k;
+  int idef, inst;
   topo_defs *defs;
-  topo_mol_segment_t *seg;
+  topo_defs_template_t *t;
+  topo_defs_ref_t *ref;
+  topo_mol_atom_t *al[8];
+  int sameres;
   topo_mol_residue_t *res;
   topo_defs_residue_t *resdef;
   topo_defs_atom_t *atomdef;
@@ -1094,31 +2320,35 @@ int topo_mol_end(topo_mol *mol) {
   char errmsg[128];
   int firstdefault=0, lastdefault=0;
 
-  if ( ! mol ) return -1;
-  if ( ! mol->buildseg ) {
-    topo_mol_log_error(mol,"no segment in progress for end");
-    return -1;
-  }
-  seg = mol->buildseg;
-  mol->buildseg = 0;
   defs = mol->defs;
 
-  /* add atoms */
+  /* add atoms, unless the segment could be instanced */
   n = hasharray_count(seg->residue_hash);
-  for ( i=0; i<n; ++i ) {
-    res = &(seg->residue_array[i]);
+  inst = topo_mol_instance_segment(mol,seg,&firstdefault,&lastdefault);
+  if ( inst < 0 ) return inst;
+  if ( ! inst ) {
+    b->idef = (int*) malloc(2*(n+1)*sizeof(int));
+    if ( ! b->idef ) return -2;
+    b->base = b->idef + n + 1;
+    b->n = n;
+  }
+  for ( i = ( inst ? n : 0 ); i<n; ++i ) {
+    res = topo_mol_seg_residue(seg,i);
     idef = hasharray_index(defs->residue_hash,res->name);
     if ( idef == HASHARRAY_FAIL ) {
       sprintf(errmsg,"unknown residue type %s",res->name);
       topo_mol_log_error(mol,errmsg);
       return -1;
     }
-    resdef = &(mol->defs->residue_array[idef]);
+    resdef = topo_defs_get_residue(mol->defs,idef);
     if ( resdef->patch ) {
       sprintf(errmsg,"unknown residue type %s",res->name);
       topo_mol_log_error(mol,errmsg);
       return -1;
     }
+    b->idef[i] = idef;
+    t = resdef->compiled;
+    b->base[i] = ( t ? b->nslots : -1 );
 
     /* patches */
     if ( i==0 && ! strlen(seg->pfirst) ) {
@@ -1130,28 +2360,31 @@ int topo_mol_end(topo_mol *mol) {
       lastdefault = 1;
     }
 
-    for ( atomdef = resdef->atoms; atomdef; atomdef = atomdef->next ) {
-      if ( topo_mol_add_atom(mol,&(res->atoms),0,atomdef) ) {
+    for ( k=0, atomdef = resdef->atoms; atomdef; atomdef = atomdef->next, ++k ) {
+      if ( topo_mol_add_atom(mol,&(res->atoms),0,atomdef,
+				t ? t->types[k] : -1) ) {
         sprintf(errmsg,"add atom failed in residue %s:%s",res->name,res->resid);
         topo_mol_log_error(mol,errmsg);
         return -8;
       }
+      /* the new atom is at the head of the list */
+      if ( t && topo_mol_build_slot(b,res->atoms) ) return -2;
     }
   }
 
-  for ( i=0; i<n; ++i ) {
-    res = &(seg->residue_array[i]);
-    idef = hasharray_index(defs->residue_hash,res->name);
-    if ( idef == HASHARRAY_FAIL ) {
-      sprintf(errmsg,"unknown residue type %s",res->name);
-      topo_mol_log_error(mol,errmsg);
-      return -1;
-    }
-    resdef = &(mol->defs->residue_array[idef]);
+  /* entries whose atoms all come from templates skip the name lookups */
+  for ( i = ( inst ? n : 0 ); i<n; ++i ) {
+    res = topo_mol_seg_residue(seg,i);
+    resdef = topo_defs_get_residue(mol->defs,b->idef[i]);
+    t = ( b->base[i] < 0 ? 0 : resdef->compiled );
     target.segid = seg->segid;
     target.resid = res->resid;
-    for ( bonddef = resdef->bonds; bonddef; bonddef = bonddef->next ) {
+    sameres = ( hasharray_index(seg->residue_hash,res->resid) == i );
+    for ( ref = t ? t->bonds : 0, bonddef = resdef->bonds; bonddef;
+				bonddef = bonddef->next, ref += 2 ) {
       int ires1, ires2;
+      if ( t && ! topo_mol_build_atoms(mol,b,i,ref,2,al) &&
+           ! topo_mol_link_bond(mol,al[0],al[1]) ) continue;
       if (bonddef->res1 != 0 || bonddef->res2 != 0) {
         /*
          * XXX This should be caught much earlier, like when the topology
@@ -1171,8 +2404,8 @@ int topo_mol_end(topo_mol *mol) {
         continue;
       }
       if (add_bond_to_residues(mol,
-            &(seg->residue_array[ires1]), bonddef->atom1,
-            &(seg->residue_array[ires2]), bonddef->atom2)) {
+            topo_mol_seg_residue(seg,ires1), bonddef->atom1,
+            topo_mol_seg_residue(seg,ires2), bonddef->atom2)) {
         sprintf(errmsg,
             "ERROR: Missing atoms for bond %s(%d) %s(%d) in residue %s:%s",
             bonddef->atom1,bonddef->rel1,bonddef->atom2,bonddef->rel2,
@@ -1184,7 +2417,10 @@ int topo_mol_end(topo_mol *mol) {
       sprintf(errmsg,"Warning: explicit angles in residue %s:%s will be deleted during autogeneration",res->name,res->resid);
       topo_mol_log_error(mol,errmsg);
     }
-    for ( angldef = resdef->angles; angldef; angldef = angldef->next ) {
+    for ( ref = t ? t->angles : 0, angldef = resdef->angles; angldef;
+				angldef = angldef->next, ref += 3 ) {
+      if ( t && sameres && ! topo_mol_build_atoms(mol,b,i,ref,3,al) &&
+           ! topo_mol_link_angle(mol,al[0],al[1],al[2]) ) continue;
       if ( topo_mol_add_angle(mol,&target,1,angldef) ) {
         sprintf(errmsg,"Warning: add angle failed in residue %s:%s",res->name,res->resid);
         topo_mol_log_error(mol,errmsg);
@@ -1194,14 +2430,20 @@ int topo_mol_end(topo_mol *mol) {
       sprintf(errmsg,"Warning: explicit dihedrals in residue %s:%s will be deleted during autogeneration",res->name,res->resid);
       topo_mol_log_error(mol,errmsg);
     }
-    for ( dihedef = resdef->dihedrals; dihedef; dihedef = dihedef->next ) {
+    for ( ref = t ? t->dihedrals : 0, dihedef = resdef->dihedrals; dihedef;
+				dihedef = dihedef->next, ref += 4 ) {
+      if ( t && sameres && ! topo_mol_build_atoms(mol,b,i,ref,4,al) &&
+           ! topo_mol_link_dihedral(mol,al[0],al[1],al[2],al[3]) ) continue;
       if ( topo_mol_add_dihedral(mol,&target,1,dihedef) ) {
         sprintf(errmsg,"Warning: add dihedral failed in residue %s:%s",res->name,res->resid);
         topo_mol_log_error(mol,errmsg);
       }
     }
-    for ( imprdef = resdef->impropers; imprdef; imprdef = imprdef->next ) {
+    for ( ref = t ? t->impropers : 0, imprdef = resdef->impropers; imprdef;
+				imprdef = imprdef->next, ref += 4 ) {
       int ires1, ires2, ires3, ires4;
+      if ( t && ! topo_mol_build_atoms(mol,b,i,ref,4,al) &&
+           ! topo_mol_link_improper(mol,al[0],al[1],al[2],al[3]) ) continue;
       if (imprdef->res1 != 0 || imprdef->res2 != 0 || imprdef->res3 != 0 ||
           imprdef->res4 != 0) {
         sprintf(errmsg, "ERROR: Bad improper definition %s %s-%s-%s-%s; skipping.",
@@ -1223,10 +2465,10 @@ int topo_mol_end(topo_mol *mol) {
         continue;
       }
       if (add_improper_to_residues(mol,
-            &(seg->residue_array[ires1]), imprdef->atom1,
-            &(seg->residue_array[ires2]), imprdef->atom2,
-            &(seg->residue_array[ires3]), imprdef->atom3,
-            &(seg->residue_array[ires4]), imprdef->atom4)) {
+            topo_mol_seg_residue(seg,ires1), imprdef->atom1,
+            topo_mol_seg_residue(seg,ires2), imprdef->atom2,
+            topo_mol_seg_residue(seg,ires3), imprdef->atom3,
+            topo_mol_seg_residue(seg,ires4), imprdef->atom4)) {
         sprintf(errmsg,
             "ERROR: Missing atoms for improper %s(%d) %s(%d) %s(%d) %s(%d)\n\tin residue %s:%s",
             imprdef->atom1,imprdef->rel1,imprdef->atom2,imprdef->rel2,
@@ -1235,10 +2477,13 @@ int topo_mol_end(topo_mol *mol) {
         topo_mol_log_error(mol, errmsg);
       }
     }
-    for ( cmapdef = resdef->cmaps; cmapdef; cmapdef = cmapdef->next ) {
+    for ( ref = t ? t->cmaps : 0, cmapdef = resdef->cmaps; cmapdef;
+				cmapdef = cmapdef->next, ref += 8 ) {
       int j, iresl[8];
-      const topo_mol_residue_t *resl[8];
+      topo_mol_residue_t *resl[8];
       const char *atoml[8];
+      if ( t && ! topo_mol_build_atoms(mol,b,i,ref,8,al) &&
+           ! topo_mol_link_cmap(mol,al) ) continue;
       for ( j=0; j<8 && (cmapdef->resl[j] == 0); ++j );
       if ( j != 8 ) {
         sprintf(errmsg, "ERROR: Bad cross-term definition %s %s-%s-%s-%s-%s-%s-%s-%s; skipping.",
@@ -1262,7 +2507,7 @@ int topo_mol_end(topo_mol *mol) {
         continue;
       }
       for ( j=0; j<8; ++j ) {
-        resl[j] = &seg->residue_array[iresl[j]];
+        resl[j] = topo_mol_seg_residue(seg,iresl[j]);
         atoml[j] = cmapdef->atoml[j];
       }
       if (add_cmap_to_residues(mol, resl, atoml) ) {
@@ -1280,8 +2525,11 @@ int topo_mol_end(topo_mol *mol) {
         topo_mol_log_error(mol, errmsg);
       }
     }
-    for ( excldef = resdef->exclusions; excldef; excldef = excldef->next ) {
+    for ( ref = t ? t->exclusions : 0, excldef = resdef->exclusions; excldef;
+				excldef = excldef->next, ref += 2 ) {
       int ires1, ires2;
+      if ( t && ! topo_mol_build_atoms(mol,b,i,ref,2,al) &&
+           ! topo_mol_link_exclusion(mol,al[0],al[1]) ) continue;
       if (excldef->res1 != 0 || excldef->res2 != 0) {
         sprintf(errmsg, "ERROR: Bad exclusion definition %s %s-%s; skipping.",
             res->name, excldef->atom1, excldef->atom2);
@@ -1297,8 +2545,8 @@ int topo_mol_end(topo_mol *mol) {
         continue;
       }
       if (add_exclusion_to_residues(mol,
-            &(seg->residue_array[ires1]), excldef->atom1,
-            &(seg->residue_array[ires2]), excldef->atom2)) {
+            topo_mol_seg_residue(seg,ires1), excldef->atom1,
+            topo_mol_seg_residue(seg,ires2), excldef->atom2)) {
         sprintf(errmsg,
             "ERROR: Missing atoms for exclusion %s(%d) %s(%d) in residue %s:%s",
             excldef->atom1,excldef->rel1,excldef->atom2,excldef->rel2,
@@ -1307,8 +2555,12 @@ int topo_mol_end(topo_mol *mol) {
       }
     }
 
-    for ( confdef = resdef->conformations; confdef; confdef = confdef->next ) {
+    for ( ref = t ? t->conformations : 0, confdef = resdef->conformations;
+			confdef; confdef = confdef->next, ref += 4 ) {
       int ires1, ires2, ires3, ires4;
+      if ( t && ! topo_mol_build_atoms(mol,b,i,ref,4,al) &&
+           ! topo_mol_link_conformation(mol,al[0],al[1],al[2],al[3],
+							confdef) ) continue;
       if (confdef->res1 != 0 || confdef->res2 != 0 || confdef->res3 != 0 ||
           confdef->res4 != 0) {
         sprintf(errmsg, "ERROR: Bad conformation definition %s %s-%s-%s-%s; skipping.",
@@ -1330,10 +2582,10 @@ int topo_mol_end(topo_mol *mol) {
         continue;
       }
       if (add_conformation_to_residues(mol,
-            &(seg->residue_array[ires1]), confdef->atom1,
-            &(seg->residue_array[ires2]), confdef->atom2,
-            &(seg->residue_array[ires3]), confdef->atom3,
-            &(seg->residue_array[ires4]), confdef->atom4, confdef)) {
+            topo_mol_seg_residue(seg,ires1), confdef->atom1,
+            topo_mol_seg_residue(seg,ires2), confdef->atom2,
+            topo_mol_seg_residue(seg,ires3), confdef->atom3,
+            topo_mol_seg_residue(seg,ires4), confdef->atom4, confdef)) {
         sprintf(errmsg, "Warning: missing atoms for conformation %s %s-%s-%s-%s; skipping.",
             res->name, confdef->atom1, confdef->atom2, confdef->atom3,
             confdef->atom4);
@@ -1344,20 +2596,20 @@ int topo_mol_end(topo_mol *mol) {
 
   /* apply patches, last then first because dipeptide patch ACED depends on CT3 atom NT */
 
-  res = &(seg->residue_array[n-1]);
+  res = topo_mol_seg_residue(seg,n-1);
   if ( ! strlen(seg->plast) ) strcpy(seg->plast,"NONE");
 
   target.segid = seg->segid;
   target.resid = res->resid;
-  if ( topo_mol_patch(mol, &target, 1, seg->plast, 0,
+  if ( topo_mol_apply_patch(mol, &target, 1, seg->plast, 0,
 	seg->auto_angles, seg->auto_dihedrals, lastdefault) ) return -10;
 
-  res = &(seg->residue_array[0]);
+  res = topo_mol_seg_residue(seg,0);
   if ( ! strlen(seg->pfirst) ) strcpy(seg->pfirst,"NONE");
 
   target.segid = seg->segid;
   target.resid = res->resid;
-  if ( topo_mol_patch(mol, &target, 1, seg->pfirst, 1,
+  if ( topo_mol_apply_patch(mol, &target, 1, seg->pfirst, 1,
 	seg->auto_angles, seg->auto_dihedrals, firstdefault) ) return -11;
 
   if (seg->auto_angles && topo_mol_auto_angles(mol, seg)) return -12;
@@ -1374,8 +2626,10 @@ int topo_mol_regenerate_resids(topo_mol *mol) {
   topo_mol_patch_t **patchptr, *patch;
   topo_mol_patchres_t *patchres, **patchresptrs;
   char newresid[NAMEMAXLEN+20], (*newpatchresids)[NAMEMAXLEN];
+  char insertion[2];
+  unsigned int packed;
 
-  if (! mol) return -1;
+  if (! mol || topo_mol_queue_busy(mol)) return -1;
 
   nseg = hasharray_count(mol->segment_hash);
   npatchresptrs=0;
@@ -1409,6 +2663,7 @@ int topo_mol_regenerate_resids(topo_mol *mol) {
     }
   }
 
+  ++mol->atom_edits;  /* resids change under the atom index */
   for ( iseg=0; iseg<nseg; ++iseg ) {
     seg = mol->segment_array[iseg];
     if ( ! seg ) continue;
@@ -1417,8 +2672,12 @@ int topo_mol_regenerate_resids(topo_mol *mol) {
 
     prevresid = -100000;
     for ( ires=0; ires<nres; ++ires ) {
-      res = &(seg->residue_array[ires]);
-      resid = atoi(res->resid);
+      res = topo_mol_seg_residue(seg,ires);
+      if ( topo_mol_resid_pack(res->resid,&packed) ) {
+        resid = topo_mol_resid_unpack(packed,insertion);
+      } else {
+        resid = atoi(res->resid);
+      }
       if ( resid <= prevresid ) resid = prevresid + 1;
       sprintf(newresid, "%d", resid);
       if ( NAMETOOLONG(newresid) ) return -3;
@@ -1449,9 +2708,14 @@ int topo_mol_regenerate_resids(topo_mol *mol) {
 
 int topo_mol_regenerate_angles(topo_mol *mol) {
   int errval;
+  topo_mol_atom_t *atom;
+  if ( mol && topo_mol_queue_busy(mol) ) return -1;
   if ( mol ) {
-    memarena_destroy(mol->angle_arena);
-    mol->angle_arena = memarena_create();
+    memarena_clear(mol->angle_arena);
+    mol->angle_free = 0;
+    for ( atom = mol->deleted_atoms; atom; atom = atom->next ) {
+      atom->angles = 0;
+    }
   }
   errval = topo_mol_auto_angles(mol,0);
   if ( errval ) {
@@ -1464,9 +2728,14 @@ int topo_mol_regenerate_angles(topo_mol *mol) {
 
 int topo_mol_regenerate_dihedrals(topo_mol *mol) {
   int errval;
+  topo_mol_atom_t *atom;
+  if ( mol && topo_mol_queue_busy(mol) ) return -1;
   if ( mol ) {
-    memarena_destroy(mol->dihedral_arena);
-    mol->dihedral_arena = memarena_create();
+    memarena_clear(mol->dihedral_arena);
+    mol->dihedral_free = 0;
+    for ( atom = mol->deleted_atoms; atom; atom = atom->next ) {
+      atom->dihedrals = 0;
+    }
   }
   errval = topo_mol_auto_dihedrals(mol,0);
   if ( errval ) {
@@ -1477,14 +2746,324 @@ int topo_mol_regenerate_dihedrals(topo_mol *mol) {
   return errval;
 }
 
-static int is_hydrogen(topo_mol_atom_t *atom) {
-  return ( atom->mass < 3.5 && atom->name[0] == 'H' );
+/* Dead tuples are gathered first and recycled only after they have
+   been unlinked from every atom that still refers to them. */
+typedef struct topo_mol_deadlist_t {
+  void **tuples;
+  int count, max;
+} topo_mol_deadlist_t;
+
+static void topo_mol_deadlist_add(topo_mol_deadlist_t *dead, int *del,
+                                                        void *tuple) {
+  if ( *del != 1 ) return;
+  *del = 2;
+  if ( dead->count == dead->max ) {
+    int newmax = dead->max ? 2 * dead->max : 1024;
+    void **newtuples = (void**) realloc(dead->tuples, newmax*sizeof(void*));
+    if ( ! newtuples ) return;  /* leaked, but no longer reachable */
+    dead->tuples = newtuples;
+    dead->max = newmax;
+  }
+  dead->tuples[dead->count++] = tuple;
+}
+
+static void topo_mol_compact_bonds(topo_mol_atom_t *atom,
+                                        topo_mol_deadlist_t *dead) {
+  topo_mol_bond_t **link, *tuple;
+  int k;
+  link = &(atom->bonds);
+  while ( (tuple = *link) ) {
+    for ( k=0; k<2 && tuple->atom[k] != atom; ++k );
+    if ( k == 2 ) break;
+    if ( tuple->del ) {
+      *link = tuple->next[k];
+      topo_mol_deadlist_add(dead,&(tuple->del),tuple);
+    } else link = &(tuple->next[k]);
+  }
+}
+
+static void topo_mol_compact_angles(topo_mol_atom_t *atom,
+                                        topo_mol_deadlist_t *dead) {
+  topo_mol_angle_t **link, *tuple;
+  int k;
+  link = &(atom->angles);
+  while ( (tuple = *link) ) {
+    for ( k=0; k<3 && tuple->atom[k] != atom; ++k );
+    if ( k == 3 ) break;
+    if ( tuple->del ) {
+      *link = tuple->next[k];
+      topo_mol_deadlist_add(dead,&(tuple->del),tuple);
+    } else link = &(tuple->next[k]);
+  }
+}
+
+static void topo_mol_compact_dihedrals(topo_mol_atom_t *atom,
+                                        topo_mol_deadlist_t *dead) {
+  topo_mol_dihedral_t **link, *tuple;
+  int k;
+  link = &(atom->dihedrals);
+  while ( (tuple = *link) ) {
+    for ( k=0; k<4 && tuple->atom[k] != atom; ++k );
+    if ( k == 4 ) break;
+    if ( tuple->del ) {
+      *link = tuple->next[k];
+      topo_mol_deadlist_add(dead,&(tuple->del),tuple);
+    } else link = &(tuple->next[k]);
+  }
+}
+
+/* Copies the velocities of n atoms from serial from on in blocks to
+   serial to on in mol. */
+static int topo_mol_move_vels(topo_mol *mol, double **blocks, int nblocks,
+					int from, int to, int n) {
+  topo_mol_atom_t atom;
+  double *v;
+  for ( ; n; --n, ++from, ++to ) {
+    if ( ! (v = topo_mol_vel_slot(blocks,nblocks,from)) ) continue;
+    atom.serial = to;
+    if ( topo_mol_put_vel(mol,&atom,v[0],v[1],v[2]) ) return -1;
+  }
+  return 0;
+}
+
+/* Numbers the atoms from 0 again, leaving out the deleted ones, and
+   moves their velocities to match; nothing changes if that fails. */
+static int topo_mol_compact_serials(topo_mol *mol) {
+  topo_mol_segment_t *seg;
+  topo_mol_residue_t *res;
+  topo_mol_atom_t *atom;
+  double **oldblocks;
+  int i, n, pass, iseg, nseg, ires, nres, serial, noldblocks, failed;
+
+  oldblocks = mol->velblocks;
+  noldblocks = mol->nvelblocks;
+  mol->velblocks = 0;
+  mol->nvelblocks = 0;
+  nseg = hasharray_count(mol->segment_hash);
+  serial = 0;
+  failed = 0;
+  /* velocities move on the first pass, serials on the second */
+  for ( pass=0; pass<2 && ! failed; ++pass ) {
+    serial = 0;
+    for ( iseg=0; iseg<nseg && ! failed; ++iseg ) {
+      seg = mol->segment_array[iseg];
+      if ( ! seg ) continue;
+      nres = hasharray_count(seg->residue_hash);
+      for ( ires=0; ires<nres && ! failed; ++ires ) {
+        res = topo_mol_seg_residue(seg,ires);
+        if ( res->inst ) {
+          n = res->inst->proto->natoms;
+          if ( pass ) res->inst->serial = serial;
+          else failed = topo_mol_move_vels(mol,oldblocks,noldblocks,
+					res->inst->serial,serial,n);
+          serial += n;
+          continue;
+        }
+        for ( atom = res->atoms; atom && ! failed; atom = atom->next ) {
+          if ( pass ) atom->serial = serial;
+          else failed = topo_mol_move_vels(mol,oldblocks,noldblocks,
+					atom->serial,serial,1);
+          ++serial;
+        }
+      }
+    }
+  }
+  if ( failed ) {
+    for ( i=0; i<mol->nvelblocks; ++i ) free((void*)mol->velblocks[i]);
+    free((void*)mol->velblocks);
+    mol->velblocks = oldblocks;
+    mol->nvelblocks = noldblocks;
+    return -1;
+  }
+  for ( i=0; i<noldblocks; ++i ) free((void*)oldblocks[i]);
+  free((void*)oldblocks);
+  mol->nserial = serial;
+  return 0;
+}
+
+int topo_mol_compact(topo_mol *mol) {
+  int i, iseg, nseg, ires, nres, count;
+  topo_mol_segment_t *seg;
+  topo_mol_residue_t *res;
+  topo_mol_atom_t *atom;
+  topo_mol_deadlist_t bonds, angles, dihedrals;
+
+  if ( ! mol || topo_mol_queue_busy(mol) ) return -1;
+  if ( mol->buildseg ) return -2;
+
+  bonds.tuples = 0;  bonds.count = 0;  bonds.max = 0;
+  angles = dihedrals = bonds;
+
+  nseg = hasharray_count(mol->segment_hash);
+  for ( iseg=0; iseg<nseg; ++iseg ) {
+    seg = mol->segment_array[iseg];
+    if ( ! seg ) continue;
+    nres = hasharray_count(seg->residue_hash);
+    for ( ires=0; ires<nres; ++ires ) {
+      res = topo_mol_seg_residue(seg,ires);
+      for ( atom = res->atoms; atom; atom = atom->next ) {
+        topo_mol_compact_bonds(atom,&bonds);
+        topo_mol_compact_angles(atom,&angles);
+        topo_mol_compact_dihedrals(atom,&dihedrals);
+      }
+    }
+  }
+  /* every tuple of a deleted atom is dead, so the atoms can be let go */
+  for ( atom = mol->deleted_atoms; atom; atom = atom->next ) {
+    topo_mol_compact_bonds(atom,&bonds);
+    topo_mol_compact_angles(atom,&angles);
+    topo_mol_compact_dihedrals(atom,&dihedrals);
+  }
+  mol->deleted_atoms = 0;
+
+  for ( i=0; i<bonds.count; ++i ) {
+    topo_mol_bond_t *tuple = (topo_mol_bond_t*) bonds.tuples[i];
+    tuple->next[0] = mol->bond_free;
+    mol->bond_free = tuple;
+  }
+  for ( i=0; i<angles.count; ++i ) {
+    topo_mol_angle_t *tuple = (topo_mol_angle_t*) angles.tuples[i];
+    tuple->next[0] = mol->angle_free;
+    mol->angle_free = tuple;
+  }
+  for ( i=0; i<dihedrals.count; ++i ) {
+    topo_mol_dihedral_t *tuple = (topo_mol_dihedral_t*) dihedrals.tuples[i];
+    tuple->next[0] = mol->dihedral_free;
+    mol->dihedral_free = tuple;
+  }
+  count = bonds.count + angles.count + dihedrals.count;
+  free((void*)bonds.tuples);
+  free((void*)angles.tuples);
+  free((void*)dihedrals.tuples);
+
+  /* drop deleted residues and segments so loops no longer visit them */
+  for ( iseg=0; iseg<nseg; ++iseg ) {
+    seg = mol->segment_array[iseg];
+    if ( ! seg ) continue;
+    if ( hasharray_compact(seg->residue_hash) < 0 ) return -3;
+  }
+  if ( hasharray_compact(mol->segment_hash) < 0 ) return -3;
+  if ( topo_mol_compact_serials(mol) ) return -2;
+  return count;
+}
+
+static void topo_mol_arena_stats_add(memarena_stats_t *sum,
+                                        const memarena_stats_t *s) {
+  sum->requested += s->requested;
+  sum->reserved += s->reserved;
+  sum->wasted += s->wasted;
+  sum->blocks += s->blocks;
+  sum->oversize += s->oversize;
+}
+
+static void topo_mol_hash_stats_add(hasharray_stats_t *sum,
+                                        const hasharray_stats_t *s) {
+  int entries = sum->hash.entries + s->hash.entries;
+  if ( entries ) {
+    sum->hash.alos = ( sum->hash.alos * sum->hash.entries +
+                       s->hash.alos * s->hash.entries ) / entries;
+  }
+  sum->count += s->count;
+  sum->alloc += s->alloc;
+  sum->itembytes += s->itembytes;
+  sum->hash.buckets += s->hash.buckets;
+  sum->hash.entries = entries;
+  sum->hash.used += s->hash.used;
+  if ( s->hash.maxchain > sum->hash.maxchain )
+    sum->hash.maxchain = s->hash.maxchain;
+  sum->hash.bytes += s->hash.bytes;
+  topo_mol_arena_stats_add(&(sum->keys),&(s->keys));
+}
+
+int topo_mol_arena_mode(topo_mol *mol, int arena, int mode) {
+  memarena *arenas[3];
+  int old[3];
+  int i;
+  if ( ! mol ) return -1;
+  switch ( arena ) {
+  case TOPO_MOL_ALL_ARENAS:
+    if ( memarena_mode_check(mode) ) return -1;
+    arenas[0] = mol->arena;
+    arenas[1] = mol->angle_arena;
+    arenas[2] = mol->dihedral_arena;
+    for ( i=0; i<3; ++i ) {
+      old[i] = memarena_get_mode(arenas[i]);
+      if ( memarena_mode(arenas[i],mode) ) {
+        /* put back the arenas already switched */
+        while ( i-- ) memarena_mode(arenas[i],old[i]);
+        return -1;
+      }
+    }
+    return 0;
+  case TOPO_MOL_ARENA:
+    return memarena_mode(mol->arena,mode);
+  case TOPO_MOL_ANGLE_ARENA:
+    return memarena_mode(mol->angle_arena,mode);
+  case TOPO_MOL_DIHEDRAL_ARENA:
+    return memarena_mode(mol->dihedral_arena,mode);
+  }
+  return -2;
+}
+
+int topo_mol_reserve(topo_mol *mol, int nsegments, int nresidues) {
+  hasharray *h;
+  if ( ! mol ) return -1;
+  h = mol->segment_hash;
+  if ( nsegments > 0 &&
+       hasharray_reserve(h,hasharray_count(h)+nsegments) ) return -2;
+  if ( ! mol->buildseg || nresidues <= 0 ) return 0;
+  h = mol->buildseg->residue_hash;
+  if ( hasharray_reserve(h,hasharray_count(h)+nresidues) ) return -2;
+  return 0;
+}
+
+int topo_mol_memory_stats(topo_mol *mol, topo_mol_memory_t *m) {
+  int iseg, nseg;
+  topo_mol_segment_t *seg;
+  hasharray_stats_t s;
+
+  if ( ! mol ) return -1;
+  memset(m,0,sizeof(topo_mol_memory_t));
+  memarena_stats(mol->arena,&(m->arena));
+  memarena_stats(mol->angle_arena,&(m->angle_arena));
+  memarena_stats(mol->dihedral_arena,&(m->dihedral_arena));
+  memarena_stats(mol->index_arena,&(m->index_arena));
+  for ( iseg=0; iseg<mol->nvelblocks; ++iseg ) {
+    if ( ! mol->velblocks[iseg] ) continue;
+    m->velocities.blocks++;
+    m->velocities.reserved += 3 * TOPO_MOL_VEL_BLOCK * sizeof(double);
+  }
+  m->velocities.requested = m->velocities.reserved;
+  hasharray_stats(mol->segment_hash,&(m->segments));
+  nseg = hasharray_count(mol->segment_hash);
+  for ( iseg=0; iseg<nseg; ++iseg ) {
+    seg = mol->segment_array[iseg];
+    if ( ! seg ) continue;
+    hasharray_stats(seg->residue_hash,&s);
+    topo_mol_hash_stats_add(&(m->residues),&s);
+  }
+  if ( mol->defs ) {
+    memarena_stats(mol->defs->arena,&(m->defs_arena));
+    hasharray_stats(mol->defs->type_hash,&(m->types));
+    hasharray_stats(mol->defs->residue_hash,&(m->resdefs));
+    hasharray_stats(mol->defs->topo_hash,&(m->topofiles));
+  }
+  return 0;
+}
+
+static int is_hydrogen(topo_mol *mol, topo_mol_atom_t *atom) {
+  return ( atom->mass < 3.5 && topo_mol_symbol(mol,atom->name)[0] == 'H' );
 }
 
-static int is_oxygen(topo_mol_atom_t *atom) {
-  return ( atom->mass > 14.5 && atom->mass < 18.5 && atom->name[0] == 'O' );
+static int is_oxygen(topo_mol *mol, topo_mol_atom_t *atom) {
+  return ( atom->mass > 14.5 && atom->mass < 18.5 &&
+           topo_mol_symbol(mol,atom->name)[0] == 'O' );
 }
 
+/* residue ires of seg, or the proto of its instances for ires -1 */
+#define topo_mol_seg_atoms(seg,ires) \
+  ( (ires) < 0 ? &((seg)->proto->res) : topo_mol_seg_residue(seg,ires) )
+
 static int topo_mol_auto_angles(topo_mol *mol, topo_mol_segment_t *segp) {
   int ires, nres, iseg, nseg;
   topo_mol_segment_t *seg;
@@ -1501,8 +3080,8 @@ static int topo_mol_auto_angles(topo_mol *mol, topo_mol_segment_t *segp) {
     if ( ! seg ) continue;
 
     nres = hasharray_count(seg->residue_hash);
-    for ( ires=0; ires<nres; ++ires ) {
-      res = &(seg->residue_array[ires]);
+    for ( ires = ( seg->proto ? -1 : 0 ); ires<nres; ++ires ) {
+      res = topo_mol_seg_atoms(seg,ires);
       for ( atom = res->atoms; atom; atom = atom->next ) {
         if ( ! segp ) { atom->angles = NULL; }
         for ( tuple = atom->angles; tuple;
@@ -1518,8 +3097,8 @@ static int topo_mol_auto_angles(topo_mol *mol, topo_mol_segment_t *segp) {
   if ( ! seg ) continue;
 
   nres = hasharray_count(seg->residue_hash);
-  for ( ires=0; ires<nres; ++ires ) {
-    res = &(seg->residue_array[ires]);
+  for ( ires = ( seg->proto ? -1 : 0 ); ires<nres; ++ires ) {
+    res = topo_mol_seg_atoms(seg,ires);
     for ( atom = res->atoms; atom; atom = atom->next ) {
       a2 = atom;
       for ( b1 = atom->bonds; b1; b1 = topo_mol_bond_next(b1,atom) ) {
@@ -1532,11 +3111,11 @@ static int topo_mol_auto_angles(topo_mol *mol, topo_mol_segment_t *segp) {
           if ( b2->atom[0] == atom ) a3 = b2->atom[1];
           else if ( b2->atom[1] == atom ) a3 = b2->atom[0];
           else return -6;
-          if ( is_hydrogen(a2) && ( ! topo_mol_bond_next(b2,atom) ) &&
-               ( ( is_hydrogen(a1) && is_oxygen(a3) ) ||
-                 ( is_hydrogen(a3) && is_oxygen(a1) ) ) )
+          if ( is_hydrogen(mol,a2) && ( ! topo_mol_bond_next(b2,atom) ) &&
+               ( ( is_hydrogen(mol,a1) && is_oxygen(mol,a3) ) ||
+                 ( is_hydrogen(mol,a3) && is_oxygen(mol,a1) ) ) )
             continue;  /* extra H-H bond on water */
-          tuple = memarena_alloc(mol->angle_arena,sizeof(topo_mol_angle_t));
+          tuple = topo_mol_angle_alloc(mol);
           if ( ! tuple ) return -10;
           tuple->next[0] = a1->angles;
           tuple->atom[0] = a1;
@@ -1573,8 +3152,8 @@ static int topo_mol_auto_dihedrals(topo_mol *mol, topo_mol_segment_t *segp) {
     if ( ! seg ) continue;
 
     nres = hasharray_count(seg->residue_hash);
-    for ( ires=0; ires<nres; ++ires ) {
-      res = &(seg->residue_array[ires]);
+    for ( ires = ( seg->proto ? -1 : 0 ); ires<nres; ++ires ) {
+      res = topo_mol_seg_atoms(seg,ires);
       for ( atom = res->atoms; atom; atom = atom->next ) {
         if ( ! segp ) { atom->dihedrals = NULL; }
         for ( tuple = atom->dihedrals; tuple;
@@ -1592,9 +3171,21 @@ static int topo_mol_auto_dihedrals(topo_mol *mol, topo_mol_segment_t *segp) {
   seg = segp ? segp : mol->segment_array[iseg];
   if ( ! seg ) continue;
 
+  /*  proto atoms are only compared with each other  */
+  if ( seg->proto ) {
+    ires = 0;
+    for ( atom = seg->proto->atoms; atom; atom = atom->next ) {
+      atom->atomid = ++ires;
+    }
+  }
+
   nres = hasharray_count(seg->residue_hash);
   for ( ires=0; ires<nres; ++ires ) {
-    res = &(seg->residue_array[ires]);
+    res = topo_mol_seg_residue(seg,ires);
+    if ( res->inst ) {
+      res->inst->atomid = atomid;
+      atomid += res->inst->proto->natoms;
+    }
     for ( atom = res->atoms; atom; atom = atom->next ) {
       atom->atomid = ++atomid;
     }
@@ -1608,8 +3199,8 @@ static int topo_mol_auto_dihedrals(topo_mol *mol, topo_mol_segment_t *segp) {
   if ( ! seg ) continue;
 
   nres = hasharray_count(seg->residue_hash);
-  for ( ires=0; ires<nres; ++ires ) {
-    res = &(seg->residue_array[ires]);
+  for ( ires = ( seg->proto ? -1 : 0 ); ires<nres; ++ires ) {
+    res = topo_mol_seg_atoms(seg,ires);
     for ( atom = res->atoms; atom; atom = atom->next ) {
       for ( g1 = atom->angles; g1; g1 = topo_mol_angle_next(g1,atom) ) {
         if ( g1->del ) continue;
@@ -1653,7 +3244,7 @@ static int topo_mol_auto_dihedrals(topo_mol *mol, topo_mol_segment_t *segp) {
           } else return -6;
           if ( ! found ) continue;
           ++count1;
-          tuple = memarena_alloc(mol->dihedral_arena,sizeof(topo_mol_dihedral_t));
+          tuple = topo_mol_dihedral_alloc(mol);
           if ( ! tuple ) return -10;
           tuple->next[0] = a1->dihedrals;
           tuple->atom[0] = a1;
@@ -1682,6 +3273,15 @@ static int topo_mol_auto_dihedrals(topo_mol *mol, topo_mol_segment_t *segp) {
 int topo_mol_patch(topo_mol *mol, const topo_mol_ident_t *targets,
                         int ntargets, const char *rname, int prepend,
 			int warn_angles, int warn_dihedrals, int deflt) {
+  if ( mol && topo_mol_queue_busy(mol) ) return -1;
+  return topo_mol_apply_patch(mol,targets,ntargets,rname,prepend,
+			warn_angles,warn_dihedrals,deflt);
+}
+
+static int topo_mol_apply_patch(topo_mol *mol,
+			const topo_mol_ident_t *targets,
+                        int ntargets, const char *rname, int prepend,
+			int warn_angles, int warn_dihedrals, int deflt) {
 
   int idef;
   topo_defs_residue_t *resdef;
@@ -1706,20 +3306,36 @@ int topo_mol_patch(topo_mol *mol, const topo_mol_ident_t *targets,
     topo_mol_log_error(mol,errmsg);
     return -4;
   }
-  resdef = &(mol->defs->residue_array[idef]);
+  resdef = topo_defs_get_residue(mol->defs,idef);
   if ( ! resdef->patch ) {
     sprintf(errmsg,"unknown patch type %s",rname);
     topo_mol_log_error(mol,errmsg);
     return -5;
   }
 
-  oldres = 0;
+  /* check every target and atom type before touching the structure,
+     so that a patch which cannot be applied leaves the molecule intact */
   for ( atomdef = resdef->atoms; atomdef; atomdef = atomdef->next ) {
     if ( atomdef->res < 0 || atomdef->res >= ntargets ) return -6;
+    if ( ! topo_mol_get_res(mol,&targets[atomdef->res],atomdef->rel) )
+      return -7;
+    if ( atomdef->del || atomdef->type[0] == '\0' ) continue;
+    if ( hasharray_index(mol->defs->type_hash,atomdef->type)
+							== HASHARRAY_FAIL ) {
+      sprintf(errmsg,"unknown atom type %s",atomdef->type);
+      topo_mol_log_error(mol,errmsg);
+      sprintf(errmsg,"add atom failed in patch %s",rname);
+      topo_mol_log_error(mol,errmsg);
+      return -8;
+    }
+  }
+
+  oldres = 0;
+  for ( atomdef = resdef->atoms; atomdef; atomdef = atomdef->next ) {
     res = topo_mol_get_res(mol,&targets[atomdef->res],atomdef->rel);
-    if ( ! res ) return -7;
+    if ( res ) topo_mol_res_atoms(mol,res);
     if ( atomdef->del ) {
-      topo_mol_del_atom(res,atomdef->name);
+      topo_mol_del_atom(mol,res,atomdef->namesym);
       oldres = 0;
       continue;
     }
@@ -1728,11 +3344,12 @@ int topo_mol_patch(topo_mol *mol, const topo_mol_ident_t *targets,
       oldatoms = res->atoms;
     }
     if ( atomdef->type[0] == '\0' ) {
-      topo_mol_find_atom(&(res->atoms), oldatoms, atomdef->name);
-    } else if ( topo_mol_add_atom(mol,&(res->atoms), oldatoms, atomdef) ) {
+      topo_mol_find_atom(mol, &(res->atoms), oldatoms, atomdef->namesym);
+    } else if ( topo_mol_add_atom(mol,&(res->atoms), oldatoms, atomdef, -1) ) {
+      /* out of memory, molecule is now inconsistent */
       sprintf(errmsg,"add atom failed in patch %s",rname);
       topo_mol_log_error(mol,errmsg);
-      return -8;
+      return -9;
     }
   }
 
@@ -1795,10 +3412,11 @@ int topo_mol_patch(topo_mol *mol, const topo_mol_ident_t *targets,
       topo_mol_log_error(mol,errmsg);
    }
     for ( idef=0; idef<ntargets; idef++ ) {
-      printf("%s:%s ", targets[idef].segid,targets[idef].resid);
+      sprintf(errmsg,"%s:%s ", targets[idef].segid,targets[idef].resid);
+      topo_mol_print(mol,errmsg);
       topo_mol_add_patchres(mol,&targets[idef]);
     }
-    printf("\n");
+    topo_mol_print(mol,"\n");
   }
   return 0;
 }
@@ -1813,7 +3431,7 @@ int topo_mol_multiply_atoms(topo_mol *mol, const topo_mol_ident_t *targets,
   topo_mol_segment_t *seg;
   int nres, ires;
 
-  if (!mol) return -1;
+  if (!mol || topo_mol_queue_busy(mol)) return -1;
 
   /* Quiet compiler warnings */
   natoms = 0;
@@ -1833,8 +3451,8 @@ int topo_mol_multiply_atoms(topo_mol *mol, const topo_mol_ident_t *targets,
         if ( ! seg ) return -2;
         nres = hasharray_count(seg->residue_hash);
         for ( ires=0; ires<nres; ++ires ) {
-          res = &(seg->residue_array[ires]);
-          for ( atom = res->atoms; atom; atom = atom->next ) {
+          res = topo_mol_seg_residue(seg,ires);
+          for ( atom = topo_mol_res_atoms(mol,res); atom; atom = atom->next ) {
             if ( ipass ) atoms[natoms] = atom;
             ++natoms;
           }
@@ -1845,7 +3463,7 @@ int topo_mol_multiply_atoms(topo_mol *mol, const topo_mol_ident_t *targets,
       if (!target->aname) { /* whole residue */
         res = topo_mol_get_res(mol,target,0);
         if ( ! res ) return -3;
-        for ( atom = res->atoms; atom; atom = atom->next ) {
+        for ( atom = topo_mol_res_atoms(mol,res); atom; atom = atom->next ) {
           if ( ipass ) atoms[natoms] = atom;
           ++natoms;
         }
@@ -1866,16 +3484,23 @@ int topo_mol_multiply_atoms(topo_mol *mol, const topo_mol_ident_t *targets,
   /* copy the actual atoms */
   for (iatom=0; iatom<natoms; ++iatom) {
     topo_mol_atom_t *newatom;
+    double vel[3];
+    int serial;
     atom = atoms[iatom];
     if ( atom->copy ) {
       topo_mol_log_error(mol,"an atom occurs twice in the selection");
       return -20;
     }
-    newatom = memarena_alloc(mol->arena,sizeof(topo_mol_atom_t));
+    newatom = topo_mol_atom_alloc(mol);
     if ( ! newatom ) return -5;
+    serial = newatom->serial;
     memcpy(newatom,atom,sizeof(topo_mol_atom_t));
+    newatom->serial = serial;
+    topo_mol_get_vel(mol,atom,vel);
+    if ( topo_mol_put_vel(mol,newatom,vel[0],vel[1],vel[2]) ) return -5;
     atom->next = newatom;
     atom->copy = newatom;
+    ++mol->atom_edits;
     newatom->bonds = 0;
     newatom->angles = 0;
     newatom->dihedrals = 0;
@@ -1902,7 +3527,7 @@ int topo_mol_multiply_atoms(topo_mol *mol, const topo_mol_ident_t *targets,
       if ( bondtmp->del ) continue;
       if ( bondtmp->atom[0] == atom || ( ! bondtmp->atom[0]->copy ) ) ;
       else continue;
-      tuple = memarena_alloc(mol->arena,sizeof(topo_mol_bond_t));
+      tuple = topo_mol_bond_alloc(mol);
       if ( ! tuple ) return -6;
       a1 = bondtmp->atom[0]->copy; if ( ! a1 ) a1 = bondtmp->atom[0];
       a2 = bondtmp->atom[1]->copy; if ( ! a2 ) a2 = bondtmp->atom[1];
@@ -1921,7 +3546,7 @@ int topo_mol_multiply_atoms(topo_mol *mol, const topo_mol_ident_t *targets,
       if ( angletmp->atom[0] == atom || ( ! angletmp->atom[0]->copy
       && ( angletmp->atom[1] == atom || ( ! angletmp->atom[1]->copy ) ) ) ) ;
       else continue;
-      tuple = memarena_alloc(mol->angle_arena,sizeof(topo_mol_angle_t));
+      tuple = topo_mol_angle_alloc(mol);
       if ( ! tuple ) return -7;
       a1 = angletmp->atom[0]->copy; if ( ! a1 ) a1 = angletmp->atom[0];
       a2 = angletmp->atom[1]->copy; if ( ! a2 ) a2 = angletmp->atom[1];
@@ -1945,7 +3570,7 @@ int topo_mol_multiply_atoms(topo_mol *mol, const topo_mol_ident_t *targets,
       && ( dihetmp->atom[1] == atom || ( ! dihetmp->atom[1]->copy
       && ( dihetmp->atom[2] == atom || ( ! dihetmp->atom[2]->copy ) ) ) ) ) ) ;
       else continue;
-      tuple = memarena_alloc(mol->dihedral_arena,sizeof(topo_mol_dihedral_t));
+      tuple = topo_mol_dihedral_alloc(mol);
       if ( ! tuple ) return -8;
       a1 = dihetmp->atom[0]->copy; if ( ! a1 ) a1 = dihetmp->atom[0];
       a2 = dihetmp->atom[1]->copy; if ( ! a2 ) a2 = dihetmp->atom[1];
@@ -2095,7 +3720,7 @@ int topo_mol_delete_atom(topo_mol *mol, const topo_mol_ident_t *target) {
   topo_mol_residue_t *res;
   topo_mol_segment_t *seg;
   int ires, iseg;
-  if (!mol) return 1;
+  if (!mol || topo_mol_queue_busy(mol)) return 1;
 
   iseg = hasharray_index(mol->segment_hash,target->segid);
   if ( iseg == HASHARRAY_FAIL ) {
@@ -2111,13 +3736,12 @@ int topo_mol_delete_atom(topo_mol *mol, const topo_mol_ident_t *target) {
     int nres = hasharray_count(seg->residue_hash);
     for ( ires=0; ires<nres; ++ires ) {
       topo_mol_atom_t *atom;
-      res = &(seg->residue_array[ires]);
-      atom = res->atoms;
-      while (atom) {
-        topo_mol_destroy_atom(atom);
-        atom = atom->next;
+      res = topo_mol_seg_residue(seg,ires);
+      res->inst = 0;
+      while ( (atom = res->atoms) ) {
+        res->atoms = atom->next;
+        topo_mol_destroy_atom(mol,atom);
       }
-      res->atoms = 0;
     }
     hasharray_destroy(seg->residue_hash);
     mol->segment_array[iseg] = 0;
@@ -2135,46 +3759,48 @@ int topo_mol_delete_atom(topo_mol *mol, const topo_mol_ident_t *target) {
     topo_mol_log_error(mol,errmsg);
     return 1;
   }
-  res = seg->residue_array+ires;
+  res = topo_mol_seg_residue(seg,ires);
 
   if (!target->aname) {
     /* Must destroy all atoms in residue, since there may be bonds between
        this residue and other atoms
     */
-    topo_mol_atom_t *atom = res->atoms;
-    while (atom) {
-      topo_mol_destroy_atom(atom);
-      atom = atom->next;
+    topo_mol_atom_t *atom;
+    res->inst = 0;
+    while ( (atom = res->atoms) ) {
+      res->atoms = atom->next;
+      topo_mol_destroy_atom(mol,atom);
     }
-    res->atoms = 0;
     hasharray_delete(seg->residue_hash, target->resid);
     return 0;
   }
   /* Just delete one atom */
-  topo_mol_destroy_atom(topo_mol_unlink_atom(&(res->atoms),target->aname));
+  topo_mol_res_atoms(mol,res);
+  topo_mol_destroy_atom(mol,
+                topo_mol_unlink_atom(&(res->atoms),
+                        symtab_lookup(mol->symbols,target->aname)));
   return 0;
 }
 
 int topo_mol_set_name(topo_mol *mol, const topo_mol_ident_t *target,
                                      const char *name) {
-  topo_mol_residue_t *res;
   topo_mol_atom_t *atom;
-  if ( ! mol ) return -1;
+  int sym;
+  if ( ! mol || topo_mol_queue_busy(mol) ) return -1;
   if ( ! target ) return -2;
-  res = topo_mol_get_res(mol,target,0);
-  if ( ! res ) return -3;
-  for ( atom = res->atoms; atom; atom = atom->next ) {
-    if ( ! strcmp(target->aname,atom->name) ) break;
-  }
+  atom = topo_mol_target_atom(mol,target,0);
   if ( ! atom ) return -3;
-  strcpy(atom->name,name);
+  sym = topo_mol_intern(mol,name);
+  if ( sym == SYMTAB_FAIL ) return -4;
+  atom->name = sym;
+  ++mol->atom_edits;
   return 0;
 }
 
 int topo_mol_set_resname(topo_mol *mol, const topo_mol_ident_t *target,
                                         const char *rname) {
   topo_mol_residue_t *res;
-  if ( ! mol ) return -1;
+  if ( ! mol || topo_mol_queue_busy(mol) ) return -1;
   if ( ! target ) return -2;
   res = topo_mol_get_res(mol,target,0);
   if ( ! res ) return -3;
@@ -2186,7 +3812,7 @@ int topo_mol_set_segid(topo_mol *mol, const topo_mol_ident_t *target,
                                       const char *segid) {
   int iseg, iseg2;
   topo_mol_segment_t *seg;
-  if ( ! mol ) return -1;
+  if ( ! mol || topo_mol_queue_busy(mol) ) return -1;
   if ( ! target ) return -2;
   seg = topo_mol_get_seg(mol,target);
   if ( ! seg ) return -3;
@@ -2201,24 +3827,26 @@ int topo_mol_set_segid(topo_mol *mol, const topo_mol_ident_t *target,
     topo_mol_log_error(mol, "Unable to insert segment");
     return -5;
   }
+  ++mol->atom_edits;
   return 0;
 }
 
 int topo_mol_set_element(topo_mol *mol, const topo_mol_ident_t *target,
                                         const char *element, int replace) {
-  topo_mol_residue_t *res;
   topo_mol_atom_t *atom;
-  if ( ! mol ) return -1;
+  topo_mol_residue_t *res = 0;
+  int sym;
+  if ( ! mol || topo_mol_queue_busy(mol) ) return -1;
   if ( ! target ) return -2;
-  res = topo_mol_get_res(mol,target,0);
-  if ( ! res ) return -3;
-  for ( atom = res->atoms; atom; atom = atom->next ) {
-    if ( ! strcmp(target->aname,atom->name) ) break;
-  }
+  atom = topo_mol_target_atom(mol,target,&res);
   if ( ! atom ) return -3;
 
-  if ( replace || ! strlen(atom->element) ) {
-    strcpy(atom->element,element);
+  if ( replace || ! topo_mol_symbol(mol,atom->element)[0] ) {
+    /* instances share the elements of their proto */
+    if ( res && ! (atom = topo_mol_target_atom(mol,target,0)) ) return -3;
+    sym = topo_mol_intern(mol,element);
+    if ( sym == SYMTAB_FAIL ) return -4;
+    atom->element = sym;
   }
   return 0;
 }
@@ -2226,7 +3854,7 @@ int topo_mol_set_element(topo_mol *mol, const topo_mol_ident_t *target,
 int topo_mol_set_chain(topo_mol *mol, const topo_mol_ident_t *target,
                                         const char *chain, int replace) {
   topo_mol_residue_t *res;
-  if ( ! mol ) return -1;
+  if ( ! mol || topo_mol_queue_busy(mol) ) return -1;
   if ( ! target ) return -2;
   res = topo_mol_get_res(mol,target,0);
   if ( ! res ) return -3;
@@ -2239,16 +3867,21 @@ int topo_mol_set_chain(topo_mol *mol, const topo_mol_ident_t *target,
 
 int topo_mol_set_xyz(topo_mol *mol, const topo_mol_ident_t *target,
                                         double x, double y, double z) {
-  topo_mol_residue_t *res;
   topo_mol_atom_t *atom;
-  if ( ! mol ) return -1;
+  topo_mol_residue_t *res = 0;
+  topo_mol_instatom_t *slot;
+  if ( ! mol || topo_mol_queue_busy(mol) ) return -1;
   if ( ! target ) return -2;
-  res = topo_mol_get_res(mol,target,0);
-  if ( ! res ) return -3;
-  for ( atom = res->atoms; atom; atom = atom->next ) {
-    if ( ! strcmp(target->aname,atom->name) ) break;
-  }
+  atom = topo_mol_target_atom(mol,target,&res);
   if ( ! atom ) return -3;
+  if ( res ) {
+    slot = res->inst->atoms + ( atom - res->inst->proto->atoms );
+    slot->x = x;
+    slot->y = y;
+    slot->z = z;
+    slot->xyz_state = TOPO_MOL_XYZ_SET;
+    return 0;
+  }
 
   atom->x = x;
   atom->y = y;
@@ -2259,34 +3892,22 @@ int topo_mol_set_xyz(topo_mol *mol, const topo_mol_ident_t *target,
 
 int topo_mol_set_vel(topo_mol *mol, const topo_mol_ident_t *target,
                                         double vx, double vy, double vz) {
-  topo_mol_residue_t *res;
   topo_mol_atom_t *atom;
-  if ( ! mol ) return -1;
+  if ( ! mol || topo_mol_queue_busy(mol) ) return -1;
   if ( ! target ) return -2;
-  res = topo_mol_get_res(mol,target,0);
-  if ( ! res ) return -3;
-  for ( atom = res->atoms; atom; atom = atom->next ) {
-    if ( ! strcmp(target->aname,atom->name) ) break;
-  }
+  atom = topo_mol_target_atom(mol,target,0);
   if ( ! atom ) return -3;
 
-  atom->vx = vx;
-  atom->vy = vy;
-  atom->vz = vz;
+  if ( topo_mol_put_vel(mol,atom,vx,vy,vz) ) return -4;
   return 0;
 }
 
 int topo_mol_set_mass(topo_mol *mol, const topo_mol_ident_t *target,
                       double mass) {
-  topo_mol_residue_t *res;
   topo_mol_atom_t *atom;
-  if ( ! mol ) return -1;
+  if ( ! mol || topo_mol_queue_busy(mol) ) return -1;
   if ( ! target ) return -2;
-  res = topo_mol_get_res(mol,target,0);
-  if ( ! res ) return -3;
-  for ( atom = res->atoms; atom; atom = atom->next ) {
-    if ( ! strcmp(target->aname,atom->name) ) break;
-  }
+  atom = topo_mol_target_atom(mol,target,0);
   if ( ! atom ) return -3;
 
   atom->mass = mass;
@@ -2295,15 +3916,10 @@ int topo_mol_set_mass(topo_mol *mol, const topo_mol_ident_t *target,
 
 int topo_mol_set_charge(topo_mol *mol, const topo_mol_ident_t *target,
                         double charge) {
-  topo_mol_residue_t *res;
   topo_mol_atom_t *atom;
-  if ( ! mol ) return -1;
+  if ( ! mol || topo_mol_queue_busy(mol) ) return -1;
   if ( ! target ) return -2;
-  res = topo_mol_get_res(mol,target,0);
-  if ( ! res ) return -3;
-  for ( atom = res->atoms; atom; atom = atom->next ) {
-    if ( ! strcmp(target->aname,atom->name) ) break;
-  }
+  atom = topo_mol_target_atom(mol,target,0);
   if ( ! atom ) return -3;
 
   atom->charge = charge;
@@ -2312,15 +3928,10 @@ int topo_mol_set_charge(topo_mol *mol, const topo_mol_ident_t *target,
 
 int topo_mol_set_bfactor(topo_mol *mol, const topo_mol_ident_t *target,
                          double bfactor) {
-  topo_mol_residue_t *res;
   topo_mol_atom_t *atom;
-  if ( ! mol ) return -1;
+  if ( ! mol || topo_mol_queue_busy(mol) ) return -1;
   if ( ! target ) return -2;
-  res = topo_mol_get_res(mol,target,0);
-  if ( ! res ) return -3;
-  for ( atom = res->atoms; atom; atom = atom->next ) {
-    if ( ! strcmp(target->aname,atom->name) ) break;
-  }
+  atom = topo_mol_target_atom(mol,target,0);
   if ( ! atom ) return -3;
 
   atom->partition = bfactor;
@@ -2330,7 +3941,7 @@ int topo_mol_set_bfactor(topo_mol *mol, const topo_mol_ident_t *target,
 /* XXX Unused */
 int topo_mol_clear_xyz(topo_mol *mol, const topo_mol_ident_t *target) {
   topo_mol_atom_t *atom;
-  if ( ! mol ) return -1;
+  if ( ! mol || topo_mol_queue_busy(mol) ) return -1;
   if ( ! target ) return -2;
 
   atom = topo_mol_get_atom(mol,target,0);
@@ -2351,6 +3962,7 @@ int topo_mol_guess_xyz(topo_mol *mol) {
   int ipass;
   topo_mol_segment_t *seg;
   topo_mol_residue_t *res;
+  topo_mol_instance_t *inst;
   topo_mol_atom_t *atom, *a1, *a2, *a3;
   topo_mol_atom_t *ka[4];
   topo_mol_atom_t *ua[4];
@@ -2362,7 +3974,7 @@ int topo_mol_guess_xyz(topo_mol *mol) {
   double r12x,r12y,r12z,r12,r23x,r23y,r23z,r23,ix,iy,iz,jx,jy,jz,kx,ky,kz;
   double tx,ty,tz,a,b,c;
 
-  if ( ! mol ) return -1;
+  if ( ! mol || topo_mol_queue_busy(mol) ) return -1;
 
   ucount = 0;
   hcount = 0;
@@ -2372,7 +3984,13 @@ int topo_mol_guess_xyz(topo_mol *mol) {
     if (! seg) continue;
     nres = hasharray_count(seg->residue_hash);
     for ( ires=0; ires<nres; ++ires ) {
-      res = &(seg->residue_array[ires]);
+      res = topo_mol_seg_residue(seg,ires);
+      if ( (inst = res->inst) ) {
+        /* instances with coordinates to guess are expanded */
+        for ( i=0; i<inst->proto->natoms &&
+		inst->atoms[i].xyz_state == TOPO_MOL_XYZ_SET; ++i );
+        if ( i < inst->proto->natoms ) topo_mol_res_atoms(mol,res);
+      }
       for ( atom = res->atoms; atom; atom = atom->next ) {
         if ( atom->xyz_state != TOPO_MOL_XYZ_SET ) {
           ++ucount;
@@ -2394,7 +4012,7 @@ int topo_mol_guess_xyz(topo_mol *mol) {
     if (! seg) continue;
     nres = hasharray_count(seg->residue_hash);
     for ( ires=0; ires<nres; ++ires ) {
-      res = &(seg->residue_array[ires]);
+      res = topo_mol_seg_residue(seg,ires);
       for ( atom = res->atoms; atom; atom = atom->next ) {
         if ( atom->xyz_state != TOPO_MOL_XYZ_SET ) uatoms[ucount++] = atom;
       }
@@ -2561,7 +4179,8 @@ int topo_mol_guess_xyz(topo_mol *mol) {
       /* assume wrong if angle is less than 45 degrees */
       if ( r12x*r23x + r12y*r23y + r12z*r23z < r12 * r23 * -0.7 ) {
         sprintf(msg, "Warning: failed to guess coordinate due to bad angle %s %s %s",
-            a1->name, a2->name, atom->name);
+            topo_mol_symbol(mol,a1->name), topo_mol_symbol(mol,a2->name),
+            topo_mol_symbol(mol,atom->name));
         topo_mol_log_error(mol, msg);
         if ( atom->xyz_state == TOPO_MOL_XYZ_BADGUESS ) {
           --wcount;
@@ -2820,11 +4439,12 @@ int topo_mol_guess_xyz(topo_mol *mol) {
       if (! seg) continue;
       nres = hasharray_count(seg->residue_hash);
       for ( ires=0; ires<nres; ++ires ) {
-        res = &(seg->residue_array[ires]);
+        res = topo_mol_seg_residue(seg,ires);
         for ( atom = res->atoms; atom; atom = atom->next ) {
           if ( atom->xyz_state == TOPO_MOL_XYZ_BADGUESS) {
             sprintf(msg, "Warning: poorly guessed coordinate for atom %s\t %s:%s\t  %s",
-                atom->name, res->name, res->resid, seg->segid);
+                topo_mol_symbol(mol,atom->name), res->name, res->resid,
+                seg->segid);
             topo_mol_log_error(mol, msg);
           }
         }
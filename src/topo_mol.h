@@ -8,6 +8,10 @@ struct topo_mol;
 typedef struct topo_mol topo_mol;
 
 topo_mol * topo_mol_create(topo_defs *defs);
+
+/* Gives mol definitions of its own that may be changed, copying them if
+   they are shared.  Returns the definitions mol now uses, 0 on failure. */
+topo_defs * topo_mol_unshare_defs(topo_mol *mol);
 void topo_mol_destroy(topo_mol *mol);
 
 void topo_mol_error_handler(topo_mol *mol, void *, void (*print_msg)(void *,const char *));
@@ -24,14 +28,38 @@ int topo_mol_residue(topo_mol *mol, const char *resid, const char *rname,
 						const char *chain);
 int topo_mol_mutate(topo_mol *mol, const char *resid, const char *rname);
 
+/* On failure the segment is rolled back and removed */
 int topo_mol_end(topo_mol *mol);
 
+/* Queues the segment in progress instead of ending it; until
+   topo_mol_end_queued, the other calls that read or change the molecule
+   fail with an error.  Returns -1 if there is no segment in progress. */
+int topo_mol_end_later(topo_mol *mol);
+
+/* Number of segments waiting for topo_mol_end_queued */
+int topo_mol_queued(topo_mol *mol);
+
+/* Ends the queued segments on up to nthreads threads (all processors if
+   nthreads is 0) with the same structure, velocity slots and messages
+   as calling topo_mol_end for each in turn.  Returns the number of
+   segments that failed and were rolled back. */
+int topo_mol_end_queued(topo_mol *mol, int nthreads);
+
 typedef struct topo_mol_ident_t {
   const char *segid;
   const char *resid;
   const char *aname;
 } topo_mol_ident_t;
 
+/* A resid of digits, an optional minus sign and at most one insertion
+   character, written without leading zeros, packs one to one into an
+   integer: the number in the upper 24 bits and the insertion code in
+   the lower 8.  Returns 0 for other resids. */
+#define TOPO_MOL_RESID_MAX 0x7fffff
+int topo_mol_resid_pack(const char *resid, unsigned int *packed);
+int topo_mol_resid_unpack(unsigned int packed, char *insertion);
+
+/* Returns -9 only if the molecule was left partially patched */
 int topo_mol_patch(topo_mol *mol, const topo_mol_ident_t *targets,
 			int ntargets, const char *rname, int prepend,
 			int warn_angles, int warn_dihedrals, int deflt);
@@ -40,6 +68,28 @@ int topo_mol_regenerate_angles(topo_mol *mol);
 int topo_mol_regenerate_dihedrals(topo_mol *mol);
 int topo_mol_regenerate_resids(topo_mol *mol);
 
+/* Block allocation mode (MEMARENA_MMAP etc.) for one of the arenas */
+#define TOPO_MOL_ARENA 0           /* atoms and most tuples */
+#define TOPO_MOL_ANGLE_ARENA 1
+#define TOPO_MOL_DIHEDRAL_ARENA 2
+#define TOPO_MOL_ALL_ARENAS -1     /* all three, or none on failure */
+int topo_mol_arena_mode(topo_mol *mol, int arena, int mode);
+
+/* Room for nsegments more segments and for nresidues more residues in
+   the segment in progress, so that building them does not reallocate */
+int topo_mol_reserve(topo_mol *mol, int nsegments, int nresidues);
+
+/* Unlink deleted bonds, angles and dihedrals and recycle their storage,
+   then drop deleted residues and segments, renumbering the rest, and
+   release the velocity slots of deleted atoms.  Returns the number of
+   tuples reclaimed. */
+int topo_mol_compact(topo_mol *mol);
+
+/* Keep a (segid, resid, atom name) index for the atom setters; it is
+   rebuilt on first use after atoms are added, removed or renamed.
+   Off by default. */
+int topo_mol_atom_index(topo_mol *mol, int enable);
+
 int topo_mol_delete_atom(topo_mol *mol, const topo_mol_ident_t *target);
 
 int topo_mol_set_name(topo_mol *mol, const topo_mol_ident_t *target,
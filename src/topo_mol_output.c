@@ -5,18 +5,31 @@
 #include "topo_mol_struct.h"
 #include "pdb_file.h"
 
+/* psf id of an atom of res, see topo_mol_instance_t */
+static int atom_id(const topo_mol_residue_t *res,
+		const topo_mol_atom_t *atom) {
+  const topo_mol_instance_t *inst = res->inst;
+  if ( ! inst ) return atom->atomid;
+  return inst->atomid + (int) ( atom - inst->proto->atoms ) + 1;
+}
+
 int topo_mol_write_pdb(topo_mol *mol, FILE *file, void *v, 
                                 void (*print_msg)(void *, const char *)) {
 
   char buf[128], insertion[2];
   int iseg,nseg,ires,nres,atomid,resid;
+  unsigned int packed;
   int has_guessed_atoms = 0;
   double x,y,z,o,b;
   topo_mol_segment_t *seg;
   topo_mol_residue_t *res;
-  topo_mol_atom_t *atom;
+  topo_mol_atom_t *atom, copy;
 
   if ( ! mol ) return -1;
+  if ( topo_mol_queued(mol) ) {
+    print_msg(v,"ERROR: segments are queued and must be ended first");
+    return -1;
+  }
 
   write_pdb_remark(file,"original generated coordinate pdb file");
 
@@ -35,8 +48,17 @@ int topo_mol_write_pdb(topo_mol *mol, FILE *file, void *v,
 
     nres = hasharray_count(seg->residue_hash);
     for ( ires=0; ires<nres; ++ires ) {
-      res = &(seg->residue_array[ires]);
-      for ( atom = res->atoms; atom; atom = atom->next ) {
+      res = topo_mol_seg_residue(seg,ires);
+      if ( ! topo_mol_res_list(res) ) continue;
+      if ( topo_mol_resid_pack(res->resid,&packed) ) {
+        resid = topo_mol_resid_unpack(packed,insertion);
+      } else {
+        insertion[0] = 0;
+        insertion[1] = 0;
+        sscanf(res->resid, "%d%c", &resid, insertion);
+      }
+      for ( atom = topo_mol_res_list(res); atom; atom = atom->next ) {
+        atom = topo_mol_inst_atom(res,atom,&copy);
         /* Paranoid: make sure x,y,z,o are set. */
         x = y = z = 0.0; o = -1.0;
         ++atomid;
@@ -58,12 +80,10 @@ int topo_mol_write_pdb(topo_mol *mol, FILE *file, void *v,
           break;
         }
         b = atom->partition;
-        insertion[0] = 0;
-        insertion[1] = 0;
-        sscanf(res->resid, "%d%c", &resid, insertion);
-        write_pdb_atom(file,atomid,atom->name,res->name,resid,insertion,
+        write_pdb_atom(file,atomid,topo_mol_symbol(mol,atom->name),
+		res->name,resid,insertion,
 		(float)x,(float)y,(float)z,(float)o,(float)b,res->chain,
-		seg->segid,atom->element);
+		seg->segid,topo_mol_symbol(mol,atom->element));
       }
     }
   }
@@ -76,18 +96,31 @@ int topo_mol_write_pdb(topo_mol *mol, FILE *file, void *v,
   return 0;
 }
 
+/* Coordinates are staged in aligned blocks of this many atoms */
+#define NAMDBIN_BLOCK 4096
+
+static int flush_namdbin(const double *xyz, int n, FILE *file) {
+  if ( ! n ) return 0;
+  return ( fwrite(xyz, sizeof(double), 3L*n, file) != (size_t)(3L*n) );
+}
+
 int topo_mol_write_namdbin(topo_mol *mol, FILE *file, FILE *velfile, void *v, 
                                 void (*print_msg)(void *, const char *)) {
 
   int iseg,nseg,ires,nres;
   int has_void_atoms = 0;
-  int numatoms;
-  double x,y,z,xyz[3];
+  int numatoms, nbuf;
+  double *xyz, *vel;
+  memarena *buf;
   topo_mol_segment_t *seg;
   topo_mol_residue_t *res;
-  topo_mol_atom_t *atom;
+  topo_mol_atom_t *atom, copy;
 
   if ( ! mol ) return -1;
+  if ( topo_mol_queued(mol) ) {
+    print_msg(v,"ERROR: segments are queued and must be ended first");
+    return -1;
+  }
 
   numatoms = 0;
   nseg = hasharray_count(mol->segment_hash);
@@ -96,8 +129,8 @@ int topo_mol_write_namdbin(topo_mol *mol, FILE *file, FILE *velfile, void *v,
     if (! seg) continue;
     nres = hasharray_count(seg->residue_hash);
     for ( ires=0; ires<nres; ++ires ) {
-      res = &(seg->residue_array[ires]);
-      for ( atom = res->atoms; atom; atom = atom->next ) {
+      res = topo_mol_seg_residue(seg,ires);
+      for ( atom = topo_mol_res_list(res); atom; atom = atom->next ) {
         ++numatoms;
       }
     }
@@ -112,49 +145,70 @@ int topo_mol_write_namdbin(topo_mol *mol, FILE *file, FILE *velfile, void *v,
       return -4;
     }
   }
+
+  buf = memarena_create();
+  if ( ! buf ) return -1;
+  memarena_alignment(buf, TOPO_MOL_XYZ_ALIGN);
+  xyz = (double *) memarena_alloc(buf, 3 * NAMDBIN_BLOCK * sizeof(double));
+  vel = (double *) memarena_alloc(buf, 3 * NAMDBIN_BLOCK * sizeof(double));
+  if ( ! xyz || ! vel ) {
+    memarena_destroy(buf);
+    return -1;
+  }
+
+  nbuf = 0;
   for ( iseg=0; iseg<nseg; ++iseg ) {
     seg = mol->segment_array[iseg];
     if (! seg) continue;
     nres = hasharray_count(seg->residue_hash);
     for ( ires=0; ires<nres; ++ires ) {
-      res = &(seg->residue_array[ires]);
-      for ( atom = res->atoms; atom; atom = atom->next ) {
+      res = topo_mol_seg_residue(seg,ires);
+      for ( atom = topo_mol_res_list(res); atom; atom = atom->next ) {
+        double *x = xyz + 3*nbuf;
+        atom = topo_mol_inst_atom(res,atom,&copy);
         /* Paranoid: make sure x,y,z are set. */
-        x = y = z = 0.0;
         switch ( atom->xyz_state ) {
         case TOPO_MOL_XYZ_SET:
         case TOPO_MOL_XYZ_GUESS:
         case TOPO_MOL_XYZ_BADGUESS:
-          x = atom->x;  y = atom->y;  z = atom->z;
+          x[0] = atom->x;  x[1] = atom->y;  x[2] = atom->z;
           break;
         default:
           print_msg(v,"ERROR: Internal error, atom has invalid state.");
           print_msg(v,"ERROR: Treating as void.");
           /* Yes, fall through */
         case TOPO_MOL_XYZ_VOID:
-          x = y = z = 0.0;
+          x[0] = x[1] = x[2] = 0.0;
           has_void_atoms = 1;
           break;
         }
-        xyz[0] = x;
-        xyz[1] = y;
-        xyz[2] = z;
-        if ( fwrite(xyz, sizeof(double), 3, file) != 3 ) {
+        topo_mol_get_vel(mol, atom, vel + 3*nbuf);
+        if ( ++nbuf < NAMDBIN_BLOCK ) continue;
+        if ( flush_namdbin(xyz, nbuf, file) ) {
           print_msg(v, "error writing namdbin file");
+          memarena_destroy(buf);
           return -3;
         }
-        if ( velfile ) {
-          xyz[0] = atom->vx;
-          xyz[1] = atom->vy;
-          xyz[2] = atom->vz;
-          if ( fwrite(xyz, sizeof(double), 3, velfile) != 3 ) {
-            print_msg(v, "error writing velnamdbin file");
-            return -5;
-          }
+        if ( velfile && flush_namdbin(vel, nbuf, velfile) ) {
+          print_msg(v, "error writing velnamdbin file");
+          memarena_destroy(buf);
+          return -5;
         }
+        nbuf = 0;
       }
     }
   }
+  if ( flush_namdbin(xyz, nbuf, file) ) {
+    print_msg(v, "error writing namdbin file");
+    memarena_destroy(buf);
+    return -3;
+  }
+  if ( velfile && flush_namdbin(vel, nbuf, velfile) ) {
+    print_msg(v, "error writing velnamdbin file");
+    memarena_destroy(buf);
+    return -5;
+  }
+  memarena_destroy(buf);
 
   if (has_void_atoms) {
     print_msg(v, 
@@ -196,6 +250,10 @@ int topo_mol_write_psf(topo_mol *mol, FILE *file, int charmmfmt, int nocmap, int
   strcpy(defpatch,"");
 
   if ( ! mol ) return -1;
+  if ( topo_mol_queued(mol) ) {
+    print_msg(v,"ERROR: segments are queued and must be ended first");
+    return -1;
+  }
 
   namdfmt = 0;
   charmmext = 0;
@@ -217,19 +275,21 @@ int topo_mol_write_psf(topo_mol *mol, FILE *file, int charmmfmt, int nocmap, int
 
     nres = hasharray_count(seg->residue_hash);
     for ( ires=0; ires<nres; ++ires ) {
-      res = &(seg->residue_array[ires]);
+      res = topo_mol_seg_residue(seg,ires);
       if (strlen(res->resid) > 4) {
         charmmext = 1;
       }
-      for ( atom = res->atoms; atom; atom = atom->next ) {
-        atom->atomid = ++atomid;
-        if (strlen(atom->name) > 4) {
+      if ( res->inst ) res->inst->atomid = atomid;
+      for ( atom = topo_mol_res_list(res); atom; atom = atom->next ) {
+        ++atomid;
+        if ( ! res->inst ) atom->atomid = atomid;
+        if (strlen(topo_mol_symbol(mol,atom->name)) > 4) {
           charmmext = 1;
         }
-        if ((! charmmfmt) && (strlen(atom->type) > 4)) {
+        if ((! charmmfmt) && (strlen(topo_mol_symbol(mol,atom->type)) > 4)) {
           charmmext = 1;
         }
-        if ((! charmmfmt) && (strlen(atom->type) > 6)) {
+        if ((! charmmfmt) && (strlen(topo_mol_symbol(mol,atom->type)) > 6)) {
           namdfmt = 1;
         }
         for ( bond = atom->bonds; bond;
@@ -385,14 +445,15 @@ int topo_mol_write_psf(topo_mol *mol, FILE *file, int charmmfmt, int nocmap, int
     nres = hasharray_count(seg->residue_hash);
     for ( ires=0; ires<nres; ++ires ) {
       char resid[9];
-      res = &(seg->residue_array[ires]);
+      res = topo_mol_seg_residue(seg,ires);
       strncpy(resid,res->resid,9);
       resid[ charmmext ? 8 : 4 ] = '\0';
-      if ( charmmfmt ) for ( atom = res->atoms; atom; atom = atom->next ) {
+      if ( charmmfmt ) for ( atom = topo_mol_res_list(res); atom; atom = atom->next ) {
         int idef,typeid;
-        idef = hasharray_index(mol->defs->type_hash,atom->type);
+        idef = hasharray_index(mol->defs->type_hash,
+                               topo_mol_symbol(mol,atom->type));
         if ( idef == HASHARRAY_FAIL ) {
-          sprintf(buf,"unknown atom type %s",atom->type);
+          sprintf(buf,"unknown atom type %s",topo_mol_symbol(mol,atom->type));
           print_msg(v,buf);
           return -3;
         }
@@ -400,14 +461,15 @@ int topo_mol_write_psf(topo_mol *mol, FILE *file, int charmmfmt, int nocmap, int
         fprintf(file, ( charmmext ?
                      "%10d %-8s %-8s %-8s %-8s %4d %10.6f    %10.4f  %10d\n" :
                      "%8d %-4s %-4s %-4s %-4s %4d %10.6f    %10.4f  %10d\n" ),
-                atom->atomid, seg->segid,resid,res->name,
-                atom->name,typeid,atom->charge,atom->mass,0);
-      } else for ( atom = res->atoms; atom; atom = atom->next ) {
+                atom_id(res,atom), seg->segid,resid,res->name,
+                topo_mol_symbol(mol,atom->name),typeid,atom->charge,atom->mass,0);
+      } else for ( atom = topo_mol_res_list(res); atom; atom = atom->next ) {
         fprintf(file, ( charmmext ?
                      "%10d %-8s %-8s %-8s %-8s %-6s %10.6f    %10.4f  %10d\n" :
                      "%8d %-4s %-4s %-4s %-4s %-4s %10.6f    %10.4f  %10d\n" ),
-                atom->atomid, seg->segid,resid,res->name,
-                atom->name,atom->type,atom->charge,atom->mass,0);
+                atom_id(res,atom), seg->segid,resid,res->name,
+                topo_mol_symbol(mol,atom->name),topo_mol_symbol(mol,atom->type),
+                atom->charge,atom->mass,0);
       }
     }
   }
@@ -420,14 +482,14 @@ int topo_mol_write_psf(topo_mol *mol, FILE *file, int charmmfmt, int nocmap, int
     if (! seg) continue;
     nres = hasharray_count(seg->residue_hash);
     for ( ires=0; ires<nres; ++ires ) {
-      res = &(seg->residue_array[ires]);
-      for ( atom = res->atoms; atom; atom = atom->next ) {
+      res = topo_mol_seg_residue(seg,ires);
+      for ( atom = topo_mol_res_list(res); atom; atom = atom->next ) {
         for ( bond = atom->bonds; bond;
                 bond = topo_mol_bond_next(bond,atom) ) {
           if ( bond->atom[0] == atom && ! bond->del ) {
             if ( numinline == 4 ) { fprintf(file,"\n");  numinline = 0; }
             fprintf(file, ( charmmext ? " %9d %9d" : " %7d %7d"),
-                    atom->atomid,bond->atom[1]->atomid);
+                    atom_id(res,atom),atom_id(res,bond->atom[1]));
             ++numinline;
           }
         }
@@ -443,14 +505,14 @@ int topo_mol_write_psf(topo_mol *mol, FILE *file, int charmmfmt, int nocmap, int
     if (! seg) continue;
     nres = hasharray_count(seg->residue_hash);
     for ( ires=0; ires<nres; ++ires ) {
-      res = &(seg->residue_array[ires]);
-      for ( atom = res->atoms; atom; atom = atom->next ) {
+      res = topo_mol_seg_residue(seg,ires);
+      for ( atom = topo_mol_res_list(res); atom; atom = atom->next ) {
         for ( angl = atom->angles; angl;
                 angl = topo_mol_angle_next(angl,atom) ) {
           if ( angl->atom[0] == atom && ! angl->del ) {
             if ( numinline == 3 ) { fprintf(file,"\n");  numinline = 0; }
-            fprintf(file, ( charmmext ? " %9d %9d %9d" : " %7d %7d %7d"),atom->atomid,
-                angl->atom[1]->atomid,angl->atom[2]->atomid);
+            fprintf(file, ( charmmext ? " %9d %9d %9d" : " %7d %7d %7d"),atom_id(res,atom),
+                atom_id(res,angl->atom[1]),atom_id(res,angl->atom[2]));
             ++numinline;
           }
         }
@@ -466,15 +528,15 @@ int topo_mol_write_psf(topo_mol *mol, FILE *file, int charmmfmt, int nocmap, int
     if (! seg) continue;
     nres = hasharray_count(seg->residue_hash);
     for ( ires=0; ires<nres; ++ires ) {
-      res = &(seg->residue_array[ires]);
-      for ( atom = res->atoms; atom; atom = atom->next ) {
+      res = topo_mol_seg_residue(seg,ires);
+      for ( atom = topo_mol_res_list(res); atom; atom = atom->next ) {
         for ( dihe = atom->dihedrals; dihe;
                 dihe = topo_mol_dihedral_next(dihe,atom) ) {
           if ( dihe->atom[0] == atom && ! dihe->del ) {
             if ( numinline == 2 ) { fprintf(file,"\n");  numinline = 0; }
-            fprintf(file, ( charmmext ? " %9d %9d %9d %9d" : " %7d %7d %7d %7d"),atom->atomid,
-                dihe->atom[1]->atomid,dihe->atom[2]->atomid,
-                dihe->atom[3]->atomid);
+            fprintf(file, ( charmmext ? " %9d %9d %9d %9d" : " %7d %7d %7d %7d"),atom_id(res,atom),
+                atom_id(res,dihe->atom[1]),atom_id(res,dihe->atom[2]),
+                atom_id(res,dihe->atom[3]));
             ++numinline;
           }
         }
@@ -490,15 +552,15 @@ int topo_mol_write_psf(topo_mol *mol, FILE *file, int charmmfmt, int nocmap, int
     if (! seg) continue;
     nres = hasharray_count(seg->residue_hash);
     for ( ires=0; ires<nres; ++ires ) {
-      res = &(seg->residue_array[ires]);
-      for ( atom = res->atoms; atom; atom = atom->next ) {
+      res = topo_mol_seg_residue(seg,ires);
+      for ( atom = topo_mol_res_list(res); atom; atom = atom->next ) {
         for ( impr = atom->impropers; impr;
                 impr = topo_mol_improper_next(impr,atom) ) {
           if ( impr->atom[0] == atom && ! impr->del ) {
             if ( numinline == 2 ) { fprintf(file,"\n");  numinline = 0; }
-            fprintf(file, ( charmmext ? " %9d %9d %9d %9d" : " %7d %7d %7d %7d"),atom->atomid,
-                impr->atom[1]->atomid,impr->atom[2]->atomid,
-                impr->atom[3]->atomid);
+            fprintf(file, ( charmmext ? " %9d %9d %9d %9d" : " %7d %7d %7d %7d"),atom_id(res,atom),
+                atom_id(res,impr->atom[1]),atom_id(res,impr->atom[2]),
+                atom_id(res,impr->atom[3]));
             ++numinline;
           }
         }
@@ -517,13 +579,13 @@ int topo_mol_write_psf(topo_mol *mol, FILE *file, int charmmfmt, int nocmap, int
     if (! seg) continue;
     nres = hasharray_count(seg->residue_hash);
     for ( ires=0; ires<nres; ++ires ) {
-      res = &(seg->residue_array[ires]);
-      for ( atom = res->atoms; atom; atom = atom->next ) {
+      res = topo_mol_seg_residue(seg,ires);
+      for ( atom = topo_mol_res_list(res); atom; atom = atom->next ) {
         for ( excl = atom->exclusions; excl;
                 excl = topo_mol_exclusion_next(excl,atom) ) {
           if ( excl->atom[0] == atom && ! excl->del ) {
             if ( numinline == 8 ) { fprintf(file,"\n");  numinline = 0; }
-            fprintf(file,(charmmext?" %9d":" %7d"),excl->atom[1]->atomid);
+            fprintf(file,(charmmext?" %9d":" %7d"),atom_id(res,excl->atom[1]));
             ++numinline;
           }
         }
@@ -539,8 +601,8 @@ int topo_mol_write_psf(topo_mol *mol, FILE *file, int charmmfmt, int nocmap, int
     if (! seg) continue;
     nres = hasharray_count(seg->residue_hash);
     for ( ires=0; ires<nres; ++ires ) {
-      res = &(seg->residue_array[ires]);
-      for ( atom = res->atoms; atom; atom = atom->next ) {
+      res = topo_mol_seg_residue(seg,ires);
+      for ( atom = topo_mol_res_list(res); atom; atom = atom->next ) {
         for ( excl = atom->exclusions; excl;
                 excl = topo_mol_exclusion_next(excl,atom) ) {
           if ( excl->atom[0] == atom && ! excl->del ) {
@@ -564,17 +626,17 @@ int topo_mol_write_psf(topo_mol *mol, FILE *file, int charmmfmt, int nocmap, int
       if (! seg) continue;
       nres = hasharray_count(seg->residue_hash);
       for ( ires=0; ires<nres; ++ires ) {
-        res = &(seg->residue_array[ires]);
-        for ( atom = res->atoms; atom; atom = atom->next ) {
+        res = topo_mol_seg_residue(seg,ires);
+        for ( atom = topo_mol_res_list(res); atom; atom = atom->next ) {
           for ( cmap = atom->cmaps; cmap;
                   cmap = topo_mol_cmap_next(cmap,atom) ) {
             if ( cmap->atom[0] == atom && ! cmap->del ) {
               fprintf(file,( charmmext ? " %9d %9d %9d %9d %9d %9d %9d %9d\n"
-                         : " %7d %7d %7d %7d %7d %7d %7d %7d\n"),atom->atomid,
-                  cmap->atom[1]->atomid,cmap->atom[2]->atomid,
-                  cmap->atom[3]->atomid,cmap->atom[4]->atomid,
-                  cmap->atom[5]->atomid,cmap->atom[6]->atomid,
-                  cmap->atom[7]->atomid);
+                         : " %7d %7d %7d %7d %7d %7d %7d %7d\n"),atom_id(res,atom),
+                  atom_id(res,cmap->atom[1]),atom_id(res,cmap->atom[2]),
+                  atom_id(res,cmap->atom[3]),atom_id(res,cmap->atom[4]),
+                  atom_id(res,cmap->atom[5]),atom_id(res,cmap->atom[6]),
+                  atom_id(res,cmap->atom[7]));
             }
           }
         }
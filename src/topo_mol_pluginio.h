@@ -4,12 +4,12 @@
 
 #include <stdio.h>
 #include "topo_mol.h"
-#include "stringhash.h"
+#include "extract_alias.h"
 
 int topo_mol_read_plugin(topo_mol *mol, const char *pluginname,
                          const char *filename, 
                          const char *coorpluginname, const char *coorfilename,
-                         const char *segid, stringhash *h, int all_caps,
+                         const char *segid, extract_alias *h, int all_caps,
                          int coordinatesonly, int residuesonly,
                          void *, void (*print_msg)(void *, const char *));
 
@@ -61,6 +61,9 @@ typedef struct topo_mol_conformation_t {
 #define TOPO_MOL_XYZ_GUESS 2
 #define TOPO_MOL_XYZ_BADGUESS 3
 
+/* alignment of bulk coordinate buffers, enough for 512-bit vector loads */
+#define TOPO_MOL_XYZ_ALIGN 64
+
 typedef struct topo_mol_atom_t {
   struct topo_mol_atom_t *next;
   struct topo_mol_atom_t *copy;
@@ -71,36 +74,95 @@ typedef struct topo_mol_atom_t {
   topo_mol_cmap_t *cmaps;
   topo_mol_exclusion_t *exclusions;
   topo_mol_conformation_t *conformations;
-  char name[NAMEMAXLEN];
-  char type[NAMEMAXLEN];
-  char element[NAMEMAXLEN];
+  int name, type, element;  /* symbols, see topo_mol_symbol */
+  int serial;               /* velocity slot, see topo_mol_get_vel */
   double mass;
   double charge;
   double x,y,z;
-  double vx,vy,vz;
   int xyz_state;
   int partition;
   int atomid;
 } topo_mol_atom_t;
 
+/* residue atoms ordered by name symbol, then by position in the list */
+typedef struct topo_mol_atom_key_t {
+  int name;
+  int order;
+  topo_mol_atom_t *atom;
+} topo_mol_atom_key_t;
+
+/* residues with fewer atoms are searched without an index */
+#define TOPO_MOL_INDEX_MIN 8
+
+struct topo_mol_instance_t;
+
 typedef struct topo_mol_residue_t {
   char resid[NAMEMAXLEN];
   char name[NAMEMAXLEN];
   char chain[NAMEMAXLEN];
-  topo_mol_atom_t *atoms;
+  topo_mol_atom_t *atoms;   /* 0 while inst is set, see topo_mol_res_atoms */
+  struct topo_mol_instance_t *inst;
+
+  /* atom name index, valid while indexstamp equals mol->atom_edits */
+  topo_mol_atom_key_t *index;
+  int nindex, maxindex;
+  int indexstamp;
 } topo_mol_residue_t;
 
 typedef struct topo_mol_segment_t {
   char segid[NAMEMAXLEN];
-  topo_mol_residue_t *residue_array;
+  chunkarray *residues;  /* residues never move, see topo_mol_seg_residue */
   hasharray *residue_hash;
 
   int auto_angles;
   int auto_dihedrals;
   char pfirst[NAMEMAXLEN];
   char plast[NAMEMAXLEN];
+
+  struct topo_mol_proto_t *proto;  /* shared by instance residues, or 0 */
 } topo_mol_segment_t;
 
+#define topo_mol_seg_residue(seg,i) \
+  ((topo_mol_residue_t*) chunkarray_item((seg)->residues,(i)))
+
+/* The atoms and entries shared by the residues of a segment that are
+   unmodified copies of one closed residue definition.  The atoms are
+   stored in list order and no entry leaves them; res holds the list so
+   that atoms can be found by name.  Auto angles and dihedrals are
+   generated on these atoms once for all instances. */
+typedef struct topo_mol_proto_t {
+  topo_mol_residue_t res;
+  int natoms;
+  topo_mol_atom_t *atoms;
+} topo_mol_proto_t;
+
+typedef struct topo_mol_instatom_t {
+  double x,y,z;
+  int xyz_state;
+} topo_mol_instatom_t;
+
+/* A residue stored as a reference to its proto; atom k of the list has
+   serial serial+k, coordinates atoms[k] and atomid atomid+k+1, or 0
+   while atomid is -1.  Any other change turns it back into an ordinary
+   residue first. */
+typedef struct topo_mol_instance_t {
+  topo_mol_proto_t *proto;
+  int serial;
+  int atomid;
+  topo_mol_instatom_t atoms[1];
+} topo_mol_instance_t;
+
+/* atoms of res, expanding it first if it is an instance; 0 if that
+   runs out of memory */
+topo_mol_atom_t * topo_mol_res_atoms(topo_mol *mol, topo_mol_residue_t *res);
+
+/* For reading without expanding: the atoms of res, or of its proto if
+   it is an instance, and an atom of that list with the serial, atomid
+   and coordinates of the instance, filled in *copy when needed. */
+topo_mol_atom_t * topo_mol_res_list(topo_mol_residue_t *res);
+topo_mol_atom_t * topo_mol_inst_atom(topo_mol_residue_t *res,
+		topo_mol_atom_t *atom, topo_mol_atom_t *copy);
+
 typedef struct topo_mol_patchres_t {
   struct topo_mol_patchres_t *next;
   char segid[NAMEMAXLEN];
@@ -120,6 +182,8 @@ struct topo_mol {
   void (*newerror_handler)(void *, const char *);
   
   topo_defs *defs;
+  /* defs->symbols, or an extension of it once defs is frozen */
+  symtab *symbols;
 
   int npatch;
   topo_mol_patch_t *patches;
@@ -129,11 +193,85 @@ struct topo_mol {
   hasharray *segment_hash;
   topo_mol_segment_t *buildseg;
 
+  /* segments waiting for topo_mol_end_queued, in order */
+  int nqueued, maxqueued;
+  topo_mol_segment_t **queued;
+  /* set on the private copies that end queued segments */
+  struct topo_mol_job_t *job;
+
   memarena *arena;
   memarena *angle_arena;
   memarena *dihedral_arena;
+
+  /* bumped when atoms are added to, removed from or renamed in any
+     residue, which makes every residue atom index stale */
+  int atom_edits;
+  memarena *index_arena;
+
+  /* optional (segid, resid, atom name) index, see topo_mol_atom_index;
+     valid while atom_index_stamp equals atom_edits */
+  int atom_index_on;
+  int atom_index_stamp;
+  hash_t atom_index;
+  topo_mol_atom_t **atom_index_atoms;
+  /* residue of each entry that is an instance, whose atom is then the
+     proto atom in the same slot; 0 for ordinary atoms */
+  topo_mol_residue_t **atom_index_res;
+  memarena *atom_index_keys;
+
+  /* atoms unlinked from their residues, linked through next */
+  topo_mol_atom_t *deleted_atoms;
+
+  /* tuples reclaimed by topo_mol_compact, linked through next[0] */
+  topo_mol_bond_t *bond_free;
+  topo_mol_angle_t *angle_free;
+  topo_mol_dihedral_t *dihedral_free;
+  /* while a segment is built, the bonds, angles and dihedrals it took
+     from the free lists, to be handed back if the build rolls back */
+  struct topo_mol_poplog_t *poplog;
+  /* free lists shared by the jobs ending queued segments */
+  struct topo_mol_pool_t *pool;
+
+  /* velocities by atom serial, TOPO_MOL_VEL_BLOCK atoms per block;
+     a block is allocated once a velocity in it is set */
+  int nserial;
+  int nvelblocks;
+  double **velblocks;
 };
 
+#define TOPO_MOL_VEL_BLOCK 4096
+
+typedef struct topo_mol_poplog_t {
+  void **tuples;
+  int count, max;
+} topo_mol_poplog_t;
+
+/* memory held by a molecule and its topology definitions */
+typedef struct topo_mol_memory_t {
+  memarena_stats_t arena, angle_arena, dihedral_arena, index_arena;
+  memarena_stats_t velocities;      /* the velocity blocks */
+  hasharray_stats_t segments;
+  hasharray_stats_t residues;       /* summed over all segments */
+  memarena_stats_t defs_arena;
+  hasharray_stats_t types, resdefs, topofiles;
+} topo_mol_memory_t;
+
+int topo_mol_memory_stats(topo_mol *mol, topo_mol_memory_t *m);
+
+/* atom names, types and elements are interned in mol->symbols */
+#define topo_mol_symbol(mol,sym) symtab_name((mol)->symbols,(sym))
+int topo_mol_intern(topo_mol *mol, const char *name);
+
+/* unset velocities read as zero */
+void topo_mol_get_vel(topo_mol *mol, const topo_mol_atom_t *atom, double *v);
+int topo_mol_put_vel(topo_mol *mol, const topo_mol_atom_t *atom,
+                                    double vx, double vy, double vz);
+
+topo_mol_atom_t * topo_mol_atom_alloc(topo_mol *mol);
+topo_mol_bond_t * topo_mol_bond_alloc(topo_mol *mol);
+topo_mol_angle_t * topo_mol_angle_alloc(topo_mol *mol);
+topo_mol_dihedral_t * topo_mol_dihedral_alloc(topo_mol *mol);
+
 topo_mol_bond_t * topo_mol_bond_next(
                 topo_mol_bond_t *tuple, topo_mol_atom_t *atom);
 